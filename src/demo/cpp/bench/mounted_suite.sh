@@ -0,0 +1,274 @@
+#!/bin/bash
+#
+# mounted_suite.sh - end to end benchmark of fusewos through the kernel
+#
+# Mounts fusewos (built with make WOS=local) on a scratch stub directory
+# with a libwoslocal object store, runs a set of profiles against the
+# mount, appends one line per passing run to a history file and fails
+# when a metric fell by more than the tolerance below the median of the
+# last runs.  A failing run is not recorded, so a regression does not
+# lower the median it is measured against.  Needs only FUSE and a shell:
+# no network, no WOS cluster.
+#
+# Every profile runs on a fresh mount, so neither the page cache nor the
+# kernel attribute cache carries over between them:
+#
+#   seq_write_mbs      one stream writing a large file
+#   seq_read_mbs       one stream reading it back
+#   multi_write_mbs    STREAMS streams writing a file each
+#   multi_read_mbs     STREAMS streams reading them back
+#   create_per_s       small files created, written and closed
+#   stat_per_s         stats of those files
+#   list_entries_per_s readdir of the directory holding them
+#   rewrite_per_s      rewrites of small files, one new version each
+#
+# All metrics are higher is better.
+#
+# Before them the create checks run on a --wos_lowlevel mount: an
+# exclusive create of a new file succeeds, a second one fails without
+# touching the file, and a plain create of an existing file truncates it.
+# A failed check fails the run like a regression does.
+#
+# usage: mounted_suite.sh [-b fusewos] [-w workdir] [-H history] [-n runs]
+#                         [-t pct] [-q] [-- fusewos options]
+#   -b fusewos   the fusewos binary (default ../fusewos next to this script)
+#   -w workdir   scratch directory (default a fresh one under /tmp)
+#   -H history   results file, one line per passing run (default ./suite_history.tsv)
+#   -n runs      how many earlier runs the median covers (default 5)
+#   -t pct       tolerance in percent (default 10)
+#   -q           quick: smaller files and fewer of them
+#
+# Sizes can also be set with SEQ_MB, STREAMS, STREAM_MB, FILES, REWRITES.
+# WOSLOCAL (see woslocal.cpp) sets the latency and bandwidth of the
+# stand-in object store, e.g. WOSLOCAL=latency_us=500,bw_mbs=400.
+#
+# Exit status: 0 passed, 1 regression or failed check, 2 setup failure.
+
+set -u
+
+here=$(cd "$(dirname "$0")" && pwd)
+fusewos=$here/../fusewos
+work=
+history=./suite_history.tsv
+runs=5
+tol=10
+quick=0
+
+while getopts "b:w:H:n:t:q" opt; do
+	case $opt in
+	b) fusewos=$OPTARG ;;
+	w) work=$OPTARG ;;
+	H) history=$OPTARG ;;
+	n) runs=$OPTARG ;;
+	t) tol=$OPTARG ;;
+	q) quick=1 ;;
+	*) sed -n '/^# usage/,/^# Exit/p' "$0" | sed 's/^# \{0,1\}//' >&2; exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ "${1:-}" = "--" ] && shift
+
+if [ $quick = 1 ]; then
+	SEQ_MB=${SEQ_MB:-64} STREAMS=${STREAMS:-4} STREAM_MB=${STREAM_MB:-16} FILES=${FILES:-500} REWRITES=${REWRITES:-200}
+else
+	SEQ_MB=${SEQ_MB:-1024} STREAMS=${STREAMS:-8} STREAM_MB=${STREAM_MB:-256} FILES=${FILES:-5000} REWRITES=${REWRITES:-2000}
+fi
+
+if [ ! -x "$fusewos" ]; then
+	echo "no fusewos at $fusewos, build it with make WOS=local" >&2
+	exit 2
+fi
+if [ ! -e /dev/fuse ]; then
+	echo "/dev/fuse is missing" >&2
+	exit 2
+fi
+
+scratch=0
+if [ -z "$work" ]; then
+	work=$(mktemp -d /tmp/wosfs_suite.XXXXXX) || exit 2
+	scratch=1
+fi
+mnt=$work/mnt
+mkdir -p "$work/objs" "$work/stub" "$mnt" || exit 2
+
+now() { date +%s%N; }
+
+# rate of $1 units in the time since $2 (ns)
+rate() { awk -v n="$1" -v t0="$2" -v t1="$(now)" 'BEGIN { printf "%.1f", n / ((t1 - t0) / 1e9) }'; }
+
+mounted() { grep -q " $mnt fuse" /proc/mounts; }
+
+mount_fs() {
+	"$fusewos" -w "dir=$work/objs" -l "$work/stub/" "$@" "$mnt" || return 1
+	for i in $(seq 50); do
+		mounted && return 0
+		sleep 0.1
+	done
+	return 1
+}
+
+umount_fs() {
+	fusermount -u "$mnt" 2>/dev/null || umount "$mnt"
+}
+
+cleanup() {
+	mounted && umount_fs
+}
+trap cleanup EXIT
+
+declare -A result
+
+# run profile $1 on a fresh mount
+profile() {
+	local name=$1
+	shift
+	if ! mount_fs "${fusewos_opts[@]}"; then
+		echo "mount failed" >&2
+		exit 2
+	fi
+	result[$name]=$("$@")
+	umount_fs
+	printf "%-20s %12s\n" "$name" "${result[$name]}"
+}
+
+seq_write() {
+	local t0=$(now)
+	dd if=/dev/zero of="$mnt/seq" bs=1M count="$SEQ_MB" conv=fsync status=none
+	rate "$SEQ_MB" "$t0"
+}
+
+seq_read() {
+	local t0=$(now)
+	dd if="$mnt/seq" of=/dev/null bs=1M status=none
+	rate "$SEQ_MB" "$t0"
+}
+
+multi_write() {
+	local t0=$(now)
+	for i in $(seq "$STREAMS"); do
+		dd if=/dev/zero of="$mnt/stream.$i" bs=1M count="$STREAM_MB" conv=fsync status=none &
+	done
+	wait
+	rate $((STREAMS * STREAM_MB)) "$t0"
+}
+
+multi_read() {
+	local t0=$(now)
+	for i in $(seq "$STREAMS"); do
+		dd if="$mnt/stream.$i" of=/dev/null bs=1M status=none &
+	done
+	wait
+	rate $((STREAMS * STREAM_MB)) "$t0"
+}
+
+# shell builtins only, so the loop itself costs little next to the file system
+create() {
+	local data t0 i
+	data=$(head -c 4096 /dev/zero | tr '\0' x)
+	mkdir -p "$mnt/many"
+	t0=$(now)
+	for ((i = 0; i < FILES; i++)); do
+		printf '%s' "$data" > "$mnt/many/f$i"
+	done
+	rate "$FILES" "$t0"
+}
+
+stat_files() {
+	local t0=$(now)
+	find "$mnt/many" -type f -printf '%s\n' > /dev/null
+	rate "$FILES" "$t0"
+}
+
+list_dir() {
+	local t0=$(now)
+	ls -f "$mnt/many" > /dev/null
+	rate "$FILES" "$t0"
+}
+
+rewrite() {
+	local t0=$(now) i
+	for ((i = 0; i < REWRITES; i++)); do
+		printf 'version %d\n' "$i" > "$mnt/many/f$((i % 10))"
+	done
+	rate "$REWRITES" "$t0"
+}
+
+# exclusive and plain creates through the low-level frontend; bash's
+# noclobber opens with O_CREAT|O_EXCL
+create_checks() {
+	local f=$mnt/excl
+	(set -o noclobber; echo one > "$f") 2>/dev/null || { echo "exclusive create of a new file failed"; return 1; }
+	[ "$(cat "$f")" = one ] || { echo "exclusive create lost its data"; return 1; }
+	(set -o noclobber; echo two > "$f") 2>/dev/null && { echo "exclusive create of an existing file succeeded"; return 1; }
+	[ "$(cat "$f")" = one ] || { echo "failed exclusive create changed the file"; return 1; }
+	echo three > "$f" || { echo "create of an existing file failed"; return 1; }
+	[ "$(cat "$f")" = three ] || { echo "create of an existing file did not truncate it"; return 1; }
+	return 0
+}
+
+fusewos_opts=("$@")
+metrics=(seq_write_mbs seq_read_mbs multi_write_mbs multi_read_mbs create_per_s stat_per_s list_entries_per_s rewrite_per_s)
+
+echo "fusewos suite in $work: seq ${SEQ_MB}MB, ${STREAMS}x${STREAM_MB}MB streams, $FILES files, $REWRITES rewrites"
+if ! mount_fs "${fusewos_opts[@]}" --wos_lowlevel; then
+	echo "mount failed" >&2
+	exit 2
+fi
+check=$(create_checks)
+check_status=$?
+umount_fs
+if [ $check_status != 0 ]; then
+	echo "FAILED lowlevel create: $check"
+	rm -rf "$work/objs" "$work/stub"
+	[ $scratch = 1 ] && rm -rf "$work"
+	exit 1
+fi
+echo "lowlevel create checks passed"
+profile seq_write_mbs seq_write
+profile seq_read_mbs seq_read
+profile multi_write_mbs multi_write
+profile multi_read_mbs multi_read
+profile create_per_s create
+profile stat_per_s stat_files
+profile list_entries_per_s list_dir
+profile rewrite_per_s rewrite
+
+# the history has a header naming the metrics, then one line per passing run
+rev=$(cd "$here" && git rev-parse --short HEAD 2>/dev/null || echo -)
+config="seq=$SEQ_MB,streams=${STREAMS}x$STREAM_MB,files=$FILES,rewrites=$REWRITES"
+[ -s "$history" ] || printf "time\trev\tconfig\t%s\n" "$(IFS=$'\t'; echo "${metrics[*]}")" > "$history"
+
+status=0
+for ((m = 0; m < ${#metrics[@]}; m++)); do
+	name=${metrics[$m]}
+	# median of this metric over the last runs with the same sizes
+	median=$(awk -F'\t' -v cfg="$config" -v col=$((m + 4)) -v n="$runs" '
+		NR > 1 && $3 == cfg { v[k++] = $col }
+		END {
+			if (k == 0) exit
+			first = k > n ? k - n : 0
+			for (i = first; i < k; i++) s[i - first] = v[i]
+			c = k - first
+			for (i = 0; i < c; i++) for (j = i + 1; j < c; j++) if (s[j] < s[i]) { t = s[i]; s[i] = s[j]; s[j] = t }
+			print c % 2 ? s[int(c / 2)] : (s[c / 2 - 1] + s[c / 2]) / 2
+		}' "$history")
+	[ -n "$median" ] || continue
+	if awk -v v="${result[$name]}" -v med="$median" -v tol="$tol" 'BEGIN { exit !(v < med * (1 - tol / 100)) }'; then
+		echo "REGRESSION $name ${result[$name]} < median $median of the last runs by more than $tol%"
+		status=1
+	fi
+done
+
+if [ $status = 0 ]; then
+	line="$(date -u +%Y-%m-%dT%H:%M:%SZ)\t$rev\t$config"
+	for name in "${metrics[@]}"; do
+		line="$line\t${result[$name]}"
+	done
+	printf "$line\n" >> "$history"
+	echo "no regressions"
+else
+	echo "not added to $history"
+fi
+rm -rf "$work/objs" "$work/stub"
+[ $scratch = 1 ] && rm -rf "$work"
+exit $status
@@ -22,6 +22,7 @@
 #endif
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -39,11 +40,38 @@
 #include <stddef.h>
 #include <pthread.h>
 #include <vector>
+#include <algorithm>
 #include <wos_cluster.hpp>
 #include <wos_obj.hpp>
 
+#include "wosfs_trace.h"
+#include "wosfs_trash.h"
+
+// USDT probes when systemtap's sys/sdt.h is installed, see "Static probes" below
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES	1
+#include <sys/sdt.h>
+#define WOSFS_HAVE_USDT		1
+#endif
+#endif
+
 #include <syslog.h>
+#include <stdarg.h>
+#include <string>
+#include <map>
+#include <set>
+#include <list>
 #include<pthread.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/xattr.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/syscall.h>
 
 using namespace wosapi;
 
@@ -120,6 +148,13 @@ typedef struct { //type union can not be used with WosPutStreamPtr and etc
 #ifdef WOSFS_FEATURE_TRASHCAN
 #define WOSFS_TRASHCAN_NAME	"/.WOSFS_TrashCan"
 char *wosfs_trashcan_path;
+#define WOSFS_FEATURE_SNAPSHOTS	1	// objects dropped by the live tree go through the trash can
+#endif
+
+#ifdef WOSFS_FEATURE_SNAPSHOTS
+#define WOSFS_SNAP_NAME		"/.WOS_snapshots"
+char *wosfs_snap_path;
+bool wosfs_snap_on;			// there are snapshots, the journal is kept
 #endif
 
 struct wosclient_pool_entry {
@@ -127,14 +162,21 @@ struct wosclient_pool_entry {
 	uint64_t 			len;
 	WosPtr_t 			WosPtr;
 	const char 			*path;
-	int				open_count;	
+	int				refs;		// the pool's while listed, and one per wosclient_pool_put() to come
+	char				oid[41];	// OID behind a WOS_READ stream, used to open hedge streams
+	int				cache_fd;	// local cache file of oid, -1 if none
+	bool				cache_skip;	// oid is not cacheable, don't look again
+	int				inflight;	// async PutSpans not yet completed (--wos_lowlevel)
 #ifdef WOSFS_PERF_FIX_01 
+	struct wosfs_sbuf		*sbuf;		// staging buffer, taken on first write
+	bool				sbuf_skip;	// budget exhausted, write through unbuffered
 	unsigned char			*buffer;
 	unsigned char			*b_ptr;
 	uint64_t			offset;
 #endif
 	struct wosclient_pool_entry 	*next;
 } *wosclient_pool_head, *wosclient_pool_curr;
+std::map<std::string, int> wosclient_pool_opens;	// open handles by backing path, under lock
 int wosclient_pool_count =0;
 int wosclient_pool_empty_count = 0;
 
@@ -147,6 +189,7 @@ struct wosobj_info {
 
 struct wosobj_oid_list_entry {
         char                            oid[41];
+	bool				heap;		// malloc'ed once the request arena is full
 	struct wosobj_oid_list_entry	*next;
 };
 
@@ -176,6 +219,33 @@ struct wosfs_config {
      char 	*wos_policy;
      int   	wosfs_debug;
      int   	wosfs_buffer;
+     int   	wosfs_buffer_budget;	// MB of staging buffers for all open files, 0 for unlimited
+     int   	wosfs_hugepages;	// back staging buffers with huge pages
+     int   	wosfs_hedge;		// max percentage of GetSpan calls that may be duplicated, 0 to disable
+     int   	wosfs_hedge_pctl;	// latency percentile after which a GetSpan is hedged
+     char 	*wosfs_cache;		// local object cache directory, NULL to disable
+     int   	wosfs_cache_max;	// largest object to cache, in MB
+     int   	wosfs_cache_size;	// cache size limit in MB, 0 for unlimited
+     int   	wosfs_dirfd_cache;	// number of directory fds to keep open, 0 to disable
+     int   	wosfs_attr_ttl;		// ms to keep getattr/readdir attributes, 0 to disable
+     int   	wosfs_threads;		// worker threads for readdir stub parsing, 0 for none
+     int   	wosfs_kernel_ttl;	// seconds for the kernel to keep entries and attributes
+     int   	wosfs_lowlevel;		// serve the kernel through fuse_lowlevel instead of fuse_main
+     int   	wosfs_fuse_threads;	// fixed number of fuse request workers, 0 for libfuse's own loop
+     int   	wosfs_fuse_pin;		// pin fuse request workers to CPUs
+     char 	*wosfs_trace;		// binary trace file, NULL to disable
+     int   	wosfs_slow_ms;		// log callbacks taking this many ms or more, 0 to disable
+     char 	*wosfs_slow_log;	// slow-op log file, NULL for syslog
+     int   	wosfs_purge_age;	// purge trashed stubs older than this many seconds, 0 to keep
+     int   	wosfs_purge_quota;	// MB of objects to keep in the trash can, 0 for unlimited
+     int   	wosfs_purge_files;	// stubs to keep in the trash can, 0 for unlimited
+     int   	wosfs_purge_interval;	// seconds between trash can scans
+     int   	wosfs_purge_depth;	// WOS deletes in flight
+     int   	wosfs_purge_rate;	// WOS deletes per second, 0 for unlimited
+     int   	wosfs_trash_shards;	// shards per hour bucket of the trash can, 0 for a flat trash can
+     int   	wosfs_keep_versions;	// versions a stub keeps after compaction, 0 for all
+     int   	wosfs_keep_age;		// seconds a version is kept after compaction, 0 for no limit
+     int   	wosfs_snapshot_threads;	// threads walking the stub tree for a snapshot
 } wosfs_conf;
 
 enum {
@@ -189,6 +259,7 @@ enum {
 #define WOSFS_LOG_FILEOP	0x02  // bitmask for fileop debug output
 #define WOSFS_LOG_WARN		0x04  // bitmask for warning debug output
 #define WOSFS_WR_DROP		0x08  // bitmask for dropping write data
+#define WOSFS_LOG_TRACE		0x10  // start with the binary trace on (--wos_trace)
 
 static struct fuse_opt wosfs_opts[] = {
      WOSFS_OPT("-m %s",             	wosfs_magic, 0),
@@ -198,6 +269,33 @@ static struct fuse_opt wosfs_opts[] = {
      WOSFS_OPT("-p %s",       	    	wos_policy, 0),
      WOSFS_OPT("--wos_debug=%i",     	wosfs_debug, 0),
      WOSFS_OPT("--wos_buffer=%i",     	wosfs_buffer, 0),
+     WOSFS_OPT("--wos_buffer_budget=%i",	wosfs_buffer_budget, 0),
+     WOSFS_OPT("--wos_hugepages",     	wosfs_hugepages, 1),
+     WOSFS_OPT("--wos_hedge=%i",     	wosfs_hedge, 0),
+     WOSFS_OPT("--wos_hedge_pctl=%i", 	wosfs_hedge_pctl, 0),
+     WOSFS_OPT("--wos_cache=%s",     	wosfs_cache, 0),
+     WOSFS_OPT("--wos_cache_max=%i", 	wosfs_cache_max, 0),
+     WOSFS_OPT("--wos_cache_size=%i", 	wosfs_cache_size, 0),
+     WOSFS_OPT("--wos_dirfd_cache=%i", 	wosfs_dirfd_cache, 0),
+     WOSFS_OPT("--wos_attr_ttl=%i", 	wosfs_attr_ttl, 0),
+     WOSFS_OPT("--wos_threads=%i", 	wosfs_threads, 0),
+     WOSFS_OPT("--wos_kernel_ttl=%i", 	wosfs_kernel_ttl, 0),
+     WOSFS_OPT("--wos_lowlevel",     	wosfs_lowlevel, 1),
+     WOSFS_OPT("--wos_fuse_threads=%i", 	wosfs_fuse_threads, 0),
+     WOSFS_OPT("--wos_fuse_pin",     	wosfs_fuse_pin, 1),
+     WOSFS_OPT("--wos_trace=%s",     	wosfs_trace, 0),
+     WOSFS_OPT("--wos_slow_ms=%i",     	wosfs_slow_ms, 0),
+     WOSFS_OPT("--wos_slow_log=%s",     	wosfs_slow_log, 0),
+     WOSFS_OPT("--wos_purge_age=%i",     	wosfs_purge_age, 0),
+     WOSFS_OPT("--wos_purge_quota=%i",  	wosfs_purge_quota, 0),
+     WOSFS_OPT("--wos_purge_files=%i",  	wosfs_purge_files, 0),
+     WOSFS_OPT("--wos_purge_interval=%i",	wosfs_purge_interval, 0),
+     WOSFS_OPT("--wos_purge_depth=%i",  	wosfs_purge_depth, 0),
+     WOSFS_OPT("--wos_purge_rate=%i",   	wosfs_purge_rate, 0),
+     WOSFS_OPT("--wos_trash_shards=%i", 	wosfs_trash_shards, 0),
+     WOSFS_OPT("--wos_keep_versions=%i",	wosfs_keep_versions, 0),
+     WOSFS_OPT("--wos_keep_age=%i",     	wosfs_keep_age, 0),
+     WOSFS_OPT("--wos_snapshot_threads=%i",	wosfs_snapshot_threads, 0),
 
      FUSE_OPT_KEY("-V",             	KEY_VERSION),
      FUSE_OPT_KEY("--version",      	KEY_VERSION),
@@ -207,7 +305,787 @@ static struct fuse_opt wosfs_opts[] = {
 };
 
 #define WOSFS_DEBUGLOG(m, fmt, args ...) { if (wosfs_conf.wosfs_debug & m ) syslog(LOG_INFO, "%s:%u:%s()" fmt, __FILE__, __LINE__, __func__, ## args);}
+
+/*
+ *  Staging buffer pool
+ *
+ *  Write staging buffers (--wos_buffer) are page aligned, optionally huge
+ *  page backed, and shared by all open files.  A file takes one on its
+ *  first buffered write and gives it back at release.  Once the budget is
+ *  used up a writer waits up to WOSFS_SBUF_WAIT_MS for a buffer to come
+ *  back, then writes through unbuffered.
+ */
+
+#define WOSFS_SBUF_WAIT_MS		200
+#define WOSFS_SBUF_IDLE_MAX		16	// free buffers kept when there is no budget
+#define WOSFS_HUGEPAGE_SIZE		(2*WOSFS_1KiB*WOSFS_1KiB)
+
+struct wosfs_sbuf {
+	unsigned char			*mem;
+	size_t				alloc_size;
+	bool				huge;
+	struct wosfs_sbuf		*next;
+};
+
+struct wosfs_sbuf_pool {
+	struct wosfs_sbuf		*free_list;
+	int				free_count;
+	uint64_t			allocated;	// bytes of all staging buffers, in use or free
+	uint64_t			in_use;
+	uint64_t			waits;		// writers throttled by the budget
+	uint64_t			fallbacks;	// writers that gave up and went unbuffered
+	pthread_mutex_t			mtx;
+	pthread_cond_t			cond;
+} wosfs_sbufs;
+
+struct wosfs_sbuf *wosfs_sbuf_alloc(void)
+{
+	struct wosfs_sbuf *sb = (struct wosfs_sbuf *)malloc(sizeof(struct wosfs_sbuf));
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	if ( NULL == sb )
+		return NULL;
+
+	sb->huge = false;
+	sb->mem = NULL;
+#ifdef MAP_HUGETLB
+	if ( wosfs_conf.wosfs_hugepages ) {
+		sb->alloc_size = (wosfs_conf.wosfs_buffer + WOSFS_HUGEPAGE_SIZE - 1) / WOSFS_HUGEPAGE_SIZE * WOSFS_HUGEPAGE_SIZE;
+		void *p = mmap(NULL, sb->alloc_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if ( p != MAP_FAILED ) {
+			sb->mem = (unsigned char *)p;
+			sb->huge = true;
+		}
+		else
+			WOSFS_DEBUGLOG(WOSFS_LOG_WARN, ":WOS:: no huge pages for staging buffer, using normal pages");
+	}
+#endif
+	if ( NULL == sb->mem ) {
+		sb->alloc_size = (wosfs_conf.wosfs_buffer + page - 1) / page * page;
+		if ( posix_memalign((void **)&sb->mem, page, sb->alloc_size) != 0 ) {
+			WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to allocate memory for staging buffer");
+			free(sb);
+			return NULL;
+		}
+	}
+
+	return sb;
+}
+
+void wosfs_sbuf_free(struct wosfs_sbuf *sb)
+{
+	if ( sb->huge )
+		munmap(sb->mem, sb->alloc_size);
+	else
+		free(sb->mem);
+	free(sb);
+}
+
+struct wosfs_sbuf *wosfs_sbuf_get(void)
+{
+	uint64_t budget = (uint64_t)wosfs_conf.wosfs_buffer_budget * WOSFS_1KiB * WOSFS_1KiB;
+	struct wosfs_sbuf *sb = NULL;
+	struct timespec deadline;
+	bool waited = false;
+
+	pthread_mutex_lock(&wosfs_sbufs.mtx);
+	for (;;) {
+		if ( wosfs_sbufs.free_list ) {
+			sb = wosfs_sbufs.free_list;
+			wosfs_sbufs.free_list = sb->next;
+			wosfs_sbufs.free_count--;
+			break;
+		}
+		if ( 0 == budget || wosfs_sbufs.allocated + wosfs_conf.wosfs_buffer <= budget ) {
+			sb = wosfs_sbuf_alloc();
+			if ( sb )
+				wosfs_sbufs.allocated += sb->alloc_size;
+			break;
+		}
+		if ( !waited ) {
+			uint64_t ns;
+
+			waited = true;
+			wosfs_sbufs.waits++;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			ns = deadline.tv_nsec + (uint64_t)WOSFS_SBUF_WAIT_MS * 1000000;
+			deadline.tv_sec += ns / 1000000000;
+			deadline.tv_nsec = ns % 1000000000;
+		}
+		if ( ETIMEDOUT == pthread_cond_timedwait(&wosfs_sbufs.cond, &wosfs_sbufs.mtx, &deadline) ) {
+			wosfs_sbufs.fallbacks++;
+			WOSFS_DEBUGLOG(WOSFS_LOG_WARN, ":WOS:: staging buffer budget exhausted, allocated=%lu, in use=%lu", wosfs_sbufs.allocated, wosfs_sbufs.in_use);
+			break;
+		}
+	}
+	if ( sb )
+		wosfs_sbufs.in_use += sb->alloc_size;
+	pthread_mutex_unlock(&wosfs_sbufs.mtx);
+
+	return sb;
+}
+
+void wosfs_sbuf_put(struct wosfs_sbuf *sb)
+{
+	pthread_mutex_lock(&wosfs_sbufs.mtx);
+	wosfs_sbufs.in_use -= sb->alloc_size;
+	if ( wosfs_conf.wosfs_buffer_budget || wosfs_sbufs.free_count < WOSFS_SBUF_IDLE_MAX ) {
+		sb->next = wosfs_sbufs.free_list;
+		wosfs_sbufs.free_list = sb;
+		wosfs_sbufs.free_count++;
+		sb = NULL;
+	}
+	else
+		wosfs_sbufs.allocated -= sb->alloc_size;
+	pthread_cond_signal(&wosfs_sbufs.cond);
+	pthread_mutex_unlock(&wosfs_sbufs.mtx);
+
+	if ( sb )
+		wosfs_sbuf_free(sb);
+}
 	
+/*
+ *  Per-thread request state
+ *
+ *  Every wosfs_* callback builds its backing paths in a wosfs_req that
+ *  belongs to the calling thread, so requests do no heap allocation for
+ *  paths and support PATH_MAX long names.  The arena is scratch space for
+ *  the request; it is reset by wosfs_req_begin(), which also closes the fd
+ *  that the thread's last read_buf left for libfuse to reply from.
+ */
+
+#define WOSFS_ARENA_SIZE		(16*WOSFS_1KiB)
+
+struct wosfs_req {
+	char				path[PATH_MAX];		// backing path of the request
+	char				path_to[PATH_MAX];	// second backing path: rename/link target, trash can path
+	char				path_bak[PATH_MAX];	// mirror path under wosfs_bak_path
+	int				reply_fd;		// handed to libfuse by the last read_buf, -1 if none
+	size_t				arena_used;
+	char				arena[WOSFS_ARENA_SIZE];
+};
+
+pthread_key_t wosfs_req_key;
+size_t wosfs_path_len;		// strlen(wosfs_conf.wosfs_path)
+
+struct wosfs_req *wosfs_req_begin(void)
+{
+	struct wosfs_req *req = (struct wosfs_req *)pthread_getspecific(wosfs_req_key);
+
+	if ( NULL == req ) {
+		// once per thread; freed by the key destructor when the thread exits
+		req = (struct wosfs_req *)malloc(sizeof(struct wosfs_req));
+		if ( NULL == req ) {
+			WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to allocate memory for wosfs_req");
+			abort();
+		}
+		req->reply_fd = -1;
+		pthread_setspecific(wosfs_req_key, req);
+	}
+	else if ( req->reply_fd >= 0 ) {
+		// the reply of the thread's last request has been sent
+		close(req->reply_fd);
+		req->reply_fd = -1;
+	}
+	req->arena_used = 0;
+
+	return req;
+}
+
+void wosfs_req_free(void *arg)
+{
+	struct wosfs_req *req = (struct wosfs_req *)arg;
+
+	if ( req->reply_fd >= 0 )
+		close(req->reply_fd);
+	free(req);
+}
+
+void *wosfs_arena_alloc(struct wosfs_req *req, size_t size)
+{
+	size = (size + 15) & ~(size_t)15;
+	if ( req->arena_used + size > WOSFS_ARENA_SIZE )
+		return NULL;
+
+	void *p = req->arena + req->arena_used;
+	req->arena_used += size;
+	return p;
+}
+
+/*
+ *  Static probes
+ *
+ *  USDT probes of provider fusewos, for perf and bpftrace:
+ *
+ *    op__entry(op, name, path, offset, size)
+ *    op__exit(op, name, path, offset, size, latency_ns)
+ *    wos__entry(op, name, offset, size)
+ *    wos__exit(op, name, offset, size, status, latency_ns, start_ns)
+ *
+ *  op is an enum wosfs_stat_id and name its wosfs_stat_names[] string.
+ *  wos__exit carries its own start time because the completion of an
+ *  asynchronous WOS call fires on a WOS thread.  Each probe has a
+ *  semaphore, and the arguments are only computed while a tracer is
+ *  attached; otherwise a probe is a nop and a not-taken branch.  The
+ *  scripts in bpftrace/ turn them into latency breakdowns.
+ */
+
+#ifdef WOSFS_HAVE_USDT
+#define WOSFS_PROBE_SEMAPHORE(name)	volatile unsigned short fusewos_##name##_semaphore __attribute__((unused)) __attribute__((section(".probes")))
+#define WOSFS_PROBE_ENABLED(name)	__builtin_expect(fusewos_##name##_semaphore != 0, 0)
+#define WOSFS_PROBE4(name, a, b, c, d)			DTRACE_PROBE4(fusewos, name, a, b, c, d)
+#define WOSFS_PROBE5(name, a, b, c, d, e)		DTRACE_PROBE5(fusewos, name, a, b, c, d, e)
+#define WOSFS_PROBE6(name, a, b, c, d, e, f)		DTRACE_PROBE6(fusewos, name, a, b, c, d, e, f)
+#define WOSFS_PROBE7(name, a, b, c, d, e, f, g)		DTRACE_PROBE7(fusewos, name, a, b, c, d, e, f, g)
+#else
+#define WOSFS_PROBE_SEMAPHORE(name)	extern int fusewos_##name##_no_usdt
+#define WOSFS_PROBE_ENABLED(name)	false
+#define WOSFS_PROBE4(name, a, b, c, d)			do { } while (0)
+#define WOSFS_PROBE5(name, a, b, c, d, e)		do { } while (0)
+#define WOSFS_PROBE6(name, a, b, c, d, e, f)		do { } while (0)
+#define WOSFS_PROBE7(name, a, b, c, d, e, f, g)		do { } while (0)
+#endif
+
+WOSFS_PROBE_SEMAPHORE(op__entry);
+WOSFS_PROBE_SEMAPHORE(op__exit);
+WOSFS_PROBE_SEMAPHORE(wos__entry);
+WOSFS_PROBE_SEMAPHORE(wos__exit);
+
+/*
+ *  Operation statistics
+ *
+ *  Every wosfs_* callback and every WOS call counts itself and its latency
+ *  in a histogram owned by the calling thread, so recording is a couple of
+ *  clock reads and plain stores with no lock and no shared cache line.
+ *  The histograms are log-linear: four buckets per power of two of
+ *  nanoseconds, which keeps every bucket within 25% of its value.  Reading
+ *  /.WOSFS_stats sums the blocks of all threads.
+ *
+ *  A thread's block outlives the thread; the next new thread reuses it, so
+ *  counts are never lost and threads that come and go do not add memory.
+ */
+
+#define WOSFS_HIST_SUB_BITS		2
+#define WOSFS_HIST_MAX_BITS		40	// latencies from 2^40 ns (18 minutes) on share the last bucket
+#define WOSFS_HIST_BUCKETS		((WOSFS_HIST_MAX_BITS - WOSFS_HIST_SUB_BITS + 1) << WOSFS_HIST_SUB_BITS)
+
+struct wosfs_op_stats {
+	uint64_t			count;
+	uint64_t			errors;		// WOS calls only, callbacks count their latency alone
+	uint64_t			sum_ns;
+	uint64_t			max_ns;
+	uint64_t			hist[WOSFS_HIST_BUCKETS];
+};
+
+/*
+ *  Request phases
+ *
+ *  Within a callback, the time spent resolving the path (lookup), reading
+ *  or appending the stub (stub), opening WOS streams (wos_open), in other
+ *  WOS calls (wos_io), waiting for another thread's GetSpan (wait),
+ *  copying data (copy) and in the local object cache (cache) is charged
+ *  to that phase; the rest is other.  Phases nest and each is charged its
+ *  own time only, so they add up to the latency of the callback.
+ *
+ *  A callback that takes --wos_slow_ms or longer is written to the slow
+ *  call log with its phases and the OID it touched.  The phase totals of
+ *  every callback are in /.WOSFS_stats.
+ */
+
+enum wosfs_phase_id {
+	WOSFS_PH_LOOKUP,
+	WOSFS_PH_STUB,
+	WOSFS_PH_WOS_OPEN,
+	WOSFS_PH_WOS_IO,
+	WOSFS_PH_WAIT,
+	WOSFS_PH_COPY,
+	WOSFS_PH_CACHE,
+	WOSFS_PH_MAX
+};
+
+static const char *wosfs_phase_names[WOSFS_PH_MAX] = {
+	"lookup", "stub", "wos_open", "wos_io", "wait", "copy", "cache",
+};
+
+/*
+ *  Binary trace (--wos_trace)
+ *
+ *  While tracing is on, wosfs_stat_record() also appends a fixed size
+ *  struct wosfs_trace_rec (wosfs_trace.h) to a ring owned by the calling
+ *  thread.  The ring has one writer and one reader, the drain thread, so
+ *  neither side takes a lock; a full ring drops records and counts them.
+ *  The drain thread writes the rings to the --wos_trace file every
+ *  WOSFS_TRACE_DRAIN_MS.  SIGUSR2 turns tracing on and off; decode the
+ *  file with wosfs_trace.
+ */
+
+#define WOSFS_TRACE_RING		8192	// records per thread, a power of two
+#define WOSFS_TRACE_DRAIN_MS		100
+
+struct wosfs_trace_ring {
+	struct wosfs_trace_rec		recs[WOSFS_TRACE_RING];
+	uint64_t			head;		// next record to write, owner thread only
+	uint64_t			tail;		// next record to drain, drain thread only
+	uint64_t			drops;
+};
+
+volatile sig_atomic_t wosfs_trace_on = 0;
+uint64_t wosfs_trace_drops = 0;		// drops of drained rings, for /.WOSFS_stats
+
+struct wosfs_thread_stats {
+	struct wosfs_op_stats		ops[WOSFS_ST_MAX];
+	struct wosfs_trace_ring		*trace;		// allocated on the first record traced
+	uint64_t			phase_sum_ns[WOSFS_ST_WOS_GETSPAN][WOSFS_PH_MAX];	// callbacks only
+	uint64_t			slow_ops;
+	uint64_t			cur_hash;	// path hash of the callback in progress
+	int				cur_depth;	// callbacks in progress, phases are charged while > 0
+	uint64_t			cur_phase_ns[WOSFS_PH_MAX];
+	uint64_t			cur_charged_ns;	// sum of cur_phase_ns
+	char				cur_oid[41];
+	uint32_t			tid;
+	bool				in_use;		// owned by a live thread
+	struct wosfs_thread_stats	*next;
+};
+
+struct wosfs_thread_stats *wosfs_stats_head = NULL;
+pthread_mutex_t lock_stats = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t wosfs_stats_key;
+uint64_t wosfs_stats_start_ns;
+
+static inline uint64_t wosfs_now_ns(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+static inline int wosfs_hist_bucket(uint64_t ns)
+{
+	if ( ns < (1 << WOSFS_HIST_SUB_BITS) )
+		return ns;
+	if ( ns >> WOSFS_HIST_MAX_BITS )
+		return WOSFS_HIST_BUCKETS - 1;
+
+	int e = 63 - __builtin_clzll(ns);
+	int sub = (ns >> (e - WOSFS_HIST_SUB_BITS)) & ((1 << WOSFS_HIST_SUB_BITS) - 1);
+	return ((e - WOSFS_HIST_SUB_BITS + 1) << WOSFS_HIST_SUB_BITS) + sub;
+}
+
+/* smallest latency that falls into bucket */
+uint64_t wosfs_hist_lower(int bucket)
+{
+	if ( bucket < (1 << WOSFS_HIST_SUB_BITS) )
+		return bucket;
+
+	int e = (bucket >> WOSFS_HIST_SUB_BITS) + WOSFS_HIST_SUB_BITS - 1;
+	uint64_t sub = bucket & ((1 << WOSFS_HIST_SUB_BITS) - 1);
+	return ((1ULL << WOSFS_HIST_SUB_BITS) + sub) << (e - WOSFS_HIST_SUB_BITS);
+}
+
+static void wosfs_stats_thread_exit(void *arg)
+{
+	struct wosfs_thread_stats *ts = (struct wosfs_thread_stats *)arg;
+
+	pthread_mutex_lock(&lock_stats);
+	ts->in_use = false;
+	pthread_mutex_unlock(&lock_stats);
+}
+
+struct wosfs_thread_stats *wosfs_stats_thread(void)
+{
+	struct wosfs_thread_stats *ts = (struct wosfs_thread_stats *)pthread_getspecific(wosfs_stats_key);
+
+	if ( ts )
+		return ts;
+
+	pthread_mutex_lock(&lock_stats);
+	for (ts = wosfs_stats_head; ts; ts = ts->next)
+		if ( !ts->in_use )
+			break;
+	if ( NULL == ts ) {
+		ts = (struct wosfs_thread_stats *)calloc(1, sizeof(struct wosfs_thread_stats));
+		if ( ts ) {
+			ts->next = wosfs_stats_head;
+			wosfs_stats_head = ts;
+		}
+	}
+	if ( ts ) {
+		ts->in_use = true;
+		ts->tid = syscall(SYS_gettid);
+	}
+	pthread_mutex_unlock(&lock_stats);
+
+	if ( ts )
+		pthread_setspecific(wosfs_stats_key, ts);
+	return ts;
+}
+
+void wosfs_trace_record(struct wosfs_thread_stats *ts, int id, uint64_t start_ns, uint64_t ns,
+			int status, uint64_t offset, uint32_t size, uint64_t hash)
+{
+	struct wosfs_trace_ring *r = ts->trace;
+
+	if ( NULL == r ) {
+		r = (struct wosfs_trace_ring *)calloc(1, sizeof(struct wosfs_trace_ring));
+		if ( NULL == r )
+			return;
+		__atomic_store_n(&ts->trace, r, __ATOMIC_RELEASE);
+	}
+
+	if ( r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= WOSFS_TRACE_RING ) {
+		r->drops++;
+		return;
+	}
+
+	struct wosfs_trace_rec *rec = &r->recs[r->head & (WOSFS_TRACE_RING - 1)];
+	rec->ts_ns = start_ns;
+	rec->lat_ns = ns;
+	rec->path_hash = hash;
+	rec->offset = offset;
+	rec->size = size;
+	rec->tid = ts->tid;
+	rec->op = id;
+	rec->pad = 0;
+	rec->status = status;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * count one call of id that started at start_ns; status is the WosStatus
+ * of WOS calls, hash 0 stands for the path of the callback in progress
+ */
+void wosfs_stat_record(int id, uint64_t start_ns, int status, uint64_t offset = 0, uint32_t size = 0, uint64_t hash = 0)
+{
+	struct wosfs_thread_stats *ts = wosfs_stats_thread();
+	uint64_t ns = wosfs_now_ns() - start_ns;
+
+	if ( NULL == ts )
+		return;
+
+	struct wosfs_op_stats *st = &ts->ops[id];
+	st->count++;
+	st->sum_ns += ns;
+	if ( ns > st->max_ns )
+		st->max_ns = ns;
+	st->hist[wosfs_hist_bucket(ns)]++;
+	if ( status != 0 )
+		st->errors++;
+
+	// a WOS call made by the callback in progress, not an async completion
+	if ( id >= WOSFS_ST_WOS_GETSPAN && ts->cur_depth ) {
+		int ph = (id == WOSFS_ST_WOS_CREATEGETSTREAM || id == WOSFS_ST_WOS_CREATEPUTSTREAM) ? WOSFS_PH_WOS_OPEN : WOSFS_PH_WOS_IO;
+
+		ts->cur_phase_ns[ph] += ns;
+		ts->cur_charged_ns += ns;
+	}
+	if ( id >= WOSFS_ST_WOS_GETSPAN && WOSFS_PROBE_ENABLED(wos__exit) )
+		WOSFS_PROBE7(wos__exit, id, wosfs_stat_names[id], offset, size, status, ns, start_ns);
+	if ( wosfs_trace_on )
+		wosfs_trace_record(ts, id, start_ns, ns, status, offset, size, hash ? hash : ts->cur_hash);
+}
+
+/* start of a WOS call: the time to pass to wosfs_stat_record() */
+static inline uint64_t wosfs_wos_begin(int id, uint64_t offset, uint64_t size)
+{
+	if ( WOSFS_PROBE_ENABLED(wos__entry) )
+		WOSFS_PROBE4(wos__entry, id, wosfs_stat_names[id], offset, size);
+	return wosfs_now_ns();
+}
+
+/* charges the rest of the enclosing block to phase id */
+struct wosfs_phase_scope {
+	struct wosfs_thread_stats	*ts;
+	int				id;
+	uint64_t			start_ns;
+	uint64_t			charged_ns;
+
+	wosfs_phase_scope(int ph) : ts(wosfs_stats_thread()), id(ph), start_ns(0), charged_ns(0)
+	{
+		if ( NULL == ts || 0 == ts->cur_depth ) {
+			ts = NULL;
+			return;
+		}
+		start_ns = wosfs_now_ns();
+		charged_ns = ts->cur_charged_ns;
+	}
+	~wosfs_phase_scope()
+	{
+		if ( NULL == ts )
+			return;
+
+		// less what nested phases and WOS calls were charged meanwhile
+		uint64_t own = wosfs_now_ns() - start_ns - (ts->cur_charged_ns - charged_ns);
+		ts->cur_phase_ns[id] += own;
+		ts->cur_charged_ns += own;
+	}
+};
+
+#define WOSFS_PHASE(ph)		struct wosfs_phase_scope wosfs_phase_scope_(ph)
+
+/* note the OID the callback in progress works on, for the slow call log */
+void wosfs_phase_oid(const char *oid)
+{
+	struct wosfs_thread_stats *ts = wosfs_stats_thread();
+
+	if ( ts && ts->cur_depth ) {
+		strncpy(ts->cur_oid, oid, sizeof(ts->cur_oid) - 1);
+		ts->cur_oid[sizeof(ts->cur_oid) - 1] = '\0';
+	}
+}
+
+/*
+ * paths seen while tracing, so each goes to the .paths file once;
+ * open addressing on the path hash, a full table just writes duplicates
+ */
+#define WOSFS_TRACE_NAMES		(1 << 16)
+
+uint64_t wosfs_trace_seen[WOSFS_TRACE_NAMES];
+FILE *wosfs_trace_paths_fp = NULL;
+pthread_mutex_t lock_trace_paths = PTHREAD_MUTEX_INITIALIZER;
+
+void wosfs_trace_name(uint64_t hash, const char *path)
+{
+	uint64_t slot = hash;
+
+	if ( NULL == wosfs_trace_paths_fp )
+		return;
+	for (int probe = 0; probe < 16; probe++, slot++) {
+		uint64_t *p = &wosfs_trace_seen[slot & (WOSFS_TRACE_NAMES - 1)];
+		uint64_t cur = __atomic_load_n(p, __ATOMIC_RELAXED);
+
+		if ( cur == hash )
+			return;
+		if ( cur == 0 ) {
+			if ( __atomic_compare_exchange_n(p, &cur, hash, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+				break;
+			if ( cur == hash )
+				return;
+		}
+	}
+
+	pthread_mutex_lock(&lock_trace_paths);
+	fprintf(wosfs_trace_paths_fp, "%016lx %s\n", hash, path);
+	pthread_mutex_unlock(&lock_trace_paths);
+}
+
+uint64_t wosfs_slow_ns = 0;		// --wos_slow_ms
+FILE *wosfs_slow_fp = NULL;
+pthread_mutex_t lock_slow = PTHREAD_MUTEX_INITIALIZER;
+
+void wosfs_slow_report(struct wosfs_thread_stats *ts, int id, const char *path, uint64_t offset, uint32_t size, uint64_t ns)
+{
+	char line[PATH_MAX + 512];
+	int len;
+
+	ts->slow_ops++;
+	len = snprintf(line, sizeof(line), "slow %s %.3f ms tid=%u path=%s offset=%lu size=%u oid=%s",
+		wosfs_stat_names[id], ns / 1e6, ts->tid, path ? path : "-", offset, size, ts->cur_oid[0] ? ts->cur_oid : "-");
+	for (int ph = 0; ph < WOSFS_PH_MAX && len < (int)sizeof(line); ph++)
+		len += snprintf(line + len, sizeof(line) - len, " %s=%.3f", wosfs_phase_names[ph], ts->cur_phase_ns[ph] / 1e6);
+	if ( len < (int)sizeof(line) )
+		snprintf(line + len, sizeof(line) - len, " other=%.3f",
+			ns > ts->cur_charged_ns ? (ns - ts->cur_charged_ns) / 1e6 : 0.0);
+
+	if ( NULL == wosfs_slow_fp ) {
+		syslog(LOG_WARNING, "fusewos %s", line);
+		return;
+	}
+
+	struct timeval tv;
+	struct tm tm;
+	char when[32];
+
+	gettimeofday(&tv, NULL);
+	localtime_r(&tv.tv_sec, &tm);
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+	pthread_mutex_lock(&lock_slow);
+	fprintf(wosfs_slow_fp, "%s.%06ld %s\n", when, (long)tv.tv_usec, line);
+	fflush(wosfs_slow_fp);
+	pthread_mutex_unlock(&lock_slow);
+}
+
+/* counts, times, traces and probes the enclosing wosfs_* callback, and its phases */
+struct wosfs_op_scope {
+	struct wosfs_thread_stats	*ts;
+	int				id;
+	const char			*path;
+	uint64_t			start_ns;
+	uint64_t			hash;
+	uint64_t			offset;
+	uint32_t			size;
+
+	wosfs_op_scope(int op, const char *p, uint64_t off = 0, uint32_t len = 0, const char *p2 = NULL) :
+		ts(wosfs_stats_thread()), id(op), path(p), start_ns(wosfs_now_ns()), hash(0), offset(off), size(len)
+	{
+		if ( p2 )
+			offset = wosfs_path_hash(p2);	// second path of rename, link and symlink
+		if ( WOSFS_PROBE_ENABLED(op__entry) )
+			WOSFS_PROBE5(op__entry, id, wosfs_stat_names[id], path, offset, size);
+		if ( NULL == ts )
+			return;
+		if ( 0 == ts->cur_depth++ ) {
+			memset(ts->cur_phase_ns, 0, sizeof(ts->cur_phase_ns));
+			ts->cur_charged_ns = 0;
+			ts->cur_oid[0] = '\0';
+		}
+		if ( wosfs_trace_on ) {
+			hash = path ? wosfs_path_hash(path) : 0;	// releasedir of the low-level frontend has none
+			ts->cur_hash = hash;	// for the WOS calls made on behalf of path
+			if ( hash )
+				wosfs_trace_name(hash, path);
+			if ( p2 )
+				wosfs_trace_name(offset, p2);
+		}
+	}
+	~wosfs_op_scope()
+	{
+		uint64_t ns = wosfs_now_ns() - start_ns;
+
+		if ( WOSFS_PROBE_ENABLED(op__exit) )
+			WOSFS_PROBE6(op__exit, id, wosfs_stat_names[id], path, offset, size, ns);
+		if ( ts && 0 == --ts->cur_depth ) {
+			for (int ph = 0; ph < WOSFS_PH_MAX; ph++)
+				ts->phase_sum_ns[id][ph] += ts->cur_phase_ns[ph];
+			if ( wosfs_slow_ns && ns >= wosfs_slow_ns )
+				wosfs_slow_report(ts, id, path, offset, size, ns);
+		}
+		wosfs_stat_record(id, start_ns, 0, offset, size, hash);
+	}
+};
+
+#define WOSFS_OP_SCOPE(id, path)			struct wosfs_op_scope wosfs_op_scope_(id, path)
+#define WOSFS_OP_SCOPE_RANGE(id, path, off, len)	struct wosfs_op_scope wosfs_op_scope_(id, path, off, len)
+#define WOSFS_OP_SCOPE2(id, path, path2)		struct wosfs_op_scope wosfs_op_scope_(id, path, 0, 0, path2)
+
+FILE *wosfs_trace_fp = NULL;
+pthread_mutex_t lock_trace = PTHREAD_MUTEX_INITIALIZER;
+
+/* write out what the rings hold; the drain thread and wosfs_destroy() */
+void wosfs_trace_drain(void)
+{
+	pthread_mutex_lock(&lock_trace);
+
+	// blocks are only ever added at the head and never freed
+	pthread_mutex_lock(&lock_stats);
+	struct wosfs_thread_stats *head = wosfs_stats_head;
+	pthread_mutex_unlock(&lock_stats);
+
+	uint64_t drops = 0;
+	for (struct wosfs_thread_stats *ts = head; ts; ts = ts->next) {
+		struct wosfs_trace_ring *r = __atomic_load_n(&ts->trace, __ATOMIC_ACQUIRE);
+		if ( NULL == r )
+			continue;
+
+		uint64_t end = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		while ( r->tail < end ) {
+			uint64_t first = r->tail & (WOSFS_TRACE_RING - 1);
+			uint64_t n = std::min(end - r->tail, (uint64_t)(WOSFS_TRACE_RING - first));
+
+			if ( wosfs_trace_fp )
+				fwrite(&r->recs[first], sizeof(struct wosfs_trace_rec), n, wosfs_trace_fp);
+			__atomic_store_n(&r->tail, r->tail + n, __ATOMIC_RELEASE);
+		}
+		drops += r->drops;
+	}
+	wosfs_trace_drops = drops;
+	if ( wosfs_trace_fp )
+		fflush(wosfs_trace_fp);
+	pthread_mutex_lock(&lock_trace_paths);
+	if ( wosfs_trace_paths_fp )
+		fflush(wosfs_trace_paths_fp);
+	pthread_mutex_unlock(&lock_trace_paths);
+
+	pthread_mutex_unlock(&lock_trace);
+}
+
+void *wosfs_trace_thread(void *arg)
+{
+	int was_on = wosfs_trace_on;
+
+	(void) arg;
+	for (;;) {
+		usleep(WOSFS_TRACE_DRAIN_MS * 1000);
+		if ( was_on != wosfs_trace_on ) {
+			was_on = wosfs_trace_on;
+			syslog(LOG_INFO, "fusewos trace %s, file=%s", was_on ? "on" : "off", wosfs_conf.wosfs_trace);
+		}
+		wosfs_trace_drain();
+	}
+	return NULL;
+}
+
+static void wosfs_trace_toggle(int sig)
+{
+	(void) sig;
+	wosfs_trace_on = !wosfs_trace_on;
+}
+
+/* fopen() for files only the mount's owner may read: 0600 whatever the umask, even if they existed */
+FILE *wosfs_fopen_private(const char *path, int flags, const char *mode)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC | flags, 0600);
+	FILE *fp = NULL;
+
+	if ( fd == -1 )
+		return NULL;
+	if ( fchmod(fd, 0600) == 0 )
+		fp = fdopen(fd, mode);
+	if ( NULL == fp ) {
+		int err = errno;
+		close(fd);
+		errno = err;
+	}
+	return fp;
+}
+
+/* open the trace file and start the drain thread; from wosfs_init() */
+bool wosfs_trace_start(void)
+{
+	struct wosfs_trace_hdr hdr;
+	struct timespec tp;
+	struct sigaction sa;
+	pthread_t thread;
+
+	// a new file per mount: the header's clock pair only holds for this process
+	wosfs_trace_fp = wosfs_fopen_private(wosfs_conf.wosfs_trace, O_TRUNC, "w");
+	if ( NULL == wosfs_trace_fp ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to open trace file %s, errno=%d", wosfs_conf.wosfs_trace, errno);
+		return false;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	strcpy(hdr.magic, WOSFS_TRACE_MAGIC);
+	hdr.version = WOSFS_TRACE_VERSION;
+	hdr.rec_size = sizeof(struct wosfs_trace_rec);
+	hdr.mono_ns = wosfs_now_ns();
+	clock_gettime(CLOCK_REALTIME, &tp);
+	hdr.real_ns = (uint64_t)tp.tv_sec * 1000000000 + tp.tv_nsec;
+	fwrite(&hdr, sizeof(hdr), 1, wosfs_trace_fp);
+	fflush(wosfs_trace_fp);
+
+	// the paths behind the path hashes, for wosfs_replay
+	std::string paths = std::string(wosfs_conf.wosfs_trace) + WOSFS_TRACE_PATHS_SUFFIX;
+	wosfs_trace_paths_fp = wosfs_fopen_private(paths.c_str(), O_TRUNC, "w");
+	if ( NULL == wosfs_trace_paths_fp )
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to open trace path file %s, errno=%d", paths.c_str(), errno);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = wosfs_trace_toggle;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR2, &sa, NULL);
+
+	if ( pthread_create(&thread, NULL, wosfs_trace_thread, NULL) != 0 ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to start trace drain thread");
+		return false;
+	}
+	pthread_detach(thread);
+
+	if ( wosfs_conf.wosfs_debug & WOSFS_LOG_TRACE )
+		wosfs_trace_on = 1;
+	return true;
+}
+
 bool test_wos_magic(FILE *fp)
 {
 	char magic[7];
@@ -226,7 +1104,35 @@ bool test_wos_magic(FILE *fp)
 		return false;
 }
 
-bool wosobj_get_oid_list(const char *path, struct wosobj_oid_list_entry *wosobj_oids)
+struct wosobj_oid_list_entry *wosobj_oid_entry_new(struct wosfs_req *req)
+{
+	struct wosobj_oid_list_entry *woid = (struct wosobj_oid_list_entry *)wosfs_arena_alloc(req, sizeof(struct wosobj_oid_list_entry));
+	bool heap = false;
+
+	if ( NULL == woid ) {
+		woid = (struct wosobj_oid_list_entry *)malloc(sizeof(struct wosobj_oid_list_entry));
+		if ( NULL == woid )
+			return NULL;
+		heap = true;
+	}
+	memset(woid, 0, sizeof(struct wosobj_oid_list_entry));
+	woid->heap = heap;
+
+	return woid;
+}
+
+void wosobj_oid_list_free(struct wosobj_oid_list_entry *wosobj_oids)
+{
+	while ( wosobj_oids != NULL ) {
+		struct wosobj_oid_list_entry *next = wosobj_oids->next;
+		if ( wosobj_oids->heap )
+			free(wosobj_oids);
+		wosobj_oids = next;
+	}
+}
+
+/* list entries come from the request arena; release them with wosobj_oid_list_free() */
+bool wosobj_get_oid_list(const char *path, struct wosobj_oid_list_entry *wosobj_oids, struct wosfs_req *req)
 {
         bool res=false;
         FILE *fp;
@@ -244,61 +1150,98 @@ bool wosobj_get_oid_list(const char *path, struct wosobj_oid_list_entry *wosobj_
 	wosobj_oid_list_entry *woid=wosobj_oids;
         while ((read = getline(&line, &len, fp)) != -1) {
                 if ( strncmp(line, wosfs_conf.wosfs_magic, strlen(wosfs_conf.wosfs_magic)) == 0 ) {
-                	sscanf(line,  "%s %s", magic, woid->oid);
+                	sscanf(line,  "%63s %40s", magic, woid->oid);
                 	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: wosobj_oids->oid=%s", woid->oid);
-			woid->next = (struct wosobj_oid_list_entry *)malloc(sizeof(struct wosobj_oid_list_entry));
+			woid->next = wosobj_oid_entry_new(req);
 			if ( NULL == woid->next ) {
 				WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed allocate memory for woid->next");
-				return false;
-			}
-			else {
-				memset(woid->next, 0, sizeof(struct wosobj_oid_list_entry));
-				woid=woid->next;
+				res = false;
+				break;
 			}
+			woid=woid->next;
 			res=true;
                 }
                 WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: wosfs_magic=%s, line=%s", wosfs_conf.wosfs_magic, line);
         }
+	free(line);
         fclose(fp);
 
         return res;
 }
 
-bool wosobj_info_last(const char *path, struct wosobj_info *wosobj_info)
+/*
+ *  The current version of a stub is its last magic line.  Scan the stub
+ *  backwards from EOF in WOSFS_STUB_WINDOW sized preads so that only the
+ *  tail of a stub with a long history is read, into a stack buffer.
+ */
+#define WOSFS_STUB_WINDOW		(8*WOSFS_1KiB)
+
+bool wosobj_info_last_at(int dirfd, const char *path, struct wosobj_info *wosobj_info)
 {  
+	WOSFS_PHASE(WOSFS_PH_STUB);
 	bool res=false; 
-        FILE *fp;
-        fp = fopen(path, "r+");
+	int fd = openat(dirfd, path, O_RDONLY);
 
-        if ( NULL == fp) {
+        if ( fd < 0 ) {
 		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to open file %s", path);
                 return res;
         }
 
-	ssize_t read;
-	char *line = NULL;
-	char *lastline = NULL;
-	size_t len = 0;
-	while ((read = getline(&line, &len, fp)) != -1) {
-		if ( strncmp(line, wosfs_conf.wosfs_magic, strlen(wosfs_conf.wosfs_magic)) == 0 ) {
-			if (lastline) 
-				free(lastline);
-			lastline = strdup(line);
+	struct stat st;
+	if ( fstat(fd, &st) != 0 ) {
+		close(fd);
+		return res;
+	}
+
+	char buf[WOSFS_STUB_WINDOW];
+	size_t magic_len = strlen(wosfs_conf.wosfs_magic);
+	off_t end = st.st_size;
+
+	while ( end > 0 && res == false ) {
+		off_t start = end > WOSFS_STUB_WINDOW ? end - WOSFS_STUB_WINDOW : 0;
+		ssize_t n = pread(fd, buf, end - start, start);
+		if ( n <= 0 )
+			break;
+
+		off_t next_end = start;
+		for (ssize_t i = n - 1; i >= 0; i--) {
+			// only look at the beginning of a line
+			if ( i > 0 ? buf[i-1] != '\n' : start != 0 )
+				continue;
+			next_end = start + i;
+			if ( (size_t)(n - i) < magic_len || strncmp(buf + i, wosfs_conf.wosfs_magic, magic_len) != 0 )
+				continue;
+
+			char line[256];
+			size_t len = 0;
+			while ( i + (ssize_t)len < n && buf[i+len] != '\n' && len < sizeof(line) - 1 ) {
+				line[len] = buf[i+len];
+				len++;
+			}
+			line[len] = '\0';
+			WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: wosfs_magic=%s, lastline=%s", wosfs_conf.wosfs_magic, line);
+
+			sscanf(line,  "%6s %40s %lu", wosobj_info->magic, wosobj_info->oid, &wosobj_info->obj_len);
+			wosfs_phase_oid(wosobj_info->oid);
+	 		res = true;	
+			break;
 		}
-		WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: wosfs_magic=%s, line=%s, lastline=%s", wosfs_conf.wosfs_magic, line, lastline);
-        }
-	if (lastline) {
-		sscanf(lastline,  "%s %s %lu", wosobj_info->magic, wosobj_info->oid, &wosobj_info->obj_len);
-	 	res = true;	
+		// a window without a line start is the middle of a long non-magic line
+		end = next_end < end ? next_end : start;
 	}
-	else
+	if ( res == false )
 		WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: file %s is empty", path);
 
-	fclose(fp);
+	close(fd);
 
 	return res;
 }
 
+bool wosobj_info_last(const char *path, struct wosobj_info *wosobj_info)
+{
+	return wosobj_info_last_at(AT_FDCWD, path, wosobj_info);
+}
+
 struct wosclient_pool_entry* wosclient_pool_create_list(const char *path, WosPtr_t WosPtr)
 {
     struct wosclient_pool_entry *ptr = (struct wosclient_pool_entry*)malloc(sizeof(struct wosclient_pool_entry));
@@ -312,90 +1255,107 @@ struct wosclient_pool_entry* wosclient_pool_create_list(const char *path, WosPtr
     memset(ptr, 0, sizeof(wosclient_pool_entry));
 
     ptr->WosPtr = WosPtr;
+    ptr->cache_fd = -1;
     ptr->path = (char *)malloc(strlen(path)+1);
     if ( NULL == ptr->path ) {
         WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to allocate memory for ptr->path");
+        free(ptr);
         return NULL;
     }
     memset((void *)ptr->path, 0, strlen(path)+1);
     strcpy((char *)ptr->path, path);
     ptr->next = NULL;
 
-#ifdef WOSFS_PERF_FIX_01
-    if ( 0 != wosfs_conf.wosfs_buffer) {
-    	ptr->buffer = (unsigned char *)malloc(wosfs_conf.wosfs_buffer);
-    	if ( NULL == ptr->buffer ) {
-        	WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to allocate memory for ptr->buffer");
-        	return NULL;
-    	}
-    	memset((void *)ptr->buffer, 0, wosfs_conf.wosfs_buffer);
-   	 ptr->b_ptr = ptr->buffer;
-    }
-#endif
-
     wosclient_pool_head = wosclient_pool_curr = ptr;
     WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: OUT: wosclient_pool_empty_count=%d", wosclient_pool_empty_count);
     wosclient_pool_count++;
     return ptr;
 }
 
-struct wosclient_pool_entry* wosclient_pool_add_to_list(const char *path, WosPtr_t WosPtr, bool add_to_end)
+struct wosclient_pool_entry* wosclient_pool_search_in_list_by_path(const char *path, struct wosclient_pool_entry **prev);
+
+/*
+ * Pool entries are counted.  The pool holds a reference while an entry is
+ * listed; wosclient_pool_add_to_list() and wosclient_pool_lookup() take one
+ * for their caller, who drops it with wosclient_pool_put() when done with
+ * the entry, and the last put frees it.  Opens are counted by path, as the
+ * stream is only created by the first read or write, and the release of
+ * the last one takes the entry out of the pool.
+ */
+
+/*
+ * Add the stream of path as type, len and oid, all set before another thread can find it.
+ * When another thread added path first, its entry is returned untouched and *added is false.
+ * Either way the caller holds a reference to the entry returned.
+ */
+struct wosclient_pool_entry* wosclient_pool_add_to_list(const char *path, WosPtr_t WosPtr, bool add_to_end,
+							int type, uint64_t len, const char *oid, bool *added)
 {
+    struct wosclient_pool_entry *ptr;
 
+    *added = false;
     pthread_mutex_lock(&lock);
     WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: path=%s", path);
 
+    // another thread may have opened a stream for the same path since our lookup
+    struct wosclient_pool_entry *found = wosclient_pool_search_in_list_by_path(path, NULL);
+    if ( NULL != found ) {
+	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: path=%s already in wosclient_pool", path);
+	found->refs++;
+	pthread_mutex_unlock(&lock);
+	return found;
+    }
+
     if(NULL == wosclient_pool_head)
     {
     	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: wosclient_pool is empty");
-	pthread_mutex_unlock(&lock);
-        return (wosclient_pool_create_list(path, WosPtr));
+        ptr = wosclient_pool_create_list(path, WosPtr);
     }
+    else
+    {
+	ptr = (struct wosclient_pool_entry*)malloc(sizeof(struct wosclient_pool_entry));
+	if ( NULL == ptr ) {
+	    WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to allocate memory for ptr");
+	    pthread_mutex_unlock(&lock);
+	    return NULL;
+	}  
+	memset(ptr, 0, sizeof(wosclient_pool_entry));
+
+	ptr->WosPtr = WosPtr;
+	ptr->cache_fd = -1;
+	ptr->path = (char *)malloc(strlen(path)+1);
+	if ( NULL == ptr->path ) {
+	    WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: failed to allocate memory for ptr->path");
+	    free(ptr);
+	    pthread_mutex_unlock(&lock);
+	    return NULL;
+	}
+	memset((void *)ptr->path, 0, strlen(path)+1);
+	strcpy((char *)ptr->path, path);
+	ptr->next = NULL;
+
+	if(add_to_end)
+	{
+	    wosclient_pool_curr->next = ptr;
+	    wosclient_pool_curr = ptr;
+	}
+	else
+	{
+	    ptr->next = wosclient_pool_head;
+	    wosclient_pool_head = ptr;
+	}
 
-    struct wosclient_pool_entry *ptr = (struct wosclient_pool_entry*)malloc(sizeof(struct wosclient_pool_entry));
-    if ( NULL == ptr ) {
-        WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to allocate memory for ptr");
-	pthread_mutex_unlock(&lock);
-        return NULL;
-    }  
-    memset(ptr, 0, sizeof(wosclient_pool_entry));
-
-    ptr->WosPtr = WosPtr;
-    ptr->path = (char *)malloc(strlen(path)+1);
-    if ( NULL == ptr->path ) {
-	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: failed to allocate memory for ptr->path");
-	pthread_mutex_unlock(&lock);
-	return NULL;
+	wosclient_pool_count++;
     }
-    memset((void *)ptr->path, 0, strlen(path)+1);
-    strcpy((char *)ptr->path, path);
-    ptr->next = NULL;
-
-#ifdef WOSFS_PERF_FIX_01
-    if ( 0 != wosfs_conf.wosfs_buffer) {
-        ptr->buffer = (unsigned char *)malloc(wosfs_conf.wosfs_buffer);
-        if ( NULL == ptr->buffer ) {
-                WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to allocate memory for ptr->buffer");
-                return NULL;
-        }
-        memset((void *)ptr->buffer, 0, wosfs_conf.wosfs_buffer);
-         ptr->b_ptr = ptr->buffer;
-    }
-#endif
 
-    if(add_to_end)
-    {
-        wosclient_pool_curr->next = ptr;
-        wosclient_pool_curr = ptr;
-    }
-    else
-    {
-        ptr->next = wosclient_pool_head;
-        wosclient_pool_head = ptr;
+    if ( NULL != ptr ) {
+	ptr->type = type;
+	ptr->len = len;
+	if ( oid )
+	    strcpy(ptr->oid, oid);
+	ptr->refs = 2;
+	*added = true;
     }
-
-    wosclient_pool_count++;
-
     pthread_mutex_unlock(&lock);
     return ptr;
 }
@@ -432,20 +1392,84 @@ struct wosclient_pool_entry* wosclient_pool_search_in_list_by_path(const char *p
     }
 }
 
+/* the entry of path with a reference taken, or NULL */
+struct wosclient_pool_entry* wosclient_pool_lookup(const char *path)
+{
+    struct wosclient_pool_entry *ptr;
+
+    pthread_mutex_lock(&lock);
+    ptr = wosclient_pool_search_in_list_by_path(path, NULL);
+    if ( ptr )
+	ptr->refs++;
+    pthread_mutex_unlock(&lock);
+
+    return ptr;
+}
+
+void wosclient_pool_free(struct wosclient_pool_entry *del)
+{
+    // malloc'ed, so the streams are let go of by hand
+    del->WosPtr.ps.reset();
+    del->WosPtr.gs.reset();
+    del->WosPtr.w.reset();
+    if ( del->cache_fd >= 0 )
+	close(del->cache_fd);
+    free((void *)del->path);
+#ifdef WOSFS_PERF_FIX_01
+    if ( del->sbuf )
+    	wosfs_sbuf_put(del->sbuf);
+#endif
+    free(del);
+}
+
+/* drop a reference to ptr, freeing it with the last one */
+void wosclient_pool_put(struct wosclient_pool_entry *ptr)
+{
+    pthread_mutex_lock(&lock);
+    bool last = --ptr->refs == 0;
+    pthread_mutex_unlock(&lock);
+
+    if ( last )
+	wosclient_pool_free(ptr);
+}
+
+/* count an open of the backing path path */
+void wosclient_pool_open(const char *path)
+{
+    pthread_mutex_lock(&lock);
+    wosclient_pool_opens[path]++;
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Drop an open of path.  When it was the last one, the entry of path, if
+ * any, is taken out of the pool and returned with the pool's reference,
+ * which the caller puts; otherwise NULL is returned.
+ */
 int wosclient_pool_delete_call_count=0;
-int wosclient_pool_delete_from_list(const char *path)
+struct wosclient_pool_entry* wosclient_pool_close(const char *path)
 {
     struct wosclient_pool_entry *prev = NULL;
     struct wosclient_pool_entry *del = NULL;
 
     pthread_mutex_lock(&lock);
 
+    std::map<std::string, int>::iterator it = wosclient_pool_opens.find(path);
+    if ( it != wosclient_pool_opens.end() ) {
+	if ( --it->second > 0 ) {
+	    WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: path=%s, still open %d times", path, it->second);
+	    pthread_mutex_unlock(&lock);
+	    return NULL;
+	}
+	wosclient_pool_opens.erase(it);
+    }
+
     WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: path=%s, calls=%d, cur number: %d", path, ++wosclient_pool_delete_call_count, wosclient_pool_count);
     del = wosclient_pool_search_in_list_by_path(path,&prev);
     if(del == NULL)
     {
 	pthread_mutex_unlock(&lock);
-        return -1;
+        return NULL;
     }
     else
     {
@@ -462,20 +1486,11 @@ int wosclient_pool_delete_from_list(const char *path)
             wosclient_pool_head = del->next;
         }
     }
-
-    free((void *)del->path);
-#ifdef WOSFS_PERF_FIX_01
-    if ( 0 != wosfs_conf.wosfs_buffer) 
-    	free(del->buffer);
-#endif
-    free(del);
-
-    del = NULL;
     wosclient_pool_count--;
 
     pthread_mutex_unlock(&lock);
 
-    return 0;
+    return del;
 }
 
 void wosclient_pool_print_list(void)
@@ -506,7 +1521,9 @@ WosOID store_obj_b(BlockWOSClient *wos_b, const char *pdata, size_t len)
 
 	WosStatus rstatus; // return status 
 	WosOID roid;// return oid
+	uint64_t start_ns = wosfs_wos_begin(WOSFS_ST_WOS_PUT, 0, len);
 	wos->Put(rstatus, roid, policy, obj);
+	wosfs_stat_record(WOSFS_ST_WOS_PUT, start_ns, rstatus, 0, len);
 	if (rstatus != ok) {
 		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: Error during Put: %s", rstatus.ErrMsg().c_str());
 		return false; 
@@ -519,1019 +1536,6861 @@ bool store_obj_stream_b(WosPutStreamPtr wosps, const char *pdata, size_t len, of
 {
 	WosStatus rstatus;
 
+	uint64_t start_ns = wosfs_wos_begin(WOSFS_ST_WOS_PUTSPAN, offset, len);
 	wosps->PutSpan(rstatus, pdata, offset, len);	
+	wosfs_stat_record(WOSFS_ST_WOS_PUTSPAN, start_ns, rstatus, offset, len);
 	if (rstatus != ok) {
-		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: Error in PutSpan %d", offset); 
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: Error in PutSpan %d", offset);
+		return false;
 	}
+
+	return true;
 }
 
-/* 
- *  Helpers
+/*
+ *  Hedged reads
+ *
+ *  A GetSpan that has not completed within the tracked latency percentile
+ *  is duplicated on a fresh GetStream, and whichever reply succeeds first
+ *  is used.  The number of duplicates is capped at wosfs_hedge percent of
+ *  all GetSpan calls.
  */
 
-char wosfs_ns_paths[64][65];
-int  wosfs_ns_paths_depth = 0;
-bool wosfs_parse_ns_paths(char *path)  //path need to be a full path string starting with "/"
-{
-	char *path2 = path;
+#define WOSFS_HEDGE_SAMPLES		1024	// recent GetSpan latencies kept
+#define WOSFS_HEDGE_MIN_SAMPLES		64	// no hedging until this many are known
+#define WOSFS_HEDGE_REFRESH		64	// recompute the percentile every N samples
+#define WOSFS_HEDGE_MIN_US		500	// never hedge sooner than this
+
+struct wosfs_hedge_state {
+	uint64_t			lat_us[WOSFS_HEDGE_SAMPLES];
+	uint64_t			samples;
+	uint64_t			threshold_us;
+	uint64_t			reads;
+	uint64_t			hedges;
+	uint64_t			hedge_wins;
+} wosfs_hedge;
+pthread_mutex_t lock_hedge;
+
+struct wosfs_span_ctx;
+
+struct wosfs_span_req {
+	struct wosfs_span_ctx		*ctx;
+	int				hedge;
+};
 
-	if ( path[0] != '/' )
-		return false;
+struct wosfs_span_ctx {
+	pthread_mutex_t			mtx;
+	pthread_cond_t			cond;
+	int				refcnt;		// waiter plus each issued GetSpan
+	int				outstanding;	// GetSpan calls without a reply yet
+	bool				done;
+	int				winner;
+	WosStatus			status;
+	WosObjPtr			obj;
+	WosGetStreamPtr			hedge_gs;
+	struct wosfs_span_req		req[2];
+};
 
-	int i, j;
+uint64_t wosfs_now_us(void)
+{
+	struct timespec tp;
 
-	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: sizeof(wosfs_ns_paths)=%d", sizeof(wosfs_ns_paths));
-	memset(wosfs_ns_paths, 0, sizeof(wosfs_ns_paths));
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
 
-	i=0;
-	wosfs_ns_paths[i][0] = '/';
-	path2++;
-	i++;
-	do {
-		WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: path2[0] = %c", path2[0]);
-		if (path2[0] == '/') {
-			char *p = wosfs_ns_paths[i];
-			strncpy(p, path, path2-path);
-			i++;
-			if (i > 64 )
-				return false;
-		}
-		path2++;
-	} while (path2[0] != (char)NULL);
-	wosfs_ns_paths_depth = i;
+void wosfs_hedge_sample(uint64_t us)
+{
+	pthread_mutex_lock(&lock_hedge);
+	wosfs_hedge.lat_us[wosfs_hedge.samples % WOSFS_HEDGE_SAMPLES] = us;
+	wosfs_hedge.samples++;
+	if ( wosfs_hedge.samples >= WOSFS_HEDGE_MIN_SAMPLES && (wosfs_hedge.samples % WOSFS_HEDGE_REFRESH) == 0 ) {
+		uint64_t n = std::min(wosfs_hedge.samples, (uint64_t)WOSFS_HEDGE_SAMPLES);
+		uint64_t tmp[WOSFS_HEDGE_SAMPLES];
+		uint64_t k = std::min(n * wosfs_conf.wosfs_hedge_pctl / 100, n - 1);
+
+		memcpy(tmp, wosfs_hedge.lat_us, n * sizeof(uint64_t));
+		std::nth_element(tmp, tmp + k, tmp + n);
+		wosfs_hedge.threshold_us = std::max(tmp[k], (uint64_t)WOSFS_HEDGE_MIN_US);
+		WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: hedge threshold=%luus, reads=%lu, hedges=%lu, wins=%lu", wosfs_hedge.threshold_us, wosfs_hedge.reads, wosfs_hedge.hedges, wosfs_hedge.hedge_wins);
+	}
+	pthread_mutex_unlock(&lock_hedge);
+}
 
-	for (j = 0; j< i; j++)
-		WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: wosfs_ns_path[%d] = %s", j, wosfs_ns_paths[j]);
+void wosfs_span_ctx_put(struct wosfs_span_ctx *ctx)
+{
+	pthread_mutex_lock(&ctx->mtx);
+	int refcnt = --ctx->refcnt;
+	pthread_mutex_unlock(&ctx->mtx);
+
+	if ( 0 == refcnt ) {
+		pthread_mutex_destroy(&ctx->mtx);
+		pthread_cond_destroy(&ctx->cond);
+		delete ctx;
+	}
+}
 
-	return true;
+static void wosfs_span_callback(WosStatus s, WosObjPtr robj, WosCluster::Context context)
+{
+	struct wosfs_span_req *req = (struct wosfs_span_req *)context;
+	struct wosfs_span_ctx *ctx = req->ctx;
+
+	pthread_mutex_lock(&ctx->mtx);
+	ctx->outstanding--;
+	// the first good reply wins; an error only counts once nothing else is pending
+	if ( !ctx->done && (s == ok || 0 == ctx->outstanding) ) {
+		ctx->done = true;
+		ctx->winner = req->hedge;
+		ctx->status = s;
+		ctx->obj = robj;
+		pthread_cond_broadcast(&ctx->cond);
+	}
+	pthread_mutex_unlock(&ctx->mtx);
 
+	wosfs_span_ctx_put(ctx);
 }
-bool wosfs_match_ns(const char *path)
+
+bool wosfs_hedge_allowed(void)
 {
+	bool res = false;
 
-	int i;
+	pthread_mutex_lock(&lock_hedge);
+	if ( wosfs_hedge.hedges * 100 < wosfs_hedge.reads * wosfs_conf.wosfs_hedge ) {
+		wosfs_hedge.hedges++;
+		res = true;
+	}
+	pthread_mutex_unlock(&lock_hedge);
 
-	for (i=0; i< wosfs_ns_paths_depth; i++)
-		if (strcmp(path, wosfs_ns_paths[i]) == 0 )
-			return true;
-		
-	return false;	
+	return res;
 }
 
-void wosfs_fix_path(const char *path, char *path2)  //path2 need to be pre-malloc'ed and init with 0
+void wosfs_get_span_hedged(struct wosclient_pool_entry *wosclient, WosStatus& rstatus, WosObjPtr& robj, off_t offset, size_t size)
 {
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
-
-        strcpy(path2, wosfs_conf.wosfs_path);
-        strcat(path2, path);
+	if ( 0 == wosfs_conf.wosfs_hedge ) {
+		wosclient->WosPtr.gs->GetSpan(rstatus, robj, offset, size);
+		return;
+	}
 
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: OUT : path=%s, path2=%s", path, path2);
+	uint64_t start = wosfs_now_us();
+	uint64_t threshold;
+
+	pthread_mutex_lock(&lock_hedge);
+	wosfs_hedge.reads++;
+	threshold = wosfs_hedge.threshold_us;
+	pthread_mutex_unlock(&lock_hedge);
+
+	struct wosfs_span_ctx *ctx = new wosfs_span_ctx;
+	pthread_mutex_init(&ctx->mtx, NULL);
+	pthread_cond_init(&ctx->cond, NULL);
+	ctx->refcnt = 2;
+	ctx->outstanding = 1;
+	ctx->done = false;
+	ctx->winner = 0;
+	ctx->req[0].ctx = ctx->req[1].ctx = ctx;
+	ctx->req[0].hedge = 0;
+	ctx->req[1].hedge = 1;
+
+	wosclient->WosPtr.gs->GetSpan(offset, size, &ctx->req[0], wosfs_span_callback);
+
+	pthread_mutex_lock(&ctx->mtx);
+	if ( !ctx->done && threshold > 0 ) {
+		struct timespec deadline;
+		uint64_t ns;
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		ns = deadline.tv_nsec + threshold * 1000;
+		deadline.tv_sec += ns / 1000000000;
+		deadline.tv_nsec = ns % 1000000000;
+		while ( !ctx->done )
+			if ( ETIMEDOUT == pthread_cond_timedwait(&ctx->cond, &ctx->mtx, &deadline) )
+				break;
+
+		if ( !ctx->done && wosfs_hedge_allowed() ) {
+			pthread_mutex_unlock(&ctx->mtx);
+
+			WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: hedging GetSpan: oid=%s, offset=%ld, size=%lu, threshold=%luus", wosclient->oid, offset, size, threshold);
+			uint64_t start_ns = wosfs_wos_begin(WOSFS_ST_WOS_CREATEGETSTREAM, 0, 0);
+			try {
+				WosGetStreamPtr gs = wos_b.wos->CreateGetStream(WosOID(wosclient->oid));
+				wosfs_stat_record(WOSFS_ST_WOS_CREATEGETSTREAM, start_ns, ok);
+
+				pthread_mutex_lock(&ctx->mtx);
+				ctx->hedge_gs = gs;
+				ctx->refcnt++;
+				ctx->outstanding++;
+				pthread_mutex_unlock(&ctx->mtx);
+
+				gs->GetSpan(offset, size, &ctx->req[1], wosfs_span_callback);
+			}
+			catch (WosException& e) {
+				wosfs_stat_record(WOSFS_ST_WOS_CREATEGETSTREAM, start_ns, wosapi::error);
+				WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to open hedge stream: oid=%s, %s", wosclient->oid, e.what());
+			}
 
+			pthread_mutex_lock(&ctx->mtx);
+		}
+	}
+	while ( !ctx->done )
+		pthread_cond_wait(&ctx->cond, &ctx->mtx);
+
+	rstatus = ctx->status;
+	robj = ctx->obj;
+	int winner = ctx->winner;
+	pthread_mutex_unlock(&ctx->mtx);
+
+	wosfs_span_ctx_put(ctx);
+
+	if ( rstatus == ok )
+		wosfs_hedge_sample(wosfs_now_us() - start);
+	if ( winner ) {
+		pthread_mutex_lock(&lock_hedge);
+		wosfs_hedge.hedge_wins++;
+		pthread_mutex_unlock(&lock_hedge);
+	}
 }
-/* 
- *  wosfs_xxx functions
- */
 
-static int wosfs_getattr(const char *path, struct stat *stbuf)
+/* one GetSpan as the statistics see it: hedges included, until the reply used */
+void wosfs_get_span(struct wosclient_pool_entry *wosclient, WosStatus& rstatus, WosObjPtr& robj, off_t offset, size_t size)
 {
-	int res = -ENOENT;
+	uint64_t start_ns = wosfs_wos_begin(WOSFS_ST_WOS_GETSPAN, offset, size);
 
-	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s, size=%d", path, stbuf->st_size)
+	wosfs_get_span_hedged(wosclient, rstatus, robj, offset, size);
+	wosfs_stat_record(WOSFS_ST_WOS_GETSPAN, start_ns, rstatus, offset, size);
+}
 
-	char *path2=(char *)malloc(256);;
-	memset((void *)path2, 0, 256);
-	
-	wosfs_fix_path(path, path2);
+/*
+ *  Read coalescing
+ *
+ *  Concurrent reads of the same OID whose range overlaps a GetSpan
+ *  already in flight wait for that GetSpan and copy the overlap from its
+ *  reply; only the parts outside it are read on their own, and those may
+ *  join other flights in turn.
+ */
 
-        res = lstat(path2, stbuf);
-        if (res == -1) {
-		free(path2);
-		return -errno;
+struct wosfs_read_flight {
+	char				oid[41];
+	off_t				offset;
+	size_t				size;
+	int				refcnt;
+	bool				done;
+	WosStatus			status;
+	WosObjPtr			obj;
+	pthread_cond_t			cond;
+	struct wosfs_read_flight	*next;
+} *wosfs_read_flights;
+
+struct wosfs_coalesce_state {
+	uint64_t			reads;		// wosfs_read_span calls
+	uint64_t			fetches;	// GetSpan calls actually issued
+	uint64_t			coalesced;	// reads served by another thread's GetSpan
+} wosfs_coalesce;
+pthread_mutex_t lock_flight;
+
+void wosfs_read_flight_put(struct wosfs_read_flight *f)  // call with lock_flight held
+{
+	if ( --f->refcnt == 0 ) {
+		pthread_cond_destroy(&f->cond);
+		delete f;
 	}
+}
 
-        if (S_ISREG(stbuf->st_mode)) {
-		WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: path2=%s, size=%d, res=%d", path2, stbuf->st_size, res);
+/* wait for flight f and copy offset/size, which lies within it, from its reply; drops the reference held on f */
+static int wosfs_read_flight_copy(struct wosfs_read_flight *f, char *buf, off_t offset, size_t size)
+{
+	pthread_mutex_lock(&lock_flight);
+	while ( !f->done )
+		pthread_cond_wait(&f->cond, &lock_flight);
+	pthread_mutex_unlock(&lock_flight);
 
-                struct wosobj_info wosobj_info;
-                memset(&wosobj_info, 0, sizeof(struct wosobj_info));
-                if ( wosobj_info_last(path2, &wosobj_info) == true )
-	                stbuf->st_size = wosobj_info.obj_len;
-        }
+	int res;
+	if ( f->status == ok ) {
+		const void* p;
+		uint64_t objlen;
+		uint64_t skip = offset - f->offset;
+
+		f->obj->GetData(p, objlen);
+		res = 0;
+		if ( objlen > skip ) {
+			WOSFS_PHASE(WOSFS_PH_COPY);
+
+			res = std::min((uint64_t)size, objlen - skip);
+			memcpy(buf, (const char *)p + skip, res);
+		}
+	}
+	else
+		res = -EIO;
 
-	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: OUT : path2=%s, size=%d, res=%d", path2, stbuf->st_size, res);
-	free(path2);
+	pthread_mutex_lock(&lock_flight);
+	wosfs_read_flight_put(f);
+	pthread_mutex_unlock(&lock_flight);
 
 	return res;
 }
 
-static int wosfs_access(const char *path, int mask)
+int wosfs_read_span(struct wosclient_pool_entry *wosclient, char *buf, off_t offset, size_t size)
 {
-	int res = -ENOENT;
-
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
+	struct wosfs_read_flight *f;
+
+	pthread_mutex_lock(&lock_flight);
+	wosfs_coalesce.reads++;
+
+	for (f = wosfs_read_flights; f != NULL; f = f->next)
+		if ( f->offset < (off_t)(offset + size) && offset < (off_t)(f->offset + f->size) && strcmp(f->oid, wosclient->oid) == 0 )
+			break;
+
+	if ( NULL == f ) {
+		f = new wosfs_read_flight;
+		strcpy(f->oid, wosclient->oid);
+		f->offset = offset;
+		f->size = size;
+		f->refcnt = 1;
+		f->done = false;
+		pthread_cond_init(&f->cond, NULL);
+		f->next = wosfs_read_flights;
+		wosfs_read_flights = f;
+		wosfs_coalesce.fetches++;
+		pthread_mutex_unlock(&lock_flight);
 
-        char *path2=(char *)malloc(256);
-        memset((void *)path2, 0, 256);
+		WosStatus rstatus;
+		WosObjPtr robj;
+		wosfs_get_span(wosclient, rstatus, robj, offset, size);
+
+		pthread_mutex_lock(&lock_flight);
+		struct wosfs_read_flight **pp = &wosfs_read_flights;
+		while ( *pp != f )
+			pp = &(*pp)->next;
+		*pp = f->next;
+		f->status = rstatus;
+		f->obj = robj;
+		f->done = true;
+		pthread_cond_broadcast(&f->cond);
+		pthread_mutex_unlock(&lock_flight);
+
+		return wosfs_read_flight_copy(f, buf, offset, size);
+	}
 
-     	wosfs_fix_path(path, path2);   
-	res = access(path2, mask);
-	if (res == -1) {
-		free(path2);
-		return -errno;
+	// the overlap comes from the flight, what lies before and after it is read on its own
+	off_t lo = std::max(offset, f->offset);
+	off_t hi = std::min((off_t)(offset + size), (off_t)(f->offset + f->size));
+	f->refcnt++;
+	wosfs_coalesce.coalesced++;
+	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: joined flight: oid=%s, offset=%ld, size=%lu, flight offset=%ld, size=%lu", f->oid, offset, size, f->offset, f->size);
+	pthread_mutex_unlock(&lock_flight);
+
+	int res = 0, part;
+	if ( lo > offset ) {
+		res = wosfs_read_span(wosclient, buf, offset, lo - offset);
+		if ( res < lo - offset ) {
+			// an error or the end of the object
+			pthread_mutex_lock(&lock_flight);
+			wosfs_read_flight_put(f);
+			pthread_mutex_unlock(&lock_flight);
+			return res;
+		}
 	}
 
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: OUT : path2=%s, res=%d", path2, res);
-	free(path2);
+	WOSFS_PHASE(WOSFS_PH_WAIT);
+	part = wosfs_read_flight_copy(f, buf + (lo - offset), lo, hi - lo);
+	if ( part < 0 )
+		return part;
+	res += part;
+	if ( part < hi - lo || hi == (off_t)(offset + size) )
+		return res;
 
-	return res;
+	part = wosfs_read_span(wosclient, buf + (hi - offset), hi, offset + size - hi);
+	return part < 0 ? part : res + part;
 }
 
-static int wosfs_readlink(const char *path, char *buf, size_t size)
-{
-	int res = -ENOENT;
+/*
+ *  Local object cache
+ *
+ *  Objects behind an OID never change, so a copy kept as <cache dir>/<oid>
+ *  is always valid.  Objects up to wosfs_cache_max MB are fetched whole by
+ *  a filler thread after their first read, which is served from WOS as
+ *  any other; once the copy is in place reads are served from the cache
+ *  file, which wosfs_read_buf hands to libfuse for splicing.  A failed
+ *  fill is retried after WOSFS_CACHE_RETRY seconds.
+ */
 
-	memset(buf, 0, size-1);
-        char *path2=(char *)malloc(256);
-        memset((void *)path2, 0, 256);
+#define WOSFS_CACHE_CHUNK		(4*WOSFS_1KiB*WOSFS_1KiB)	// GetSpan size when filling the cache
+#define WOSFS_CACHE_QUEUE		256	// fills waiting at most, further objects are not queued
+#define WOSFS_CACHE_RETRY		60	// seconds before a failed fill is tried again
 
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s, size=%d", path, size);
-        wosfs_fix_path(path, path2);
-        res = readlink(path2, buf, size - 1);
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: path2=%s, buf=%s, size-1=%d, res=%d", path2, buf, size-1, res);
-        if (res == -1) {
-		free(path2);
-                return -errno;
-	}
+uint64_t wosfs_cache_used;	// bytes in the cache directory
+pthread_mutex_t lock_cache;	// wosfs_cache_used, the fill queue and wosfs_cache_state
+bool wosfs_cache_evicting;	// an eviction scan runs, don't start another
+pthread_cond_t wosfs_cache_cond = PTHREAD_COND_INITIALIZER;
+std::list<std::pair<std::string, uint64_t> > wosfs_cache_queue;	// oid, length
+std::map<std::string, time_t> wosfs_cache_state;	// oid -> 0 while queued or filling, else when to try again
 
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: OUT : path2=%s, res=%d, sizeof(path2)", path2, res);
-	free(path2);
+struct wosfs_cache_file {
+	time_t				atime;
+	uint64_t			size;
+	std::string			name;
 
-        return 0;
+	bool operator<(const wosfs_cache_file& other) const { return atime < other.atime; }
+};
+
+/* unlink least recently read cache files until usage is below 90% of the limit; scans without lock_cache */
+void wosfs_cache_evict(void)
+{
+	uint64_t limit = (uint64_t)wosfs_conf.wosfs_cache_size * WOSFS_1KiB * WOSFS_1KiB;
+	std::vector<wosfs_cache_file> files;
+	DIR *dp;
+	struct dirent *de;
+
+	dp = opendir(wosfs_conf.wosfs_cache);
+	if (dp == NULL) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to open cache directory %s", wosfs_conf.wosfs_cache);
+		return;
+	}
+	while ((de = readdir(dp)) != NULL) {
+		struct stat st;
+		if (de->d_name[0] == '.' || fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(st.st_mode))
+			continue;
+		wosfs_cache_file f;
+		f.atime = st.st_atime;
+		f.size = st.st_size;
+		f.name = de->d_name;
+		files.push_back(f);
+	}
+
+	std::sort(files.begin(), files.end());
+	for (size_t i = 0; i < files.size(); i++) {
+		pthread_mutex_lock(&lock_cache);
+		bool over = wosfs_cache_used > limit / 10 * 9;
+		pthread_mutex_unlock(&lock_cache);
+		if ( !over )
+			break;
+		if (unlinkat(dirfd(dp), files[i].name.c_str(), 0) == 0) {
+			pthread_mutex_lock(&lock_cache);
+			wosfs_cache_used -= std::min(wosfs_cache_used, files[i].size);
+			pthread_mutex_unlock(&lock_cache);
+		}
+		WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: evicted %s, size=%lu", files[i].name.c_str(), files[i].size);
+	}
+	closedir(dp);
 }
 
-static int wosfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		       off_t offset, struct fuse_file_info *fi)
+/* fetch the whole object oid of len bytes into the cache; the file appears atomically on success */
+bool wosfs_cache_fill(const std::string& oid, uint64_t len)
 {
-	int res = -ENOENT;
+	char cache_path[PATH_MAX], tmp_path[PATH_MAX];
+	struct wosclient_pool_entry wosclient = wosclient_pool_entry();
+	char *chunk;
+	uint64_t offset;
+	int fd;
 
-        char *path2=(char *)malloc(256);
-        memset((void *)path2, 0, 256);
+	strcpy(wosclient.oid, oid.c_str());
+	wosclient.len = len;
+	wosclient.cache_fd = -1;
+	uint64_t start_ns = wosfs_wos_begin(WOSFS_ST_WOS_CREATEGETSTREAM, 0, 0);
+	try {
+		wosclient.WosPtr.gs = wos_b.wos->CreateGetStream(WosOID(wosclient.oid));
+		wosfs_stat_record(WOSFS_ST_WOS_CREATEGETSTREAM, start_ns, ok);
+	}
+	catch (WosException& e) {
+		wosfs_stat_record(WOSFS_ST_WOS_CREATEGETSTREAM, start_ns, wosapi::error);
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to open stream to fill cache: oid=%s, %s", wosclient.oid, e.what());
+		return false;
+	}
 
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
-        wosfs_fix_path(path, path2);
+	snprintf(cache_path, sizeof(cache_path), "%s/%s", wosfs_conf.wosfs_cache, wosclient.oid);
+	snprintf(tmp_path, sizeof(tmp_path), "%s/.%s.%d.%lu", wosfs_conf.wosfs_cache, wosclient.oid, getpid(), (unsigned long)pthread_self());
+	fd = open(tmp_path, O_CREAT | O_EXCL | O_WRONLY, 0600);
+	if (fd == -1) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to create cache file %s", tmp_path);
+		return false;
+	}
 
-        DIR *dp;
-        struct dirent *de;
+	chunk = (char *)malloc(WOSFS_CACHE_CHUNK);
+	if ( NULL == chunk ) {
+		close(fd);
+		unlink(tmp_path);
+		return false;
+	}
 
-        (void) offset;
-        (void) fi;
+	for (offset = 0; offset < len; ) {
+		size_t size = std::min((uint64_t)WOSFS_CACHE_CHUNK, len - offset);
+		int res = wosfs_read_span(&wosclient, chunk, offset, size);
 
-        dp = opendir(path2);
-        if (dp == NULL) {
-		free(path2);
-                return -errno;
+		if ( res <= 0 || pwrite(fd, chunk, res, offset) != res ) {
+			WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to fill cache file %s at offset %lu", tmp_path, offset);
+			break;
+		}
+		offset += res;
 	}
+	free(chunk);
+	close(fd);
 
-        while ((de = readdir(dp)) != NULL) {
-                struct stat st;
-                memset(&st, 0, sizeof(st));
-                st.st_ino = de->d_ino;
-                st.st_mode = de->d_type << 12;
-                if (filler(buf, de->d_name, &st, 0))
-                        break;
-        }
+	if ( offset < len || rename(tmp_path, cache_path) == -1 ) {
+		unlink(tmp_path);
+		return false;
+	}
 
-        closedir(dp);
-	free(path2);
+	pthread_mutex_lock(&lock_cache);
+	wosfs_cache_used += len;
+	bool evict = wosfs_conf.wosfs_cache_size && !wosfs_cache_evicting &&
+		     wosfs_cache_used > (uint64_t)wosfs_conf.wosfs_cache_size * WOSFS_1KiB * WOSFS_1KiB;
+	if ( evict )
+		wosfs_cache_evicting = true;
+	pthread_mutex_unlock(&lock_cache);
+
+	if ( evict ) {
+		wosfs_cache_evict();
+		pthread_mutex_lock(&lock_cache);
+		wosfs_cache_evicting = false;
+		pthread_mutex_unlock(&lock_cache);
+	}
 
-        return 0;
+	return true;
 }
 
-static int wosfs_mknod(const char *path, mode_t mode, dev_t rdev)
+void *wosfs_cache_thread(void *arg)
 {
-	int res = -ENOENT;
+	(void) arg;
 
-        char path2[256];
-        memset((void *)&path2, 0, 256);
+	for (;;) {
+		pthread_mutex_lock(&lock_cache);
+		while ( wosfs_cache_queue.empty() )
+			pthread_cond_wait(&wosfs_cache_cond, &lock_cache);
+		std::pair<std::string, uint64_t> job = wosfs_cache_queue.front();
+		wosfs_cache_queue.pop_front();
+		pthread_mutex_unlock(&lock_cache);
 
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
-        wosfs_fix_path(path, path2);
+		bool filled = wosfs_cache_fill(job.first, job.second);
 
-        /* On Linux this could just be 'mknod(path, mode, rdev)' but this
-           is more portable */
-        if (S_ISREG(mode)) {
-                res = open(path2, O_CREAT | O_EXCL | O_WRONLY, mode);
-                if (res >= 0)
-                        res = close(res);
-        } else if (S_ISFIFO(mode))
-                res = mkfifo(path2, mode);
-        else   
-                res = mknod(path2, mode, rdev);
-        if (res == -1)
-                return -errno;
+		pthread_mutex_lock(&lock_cache);
+		if ( filled )
+			wosfs_cache_state.erase(job.first);
+		else
+			wosfs_cache_state[job.first] = time(NULL) + WOSFS_CACHE_RETRY;
+		pthread_mutex_unlock(&lock_cache);
+	}
+	return NULL;
+}
 
-        return 0;
+/* from wosfs_init(), when --wos_cache is set */
+void wosfs_cache_start(void)
+{
+	pthread_t thread;
+
+	if ( pthread_create(&thread, NULL, wosfs_cache_thread, NULL) != 0 ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to start cache filler thread");
+		return;
+	}
+	pthread_detach(thread);
 }
 
-static int wosfs_mkdir(const char *path, mode_t mode)
+/* true while a fill of oid is queued or running, or failed recently; call with lock_cache held */
+bool wosfs_cache_busy(const char *oid)
 {
-	int res = -ENOENT;
+	std::map<std::string, time_t>::iterator it = wosfs_cache_state.find(oid);
 
-        char path2[256];
-        memset((void *)&path2, 0, 256);
+	return it != wosfs_cache_state.end() && ( it->second == 0 || time(NULL) < it->second );
+}
 
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
-        wosfs_fix_path(path, path2);
+/* queue a fill of the object behind wosclient unless it is busy */
+void wosfs_cache_queue_fill(struct wosclient_pool_entry *wosclient)
+{
+	pthread_mutex_lock(&lock_cache);
+	if ( !wosfs_cache_busy(wosclient->oid) && wosfs_cache_queue.size() < WOSFS_CACHE_QUEUE ) {
+		wosfs_cache_state[wosclient->oid] = 0;
+		wosfs_cache_queue.push_back(std::make_pair(std::string(wosclient->oid), wosclient->len));
+		pthread_cond_signal(&wosfs_cache_cond);
+	}
+	pthread_mutex_unlock(&lock_cache);
+}
 
-        res = mkdir(path2, mode);
-        if (res == -1)
-                return -errno;
+/* return an fd of the cached copy of the object behind wosclient, or -1 and have it fetched */
+int wosfs_cache_fd(struct wosclient_pool_entry *wosclient)
+{
+	char cache_path[PATH_MAX];
+	int fd;
 
-        if ( wosfs_conf.wosfs_bak_path ) {
-                int res2;
-                char tgt_path[256];
-                memset(tgt_path, 0, 256);
-                int i;
+	if ( NULL == wosfs_conf.wosfs_cache || wosclient->cache_skip )
+		return -1;
+	if ( wosclient->cache_fd >= 0 )
+		return wosclient->cache_fd;
+	if ( wosclient->len > (uint64_t)wosfs_conf.wosfs_cache_max * WOSFS_1KiB * WOSFS_1KiB ) {
+		wosclient->cache_skip = true;
+		return -1;
+	}
 
-                i=strlen(wosfs_conf.wosfs_bak_path);
-                strncpy(tgt_path, wosfs_conf.wosfs_bak_path, i);
-                strncpy(tgt_path+i, path+strlen(wosfs_conf.wosfs_path), strlen(path)-strlen(wosfs_conf.wosfs_path));
-                WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: OUT : make new directory in backup path: path=%s, tgt_path=%s", path, tgt_path);
+	// no copy to look for before the fill is done
+	pthread_mutex_lock(&lock_cache);
+	bool busy = wosfs_cache_busy(wosclient->oid);
+	pthread_mutex_unlock(&lock_cache);
+	if ( busy )
+		return -1;
+
+	WOSFS_PHASE(WOSFS_PH_CACHE);
+	snprintf(cache_path, sizeof(cache_path), "%s/%s", wosfs_conf.wosfs_cache, wosclient->oid);
+	fd = open(cache_path, O_RDONLY);
+	if ( fd == -1 ) {
+		if ( errno == ENOENT )
+			wosfs_cache_queue_fill(wosclient);
+		return -1;
+	}
 
-                res2 = mkdir(tgt_path, mode);
-                if (res == -1) {
-                        WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: OUT : failed to make directory path=%s", tgt_path);
-                }
-        }
+	if ( !__sync_bool_compare_and_swap(&wosclient->cache_fd, -1, fd) ) {
+		close(fd);		// another reader got there first
+		fd = wosclient->cache_fd;
+	}
 
-        return 0;
+	return fd;
 }
 
-static int wosfs_unlink(const char *path)
+bool wosfs_cache_init(void)
 {
-	int res = -ENOENT;
+	DIR *dp;
+	struct dirent *de;
 
-        char path2[WOSFS_1KiB];
-        memset((void *)&path2, 0, 256);
+	mkdir(wosfs_conf.wosfs_cache, 0700);
+	dp = opendir(wosfs_conf.wosfs_cache);
+	if (dp == NULL) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to open cache directory %s", wosfs_conf.wosfs_cache);
+		return false;
+	}
 
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
-        wosfs_fix_path(path, path2);
+	wosfs_cache_used = 0;
+	while ((de = readdir(dp)) != NULL) {
+		struct stat st;
+		if (fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(st.st_mode))
+			continue;
+		if (de->d_name[0] == '.')
+			unlinkat(dirfd(dp), de->d_name, 0);	// left over from an interrupted fill
+		else
+			wosfs_cache_used += st.st_size;
+	}
+	closedir(dp);
 
-        struct stat stbuf;
+	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: wosfs_cache=%s, used=%lu", wosfs_conf.wosfs_cache, wosfs_cache_used);
+	return true;
+}
 
-        res = lstat(path2, &stbuf);
-        if (res == -1)
-                return -errno;
+/* 
+ *  Helpers
+ */
 
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s, path2=%s", path, path2);
+char wosfs_ns_paths[64][65];
+int  wosfs_ns_paths_depth = 0;
+bool wosfs_parse_ns_paths(char *path)  //path need to be a full path string starting with "/"
+{
+	char *path2 = path;
 
-        if (S_ISREG(stbuf.st_mode) && stbuf.st_nlink == 1) {
-#ifdef WOSFS_FEATURE_TRASHCAN
-		if ( strncmp( path2, wosfs_trashcan_path, strlen(wosfs_trashcan_path)) == 0 ) {
- 			// find all OIDs in the stub file and delete them from WOS core, then delete the local stub file and return.	
-			struct wosobj_oid_list_entry *wosobj_oids = (wosobj_oid_list_entry *)malloc(sizeof(wosobj_oid_list_entry));;
-			memset(wosobj_oids, 0, sizeof(struct wosobj_oid_list_entry));
+	if ( path[0] != '/' )
+		return false;
 
-			if ( true == wosobj_get_oid_list(path2, wosobj_oids) ) {
-				struct wosobj_oid_list_entry *woid = wosobj_oids;
-				do {
-					if ( woid->oid[0] != '\0'  ) {
-						WosStatus status;
-        			                WosOID oid(woid->oid);
-                        			WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: path=%s, oid=%s", path2, oid.c_str());
-	                        		wos_b.wos->Delete(status, oid);
-                        			if (status != ok) {
-                                			WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to delete oid: %s,  delete status=%s", woid->oid, status.ErrMsg().c_str());
-                        			}
-					}
-					woid = woid->next;		
-					free(wosobj_oids); wosobj_oids=woid;
-				} while ( woid != NULL );	
-			}
+	int i, j;
+
+	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: sizeof(wosfs_ns_paths)=%d", sizeof(wosfs_ns_paths));
+	memset(wosfs_ns_paths, 0, sizeof(wosfs_ns_paths));
+
+	i=0;
+	wosfs_ns_paths[i][0] = '/';
+	path2++;
+	i++;
+	do {
+		WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: path2[0] = %c", path2[0]);
+		if (path2[0] == '/') {
+			char *p = wosfs_ns_paths[i];
+			strncpy(p, path, path2-path);
+			i++;
+			if (i > 64 )
+				return false;
 		}
-		else {
-                	
-			char *fname;
-			char *tmp = strdup(path2);
-			if ( NULL == tmp ) {
-				WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to allocate memory for tmp (path2)");
-				return -errno;
-			}
-			fname = basename(tmp);
-        		char trash_path[WOSFS_1KiB];
+		path2++;
+	} while (path2[0] != (char)NULL);
+	wosfs_ns_paths_depth = i;
 
-			struct timespec tp;
-			clock_gettime(CLOCK_REALTIME, &tp);
-			sprintf( trash_path, "%s/%s.%lld.%lld", wosfs_trashcan_path, fname, tp.tv_sec, tp.tv_nsec);
+	for (j = 0; j< i; j++)
+		WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: wosfs_ns_path[%d] = %s", j, wosfs_ns_paths[j]);
 
-			WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: path2=%s, trash_path=%s", path2, trash_path);	
+	return true;
 
-		        FILE * fp = fopen (path2, "a+");
-        		if ( NULL == fp ) {
-                		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: OUT : failed to open file.  path=%s", path);
-                		return -errno;
-        		}
+}
+bool wosfs_match_ns(const char *path)
+{
 
-        		fprintf(fp, "WOSFS original path: %s\n", path2);
-        		fclose(fp);
+	int i;
 
-			rename(path2, trash_path);
-			free(tmp);	
+	for (i=0; i< wosfs_ns_paths_depth; i++)
+		if (strcmp(path, wosfs_ns_paths[i]) == 0 )
+			return true;
+		
+	return false;	
+}
 
-			return 0;
-		}
-#else
-                struct wosobj_info wosobj_info;
-                memset(&wosobj_info, 0, sizeof(struct wosobj_info));
-                if ( wosobj_info_last(path2, &wosobj_info) == false) {
-                        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: failed to read from file: %s", path2);
-                }
-                else {
-                        WosStatus status;
-                        WosOID oid(wosobj_info.oid);
-                        wos_b.wos->Delete(status, oid);
-                        if (status != ok) {
-                                WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to delete oid: %s,  delete status=%s", wosobj_info.oid, status.ErrMsg().c_str());
-                        }
-                        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: path=%s, oid=%s", path2, wosobj_info.oid);
-                }
-#endif
-        }
-        res = unlink(path2);
-        if (res == -1)
-                return -errno;
+int wosfs_fix_path(const char *path, char *path2)  //path2 needs to hold PATH_MAX bytes
+{
+	size_t len = strlen(path);
+
+	if ( wosfs_path_len + len >= PATH_MAX ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: path too long: path=%s", path);
+		return -ENAMETOOLONG;
+	}
+
+	memcpy(path2, wosfs_conf.wosfs_path, wosfs_path_len);
+	memcpy(path2 + wosfs_path_len, path, len + 1);
+
+        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: OUT : path=%s, path2=%s", path, path2);
+	return 0;
 }
 
-static int wosfs_rmdir(const char *path)
+/* mirror of mount relative path under wosfs_bak_path */
+int wosfs_fix_bak_path(const char *path, char *tgt_path)
 {
-	int res = -ENOENT;
+	if ( snprintf(tgt_path, PATH_MAX, "%s%s", wosfs_conf.wosfs_bak_path, path) >= PATH_MAX )
+		return -ENAMETOOLONG;
 
-        char path2[256];
-        memset((void *)&path2, 0, 256);
+	return 0;
+}
 
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
-        wosfs_fix_path(path, path2);
+/*
+ *  Directory handle cache
+ *
+ *  Backing store calls are made relative to an fd of the parent directory
+ *  (fstatat, openat, renameat, ...) so that GPFS does not re-walk every
+ *  component of a deep path on each call.  wosfs_root_fd is the -l
+ *  directory; the parents below it are kept in an LRU of refcounted fds
+ *  keyed by mount relative path.  rename and rmdir drop the cached
+ *  directories under the old path.
+ */
 
-        res = rmdir(path2);
-        if (res == -1)
-                return -errno;
+#ifndef O_PATH
+#define O_PATH			0	// kernels before 2.6.39: plain read-only directory fds
+#endif
 
-        return 0;
+#define WOSFS_DIRFD_HASH	1024
+
+struct wosfs_dirfd {
+	char				*path;		// mount relative, "/" for the root
+	int				fd;
+	int				refs;
+	bool				stale;		// dropped from the cache while in use
+	struct wosfs_dirfd		*hnext;
+	struct wosfs_dirfd		*prev;		// LRU, most recent first
+	struct wosfs_dirfd		*next;
+};
+
+int wosfs_root_fd = -1;
+struct wosfs_dirfd wosfs_dirfd_root;
+struct wosfs_dirfd *wosfs_dirfd_hash[WOSFS_DIRFD_HASH];
+struct wosfs_dirfd *wosfs_dirfd_lru_head = NULL;
+struct wosfs_dirfd *wosfs_dirfd_lru_tail = NULL;
+int wosfs_dirfd_count = 0;
+uint64_t wosfs_dirfd_gen = 0;	// bumped by each invalidate, under lock_dirfd
+pthread_mutex_t lock_dirfd;
+
+unsigned int wosfs_dirfd_hashkey(const char *path, size_t len)
+{
+	unsigned int h = 2166136261u;
+
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ (unsigned char)path[i]) * 16777619u;
+	return h % WOSFS_DIRFD_HASH;
 }
 
-static int wosfs_symlink(const char *from, const char *to)
+bool wosfs_dirfd_init(void)
 {
-	int res = -ENOENT;
+	wosfs_root_fd = open(wosfs_conf.wosfs_path, O_PATH | O_DIRECTORY);
+	if ( wosfs_root_fd < 0 ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to open wosfs_path=%s, errno=%d", wosfs_conf.wosfs_path, errno);
+		return false;
+	}
+	memset(&wosfs_dirfd_root, 0, sizeof(wosfs_dirfd_root));
+	wosfs_dirfd_root.path = (char *)"/";
+	wosfs_dirfd_root.fd = wosfs_root_fd;
 
-	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: from=%s, to=%s", from, to);
+	return true;
+}
 
-        char from2[256];
-        char to2[256];
-        memset((void *)&to2, 0, 256);
+/* caller holds lock_dirfd */
+void wosfs_dirfd_unlink_locked(struct wosfs_dirfd *dir)
+{
+	struct wosfs_dirfd **pp = &wosfs_dirfd_hash[wosfs_dirfd_hashkey(dir->path, strlen(dir->path))];
 
-        wosfs_fix_path(to, to2);
-	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: from=%s, to2=%s", from, to2);
+	while ( *pp != dir )
+		pp = &(*pp)->hnext;
+	*pp = dir->hnext;
 
-        res = symlink(from, to2);
-        if (res == -1) {
-                WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to make link from from=%s to to=%s", from, to);
-                return -errno;
-        }
-        
-        return res;
+	if ( dir->prev ) dir->prev->next = dir->next; else wosfs_dirfd_lru_head = dir->next;
+	if ( dir->next ) dir->next->prev = dir->prev; else wosfs_dirfd_lru_tail = dir->prev;
+	dir->prev = dir->next = dir->hnext = NULL;
+	wosfs_dirfd_count--;
 }
 
-static int wosfs_rename(const char *from, const char *to)
+void wosfs_dirfd_free(struct wosfs_dirfd *dir)
 {
-	int res = -ENOENT;
+	close(dir->fd);
+	free(dir->path);
+	free(dir);
+}
 
-	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : from=%s, to=%s", from, to);
+/*
+ * Return the parent directory of the mount relative path with a reference
+ * held, and point *name at the last component ("." for the root itself).
+ * Returns NULL with errno set if the parent can not be opened.
+ */
+struct wosfs_dirfd *wosfs_dirfd_get(const char *path, const char **name)
+{
+	const char *slash = strrchr(path, '/');
+	size_t len = slash - path;
 
-        char from2[256];
-        char to2[256];
-        memset((void *)&from2, 0, 256);
-        memset((void *)&to2, 0, 256);
+	if ( NULL == slash || len == 0 ) {
+		*name = ( NULL == slash || slash[1] == '\0' ) ? "." : slash + 1;
+		return &wosfs_dirfd_root;
+	}
 
-        wosfs_fix_path(from, from2);
-        wosfs_fix_path(to, to2);
+	WOSFS_PHASE(WOSFS_PH_LOOKUP);
+	*name = slash + 1;
 
-        res = rename(from2, to2);
-        if (res == -1)
-                return -errno;
+	unsigned int key = wosfs_dirfd_hashkey(path, len);
+	struct wosfs_dirfd *dir;
 
-        return 0;
+	pthread_mutex_lock(&lock_dirfd);
+	for (dir = wosfs_dirfd_hash[key]; dir; dir = dir->hnext) {
+		if ( strncmp(dir->path, path, len) == 0 && dir->path[len] == '\0' )
+			break;
+	}
+	if ( dir ) {
+		dir->refs++;
+		if ( dir != wosfs_dirfd_lru_head ) {
+			dir->prev->next = dir->next;
+			if ( dir->next ) dir->next->prev = dir->prev; else wosfs_dirfd_lru_tail = dir->prev;
+			dir->prev = NULL;
+			dir->next = wosfs_dirfd_lru_head;
+			wosfs_dirfd_lru_head->prev = dir;
+			wosfs_dirfd_lru_head = dir;
+		}
+		pthread_mutex_unlock(&lock_dirfd);
+		return dir;
+	}
+	uint64_t gen = wosfs_dirfd_gen;
+	pthread_mutex_unlock(&lock_dirfd);
+
+	// miss: one walk from the root, outside of the lock
+	dir = (struct wosfs_dirfd *)malloc(sizeof(struct wosfs_dirfd));
+	if ( NULL == dir ) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(dir, 0, sizeof(struct wosfs_dirfd));
+	dir->path = strndup(path, len);
+	if ( NULL == dir->path ) {
+		free(dir);
+		errno = ENOMEM;
+		return NULL;
+	}
+	dir->fd = openat(wosfs_root_fd, dir->path + 1, O_PATH | O_DIRECTORY);
+	if ( dir->fd < 0 ) {
+		int err = errno;
+		free(dir->path);
+		free(dir);
+		errno = err;
+		return NULL;
+	}
+	dir->refs = 1;
+
+	if ( wosfs_conf.wosfs_dirfd_cache <= 0 ) {
+		dir->stale = true;
+		return dir;
+	}
+
+	pthread_mutex_lock(&lock_dirfd);
+	struct wosfs_dirfd *other;
+	for (other = wosfs_dirfd_hash[key]; other; other = other->hnext) {
+		if ( strcmp(other->path, dir->path) == 0 )
+			break;
+	}
+	if ( other ) {
+		// lost the race to another thread
+		other->refs++;
+		pthread_mutex_unlock(&lock_dirfd);
+		wosfs_dirfd_free(dir);
+		return other;
+	}
+	if ( gen != wosfs_dirfd_gen ) {
+		// an invalidate ran during the walk, the fd may name a moved directory: use it once, don't cache it
+		pthread_mutex_unlock(&lock_dirfd);
+		dir->stale = true;
+		return dir;
+	}
+
+	dir->hnext = wosfs_dirfd_hash[key];
+	wosfs_dirfd_hash[key] = dir;
+	dir->next = wosfs_dirfd_lru_head;
+	if ( wosfs_dirfd_lru_head ) wosfs_dirfd_lru_head->prev = dir; else wosfs_dirfd_lru_tail = dir;
+	wosfs_dirfd_lru_head = dir;
+	wosfs_dirfd_count++;
+
+	// evict idle entries from the cold end
+	struct wosfs_dirfd *victim = wosfs_dirfd_lru_tail;
+	struct wosfs_dirfd *evicted = NULL;
+	while ( wosfs_dirfd_count > wosfs_conf.wosfs_dirfd_cache && victim ) {
+		struct wosfs_dirfd *prev = victim->prev;
+		if ( victim->refs == 0 ) {
+			wosfs_dirfd_unlink_locked(victim);
+			victim->hnext = evicted;
+			evicted = victim;
+		}
+		victim = prev;
+	}
+	pthread_mutex_unlock(&lock_dirfd);
+
+	while ( evicted ) {
+		struct wosfs_dirfd *next = evicted->hnext;
+		wosfs_dirfd_free(evicted);
+		evicted = next;
+	}
+
+	return dir;
 }
 
-static int wosfs_link(const char *from, const char *to)
+void wosfs_dirfd_put(struct wosfs_dirfd *dir)
 {
-	int res = -ENOENT;
+	if ( dir == &wosfs_dirfd_root )
+		return;
 
-        char from2[256];
-        char to2[256];
-        memset((void *)&from2, 0, 256);
-        memset((void *)&to2, 0, 256);
+	pthread_mutex_lock(&lock_dirfd);
+	bool last = ( --dir->refs == 0 && dir->stale );
+	pthread_mutex_unlock(&lock_dirfd);
 
-	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : from=%s, to=%s", from, to);
+	if ( last )
+		wosfs_dirfd_free(dir);
+}
+
+/* drop the cached directory at the mount relative path and everything below it */
+void wosfs_dirfd_invalidate(const char *path)
+{
+	size_t len = strlen(path);
+	struct wosfs_dirfd *dir, *next;
+	struct wosfs_dirfd *evicted = NULL;
+
+	pthread_mutex_lock(&lock_dirfd);
+	wosfs_dirfd_gen++;
+	for (dir = wosfs_dirfd_lru_head; dir; dir = next) {
+		next = dir->next;
+		if ( strncmp(dir->path, path, len) != 0 || (dir->path[len] != '\0' && dir->path[len] != '/') )
+			continue;
+		wosfs_dirfd_unlink_locked(dir);
+		if ( dir->refs == 0 ) {
+			dir->hnext = evicted;
+			evicted = dir;
+		}
+		else
+			dir->stale = true;
+	}
+	pthread_mutex_unlock(&lock_dirfd);
 
-        wosfs_fix_path(from, from2);
-        wosfs_fix_path(to, to2);
+	while ( evicted ) {
+		next = evicted->hnext;
+		wosfs_dirfd_free(evicted);
+		evicted = next;
+	}
+}
 
-        res = link(from2, to2);
-        if (res == -1)
-                return -errno;
+/*
+ *  Attribute cache
+ *
+ *  getattr results keyed by mount relative path, kept for
+ *  --wos_attr_ttl milliseconds.  readdir fills it in for every entry it
+ *  lists, so the getattr calls that follow an `ls -l` do not re-read the
+ *  stubs.  Callbacks that change a file or a directory drop its entry.
+ */
 
-        return 0;
+#define WOSFS_ATTR_HASH		65536
+#define WOSFS_ATTR_LOCKS	64
+#define WOSFS_ATTR_MAX		(256*1024)	// entries; new ones are not cached past this
+
+struct wosfs_attr_entry {
+	char				*path;
+	struct stat			st;
+	uint64_t			expires;	// wosfs_now_us()
+	struct wosfs_attr_entry		*next;
+};
+
+struct wosfs_attr_entry *wosfs_attr_hash[WOSFS_ATTR_HASH];
+pthread_mutex_t wosfs_attr_locks[WOSFS_ATTR_LOCKS];
+volatile long wosfs_attr_count = 0;
+volatile unsigned long wosfs_attr_hits = 0;
+volatile unsigned long wosfs_attr_misses = 0;
+
+unsigned int wosfs_attr_hashkey(const char *path)
+{
+	unsigned int h = 2166136261u;
+
+	for ( ; *path; path++)
+		h = (h ^ (unsigned char)*path) * 16777619u;
+	return h % WOSFS_ATTR_HASH;
 }
 
-static int wosfs_chmod(const char *path, mode_t mode)
+bool wosfs_attr_init(void)
 {
-	int res = -ENOENT;
+	for (int i = 0; i < WOSFS_ATTR_LOCKS; i++) {
+		if (pthread_mutex_init(&wosfs_attr_locks[i], NULL) != 0)
+			return false;
+	}
+	return true;
+}
 
-        char path2[256];
-        memset((void *)&path2, 0, 256);
+bool wosfs_attr_lookup(const char *path, struct stat *stbuf)
+{
+	if ( wosfs_conf.wosfs_attr_ttl <= 0 )
+		return false;
 
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
-        wosfs_fix_path(path, path2);
+	unsigned int key = wosfs_attr_hashkey(path);
+	pthread_mutex_t *lock = &wosfs_attr_locks[key % WOSFS_ATTR_LOCKS];
+	bool found = false;
 
-        res = chmod(path2, mode);
-        if (res == -1)
-                return -errno;
+	pthread_mutex_lock(lock);
+	for (struct wosfs_attr_entry *e = wosfs_attr_hash[key]; e; e = e->next) {
+		if ( strcmp(e->path, path) == 0 ) {
+			if ( e->expires > wosfs_now_us() ) {
+				*stbuf = e->st;
+				found = true;
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(lock);
 
-        return 0;
+	if ( found )
+		__sync_fetch_and_add(&wosfs_attr_hits, 1);
+	else
+		__sync_fetch_and_add(&wosfs_attr_misses, 1);
+	return found;
 }
 
-static int wosfs_chown(const char *path, uid_t uid, gid_t gid)
+void wosfs_attr_store(const char *path, const struct stat *stbuf)
 {
-	int res = -ENOENT;
+	if ( wosfs_conf.wosfs_attr_ttl <= 0 )
+		return;
+
+	unsigned int key = wosfs_attr_hashkey(path);
+	pthread_mutex_t *lock = &wosfs_attr_locks[key % WOSFS_ATTR_LOCKS];
+	uint64_t now = wosfs_now_us();
+	struct wosfs_attr_entry *e, **pp;
+	struct wosfs_attr_entry *expired = NULL;
+
+	pthread_mutex_lock(lock);
+	for (pp = &wosfs_attr_hash[key]; (e = *pp) != NULL; ) {
+		if ( strcmp(e->path, path) == 0 )
+			break;
+		if ( e->expires <= now ) {
+			// unlink stale neighbours while walking the chain
+			*pp = e->next;
+			e->next = expired;
+			expired = e;
+			__sync_fetch_and_sub(&wosfs_attr_count, 1);
+			continue;
+		}
+		pp = &e->next;
+	}
+	if ( NULL == e && wosfs_attr_count < WOSFS_ATTR_MAX ) {
+		e = (struct wosfs_attr_entry *)malloc(sizeof(struct wosfs_attr_entry));
+		if ( e && NULL == (e->path = strdup(path)) ) {
+			free(e);
+			e = NULL;
+		}
+		if ( e ) {
+			e->next = wosfs_attr_hash[key];
+			wosfs_attr_hash[key] = e;
+			__sync_fetch_and_add(&wosfs_attr_count, 1);
+		}
+	}
+	if ( e ) {
+		e->st = *stbuf;
+		e->expires = now + (uint64_t)wosfs_conf.wosfs_attr_ttl * 1000;
+	}
+	pthread_mutex_unlock(lock);
 
-        char path2[256];
-        memset((void *)&path2, 0, 256);
+	while ( expired ) {
+		e = expired->next;
+		free(expired->path);
+		free(expired);
+		expired = e;
+	}
+}
 
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
-        wosfs_fix_path(path, path2);
+void wosfs_attr_invalidate(const char *path)
+{
+	unsigned int key = wosfs_attr_hashkey(path);
+	pthread_mutex_t *lock = &wosfs_attr_locks[key % WOSFS_ATTR_LOCKS];
+	struct wosfs_attr_entry *e = NULL, **pp;
+
+	pthread_mutex_lock(lock);
+	for (pp = &wosfs_attr_hash[key]; *pp; pp = &(*pp)->next) {
+		if ( strcmp((*pp)->path, path) == 0 ) {
+			e = *pp;
+			*pp = e->next;
+			__sync_fetch_and_sub(&wosfs_attr_count, 1);
+			break;
+		}
+	}
+	pthread_mutex_unlock(lock);
 
-        res = lchown(path2, uid, gid);
-        if (res == -1)  
-                return -errno;
+	if ( e ) {
+		free(e->path);
+		free(e);
+	}
+}
 
-        return 0;
+/* an entry was added to or removed from the parent: its nlink and times changed */
+void wosfs_attr_invalidate_parent(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	char parent[PATH_MAX];
+
+	if ( NULL == slash || slash == path ) {
+		wosfs_attr_invalidate("/");
+		return;
+	}
+	memcpy(parent, path, slash - path);
+	parent[slash - path] = '\0';
+	wosfs_attr_invalidate(parent);
 }
 
-static int wosfs_truncate(const char *path, off_t size)
+/* drop path and everything below it, for a directory that was renamed or removed */
+void wosfs_attr_invalidate_tree(const char *path)
 {
-	int res = -ENOENT;
+	size_t len = strlen(path);
+
+	if ( wosfs_attr_count == 0 )
+		return;
+
+	for (int l = 0; l < WOSFS_ATTR_LOCKS; l++) {
+		struct wosfs_attr_entry *dropped = NULL, *e, **pp;
+
+		pthread_mutex_lock(&wosfs_attr_locks[l]);
+		for (int key = l; key < WOSFS_ATTR_HASH; key += WOSFS_ATTR_LOCKS) {
+			for (pp = &wosfs_attr_hash[key]; (e = *pp) != NULL; ) {
+				if ( strncmp(e->path, path, len) == 0 && (e->path[len] == '\0' || e->path[len] == '/') ) {
+					*pp = e->next;
+					e->next = dropped;
+					dropped = e;
+					__sync_fetch_and_sub(&wosfs_attr_count, 1);
+					continue;
+				}
+				pp = &e->next;
+			}
+		}
+		pthread_mutex_unlock(&wosfs_attr_locks[l]);
 
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
+		while ( dropped ) {
+			e = dropped->next;
+			free(dropped->path);
+			free(dropped);
+			dropped = e;
+		}
+	}
+}
 
-        char path2[256];
-        memset((void *)&path2, 0, 256);
+/*
+ *  Kernel caching
+ *
+ *  The data behind an OID never changes, so a file may keep its kernel
+ *  page cache across opens (keep_cache) as long as its stub still names
+ *  the OID it named the last time it was opened.  wosfs_oidmap remembers
+ *  that OID per path; a slot holds a 64 bit hash of the path, so a
+ *  collision only costs a cache drop.
+ *
+ *  wosfs_notify_inval*() are called where fusewos itself changes a stub
+ *  or a directory entry.  They drop the fusewos side caches and, when the
+ *  frontend can address kernel inodes, have the kernel drop its copy too.
+ */
 
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
-        wosfs_fix_path(path, path2);
+#define WOSFS_OIDMAP_SIZE	16384
 
-        struct stat stbuf;
+struct wosfs_oidmap_slot {
+	uint64_t			key;		// 0 for an empty slot
+	char				oid[41];
+};
 
-        res = lstat(path2, &stbuf);
-        if (res == -1)
-                return -errno;
+struct wosfs_oidmap_slot wosfs_oidmap[WOSFS_OIDMAP_SIZE];
+pthread_mutex_t lock_oidmap;
+
+/* set by a frontend that can send FUSE notifications */
+void (*wosfs_kernel_inval_inode)(const char *path, bool data) = NULL;
+void (*wosfs_kernel_inval_entry)(const char *path) = NULL;
+
+uint64_t wosfs_oidmap_key(const char *path)
+{
+	uint64_t h = wosfs_path_hash(path);
+
+	return h ? h : 1;
+}
+
+/* record oid as the current OID of path; true if it already was */
+bool wosfs_oidmap_check(const char *path, const char *oid)
+{
+	uint64_t key = wosfs_oidmap_key(path);
+	struct wosfs_oidmap_slot *slot = &wosfs_oidmap[key % WOSFS_OIDMAP_SIZE];
+	bool same;
+
+	pthread_mutex_lock(&lock_oidmap);
+	same = ( slot->key == key && strcmp(slot->oid, oid) == 0 );
+	if ( !same ) {
+		slot->key = key;
+		strncpy(slot->oid, oid, sizeof(slot->oid) - 1);
+		slot->oid[sizeof(slot->oid) - 1] = '\0';
+	}
+	pthread_mutex_unlock(&lock_oidmap);
+
+	return same;
+}
+
+void wosfs_oidmap_drop(const char *path)
+{
+	uint64_t key = wosfs_oidmap_key(path);
+	struct wosfs_oidmap_slot *slot = &wosfs_oidmap[key % WOSFS_OIDMAP_SIZE];
+
+	pthread_mutex_lock(&lock_oidmap);
+	if ( slot->key == key )
+		slot->key = 0;
+	pthread_mutex_unlock(&lock_oidmap);
+}
+
+/* a directory moved: the hashed paths below it can not be found, forget all */
+void wosfs_oidmap_clear(void)
+{
+	pthread_mutex_lock(&lock_oidmap);
+	memset(wosfs_oidmap, 0, sizeof(wosfs_oidmap));
+	pthread_mutex_unlock(&lock_oidmap);
+}
+
+/* attributes of path changed, and its data too if data is set */
+void wosfs_notify_inval(const char *path, bool data)
+{
+	wosfs_attr_invalidate(path);
+	if ( data )
+		wosfs_oidmap_drop(path);
+	if ( wosfs_kernel_inval_inode )
+		wosfs_kernel_inval_inode(path, data);
+}
+
+/* the directory entry at path went away or now names another file */
+void wosfs_notify_inval_entry(const char *path)
+{
+	wosfs_attr_invalidate(path);
+	wosfs_attr_invalidate_parent(path);
+	wosfs_oidmap_drop(path);
+	if ( wosfs_kernel_inval_entry )
+		wosfs_kernel_inval_entry(path);
+}
+
+/*
+ *  Worker pool
+ *
+ *  A fixed set of threads running queued jobs, for work a single request
+ *  can spread out (stub parsing in readdir).  The threads are started
+ *  from wosfs_init(), after fuse_main() has daemonized.
+ */
+
+struct wosfs_job {
+	void				(*fn)(void *);
+	void				*arg;
+	struct wosfs_job		*next;
+};
+
+struct wosfs_workq {
+	struct wosfs_job		*head;
+	struct wosfs_job		*tail;
+	int				nthreads;
+	pthread_mutex_t			mtx;
+	pthread_cond_t			cond;
+} wosfs_workq;
+
+/* counts outstanding jobs of one request */
+struct wosfs_wait_group {
+	int				pending;
+	pthread_mutex_t			mtx;
+	pthread_cond_t			cond;
+};
+
+void *wosfs_workq_thread(void *unused)
+{
+	(void) unused;
+
+	for (;;) {
+		pthread_mutex_lock(&wosfs_workq.mtx);
+		while ( NULL == wosfs_workq.head )
+			pthread_cond_wait(&wosfs_workq.cond, &wosfs_workq.mtx);
+		struct wosfs_job *job = wosfs_workq.head;
+		wosfs_workq.head = job->next;
+		if ( NULL == wosfs_workq.head )
+			wosfs_workq.tail = NULL;
+		pthread_mutex_unlock(&wosfs_workq.mtx);
+
+		job->fn(job->arg);
+	}
+	return NULL;
+}
+
+void wosfs_workq_start(int nthreads)
+{
+	for (int i = 0; i < nthreads; i++) {
+		pthread_t tid;
+		if ( pthread_create(&tid, NULL, wosfs_workq_thread, NULL) != 0 ) {
+			WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to start worker thread %d", i);
+			break;
+		}
+		pthread_detach(tid);
+		wosfs_workq.nthreads++;
+	}
+}
+
+/* job must stay valid until it has run; returns false when there are no workers */
+bool wosfs_workq_submit(struct wosfs_job *job)
+{
+	if ( wosfs_workq.nthreads == 0 )
+		return false;
+
+	job->next = NULL;
+	pthread_mutex_lock(&wosfs_workq.mtx);
+	if ( wosfs_workq.tail )
+		wosfs_workq.tail->next = job;
+	else
+		wosfs_workq.head = job;
+	wosfs_workq.tail = job;
+	pthread_cond_signal(&wosfs_workq.cond);
+	pthread_mutex_unlock(&wosfs_workq.mtx);
+
+	return true;
+}
+
+void wosfs_wait_group_done(struct wosfs_wait_group *wg)
+{
+	pthread_mutex_lock(&wg->mtx);
+	if ( --wg->pending == 0 )
+		pthread_cond_signal(&wg->cond);
+	pthread_mutex_unlock(&wg->mtx);
+}
+
+void wosfs_wait_group_wait(struct wosfs_wait_group *wg)
+{
+	pthread_mutex_lock(&wg->mtx);
+	while ( wg->pending > 0 )
+		pthread_cond_wait(&wg->cond, &wg->mtx);
+	pthread_mutex_unlock(&wg->mtx);
+}
+
+#ifdef WOSFS_FEATURE_SNAPSHOTS
+/*
+ *  Snapshot hooks (see Snapshots below)
+ *
+ *  The live tree callbacks note in the journal the directories they change
+ *  an entry or a stub of, and the trash can asks before it deletes an
+ *  object whether a snapshot still holds it.  Every snapshot lists the
+ *  OIDs of the stubs it captured in WOSFS_SNAP_META/<name>.oids; they are
+ *  kept here as 64 bit hashes, a collision only keeps an object longer.
+ *  An object that is held is not deleted but noted in WOSFS_SNAP_DEFERRED,
+ *  and goes back to the trash can once no snapshot holds it.
+ */
+
+#define WOSFS_SNAP_META			".wosfs"	// in WOSFS_SNAP_NAME
+#define WOSFS_SNAP_DEFERRED		"deferred"
+
+pthread_mutex_t wosfs_snap_journal_mtx = PTHREAD_MUTEX_INITIALIZER;
+std::set<std::string> wosfs_snap_dirs;		// changed since the last snapshot, mount relative without the leading /
+std::set<std::string> wosfs_snap_trees;		// moved in, everything below changed
+bool wosfs_snap_full;				// the journal is incomplete, walk everything
+FILE *wosfs_snap_journal;
+
+pthread_mutex_t wosfs_snap_oids_mtx = PTHREAD_MUTEX_INITIALIZER;
+std::set<uint64_t> wosfs_snap_oids;
+uint64_t wosfs_snap_deferred;
+
+static inline bool wosfs_path_under(const char *path, const char *top, size_t len)
+{
+	return strncmp(path, top, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+static inline bool wosfs_in_snapshots(const char *path)
+{
+	return path[1] == '.' && wosfs_path_under(path, WOSFS_SNAP_NAME, sizeof(WOSFS_SNAP_NAME) - 1);
+}
+
+/* the snapshot name of /.WOS_snapshots/<name>, NULL for any other path */
+static inline const char *wosfs_snap_top(const char *path)
+{
+	const char *name = path + sizeof(WOSFS_SNAP_NAME);
+
+	if ( !wosfs_in_snapshots(path) || path[sizeof(WOSFS_SNAP_NAME) - 1] != '/' || strchr(name, '/') )
+		return NULL;
+	return name;
+}
+
+/* dir, of len bytes, changed; with tree everything below it too */
+void wosfs_snap_note(const char *dir, size_t len, bool tree)
+{
+	if ( !wosfs_snap_on || wosfs_path_under(dir, WOSFS_SNAP_NAME, sizeof(WOSFS_SNAP_NAME) - 1) ||
+	     wosfs_path_under(dir, WOSFS_TRASHCAN_NAME, sizeof(WOSFS_TRASHCAN_NAME) - 1) )
+		return;
+
+	std::string rel(dir + 1, len - 1);
+	pthread_mutex_lock(&wosfs_snap_journal_mtx);
+	if ( !wosfs_snap_full && (tree ? wosfs_snap_trees : wosfs_snap_dirs).insert(rel).second ) {
+		if ( NULL == wosfs_snap_journal || rel.find('\n') != std::string::npos ) {
+			wosfs_snap_full = true;
+			if ( wosfs_snap_journal )
+				fputs("full\n", wosfs_snap_journal);
+		}
+		else
+			fprintf(wosfs_snap_journal, "%c %s\n", tree ? 't' : 'd', rel.c_str());
+		if ( wosfs_snap_journal )
+			fflush(wosfs_snap_journal);
+	}
+	pthread_mutex_unlock(&wosfs_snap_journal_mtx);
+}
+
+/* the entry at path was made, removed or changed */
+static inline void wosfs_snap_dirty(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+
+	if ( wosfs_snap_on && slash )
+		wosfs_snap_note(path, slash == path ? 1 : slash - path, false);
+}
+
+/* the directory at path changed itself, or with tree was moved in */
+static inline void wosfs_snap_dirty_dir(const char *path, bool tree)
+{
+	if ( wosfs_snap_on )
+		wosfs_snap_note(path, strlen(path), tree);
+}
+
+bool wosfs_snap_holds(const char *oid)
+{
+	if ( !wosfs_snap_on )
+		return false;
+
+	uint64_t key = wosfs_path_hash(oid);
+	pthread_mutex_lock(&wosfs_snap_oids_mtx);
+	bool held = wosfs_snap_oids.count(key) > 0;
+	pthread_mutex_unlock(&wosfs_snap_oids_mtx);
+	return held;
+}
+
+/* oid was not deleted because a snapshot holds it */
+void wosfs_snap_defer(const char *oid)
+{
+	std::string path = std::string(wosfs_snap_path) + "/" WOSFS_SNAP_META "/" WOSFS_SNAP_DEFERRED;
+
+	pthread_mutex_lock(&wosfs_snap_oids_mtx);
+	FILE *fp = fopen(path.c_str(), "a");
+	if ( fp ) {
+		fprintf(fp, "%s %s 0\n", wosfs_conf.wosfs_magic, oid);
+		fclose(fp);
+	}
+	else
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: snapshot: failed to note deferred oid %s, errno=%d", oid, errno);
+	wosfs_snap_deferred++;
+	pthread_mutex_unlock(&wosfs_snap_oids_mtx);
+}
+
+/*
+ *  A directory of a snapshot that did not change since an older one is a
+ *  symlink to it, "../" once per component of rel, then <held>/<rel>.
+ */
+std::string wosfs_snap_ref(const std::string& held, const std::string& rel)
+{
+	std::string target = "../";
+
+	for (size_t i = 0; i < rel.size(); i++)
+		if ( rel[i] == '/' )
+			target += "../";
+	return target + held + "/" + rel;
+}
+
+/* whether target is the symlink of rel to an older snapshot, which is left in *held */
+bool wosfs_snap_ref_parse(const char *target, const char *rel, std::string *held)
+{
+	for (const char *p = rel; p; p = strchr(p + 1, '/')) {
+		if ( strncmp(target, "../", 3) != 0 )
+			return false;
+		target += 3;
+	}
+
+	const char *slash = strchr(target, '/');
+	if ( NULL == slash || slash == target || target[0] == '.' || strcmp(slash + 1, rel) != 0 )
+		return false;
+	held->assign(target, slash - target);
+	return true;
+}
+
+/* a symlink at path in a snapshot that stands for a directory of another one is shown as the directory */
+void wosfs_snap_follow(int dirfd, const char *name, const char *path, struct stat *st)
+{
+	const char *snap = path + sizeof(WOSFS_SNAP_NAME);
+	const char *rel = strchr(snap, '/');
+	char target[PATH_MAX];
+	std::string held;
+	ssize_t n;
+
+	if ( NULL == rel || (n = readlinkat(dirfd, name, target, sizeof(target) - 1)) < 0 )
+		return;
+	target[n] = '\0';
+	if ( wosfs_snap_ref_parse(target, rel + 1, &held) && held.compare(0, std::string::npos, snap, rel - snap) != 0 )
+		fstatat(dirfd, name, st, 0);
+}
+
+static inline void wosfs_snap_stat_fix(int dirfd, const char *name, const char *path, struct stat *st)
+{
+	if ( S_ISLNK(st->st_mode) && wosfs_in_snapshots(path) && path[sizeof(WOSFS_SNAP_NAME) - 1] == '/' )
+		wosfs_snap_follow(dirfd, name, path, st);
+}
+#else
+static inline bool wosfs_in_snapshots(const char *path) { (void) path; return false; }
+static inline const char *wosfs_snap_top(const char *path) { (void) path; return NULL; }
+static inline void wosfs_snap_dirty(const char *path) { (void) path; }
+static inline void wosfs_snap_dirty_dir(const char *path, bool tree) { (void) path; (void) tree; }
+static inline void wosfs_snap_stat_fix(int dirfd, const char *name, const char *path, struct stat *st) { (void) dirfd; (void) name; (void) path; (void) st; }
+#endif
+
+/*
+ *  readdir attributes
+ *
+ *  Entries are read in batches of WOSFS_READDIR_BATCH; each batch is
+ *  stat'ed (and its stubs parsed) in slices of WOSFS_READDIR_SLICE on the
+ *  worker pool, then handed to the filler in directory order.
+ */
+
+#define WOSFS_READDIR_BATCH	1024
+#define WOSFS_READDIR_SLICE	64
+
+struct wosfs_dirent_attr {
+	char				name[NAME_MAX + 1];
+	struct stat			st;
+	off_t				off;		// telldir() cookie of the entry after this one
+	bool				valid;		// st is complete, not just d_ino/d_type
+};
+
+struct wosfs_readdir_slice {
+	struct wosfs_job		job;
+	int				dirfd;
+	const char			*dirpath;	// mount relative
+	struct wosfs_dirent_attr	*ents;
+	int				count;
+	struct wosfs_wait_group		*wg;
+};
+
+void wosfs_readdir_stat(int dirfd, const char *dirpath, struct wosfs_dirent_attr *ents, int count)
+{
+	char path[PATH_MAX];
+	size_t len = strlen(dirpath);
+
+	// "/" joins as "/name", everything else as "dir/name"
+	if ( len == 1 )
+		len = 0;
+	memcpy(path, dirpath, len);
+	path[len] = '/';
+
+	for (int i = 0; i < count; i++) {
+		struct wosfs_dirent_attr *ent = &ents[i];
+
+		if ( strcmp(ent->name, ".") == 0 || strcmp(ent->name, "..") == 0 )
+			continue;
+		if ( fstatat(dirfd, ent->name, &ent->st, AT_SYMLINK_NOFOLLOW) != 0 )
+			continue;
+		if ( S_ISREG(ent->st.st_mode) ) {
+			struct wosobj_info wosobj_info;
+			memset(&wosobj_info, 0, sizeof(struct wosobj_info));
+			if ( wosobj_info_last_at(dirfd, ent->name, &wosobj_info) == true )
+				ent->st.st_size = wosobj_info.obj_len;
+		}
+
+		size_t nlen = strlen(ent->name);
+		if ( len + 1 + nlen >= PATH_MAX ) {
+			ent->valid = true;
+			continue;
+		}
+		memcpy(path + len + 1, ent->name, nlen + 1);
+		wosfs_snap_stat_fix(dirfd, ent->name, path, &ent->st);
+		ent->valid = true;
+		wosfs_attr_store(path, &ent->st);
+	}
+}
+
+void wosfs_readdir_slice_run(void *arg)
+{
+	struct wosfs_readdir_slice *slice = (struct wosfs_readdir_slice *)arg;
+
+	wosfs_readdir_stat(slice->dirfd, slice->dirpath, slice->ents, slice->count);
+	wosfs_wait_group_done(slice->wg);
+}
+
+void wosfs_readdir_batch(int dirfd, const char *dirpath, struct wosfs_dirent_attr *ents, int count)
+{
+	if ( count <= WOSFS_READDIR_SLICE || wosfs_workq.nthreads == 0 ) {
+		wosfs_readdir_stat(dirfd, dirpath, ents, count);
+		return;
+	}
+
+	struct wosfs_readdir_slice slices[WOSFS_READDIR_BATCH / WOSFS_READDIR_SLICE];
+	struct wosfs_wait_group wg;
+	int nslices = 0;
+
+	wg.pending = 0;
+	pthread_mutex_init(&wg.mtx, NULL);
+	pthread_cond_init(&wg.cond, NULL);
+
+	// the first slice is done by the request thread itself
+	for (int i = WOSFS_READDIR_SLICE; i < count; i += WOSFS_READDIR_SLICE) {
+		struct wosfs_readdir_slice *slice = &slices[nslices];
+		slice->job.fn = wosfs_readdir_slice_run;
+		slice->job.arg = slice;
+		slice->dirfd = dirfd;
+		slice->dirpath = dirpath;
+		slice->ents = ents + i;
+		slice->count = count - i < WOSFS_READDIR_SLICE ? count - i : WOSFS_READDIR_SLICE;
+		slice->wg = &wg;
+
+		pthread_mutex_lock(&wg.mtx);
+		wg.pending++;
+		pthread_mutex_unlock(&wg.mtx);
+		wosfs_workq_submit(&slice->job);
+		nslices++;
+	}
+	wosfs_readdir_stat(dirfd, dirpath, ents, WOSFS_READDIR_SLICE);
+	wosfs_wait_group_wait(&wg);
+
+	pthread_cond_destroy(&wg.cond);
+	pthread_mutex_destroy(&wg.mtx);
+}
+
+#ifdef WOSFS_FEATURE_TRASHCAN
+/*
+ *  Trash can layout (see wosfs_trash.h)
+ *
+ *  Deleted stubs go to an hour bucket and a shard in it, so no directory
+ *  of the trash can grows past what one hour of deletes brings.  Bucket
+ *  and shard directories are made by the first stub that needs them.
+ */
+
+/* rename name in dirfd to the trash can as <as>.<sec>.<nsec>, the new path is left in trash_path */
+int wosfs_trash_move(int dirfd, const char *name, const char *as, char *trash_path)
+{
+	int shards = std::min(wosfs_conf.wosfs_trash_shards, WOSFS_TRASH_MAX_SHARDS);
+	char bucket[WOSFS_TRASH_BUCKET_LEN + 1];
+	char dir[WOSFS_TRASH_BUCKET_LEN + 5];
+	struct timespec tp;
+
+	clock_gettime(CLOCK_REALTIME, &tp);
+	dir[0] = '\0';
+	if ( shards > 0 ) {
+		wosfs_trash_bucket(tp.tv_sec, bucket);
+		snprintf(dir, sizeof(dir), "/%s/%02x", bucket, wosfs_trash_shard(as, shards) & 0xff);	// below WOSFS_TRASH_MAX_SHARDS
+	}
+	if ( snprintf(trash_path, PATH_MAX, "%s%s/%s.%lld.%lld", wosfs_trashcan_path, dir, as, (long long)tp.tv_sec, (long long)tp.tv_nsec) >= PATH_MAX )
+		return -ENAMETOOLONG;
+
+	int res = renameat(dirfd, name, AT_FDCWD, trash_path);
+	if ( res != 0 && ENOENT == errno && shards > 0 ) {
+		// the first stub of this bucket or shard
+		std::string path = std::string(wosfs_trashcan_path) + "/" + bucket;
+		mkdir(path.c_str(), 0700);
+		path += dir + 1 + WOSFS_TRASH_BUCKET_LEN;
+		mkdir(path.c_str(), 0700);
+		res = renameat(dirfd, name, AT_FDCWD, trash_path);
+	}
+	if ( res != 0 ) {
+		res = -errno;
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to move %s to the trash can, errno=%d", name, -res);
+		return res;
+	}
+	wosfs_notify_inval((std::string(WOSFS_TRASHCAN_NAME) + dir).c_str(), false);
+	return 0;
+}
+
+/*
+ *  Trash can purger (--wos_purge_age, --wos_purge_quota, --wos_purge_files)
+ *
+ *  Every --wos_purge_interval seconds a background thread goes over the
+ *  trash can bucket by bucket, oldest first, and picks stubs to purge: all
+ *  trashed more than --wos_purge_age seconds ago, then more until the rest
+ *  holds no more than --wos_purge_quota MB of objects and
+ *  --wos_purge_files stubs.  The totals of a shard are kept between scans
+ *  and only listed again when its mtime changes, and a bucket is listed
+ *  in full only when it has stubs to purge.  A picked stub is renamed to
+ *  <name>.purging, so a purge cut short by a restart is finished by the
+ *  next scan, its OIDs are deleted with the asynchronous Delete, at most
+ *  --wos_purge_depth at a time and at most --wos_purge_rate a second, and
+ *  it is unlinked once all are gone.  Buckets left empty are removed.
+ *  Versions dropped by the compactor are purged by the next scan.
+ *  Totals are checkpointed to WOSFS_PURGE_STATE in the trash can.
+ */
+
+#define WOSFS_PURGE_STATE		".purge_state"
+#define WOSFS_PURGE_CHECKPOINT		1000	// stubs between checkpoints
+
+struct wosfs_purge_entry {
+	std::string			name;		// relative to the trash can
+	time_t				trashed;
+	uint64_t			bytes;		// all versions
+};
+
+/* cached totals of one directory of stubs */
+struct wosfs_purge_dir {
+	struct timespec			mtime;
+	uint64_t			files;
+	uint64_t			bytes;
+	int				purging;	// stubs left .purging
+	int				versions;	// stubs of versions dropped by compaction
+};
+
+/* one stub being purged, freed by the purge thread once its deletes are back */
+struct wosfs_purge_stub {
+	std::string			name;
+	uint64_t			bytes;
+	int				pending;	// deletes in flight
+	int				failed;
+	bool				issued;		// all deletes sent
+	struct wosfs_purge_stub		*next;		// on wosfs_purge.done
+};
+
+/*
+ *  The purger has its own connection, made in wosfs_purge_start(): the
+ *  threads completing callback calls start with the connection and the
+ *  one in wos_b is made before fuse_main() daemonizes.
+ */
+BlockWOSClient wosfs_purge_wos;
+
+struct wosfs_purge_del {
+	struct wosfs_purge_stub		*stub;
+	uint64_t			start_ns;
+};
+
+struct wosfs_purge_state {
+	pthread_mutex_t			mtx;
+	pthread_cond_t			cond;
+	int				inflight;
+	struct wosfs_purge_stub		*done;
+	uint64_t			files;		// totals, checkpointed
+	uint64_t			objects;
+	uint64_t			bytes;
+	uint64_t			errors;
+	uint64_t			backlog_files;	// left in the trash after the last scan
+	uint64_t			backlog_bytes;
+	uint64_t			backlog_buckets;
+	uint64_t			rate;		// objects/s of the last pass
+} wosfs_purge = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, NULL, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+std::map<std::string, struct wosfs_purge_dir> wosfs_purge_dirs;	// purge thread only, "" for the top
+
+static void wosfs_purge_callback(WosStatus s, WosObjPtr robj, WosCluster::Context context)
+{
+	struct wosfs_purge_del *del = (struct wosfs_purge_del *)context;
+	struct wosfs_purge_stub *stub = del->stub;
+
+	(void) robj;
+	// an object that is already gone was deleted by a purge cut short
+	wosfs_stat_record(WOSFS_ST_WOS_DELETE, del->start_ns, s == ObjNotFound ? ok : s);
+	delete del;
+
+	pthread_mutex_lock(&wosfs_purge.mtx);
+	if ( s == ok || s == ObjNotFound )
+		wosfs_purge.objects++;
+	else {
+		stub->failed++;
+		wosfs_purge.errors++;
+	}
+	wosfs_purge.inflight--;
+	if ( 0 == --stub->pending && stub->issued ) {
+		stub->next = wosfs_purge.done;
+		wosfs_purge.done = stub;
+	}
+	pthread_cond_broadcast(&wosfs_purge.cond);
+	pthread_mutex_unlock(&wosfs_purge.mtx);
+}
+
+void wosfs_purge_checkpoint(void)
+{
+	std::string path = std::string(wosfs_trashcan_path) + "/" WOSFS_PURGE_STATE;
+	std::string tmp = path + ".tmp";
+
+	pthread_mutex_lock(&wosfs_purge.mtx);
+	uint64_t files = wosfs_purge.files, objects = wosfs_purge.objects, bytes = wosfs_purge.bytes, errors = wosfs_purge.errors;
+	pthread_mutex_unlock(&wosfs_purge.mtx);
+
+	FILE *fp = fopen(tmp.c_str(), "w");
+	if ( NULL == fp ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to write %s, errno=%d", tmp.c_str(), errno);
+		return;
+	}
+	fprintf(fp, "files %lu\nobjects %lu\nbytes %lu\nerrors %lu\n", files, objects, bytes, errors);
+	if ( fclose(fp) == 0 )
+		rename(tmp.c_str(), path.c_str());
+}
+
+void wosfs_purge_restore(void)
+{
+	std::string path = std::string(wosfs_trashcan_path) + "/" WOSFS_PURGE_STATE;
+	FILE *fp = fopen(path.c_str(), "r");
+	char key[32];
+	uint64_t val;
+
+	if ( NULL == fp )
+		return;
+	while ( fscanf(fp, "%31s %lu", key, &val) == 2 ) {
+		if ( strcmp(key, "files") == 0 )
+			wosfs_purge.files = val;
+		else if ( strcmp(key, "objects") == 0 )
+			wosfs_purge.objects = val;
+		else if ( strcmp(key, "bytes") == 0 )
+			wosfs_purge.bytes = val;
+		else if ( strcmp(key, "errors") == 0 )
+			wosfs_purge.errors = val;
+	}
+	fclose(fp);
+}
+
+/* unlink the stubs whose deletes have all come back */
+void wosfs_purge_reap(int dirfd)
+{
+	pthread_mutex_lock(&wosfs_purge.mtx);
+	struct wosfs_purge_stub *stub = wosfs_purge.done;
+	wosfs_purge.done = NULL;
+	pthread_mutex_unlock(&wosfs_purge.mtx);
+
+	while ( stub ) {
+		struct wosfs_purge_stub *next = stub->next;
+
+		// a stub with failed deletes stays .purging and is retried by the next scan
+		if ( 0 == stub->failed && unlinkat(dirfd, stub->name.c_str(), 0) == 0 ) {
+			pthread_mutex_lock(&wosfs_purge.mtx);
+			wosfs_purge.files++;
+			wosfs_purge.bytes += stub->bytes;
+			pthread_mutex_unlock(&wosfs_purge.mtx);
+		}
+		delete stub;
+		stub = next;
+	}
+}
+
+/* the time a stub was trashed, from its name or else its mtime */
+time_t wosfs_purge_trashed(int dirfd, const char *name)
+{
+	const char *base = strrchr(name, '/');
+	time_t t = wosfs_trash_stub_time(base ? base + 1 : name);
+	struct stat st;
+
+	if ( t > 0 )
+		return t;
+	return fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 ? st.st_mtime : 0;
+}
+
+uint64_t wosfs_purge_stub_bytes(int dirfd, const char *name)
+{
+	int fd = openat(dirfd, name, O_RDONLY);
+	FILE *fp = fd < 0 ? NULL : fdopen(fd, "r");
+	size_t magic_len = strlen(wosfs_conf.wosfs_magic);
+	char *line = NULL;
+	size_t len = 0;
+	uint64_t bytes = 0;
+
+	if ( NULL == fp ) {
+		if ( fd >= 0 )
+			close(fd);
+		return 0;
+	}
+	while ( getline(&line, &len, fp) != -1 ) {
+		char magic[64], oid[41];
+		unsigned long n;
+		if ( strncmp(line, wosfs_conf.wosfs_magic, magic_len) == 0 && sscanf(line, "%63s %40s %lu", magic, oid, &n) == 3 )
+			bytes += n;
+	}
+	free(line);
+	fclose(fp);
+	return bytes;
+}
+
+static bool wosfs_purge_is_purging(const std::string& name)
+{
+	return name.size() >= sizeof(WOSFS_PURGE_SUFFIX) &&
+		name.compare(name.size() - sizeof(WOSFS_PURGE_SUFFIX) + 1, std::string::npos, WOSFS_PURGE_SUFFIX) == 0;
+}
+
+/* send the deletes of one stub, renamed to .purging first */
+void wosfs_purge_one(int dirfd, const std::string& name, uint64_t bytes, struct wosfs_req *req)
+{
+	static uint64_t next_ns = 0;
+	std::string purging = name;
+
+	if ( !wosfs_purge_is_purging(name) ) {
+		purging += WOSFS_PURGE_SUFFIX;
+		if ( renameat(dirfd, name.c_str(), dirfd, purging.c_str()) != 0 )
+			return;
+	}
+
+	std::string path = std::string(wosfs_trashcan_path) + "/" + purging;
+	req->arena_used = 0;
+	struct wosobj_oid_list_entry *oids = wosobj_oid_entry_new(req);
+	if ( NULL == oids )
+		return;
+	wosobj_get_oid_list(path.c_str(), oids, req);
+
+	struct wosfs_purge_stub *stub = new wosfs_purge_stub;
+	stub->name = purging;
+	stub->bytes = bytes;
+	stub->pending = 0;
+	stub->failed = 0;
+	stub->issued = false;
+	stub->next = NULL;
+
+	for (struct wosobj_oid_list_entry *woid = oids; woid; woid = woid->next) {
+		if ( woid->oid[0] == '\0' )
+			continue;
+#ifdef WOSFS_FEATURE_SNAPSHOTS
+		if ( wosfs_snap_holds(woid->oid) ) {
+			wosfs_snap_defer(woid->oid);
+			continue;
+		}
+#endif
+
+		if ( wosfs_conf.wosfs_purge_rate > 0 ) {
+			uint64_t now = wosfs_now_ns();
+			if ( next_ns > now )
+				usleep((next_ns - now) / 1000);
+			next_ns = std::max(next_ns, now) + 1000000000ULL / wosfs_conf.wosfs_purge_rate;
+		}
+
+		pthread_mutex_lock(&wosfs_purge.mtx);
+		while ( wosfs_purge.inflight >= wosfs_conf.wosfs_purge_depth )
+			pthread_cond_wait(&wosfs_purge.cond, &wosfs_purge.mtx);
+		wosfs_purge.inflight++;
+		stub->pending++;
+		pthread_mutex_unlock(&wosfs_purge.mtx);
+
+		struct wosfs_purge_del *del = new wosfs_purge_del;
+		del->stub = stub;
+		del->start_ns = wosfs_wos_begin(WOSFS_ST_WOS_DELETE, 0, 0);
+		wosfs_purge_wos.wos->Delete(WosOID(woid->oid), wosfs_purge_callback, del);
+	}
+	wosobj_oid_list_free(oids);
+
+	pthread_mutex_lock(&wosfs_purge.mtx);
+	stub->issued = true;
+	if ( 0 == stub->pending ) {
+		stub->next = wosfs_purge.done;
+		wosfs_purge.done = stub;
+	}
+	pthread_mutex_unlock(&wosfs_purge.mtx);
+}
+
+static bool wosfs_purge_older(const struct wosfs_purge_entry& a, const struct wosfs_purge_entry& b)
+{
+	return a.trashed < b.trashed;
+}
+
+/* the subdirectories of dir in the trash can, sorted */
+void wosfs_purge_subdirs(int dirfd, const char *dir, bool buckets, std::vector<std::string>& out)
+{
+	int fd = openat(dirfd, dir, O_RDONLY | O_DIRECTORY);
+	DIR *dp = fd < 0 ? NULL : fdopendir(fd);
+	struct dirent *de;
+
+	if ( NULL == dp ) {
+		if ( fd >= 0 )
+			close(fd);
+		return;
+	}
+	while ( (de = readdir(dp)) != NULL ) {
+		if ( de->d_name[0] == '.' )
+			continue;
+		if ( buckets ? wosfs_trash_bucket_time(de->d_name) >= 0 : de->d_type == DT_DIR || de->d_type == DT_UNKNOWN )
+			out.push_back(de->d_name);
+	}
+	closedir(dp);
+	std::sort(out.begin(), out.end());
+}
+
+/* append the stubs of one directory of the trash can, "" for the top */
+void wosfs_purge_list(int dirfd, const std::string& dir, std::vector<struct wosfs_purge_entry>& out)
+{
+	int fd = openat(dirfd, dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY);
+	DIR *dp = fd < 0 ? NULL : fdopendir(fd);
+	struct dirent *de;
+
+	if ( NULL == dp ) {
+		if ( fd >= 0 )
+			close(fd);
+		return;
+	}
+	while ( (de = readdir(dp)) != NULL ) {
+		if ( de->d_name[0] == '.' )
+			continue;	// ., .. and WOSFS_PURGE_STATE
+		if ( de->d_type == DT_DIR || (dir.empty() && wosfs_trash_bucket_time(de->d_name) >= 0) )
+			continue;	// buckets
+		struct wosfs_purge_entry e;
+		e.name = dir.empty() ? std::string(de->d_name) : dir + "/" + de->d_name;
+		e.trashed = wosfs_purge_trashed(dirfd, e.name.c_str());
+		e.bytes = wosfs_purge_stub_bytes(dirfd, e.name.c_str());
+		out.push_back(e);
+	}
+	closedir(dp);
+}
+
+/* the totals of one directory, listed again only when its mtime has changed */
+void wosfs_purge_refresh(int dirfd, const std::string& dir, std::map<std::string, struct wosfs_purge_dir>& dirs)
+{
+	std::map<std::string, struct wosfs_purge_dir>::iterator it = wosfs_purge_dirs.find(dir);
+	struct stat st;
+
+	if ( fstatat(dirfd, dir.empty() ? "." : dir.c_str(), &st, 0) != 0 )
+		return;
+	if ( it != wosfs_purge_dirs.end() && it->second.mtime.tv_sec == st.st_mtim.tv_sec && it->second.mtime.tv_nsec == st.st_mtim.tv_nsec ) {
+		dirs.insert(*it);
+		return;
+	}
+
+	std::vector<struct wosfs_purge_entry> stubs;
+	struct wosfs_purge_dir d;
+	wosfs_purge_list(dirfd, dir, stubs);
+	d.mtime = st.st_mtim;
+	// a stub added in the same mtime tick as the listing would be missed
+	if ( time(NULL) - st.st_mtim.tv_sec < 2 )
+		d.mtime.tv_sec = d.mtime.tv_nsec = 0;
+	d.files = stubs.size();
+	d.bytes = 0;
+	d.purging = 0;
+	d.versions = 0;
+	for (size_t i = 0; i < stubs.size(); i++) {
+		d.bytes += stubs[i].bytes;
+		if ( wosfs_purge_is_purging(stubs[i].name) )
+			d.purging++;
+		if ( wosfs_trash_is_versions(stubs[i].name.c_str()) )
+			d.versions++;
+	}
+	dirs[dir] = d;
+}
+
+/* one pass over the trash can */
+void wosfs_purge_scan(struct wosfs_req *req)
+{
+	int dirfd = open(wosfs_trashcan_path, O_RDONLY | O_DIRECTORY);
+
+	if ( dirfd < 0 ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: purge: failed to open %s, errno=%d", wosfs_trashcan_path, errno);
+		return;
+	}
+
+	// the buckets oldest first, after the stubs at the top, and their shards
+	std::vector<std::string> buckets;
+	std::vector<std::vector<std::string> > shards;
+	wosfs_purge_subdirs(dirfd, ".", true, buckets);
+	buckets.insert(buckets.begin(), std::string());
+	shards.resize(buckets.size());
+	shards[0].push_back(std::string());
+	for (size_t b = 1; b < buckets.size(); b++) {
+		std::vector<std::string> names;
+		wosfs_purge_subdirs(dirfd, buckets[b].c_str(), false, names);
+		for (size_t i = 0; i < names.size(); i++)
+			shards[b].push_back(buckets[b] + "/" + names[i]);
+	}
+
+	std::map<std::string, struct wosfs_purge_dir> dirs;
+	uint64_t left_files = 0, left_bytes = 0;
+	for (size_t b = 0; b < buckets.size(); b++)
+		for (size_t i = 0; i < shards[b].size(); i++)
+			wosfs_purge_refresh(dirfd, shards[b][i], dirs);
+	wosfs_purge_dirs.swap(dirs);
+	for (std::map<std::string, struct wosfs_purge_dir>::iterator it = wosfs_purge_dirs.begin(); it != wosfs_purge_dirs.end(); ++it) {
+		left_files += it->second.files;
+		left_bytes += it->second.bytes;
+	}
+
+	time_t now = time(NULL);
+	uint64_t quota = (uint64_t)wosfs_conf.wosfs_purge_quota * WOSFS_1MiB;
+	pthread_mutex_lock(&wosfs_purge.mtx);
+	uint64_t objects = wosfs_purge.objects, start_ns = wosfs_now_ns();
+	pthread_mutex_unlock(&wosfs_purge.mtx);
+	std::vector<size_t> touched;
+	size_t n = 0;
+	for (size_t b = 0; b < buckets.size(); b++) {
+		time_t start = b ? wosfs_trash_bucket_time(buckets[b].c_str()) : 0;
+		bool old = wosfs_conf.wosfs_purge_age > 0 && now - start >= wosfs_conf.wosfs_purge_age;
+		bool over = (quota && left_bytes > quota) ||
+			(wosfs_conf.wosfs_purge_files > 0 && left_files > (uint64_t)wosfs_conf.wosfs_purge_files);
+		int purging = 0;
+		for (size_t i = 0; i < shards[b].size(); i++)
+			purging += wosfs_purge_dirs[shards[b][i]].purging + wosfs_purge_dirs[shards[b][i]].versions;
+		if ( !old && !over && 0 == purging )
+			continue;
+
+		// only this bucket is listed in full
+		std::vector<struct wosfs_purge_entry> stubs;
+		for (size_t i = 0; i < shards[b].size(); i++) {
+			wosfs_purge_list(dirfd, shards[b][i], stubs);
+			wosfs_purge_dirs.erase(shards[b][i]);
+		}
+		std::sort(stubs.begin(), stubs.end(), wosfs_purge_older);
+		touched.push_back(b);
+
+		for (size_t i = 0; i < stubs.size(); i++) {
+			old = wosfs_conf.wosfs_purge_age > 0 && now - stubs[i].trashed >= wosfs_conf.wosfs_purge_age;
+			over = (quota && left_bytes > quota) ||
+				(wosfs_conf.wosfs_purge_files > 0 && left_files > (uint64_t)wosfs_conf.wosfs_purge_files);
+			if ( !wosfs_purge_is_purging(stubs[i].name) && !wosfs_trash_is_versions(stubs[i].name.c_str()) && !old && !over )
+				continue;
+			wosfs_purge_one(dirfd, stubs[i].name, stubs[i].bytes, req);
+			left_files--;
+			left_bytes -= stubs[i].bytes;
+			wosfs_purge_reap(dirfd);
+			if ( ++n % WOSFS_PURGE_CHECKPOINT == 0 )
+				wosfs_purge_checkpoint();
+		}
+	}
+
+	// wait for the last deletes
+	pthread_mutex_lock(&wosfs_purge.mtx);
+	while ( wosfs_purge.inflight > 0 )
+		pthread_cond_wait(&wosfs_purge.cond, &wosfs_purge.mtx);
+	pthread_mutex_unlock(&wosfs_purge.mtx);
+	wosfs_purge_reap(dirfd);
+
+	// drop the buckets that are done with, not the one of this hour
+	uint64_t nbuckets = buckets.size() - 1;
+	for (size_t t = 0; t < touched.size(); t++) {
+		size_t b = touched[t];
+		if ( 0 == b || wosfs_trash_bucket_time(buckets[b].c_str()) + WOSFS_TRASH_BUCKET_SECS + 60 > now )
+			continue;
+		for (size_t i = 0; i < shards[b].size(); i++)
+			unlinkat(dirfd, shards[b][i].c_str(), AT_REMOVEDIR);
+		if ( unlinkat(dirfd, buckets[b].c_str(), AT_REMOVEDIR) == 0 )
+			nbuckets--;
+	}
+	close(dirfd);
+
+	pthread_mutex_lock(&wosfs_purge.mtx);
+	wosfs_purge.backlog_files = left_files;
+	wosfs_purge.backlog_bytes = left_bytes;
+	wosfs_purge.backlog_buckets = nbuckets;
+	if ( n ) {
+		uint64_t ns = wosfs_now_ns() - start_ns;
+		wosfs_purge.rate = ns ? (wosfs_purge.objects - objects) * 1000000000ULL / ns : 0;
+	}
+	pthread_mutex_unlock(&wosfs_purge.mtx);
+
+	if ( n ) {
+		wosfs_purge_checkpoint();
+		wosfs_notify_inval(WOSFS_TRASHCAN_NAME, false);
+		syslog(LOG_INFO, "fusewos purge: %zu stubs, %lu objects/s, backlog %lu stubs %lu bytes in %lu buckets",
+			n, wosfs_purge.rate, left_files, left_bytes, nbuckets);
+	}
+}
+
+void *wosfs_purge_thread(void *arg)
+{
+	(void) arg;
+	struct wosfs_req *req = wosfs_req_begin();
+
+	for (;;) {
+		wosfs_purge_scan(req);
+		sleep(wosfs_conf.wosfs_purge_interval);
+	}
+	return NULL;
+}
+
+bool wosfs_purge_running;
+
+/* from wosfs_init(), when any retention is set, or by the first snapshot */
+void wosfs_purge_start(void)
+{
+	pthread_t thread;
+
+	if ( wosfs_purge_running )
+		return;
+	if ( wosfs_conf.wosfs_purge_depth < 1 )
+		wosfs_conf.wosfs_purge_depth = 1;
+	if ( wosfs_conf.wosfs_purge_interval < 1 )
+		wosfs_conf.wosfs_purge_interval = 1;
+	try {
+		wosfs_purge_wos.Connect(wosfs_conf.wos_ip);
+	} catch (WosException& e) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: trash purger failed to connect to %s: %s", wosfs_conf.wos_ip, e.what());
+		return;
+	}
+	wosfs_purge_restore();
+	if ( pthread_create(&thread, NULL, wosfs_purge_thread, NULL) != 0 ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to start trash purge thread");
+		return;
+	}
+	pthread_detach(thread);
+	wosfs_purge_running = true;
+}
+#endif
+
+/*
+ *  Stub lock
+ *
+ *  The version compactor replaces a stub by renaming a new one over it.
+ *  While it is on, appending a version and compacting both hold an
+ *  exclusive flock on the stub, and an appender that finds the stub was
+ *  replaced while it waited opens the new one.
+ *
+ *  A snapshot may hard link the stubs it captures, which it marks with
+ *  WOSFS_SNAP_XATTR.  While there are snapshots the lock is always taken,
+ *  and a marked stub with more than one link is copied, and the copy
+ *  renamed over it, before it is opened: the snapshot keeps the old one.
+ *  A snapshot takes the lock before it links a stub, so a change in place
+ *  (chmod, chown, utimens, link) is made while holding the unshared stub
+ *  locked.
+ */
+bool wosfs_compact_on;
+
+#ifdef WOSFS_FEATURE_SNAPSHOTS
+#define WOSFS_SNAP_XATTR		"user.wosfs.snapshot"
+#define WOSFS_SNAP_TMP			".wosfs_unshare"
+
+uint64_t wosfs_snap_unshared;
+#endif
+
+/* copy [off, end) of from to the end of to */
+static bool wosfs_stub_copy(int from, int to, off_t off, off_t end)
+{
+	char buf[4096];
+
+	while ( off < end ) {
+		ssize_t n = pread(from, buf, std::min((off_t)sizeof(buf), end - off), off);
+		if ( n <= 0 || write(to, buf, n) != n )
+			return false;
+		off += n;
+	}
+	return true;
+}
+
+/* xattrs other than the snapshot mark */
+static void wosfs_stub_copy_xattrs(int from, int to)
+{
+	ssize_t len = flistxattr(from, NULL, 0);
+	if ( len <= 0 )
+		return;
+
+	std::vector<char> names(len), value;
+	len = flistxattr(from, &names[0], len);
+	for (ssize_t i = 0; i < len; i += strlen(&names[i]) + 1) {
+#ifdef WOSFS_FEATURE_SNAPSHOTS
+		if ( strcmp(&names[i], WOSFS_SNAP_XATTR) == 0 )
+			continue;
+#endif
+		ssize_t vlen = fgetxattr(from, &names[i], NULL, 0);
+		if ( vlen < 0 )
+			continue;
+		value.resize(vlen + 1);
+		vlen = fgetxattr(from, &names[i], &value[0], vlen);
+		if ( vlen >= 0 )
+			fsetxattr(to, &names[i], &value[0], vlen, 0);
+	}
+}
+
+/* owner, mode, xattrs and times of st and from */
+static void wosfs_stub_copy_attrs(int from, int to, const struct stat *st)
+{
+	struct timespec times[2] = { st->st_atim, st->st_mtim };
+
+	if ( fchown(to, st->st_uid, st->st_gid) != 0 )
+		WOSFS_DEBUGLOG(WOSFS_LOG_WARN, ":WOS:: failed to chown a stub copy, errno=%d", errno);
+	fchmod(to, st->st_mode & 07777);
+	wosfs_stub_copy_xattrs(from, to);
+	futimens(to, times);
+}
+
+/* whether the open stub is held by a snapshot, rather than hard linked by the user */
+static inline bool wosfs_stub_shared(int fd, const struct stat *st)
+{
+#ifdef WOSFS_FEATURE_SNAPSHOTS
+	return st->st_nlink > 1 && wosfs_snap_on && fgetxattr(fd, WOSFS_SNAP_XATTR, NULL, 0) >= 0;
+#else
+	(void) fd;
+	(void) st;
+	return false;
+#endif
+}
+
+#ifdef WOSFS_FEATURE_SNAPSHOTS
+/* rename a copy of the locked stub fd over name, the snapshots keep fd */
+int wosfs_stub_unshare(int dirfd, const char *name, int fd, const struct stat *st)
+{
+	std::string tmp = std::string(".") + name + WOSFS_SNAP_TMP;
+	int tfd = openat(dirfd, tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, st->st_mode & 07777);
+	bool ok = tfd >= 0 && wosfs_stub_copy(fd, tfd, 0, st->st_size);
+
+	if ( ok ) {
+		wosfs_stub_copy_attrs(fd, tfd, st);
+		ok = fsync(tfd) == 0 && renameat(dirfd, tmp.c_str(), dirfd, name) == 0;
+	}
+	if ( !ok ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to copy %s away from its snapshots, errno=%d", name, errno);
+		if ( tfd >= 0 )
+			unlinkat(dirfd, tmp.c_str(), 0);
+	}
+	if ( tfd >= 0 )
+		close(tfd);
+	if ( !ok )
+		return -1;
+	__sync_fetch_and_add(&wosfs_snap_unshared, 1);
+	return 0;
+}
+#endif
+
+int wosfs_stub_open_locked(int dirfd, const char *name, int flags)
+{
+	struct stat a, b;
+	int fd;
+
+	for (int tries = 0; ; tries++) {
+		fd = openat(dirfd, name, flags);
+#ifdef WOSFS_FEATURE_SNAPSHOTS
+		if ( fd < 0 || !(wosfs_compact_on || wosfs_snap_on) || flock(fd, LOCK_EX) != 0 )
+#else
+		if ( fd < 0 || !wosfs_compact_on || flock(fd, LOCK_EX) != 0 )
+#endif
+			return fd;
+		if ( fstat(fd, &a) != 0 || fstatat(dirfd, name, &b, AT_SYMLINK_NOFOLLOW) != 0 || tries == 8 )
+			return fd;
+		if ( a.st_ino == b.st_ino && a.st_dev == b.st_dev ) {
+			if ( !wosfs_stub_shared(fd, &a) )
+				return fd;
+#ifdef WOSFS_FEATURE_SNAPSHOTS
+			// open the copy
+			if ( wosfs_stub_unshare(dirfd, name, fd, &a) != 0 )
+				return fd;
+#endif
+		}
+		close(fd);
+	}
+}
+
+#ifdef WOSFS_FEATURE_SNAPSHOTS
+/* before name in dirfd changes in place: copy it away from the snapshots */
+void wosfs_stub_unshare_at(int dirfd, const char *name)
+{
+	struct stat st;
+
+	if ( wosfs_snap_on && fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1 ) {
+		int fd = wosfs_stub_open_locked(dirfd, name, O_RDONLY | O_NOFOLLOW);
+		if ( fd >= 0 )
+			close(fd);
+	}
+}
+
+/*
+ * The stub name in dirfd copied away from the snapshots and locked, for a
+ * change in place made through the fd or before it is closed; -1 when there
+ * are no snapshots or name is not a regular file, change it by name then.
+ */
+int wosfs_stub_open_unshared(int dirfd, const char *name)
+{
+	struct stat st;
+
+	if ( !wosfs_snap_on || fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode) )
+		return -1;
+	return wosfs_stub_open_locked(dirfd, name, O_RDONLY | O_NOFOLLOW);
+}
+
+/*
+ * Before the user hard links name: the link must not be to a stub of the
+ * snapshots.  Returns the stub locked, to be closed once the link is made.
+ */
+int wosfs_stub_unmark_at(int dirfd, const char *name)
+{
+	struct stat st;
+	int fd = wosfs_stub_open_unshared(dirfd, name);
+
+	// a mark left over from snapshots deleted since
+	if ( fd >= 0 && fstat(fd, &st) == 0 && st.st_nlink == 1 )
+		fremovexattr(fd, WOSFS_SNAP_XATTR);
+	return fd;
+}
+#else
+static inline void wosfs_stub_unshare_at(int dirfd, const char *name) { (void) dirfd; (void) name; }
+static inline int wosfs_stub_open_unshared(int dirfd, const char *name) { (void) dirfd; (void) name; return -1; }
+static inline int wosfs_stub_unmark_at(int dirfd, const char *name) { (void) dirfd; (void) name; return -1; }
+#endif
+
+#ifdef WOSFS_FEATURE_TRASHCAN
+/*
+ *  Version compactor (--wos_keep_versions, --wos_keep_age)
+ *
+ *  Every rewrite appends a version line to the stub.  wosfs_release()
+ *  queues a stub once it holds WOSFS_COMPACT_SLACK versions more than
+ *  --wos_keep_versions, and a background thread keeps its last
+ *  --wos_keep_versions versions and those newer than --wos_keep_age
+ *  seconds, always the last one.  The new stub is written next to the old
+ *  one and renamed over it with the old mode, owner, times and xattrs.
+ *  The dropped versions go to the trash can as a WOSFS_TRASH_VERSIONS
+ *  stub, so the purger deletes their objects at its own depth and rate.
+ *  Stubs that are open, hard linked by the user or not regular files are
+ *  left alone.
+ */
+
+#define WOSFS_COMPACT_SLACK		16		// versions beyond the limit before a stub is queued
+#define WOSFS_COMPACT_QUEUE		65536		// stubs queued or remembered at most
+#define WOSFS_COMPACT_TMP		".wosfs_compact"
+
+pthread_mutex_t wosfs_compact_mtx = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t wosfs_compact_cond = PTHREAD_COND_INITIALIZER;
+std::map<std::string, std::string> wosfs_compact_queue;	// stub path -> mount path
+std::map<std::string, time_t> wosfs_compact_later;	// stub path -> no version ages out before
+uint64_t wosfs_compact_stubs, wosfs_compact_versions, wosfs_compact_skipped;
+
+/* from wosfs_release() after appending a version to fp, still open and locked */
+void wosfs_compact_note(const char *stub, const char *path, FILE *fp)
+{
+	size_t magic_len = strlen(wosfs_conf.wosfs_magic);
+	char *line = NULL;
+	size_t len = 0;
+	int versions = 0;
+
+	if ( !wosfs_compact_on || fflush(fp) != 0 )
+		return;
+	// only version lines count, not the trash can's original path line
+	rewind(fp);
+	while ( getline(&line, &len, fp) != -1 )
+		if ( strncmp(line, wosfs_conf.wosfs_magic, magic_len) == 0 )
+			versions++;
+	free(line);
+	if ( versions <= wosfs_conf.wosfs_keep_versions + WOSFS_COMPACT_SLACK )
+		return;
+
+	pthread_mutex_lock(&wosfs_compact_mtx);
+	std::map<std::string, time_t>::iterator it = wosfs_compact_later.find(stub);
+	if ( it == wosfs_compact_later.end() || time(NULL) >= it->second ) {
+		if ( wosfs_compact_queue.size() < WOSFS_COMPACT_QUEUE &&
+		     wosfs_compact_queue.insert(std::make_pair(std::string(stub), std::string(path))).second )
+			pthread_cond_signal(&wosfs_compact_cond);
+	}
+	pthread_mutex_unlock(&wosfs_compact_mtx);
+}
+
+static bool wosfs_compact_write(const char *path, mode_t mode, const std::vector<std::string>& lines)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+	FILE *fp = fd < 0 ? NULL : fdopen(fd, "w");
+
+	if ( NULL == fp ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: compact: failed to create %s, errno=%d", path, errno);
+		if ( fd >= 0 )
+			close(fd);
+		return false;
+	}
+	for (size_t i = 0; i < lines.size(); i++)
+		fputs(lines[i].c_str(), fp);
+	if ( fflush(fp) != 0 || fsync(fd) != 0 ) {
+		fclose(fp);
+		unlink(path);
+		return false;
+	}
+	fclose(fp);
+	return true;
+}
+
+/*
+ *  Compact one stub, the dropped versions are left in the trash can.  The
+ *  new stub is written and synced without the lock, which is only taken
+ *  to copy over what was appended meanwhile and rename.
+ */
+void wosfs_compact_one(const std::string& stub, const std::string& path)
+{
+	time_t now = time(NULL), later = 0;
+
+	struct wosclient_pool_entry *wosclient = wosclient_pool_lookup(stub.c_str());
+	if ( wosclient ) {
+		wosclient_pool_put(wosclient);
+		__sync_fetch_and_add(&wosfs_compact_skipped, 1);
+		return;		// queued again by its release
+	}
+
+	int fd = open(stub.c_str(), O_RDONLY);
+	struct stat st;
+	if ( fd < 0 )
+		return;
+	if ( fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (st.st_nlink > 1 && !wosfs_stub_shared(fd, &st)) ) {
+		__sync_fetch_and_add(&wosfs_compact_skipped, 1);
+		close(fd);
+		return;
+	}
+
+	// whole lines only, an append may be under way
+	int rfd = dup(fd);
+	FILE *fp = rfd < 0 ? NULL : fdopen(rfd, "r");
+	std::vector<std::string> lines;
+	std::vector<size_t> versions;
+	size_t magic_len = strlen(wosfs_conf.wosfs_magic);
+	off_t consumed = 0;
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t n;
+
+	if ( NULL == fp ) {
+		if ( rfd >= 0 )
+			close(rfd);
+		close(fd);
+		return;
+	}
+	while ( (n = getline(&line, &len, fp)) != -1 && line[n - 1] == '\n' ) {
+		if ( strncmp(line, wosfs_conf.wosfs_magic, magic_len) == 0 )
+			versions.push_back(lines.size());
+		lines.push_back(std::string(line, n));
+		consumed += n;
+	}
+	free(line);
+	fclose(fp);
+
+	// keep the last --wos_keep_versions, those newer than --wos_keep_age and the last one
+	std::vector<std::string> kept, dropped;
+	std::vector<bool> drop(lines.size(), false);
+	size_t keep_last = wosfs_conf.wosfs_keep_versions > 0 ? wosfs_conf.wosfs_keep_versions : 1;
+	for (size_t v = 0; v + keep_last < versions.size(); v++) {
+		long t = 0;
+		sscanf(lines[versions[v]].c_str(), "%*s %*s %*s %ld", &t);
+		if ( wosfs_conf.wosfs_keep_age > 0 && now - t < wosfs_conf.wosfs_keep_age ) {
+			if ( 0 == later || t + wosfs_conf.wosfs_keep_age < later )
+				later = t + wosfs_conf.wosfs_keep_age;
+			continue;
+		}
+		drop[versions[v]] = true;
+	}
+	for (size_t i = 0; i < lines.size(); i++)
+		(drop[i] ? dropped : kept).push_back(lines[i]);
+
+	pthread_mutex_lock(&wosfs_compact_mtx);
+	if ( wosfs_compact_later.size() >= WOSFS_COMPACT_QUEUE )
+		wosfs_compact_later.clear();
+	if ( later )
+		wosfs_compact_later[stub] = later;
+	else
+		wosfs_compact_later.erase(stub);
+	pthread_mutex_unlock(&wosfs_compact_mtx);
+
+	if ( dropped.empty() ) {
+		close(fd);
+		return;
+	}
+	dropped.push_back(std::string(WOSFS_TRASH_ORIG) + stub + "\n");
+
+	// the new stub next to the old one, the dropped versions at the top of the trash can
+	size_t slash = stub.rfind('/');
+	std::string base = stub.substr(slash + 1);
+	std::string tmp = stub.substr(0, slash + 1) + "." + base + WOSFS_COMPACT_TMP;
+	std::string vtmp = std::string(wosfs_trashcan_path) + "/." + base + WOSFS_COMPACT_TMP;
+	if ( !wosfs_compact_write(tmp.c_str(), st.st_mode & 07777, kept) ) {
+		close(fd);
+		return;
+	}
+	if ( !wosfs_compact_write(vtmp.c_str(), 0600, dropped) ) {
+		unlink(tmp.c_str());
+		close(fd);
+		return;
+	}
+
+	// under the lock: still the same stub, then what was appended since
+	struct stat cur;
+	int tfd = -1;
+	bool ok = flock(fd, LOCK_EX) == 0 && stat(stub.c_str(), &cur) == 0 &&
+		cur.st_ino == st.st_ino && cur.st_dev == st.st_dev && fstat(fd, &st) == 0;
+	if ( ok )
+		ok = (tfd = open(tmp.c_str(), O_WRONLY | O_APPEND)) >= 0;
+	if ( ok )
+		ok = wosfs_stub_copy(fd, tfd, consumed, st.st_size);
+	if ( ok ) {
+		wosfs_stub_copy_attrs(fd, tfd, &st);
+		ok = rename(tmp.c_str(), stub.c_str()) == 0;
+	}
+	if ( tfd >= 0 )
+		close(tfd);
+	close(fd);
+	if ( !ok ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: compact: failed to replace %s, errno=%d", stub.c_str(), errno);
+		unlink(tmp.c_str());
+		unlink(vtmp.c_str());
+		return;
+	}
+
+	// the old stub is gone, now the dropped versions may be deleted
+	char trash_path[PATH_MAX];
+	std::string vname = vtmp.substr(vtmp.rfind('/') + 1);
+	int tdir = open(wosfs_trashcan_path, O_RDONLY | O_DIRECTORY);
+	if ( tdir < 0 || wosfs_trash_move(tdir, vname.c_str(), (base + WOSFS_TRASH_VERSIONS).c_str(), trash_path) != 0 )
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: compact: dropped versions of %s left in %s", stub.c_str(), vtmp.c_str());
+	if ( tdir >= 0 )
+		close(tdir);
+
+	wosfs_attr_invalidate(path.c_str());
+	wosfs_snap_dirty(path.c_str());
+	__sync_fetch_and_add(&wosfs_compact_stubs, 1);
+	__sync_fetch_and_add(&wosfs_compact_versions, dropped.size() - 1);
+	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: compact: %s kept %zu lines, dropped %zu versions", stub.c_str(), kept.size(), dropped.size() - 1);
+}
+
+void *wosfs_compact_thread(void *arg)
+{
+	(void) arg;
+
+	for (;;) {
+		pthread_mutex_lock(&wosfs_compact_mtx);
+		while ( wosfs_compact_queue.empty() )
+			pthread_cond_wait(&wosfs_compact_cond, &wosfs_compact_mtx);
+		std::string stub = wosfs_compact_queue.begin()->first;
+		std::string path = wosfs_compact_queue.begin()->second;
+		wosfs_compact_queue.erase(wosfs_compact_queue.begin());
+		pthread_mutex_unlock(&wosfs_compact_mtx);
+
+		wosfs_compact_one(stub, path);
+	}
+	return NULL;
+}
+
+/* from wosfs_init(), when --wos_keep_versions or --wos_keep_age is set */
+void wosfs_compact_start(void)
+{
+	pthread_t thread;
+
+	if ( pthread_create(&thread, NULL, wosfs_compact_thread, NULL) != 0 ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to start version compactor thread");
+		wosfs_compact_on = false;
+		return;
+	}
+	pthread_detach(thread);
+}
+#endif
+
+#ifdef WOSFS_FEATURE_SNAPSHOTS
+/*
+ *  Snapshots (/.WOS_snapshots, --wos_snapshot_threads)
+ *
+ *  mkdir /.WOS_snapshots/<name> takes a snapshot of the stub tree into
+ *  <stub path>/.WOS_snapshots/<name>, rmdir deletes it, and nothing in a
+ *  snapshot can be changed.  --wos_snapshot_threads threads walk the tree
+ *  a directory each at a time.  A stub is reflinked (FICLONE) where the
+ *  backing file system can, else hard linked and marked (see Stub lock),
+ *  else, when the user hard linked it or it can not be marked, copied.
+ *  Each stub is captured under the stub lock, as it is when the walk gets
+ *  to it.  The walk runs inside the mkdir call and under wosfs_snap_mtx:
+ *  the mkdir, and any other snapshot mkdir or rmdir, waits for it.
+ *
+ *  A snapshot after the first only walks the directories the journal noted
+ *  since the one before, and their parents.  Any other directory is a
+ *  symlink to the older snapshot that holds it (see wosfs_snap_ref()),
+ *  shown as the directory itself, and a stub unchanged since the snapshot
+ *  holding its directory is hard linked from there: a snapshot costs what
+ *  changed since the last one.  The journal gets a closing "clean" line
+ *  when fusewos stops; without it the next snapshot walks the whole tree.
+ *
+ *  Deleting a snapshot moves the directories later ones link to into the
+ *  oldest of those and leaves a symlink to it behind for the others.
+ *
+ *  WOSFS_SNAP_META holds
+ *    list           "<sec> <nsec> <name>" per snapshot, oldest first
+ *    journal        "base <latest snapshot>", then "d <dir>", "t <dir>" and "full" lines
+ *    <name>.dirs    the journal lines <name> was walked for
+ *    <name>.oids    OIDs of the stubs <name> captured (see Snapshot hooks)
+ *    deferred       objects kept because a snapshot holds them
+ */
+
+#ifndef FICLONE
+#define FICLONE				_IOW(0x94, 9, int)
+#endif
+
+#define WOSFS_SNAP_LIST			"list"
+#define WOSFS_SNAP_JOURNAL		"journal"
+#define WOSFS_SNAP_MAX_THREADS		64
+
+struct wosfs_snap {
+	std::string			name;
+	struct timespec			taken;		// when its walk started
+};
+
+pthread_mutex_t wosfs_snap_mtx = PTHREAD_MUTEX_INITIALIZER;	// one snapshot taken or deleted at a time
+std::vector<struct wosfs_snap> wosfs_snaps;			// oldest first
+int wosfs_snap_fd = -1;						// wosfs_snap_path
+
+struct wosfs_snap_stats {
+	uint64_t			taken;
+	uint64_t			deleted;
+	uint64_t			last_ms;	// of the last snapshot taken
+	uint64_t			dirs;		// walked by it
+	uint64_t			links;		// directories it links to older snapshots
+	uint64_t			captured;	// stubs it reflinked, linked or copied
+	uint64_t			kept;		// stubs it shares with older snapshots
+} wosfs_snap_stats;
+
+/* a directory to walk */
+struct wosfs_snap_dir {
+	std::string			rel;		// mount relative without the leading /, "" for the root
+	std::string			held;		// the snapshot holding rel so far, "" if none
+	struct timespec			held_taken;
+	struct stat			st;		// of the live directory
+};
+
+struct wosfs_snap_walk {
+	std::string			name;
+	std::map<std::string, struct timespec> taken;	// of the older snapshots
+	std::set<std::string>		touched;	// noted directories and their parents
+	std::set<std::string>		trees;
+	bool				reflink;	// FICLONE still worth trying
+	pthread_mutex_t			mtx;
+	pthread_cond_t			cond;
+	std::vector<struct wosfs_snap_dir> queue;
+	int				active;
+	int				error;		// first errno
+	FILE				*oids;
+	uint64_t			dirs, links, captured, kept;
+};
+
+static std::string wosfs_snap_meta_path(const std::string& file)
+{
+	return std::string(wosfs_snap_path) + "/" WOSFS_SNAP_META "/" + file;
+}
+
+static inline bool wosfs_ts_before(const struct timespec& a, const struct timespec& b)
+{
+	return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+static inline bool wosfs_ends_with(const char *name, size_t len, const char *suffix, size_t slen)
+{
+	return len > slen && strcmp(name + len - slen, suffix) == 0;
+}
+
+/* read the lines of a journal or a .dirs file, false if there is none */
+static bool wosfs_snap_read_dirs(const std::string& path, std::set<std::string>& dirs, std::set<std::string>& trees,
+				 bool *full, std::string *base, bool *clean)
+{
+	FILE *fp = fopen(path.c_str(), "r");
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t n;
+
+	if ( NULL == fp )
+		return false;
+	while ( (n = getline(&line, &len, fp)) != -1 ) {
+		if ( n > 0 && line[n - 1] == '\n' )
+			line[--n] = '\0';
+		if ( clean )
+			*clean = strcmp(line, "clean") == 0;
+		if ( strncmp(line, "base ", 5) == 0 ) {
+			if ( base )
+				base->assign(line + 5);
+		}
+		else if ( strcmp(line, "full") == 0 )
+			*full = true;
+		else if ( n >= 2 && line[1] == ' ' && (line[0] == 'd' || line[0] == 't') )
+			(line[0] == 'd' ? dirs : trees).insert(line + 2);
+	}
+	free(line);
+	fclose(fp);
+	return true;
+}
+
+static void wosfs_snap_print_dirs(FILE *fp, const std::set<std::string>& dirs, const std::set<std::string>& trees, bool full)
+{
+	if ( full ) {
+		fputs("full\n", fp);
+		return;
+	}
+	for (std::set<std::string>::const_iterator it = dirs.begin(); it != dirs.end(); ++it)
+		fprintf(fp, "d %s\n", it->c_str());
+	for (std::set<std::string>::const_iterator it = trees.begin(); it != trees.end(); ++it)
+		fprintf(fp, "t %s\n", it->c_str());
+}
+
+static bool wosfs_snap_write_dirs(const std::string& path, const std::set<std::string>& dirs, const std::set<std::string>& trees, bool full)
+{
+	FILE *fp = fopen(path.c_str(), "w");
+
+	if ( NULL == fp )
+		return false;
+	wosfs_snap_print_dirs(fp, dirs, trees, full);
+	return fclose(fp) == 0;
+}
+
+/* start the journal over from base with what is noted now, none without base; caller holds wosfs_snap_journal_mtx */
+void wosfs_snap_journal_reset(const std::string& base)
+{
+	std::string path = wosfs_snap_meta_path(WOSFS_SNAP_JOURNAL), tmp = path + ".tmp";
+
+	if ( wosfs_snap_journal ) {
+		fclose(wosfs_snap_journal);
+		wosfs_snap_journal = NULL;
+	}
+	if ( base.empty() ) {
+		wosfs_snap_dirs.clear();
+		wosfs_snap_trees.clear();
+		wosfs_snap_full = false;
+		unlink(path.c_str());
+		return;
+	}
+
+	// the journal is appended to after the rename
+	FILE *fp = fopen(tmp.c_str(), "w");
+	if ( fp ) {
+		fprintf(fp, "base %s\n", base.c_str());
+		wosfs_snap_print_dirs(fp, wosfs_snap_dirs, wosfs_snap_trees, wosfs_snap_full);
+		if ( fflush(fp) != 0 || rename(tmp.c_str(), path.c_str()) != 0 ) {
+			fclose(fp);
+			fp = NULL;
+		}
+	}
+	if ( NULL == fp ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: snapshot: failed to write %s, errno=%d", path.c_str(), errno);
+		wosfs_snap_full = true;
+	}
+	wosfs_snap_journal = fp;
+}
+
+static bool wosfs_snap_write_list(void)
+{
+	std::string path = wosfs_snap_meta_path(WOSFS_SNAP_LIST), tmp = path + ".tmp";
+	FILE *fp = fopen(tmp.c_str(), "w");
+
+	if ( NULL == fp )
+		return false;
+	for (size_t i = 0; i < wosfs_snaps.size(); i++)
+		fprintf(fp, "%lld %ld %s\n", (long long)wosfs_snaps[i].taken.tv_sec, wosfs_snaps[i].taken.tv_nsec, wosfs_snaps[i].name.c_str());
+	if ( fflush(fp) != 0 || fsync(fileno(fp)) != 0 ) {
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+	return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+/* the OIDs all snapshots hold, from their .oids */
+void wosfs_snap_load_oids(void)
+{
+	std::set<uint64_t> oids;
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t n;
+
+	for (size_t i = 0; i < wosfs_snaps.size(); i++) {
+		FILE *fp = fopen(wosfs_snap_meta_path(wosfs_snaps[i].name + ".oids").c_str(), "r");
+		if ( NULL == fp )
+			continue;
+		while ( (n = getline(&line, &len, fp)) != -1 ) {
+			if ( n > 0 && line[n - 1] == '\n' )
+				line[n - 1] = '\0';
+			oids.insert(wosfs_path_hash(line));
+		}
+		fclose(fp);
+	}
+	free(line);
+
+	pthread_mutex_lock(&wosfs_snap_oids_mtx);
+	wosfs_snap_oids.swap(oids);
+	pthread_mutex_unlock(&wosfs_snap_oids_mtx);
+}
+
+/* the OIDs of every version in the stub fd */
+static void wosfs_snap_stub_oids(int fd, std::vector<std::string>& oids)
+{
+	int rfd = dup(fd);
+	FILE *fp = rfd < 0 ? NULL : fdopen(rfd, "r");
+	size_t magic_len = strlen(wosfs_conf.wosfs_magic);
+	char *line = NULL, oid[41];
+	size_t len = 0;
+
+	if ( NULL == fp ) {
+		if ( rfd >= 0 )
+			close(rfd);
+		return;
+	}
+	rewind(fp);
+	while ( getline(&line, &len, fp) != -1 ) {
+		if ( strncmp(line, wosfs_conf.wosfs_magic, magic_len) == 0 && sscanf(line, "%*s %40s", oid) == 1 )
+			oids.push_back(oid);
+	}
+	free(line);
+	fclose(fp);
+}
+
+static void wosfs_snap_fail(struct wosfs_snap_walk *w, int err)
+{
+	pthread_mutex_lock(&w->mtx);
+	if ( 0 == w->error )
+		w->error = err;
+	pthread_mutex_unlock(&w->mtx);
+}
+
+static bool wosfs_snap_under_tree(const struct wosfs_snap_walk *w, const std::string& rel)
+{
+	std::string p = rel;
+
+	for (;;) {
+		if ( w->trees.count(p) )
+			return true;
+		if ( p.empty() )
+			return false;
+		size_t slash = p.rfind('/');
+		p.erase(slash == std::string::npos ? 0 : slash);
+	}
+}
+
+/* not part of a snapshot: the snapshots, the trash can and copies being made */
+static bool wosfs_snap_skip(const std::string& rel, const char *name)
+{
+	size_t len = strlen(name);
+
+	if ( rel.empty() && (strcmp(name, WOSFS_SNAP_NAME + 1) == 0 || strcmp(name, WOSFS_TRASHCAN_NAME + 1) == 0) )
+		return true;
+	return name[0] == '.' && (wosfs_ends_with(name, len, WOSFS_SNAP_TMP, sizeof(WOSFS_SNAP_TMP) - 1) ||
+				  wosfs_ends_with(name, len, WOSFS_COMPACT_TMP, sizeof(WOSFS_COMPACT_TMP) - 1));
+}
+
+/*
+ *  Find which snapshot held the directory name of parent before this one,
+ *  into sub, and when nothing below it changed since, link to it there.
+ */
+static bool wosfs_snap_link_dir(struct wosfs_snap_walk *w, int sfd, int pfd, const struct wosfs_snap_dir& parent,
+				const char *name, struct wosfs_snap_dir *sub)
+{
+	char target[PATH_MAX];
+	struct stat pst;
+	ssize_t n;
+
+	sub->held.clear();
+	if ( pfd >= 0 && fstatat(pfd, name, &pst, AT_SYMLINK_NOFOLLOW) == 0 ) {
+		if ( S_ISDIR(pst.st_mode) ) {
+			sub->held = parent.held;
+			sub->held_taken = parent.held_taken;
+		}
+		else if ( S_ISLNK(pst.st_mode) && (n = readlinkat(pfd, name, target, sizeof(target) - 1)) >= 0 ) {
+			target[n] = '\0';
+			std::map<std::string, struct timespec>::iterator it;
+			if ( wosfs_snap_ref_parse(target, sub->rel.c_str(), &sub->held) && (it = w->taken.find(sub->held)) != w->taken.end() )
+				sub->held_taken = it->second;
+			else
+				sub->held.clear();
+		}
+	}
+	if ( sub->held.empty() || w->touched.count(sub->rel) || wosfs_snap_under_tree(w, sub->rel) )
+		return false;
+	return symlinkat(wosfs_snap_ref(sub->held, sub->rel).c_str(), sfd, name) == 0;
+}
+
+/* capture the live stub name of dfd into sfd, its OIDs are added to oids and held */
+static int wosfs_snap_capture(struct wosfs_snap_walk *w, int dfd, int sfd, const char *name, std::vector<std::string>& oids)
+{
+	struct stat st, cur;
+	int fd = -1, out = -1, res = 0;
+	bool done = false;
+
+	// under the stub lock, so that no version is appended meanwhile
+	for (int tries = 0; tries < 8 && fd < 0; tries++) {
+		fd = openat(dfd, name, O_RDONLY | O_NOFOLLOW);
+		if ( fd < 0 )
+			return -errno;
+		if ( flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0 || fstatat(dfd, name, &cur, AT_SYMLINK_NOFOLLOW) != 0 ||
+		     cur.st_ino != st.st_ino || cur.st_dev != st.st_dev ) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	if ( fd < 0 )
+		return -EAGAIN;
+
+	if ( w->reflink ) {
+		out = openat(sfd, name, O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 07777);
+		if ( out >= 0 && ioctl(out, FICLONE, fd) == 0 )
+			done = true;
+		else if ( out >= 0 ) {
+			if ( EOPNOTSUPP == errno || ENOTTY == errno || EXDEV == errno || EINVAL == errno || ENOSYS == errno )
+				w->reflink = false;	// not on this file system
+			close(out);
+			unlinkat(sfd, name, 0);
+			out = -1;
+		}
+	}
+	if ( !done && (st.st_nlink == 1 || wosfs_stub_shared(fd, &st)) &&
+	     fsetxattr(fd, WOSFS_SNAP_XATTR, "1", 1, 0) == 0 && linkat(dfd, name, sfd, name, 0) == 0 )
+		done = true;
+	if ( !done ) {
+		out = openat(sfd, name, O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 07777);
+		done = out >= 0 && wosfs_stub_copy(fd, out, 0, st.st_size);
+		if ( !done )
+			res = -errno;
+	}
+	if ( out >= 0 ) {
+		wosfs_stub_copy_attrs(fd, out, &st);
+		close(out);
+	}
+
+	// held before the stub is unlocked, the trash can may have it next
+	if ( done ) {
+		size_t from = oids.size();
+		wosfs_snap_stub_oids(fd, oids);
+		pthread_mutex_lock(&wosfs_snap_oids_mtx);
+		for (size_t i = from; i < oids.size(); i++)
+			wosfs_snap_oids.insert(wosfs_path_hash(oids[i].c_str()));
+		pthread_mutex_unlock(&wosfs_snap_oids_mtx);
+	}
+	close(fd);
+	return res;
+}
+
+static void wosfs_snap_file(struct wosfs_snap_walk *w, const struct wosfs_snap_dir& d, int dfd, int sfd, int pfd,
+			    const char *name, const struct stat *st, std::vector<std::string>& oids)
+{
+	struct stat pst;
+
+	// unchanged since the snapshot holding the directory: share its stub
+	if ( pfd >= 0 && fstatat(pfd, name, &pst, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(pst.st_mode) &&
+	     ((pst.st_ino == st->st_ino && pst.st_dev == st->st_dev) ||
+	      (wosfs_ts_before(st->st_ctim, d.held_taken) && pst.st_size == st->st_size)) &&
+	     linkat(pfd, name, sfd, name, 0) == 0 ) {
+		__sync_fetch_and_add(&w->kept, 1);
+		return;
+	}
+
+	int res = wosfs_snap_capture(w, dfd, sfd, name, oids);
+	if ( 0 == res )
+		__sync_fetch_and_add(&w->captured, 1);
+	else if ( -ENOENT != res ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: snapshot %s: failed to capture %s/%s, errno=%d", w->name.c_str(), d.rel.c_str(), name, -res);
+		wosfs_snap_fail(w, -res);
+	}
+}
+
+/* one directory: its entries into the snapshot, its subdirectories to the queue */
+void wosfs_snap_walk_dir(struct wosfs_snap_walk *w, const struct wosfs_snap_dir& d)
+{
+	std::string spath = w->name, ppath = d.held;
+	if ( !d.rel.empty() ) {
+		spath += "/" + d.rel;
+		if ( !ppath.empty() )
+			ppath += "/" + d.rel;
+	}
+
+	int dfd = openat(wosfs_root_fd, d.rel.empty() ? "." : d.rel.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if ( dfd < 0 ) {
+		if ( ENOENT != errno )		// removed since it was listed
+			wosfs_snap_fail(w, errno);
+		return;
+	}
+	int sfd = openat(wosfs_snap_fd, spath.c_str(), O_RDONLY | O_DIRECTORY);
+	int pfd = ppath.empty() ? -1 : openat(wosfs_snap_fd, ppath.c_str(), O_RDONLY | O_DIRECTORY);
+	int lfd = dup(dfd);
+	DIR *dp = lfd < 0 ? NULL : fdopendir(lfd);
+	std::vector<struct wosfs_snap_dir> subdirs;
+	std::vector<std::string> oids;
+	uint64_t links = 0;
+	struct dirent *de;
+
+	if ( NULL == dp || sfd < 0 ) {
+		wosfs_snap_fail(w, errno);
+		if ( dp )
+			closedir(dp);
+		else if ( lfd >= 0 )
+			close(lfd);
+		goto out;
+	}
+
+	while ( (de = readdir(dp)) != NULL ) {
+		const char *name = de->d_name;
+		struct stat st;
+		int res = 0;
+
+		if ( strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || wosfs_snap_skip(d.rel, name) )
+			continue;
+		if ( fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 )
+			continue;		// gone since
+
+		if ( S_ISDIR(st.st_mode) ) {
+			struct wosfs_snap_dir sub;
+			sub.rel = d.rel.empty() ? std::string(name) : d.rel + "/" + name;
+			sub.st = st;
+			if ( wosfs_snap_link_dir(w, sfd, pfd, d, name, &sub) )
+				links++;
+			else if ( mkdirat(sfd, name, 0700) == 0 )
+				subdirs.push_back(sub);
+			else
+				res = errno;
+		}
+		else if ( S_ISREG(st.st_mode) )
+			wosfs_snap_file(w, d, dfd, sfd, pfd, name, &st, oids);
+		else {
+			char target[PATH_MAX];
+			ssize_t n;
+
+			if ( S_ISLNK(st.st_mode) ) {
+				if ( (n = readlinkat(dfd, name, target, sizeof(target) - 1)) < 0 )
+					continue;
+				target[n] = '\0';
+				res = symlinkat(target, sfd, name) == 0 ? 0 : errno;
+			}
+			else if ( mknodat(sfd, name, st.st_mode, st.st_rdev) != 0 ) {
+				WOSFS_DEBUGLOG(WOSFS_LOG_WARN, ":WOS:: snapshot %s: left out %s/%s, errno=%d", w->name.c_str(), d.rel.c_str(), name, errno);
+				continue;
+			}
+			if ( 0 == res ) {
+				struct timespec times[2] = { st.st_atim, st.st_mtim };
+				if ( fchownat(sfd, name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) != 0 )
+					WOSFS_DEBUGLOG(WOSFS_LOG_WARN, ":WOS:: snapshot %s: failed to chown %s/%s, errno=%d", w->name.c_str(), d.rel.c_str(), name, errno);
+				utimensat(sfd, name, times, AT_SYMLINK_NOFOLLOW);
+			}
+		}
+		if ( res ) {
+			WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: snapshot %s: failed to make %s/%s, errno=%d", w->name.c_str(), d.rel.c_str(), name, res);
+			wosfs_snap_fail(w, res);
+		}
+	}
+	closedir(dp);
+
+	// its own attributes last, now that its entries are in
+	{
+		struct timespec times[2] = { d.st.st_atim, d.st.st_mtim };
+		if ( fchown(sfd, d.st.st_uid, d.st.st_gid) != 0 )
+			WOSFS_DEBUGLOG(WOSFS_LOG_WARN, ":WOS:: snapshot %s: failed to chown %s, errno=%d", w->name.c_str(), spath.c_str(), errno);
+		fchmod(sfd, d.st.st_mode & 07777);
+		futimens(sfd, times);
+	}
+
+	pthread_mutex_lock(&w->mtx);
+	for (size_t i = 0; i < oids.size(); i++)
+		fprintf(w->oids, "%s\n", oids[i].c_str());
+	w->dirs++;
+	w->links += links;
+	w->queue.insert(w->queue.end(), subdirs.begin(), subdirs.end());
+	if ( !subdirs.empty() )
+		pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->mtx);
+
+out:
+	close(dfd);
+	if ( sfd >= 0 )
+		close(sfd);
+	if ( pfd >= 0 )
+		close(pfd);
+}
+
+void *wosfs_snap_worker(void *arg)
+{
+	struct wosfs_snap_walk *w = (struct wosfs_snap_walk *)arg;
+
+	pthread_mutex_lock(&w->mtx);
+	for (;;) {
+		while ( w->queue.empty() && w->active > 0 )
+			pthread_cond_wait(&w->cond, &w->mtx);
+		if ( w->queue.empty() )
+			break;
+		struct wosfs_snap_dir d = w->queue.back();
+		w->queue.pop_back();
+		w->active++;
+		pthread_mutex_unlock(&w->mtx);
+
+		wosfs_snap_walk_dir(w, d);
+
+		pthread_mutex_lock(&w->mtx);
+		if ( --w->active == 0 && w->queue.empty() )
+			pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->mtx);
+	return NULL;
+}
+
+/* remove dirfd/name and everything below it, without following symlinks */
+int wosfs_snap_remove(int dirfd, const char *name)
+{
+	int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	DIR *dp = fd < 0 ? NULL : fdopendir(fd);
+	struct dirent *de;
+
+	if ( NULL == dp ) {
+		if ( fd >= 0 )
+			close(fd);
+		return unlinkat(dirfd, name, 0);
+	}
+	fchmod(fd, 0700);	// a snapshot of a read-only directory
+	while ( (de = readdir(dp)) != NULL ) {
+		struct stat st;
+
+		if ( strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 )
+			continue;
+		if ( fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode) )
+			wosfs_snap_remove(fd, de->d_name);
+		else
+			unlinkat(fd, de->d_name, 0);
+	}
+	closedir(dp);
+	return unlinkat(dirfd, name, AT_REMOVEDIR);
+}
+
+typedef void (*wosfs_snap_visit_fn)(int dirfd, const char *name, const std::string& rel, const struct stat *st, void *arg);
+
+/* fn for everything but directories below dirfd/path, rel is the mount relative path of path */
+void wosfs_snap_visit(int dirfd, const char *path, const std::string& rel, wosfs_snap_visit_fn fn, void *arg)
+{
+	int fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	DIR *dp = fd < 0 ? NULL : fdopendir(fd);
+	struct dirent *de;
+
+	if ( NULL == dp ) {
+		if ( fd >= 0 )
+			close(fd);
+		return;
+	}
+	while ( (de = readdir(dp)) != NULL ) {
+		struct stat st;
+
+		if ( strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 ||
+		     fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 )
+			continue;
+		std::string sub = rel.empty() ? std::string(de->d_name) : rel + "/" + de->d_name;
+		if ( S_ISDIR(st.st_mode) )
+			wosfs_snap_visit(fd, de->d_name, sub, fn, arg);
+		else
+			fn(fd, de->d_name, sub, &st, arg);
+	}
+	closedir(dp);
+}
+
+/* the directories of one snapshot another one links to */
+struct wosfs_snap_links {
+	const char			*held;
+	std::vector<std::string>	rels;
+};
+
+static void wosfs_snap_find_links(int dirfd, const char *name, const std::string& rel, const struct stat *st, void *arg)
+{
+	struct wosfs_snap_links *links = (struct wosfs_snap_links *)arg;
+	char target[PATH_MAX];
+	std::string held;
+	ssize_t n;
+
+	if ( !S_ISLNK(st->st_mode) || (n = readlinkat(dirfd, name, target, sizeof(target) - 1)) < 0 )
+		return;
+	target[n] = '\0';
+	if ( wosfs_snap_ref_parse(target, rel.c_str(), &held) && held == links->held )
+		links->rels.push_back(rel);
+}
+
+/* the OIDs of stubs still held elsewhere, or all with all, to fp */
+struct wosfs_snap_keep {
+	FILE				*fp;
+	bool				all;
+};
+
+static void wosfs_snap_keep_oids(int dirfd, const char *name, const std::string& rel, const struct stat *st, void *arg)
+{
+	struct wosfs_snap_keep *keep = (struct wosfs_snap_keep *)arg;
+	std::vector<std::string> oids;
+
+	(void) rel;
+	if ( !S_ISREG(st->st_mode) || (!keep->all && st->st_nlink == 1) )
+		return;
+	int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW);
+	if ( fd < 0 )
+		return;
+	wosfs_snap_stub_oids(fd, oids);
+	close(fd);
+	for (size_t i = 0; i < oids.size(); i++)
+		fprintf(keep->fp, "%s\n", oids[i].c_str());
+}
+
+/* the snapshot that holds rel of snap, following what deletes left behind */
+static std::string wosfs_snap_holder(const std::string& snap, const std::string& rel)
+{
+	std::string held = snap, next;
+	char target[PATH_MAX];
+	ssize_t n;
+
+	for (size_t pos = rel.find('/'); ; pos = rel.find('/', pos + 1)) {
+		std::string part = rel.substr(0, pos);
+		n = readlinkat(wosfs_snap_fd, (held + "/" + part).c_str(), target, sizeof(target) - 1);
+		if ( n >= 0 ) {
+			target[n] = '\0';
+			if ( wosfs_snap_ref_parse(target, part.c_str(), &next) )
+				held = next;
+		}
+		if ( pos == std::string::npos )
+			return held;
+	}
+}
+
+/* objects in WOSFS_SNAP_DEFERRED no snapshot holds any more go back to the trash can */
+void wosfs_snap_release_deferred(void)
+{
+	std::string path = wosfs_snap_meta_path(WOSFS_SNAP_DEFERRED), tmp = path + ".tmp";
+	std::set<std::string> keep, gone;
+	char *line = NULL, magic[64], oid[41];
+	size_t len = 0;
+
+	pthread_mutex_lock(&wosfs_snap_oids_mtx);
+	FILE *fp = fopen(path.c_str(), "r");
+	if ( fp ) {
+		while ( getline(&line, &len, fp) != -1 ) {
+			if ( sscanf(line, "%63s %40s", magic, oid) == 2 )
+				(wosfs_snap_oids.count(wosfs_path_hash(oid)) ? keep : gone).insert(oid);
+		}
+		free(line);
+		fclose(fp);
+	}
+	if ( !gone.empty() ) {
+		fp = fopen(tmp.c_str(), "w");
+		for (std::set<std::string>::iterator it = keep.begin(); fp && it != keep.end(); ++it)
+			fprintf(fp, "%s %s 0\n", wosfs_conf.wosfs_magic, it->c_str());
+		if ( NULL == fp || fclose(fp) != 0 || rename(tmp.c_str(), path.c_str()) != 0 )
+			gone.clear();		// tried again by the next delete
+	}
+	pthread_mutex_unlock(&wosfs_snap_oids_mtx);
+	if ( gone.empty() )
+		return;
+
+	// purged by the next scan whatever the retention
+	std::string vtmp = std::string(wosfs_trashcan_path) + "/.WOS_snapshots" WOSFS_SNAP_TMP;
+	char trash_path[PATH_MAX];
+	fp = fopen(vtmp.c_str(), "w");
+	if ( NULL == fp ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: snapshot: %zu objects no snapshot holds left out of the trash can, errno=%d", gone.size(), errno);
+		return;
+	}
+	for (std::set<std::string>::iterator it = gone.begin(); it != gone.end(); ++it)
+		fprintf(fp, "%s %s 0\n", wosfs_conf.wosfs_magic, it->c_str());
+	fprintf(fp, WOSFS_TRASH_ORIG "%s\n", wosfs_snap_path);
+	fclose(fp);
+	if ( wosfs_trash_move(AT_FDCWD, vtmp.c_str(), "WOS_snapshots" WOSFS_TRASH_VERSIONS, trash_path) != 0 )
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: snapshot: objects no snapshot holds left in %s", vtmp.c_str());
+	wosfs_purge_start();
+}
+
+/* mkdir /.WOS_snapshots/<name> */
+int wosfs_snap_create(const char *name)
+{
+	struct wosfs_snap_walk w;
+	struct wosfs_snap_dir root;
+	struct wosfs_snap snap;
+	std::set<std::string> dirs, trees;
+	std::string prev;
+	uint64_t start_ns = wosfs_now_ns();
+	bool full, was_on;
+
+	if ( name[0] == '\0' || name[0] == '.' || strchr(name, '\n') )
+		return -EINVAL;
+	if ( wosfs_snap_fd < 0 )
+		return -EIO;
+
+	pthread_mutex_lock(&wosfs_snap_mtx);
+	if ( mkdirat(wosfs_snap_fd, name, 0700) != 0 ) {
+		int res = -errno;
+		pthread_mutex_unlock(&wosfs_snap_mtx);
+		return res;
+	}
+	for (size_t i = 0; i < wosfs_snaps.size(); i++)
+		w.taken[wosfs_snaps[i].name] = wosfs_snaps[i].taken;
+	if ( !wosfs_snaps.empty() )
+		prev = wosfs_snaps.back().name;
+
+	// what changes from now on is for the next snapshot
+	pthread_mutex_lock(&wosfs_snap_journal_mtx);
+	clock_gettime(CLOCK_REALTIME, &snap.taken);
+	full = wosfs_snap_full || prev.empty();
+	dirs.swap(wosfs_snap_dirs);
+	trees.swap(wosfs_snap_trees);
+	wosfs_snap_full = false;
+	was_on = wosfs_snap_on;
+	wosfs_snap_on = true;
+	wosfs_snap_journal_reset(name);
+	pthread_mutex_unlock(&wosfs_snap_journal_mtx);
+
+	// walk what was noted and the directories leading to it
+	for (int pass = 0; pass < 2; pass++) {
+		const std::set<std::string>& noted = pass ? trees : dirs;
+		for (std::set<std::string>::const_iterator it = noted.begin(); it != noted.end(); ++it) {
+			for (size_t slash = it->find('/'); slash != std::string::npos; slash = it->find('/', slash + 1))
+				w.touched.insert(it->substr(0, slash));
+			w.touched.insert(*it);
+		}
+	}
+	w.name = name;
+	w.trees = trees;
+	w.reflink = true;
+	w.active = 0;
+	w.error = 0;
+	w.dirs = w.links = w.captured = w.kept = 0;
+	pthread_mutex_init(&w.mtx, NULL);
+	pthread_cond_init(&w.cond, NULL);
+	w.oids = fopen(wosfs_snap_meta_path(w.name + ".oids").c_str(), "w");
+
+	root.held = full ? "" : prev;
+	if ( !full )
+		root.held_taken = w.taken[prev];
+	if ( NULL == w.oids || fstat(wosfs_root_fd, &root.st) != 0 )
+		w.error = errno;
+	else {
+		w.queue.push_back(root);
+
+		pthread_t threads[WOSFS_SNAP_MAX_THREADS];
+		int nthreads = 0, want = std::min(std::max(wosfs_conf.wosfs_snapshot_threads, 1), WOSFS_SNAP_MAX_THREADS);
+		while ( nthreads < want - 1 && pthread_create(&threads[nthreads], NULL, wosfs_snap_worker, &w) == 0 )
+			nthreads++;
+		wosfs_snap_worker(&w);
+		for (int i = 0; i < nthreads; i++)
+			pthread_join(threads[i], NULL);
+	}
+	if ( w.oids && fclose(w.oids) != 0 && 0 == w.error )
+		w.error = errno;
+	pthread_cond_destroy(&w.cond);
+	pthread_mutex_destroy(&w.mtx);
+
+	snap.name = name;
+	if ( 0 == w.error ) {
+		wosfs_snaps.push_back(snap);
+		if ( !wosfs_snap_write_dirs(wosfs_snap_meta_path(w.name + ".dirs"), dirs, trees, full) || !wosfs_snap_write_list() ) {
+			w.error = errno ? errno : EIO;
+			wosfs_snaps.pop_back();
+		}
+	}
+	if ( w.error ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: snapshot %s failed, errno=%d", name, w.error);
+		wosfs_snap_remove(wosfs_snap_fd, name);
+		unlink(wosfs_snap_meta_path(w.name + ".oids").c_str());
+		unlink(wosfs_snap_meta_path(w.name + ".dirs").c_str());
+
+		// the journal goes back to the last snapshot, with what was taken from it
+		pthread_mutex_lock(&wosfs_snap_journal_mtx);
+		wosfs_snap_dirs.insert(dirs.begin(), dirs.end());
+		wosfs_snap_trees.insert(trees.begin(), trees.end());
+		wosfs_snap_full = wosfs_snap_full || full;
+		wosfs_snap_on = was_on;
+		wosfs_snap_journal_reset(prev);
+		pthread_mutex_unlock(&wosfs_snap_journal_mtx);
+		wosfs_snap_load_oids();
+		pthread_mutex_unlock(&wosfs_snap_mtx);
+		return -w.error;
+	}
+
+	wosfs_snap_stats.taken++;
+	wosfs_snap_stats.last_ms = (wosfs_now_ns() - start_ns) / 1000000;
+	wosfs_snap_stats.dirs = w.dirs;
+	wosfs_snap_stats.links = w.links;
+	wosfs_snap_stats.captured = w.captured;
+	wosfs_snap_stats.kept = w.kept;
+	pthread_mutex_unlock(&wosfs_snap_mtx);
+
+	// deletes in the trash can from now on are checked against the snapshots
+	wosfs_purge_start();
+	syslog(LOG_INFO, "fusewos snapshot %s: %s walk of %lu directories in %lu ms, %lu linked to older snapshots, %lu stubs captured, %lu kept",
+		name, full ? "full" : "incremental", w.dirs, wosfs_snap_stats.last_ms, w.links, w.captured, w.kept);
+	return 0;
+}
+
+/* rmdir /.WOS_snapshots/<name> */
+int wosfs_snap_delete(const char *name)
+{
+	std::set<std::string> dirs, trees;
+	bool full = false;
+	size_t i;
+
+	if ( name[0] == '.' )
+		return -EPERM;		// WOSFS_SNAP_META
+	if ( wosfs_snap_fd < 0 )
+		return -EIO;
+
+	pthread_mutex_lock(&wosfs_snap_mtx);
+	for (i = 0; i < wosfs_snaps.size() && wosfs_snaps[i].name != name; i++)
+		;
+	if ( i == wosfs_snaps.size() ) {
+		// left by a snapshot cut short
+		int res = wosfs_snap_remove(wosfs_snap_fd, name) == 0 ? 0 : -errno;
+		pthread_mutex_unlock(&wosfs_snap_mtx);
+		return res;
+	}
+
+	// directories of it later snapshots link to move to the oldest of them
+	std::vector<std::pair<std::string, std::string> > moved;	// snapshot, rel
+	for (size_t j = i + 1; j < wosfs_snaps.size(); j++) {
+		struct wosfs_snap_links links;
+		const std::string& later = wosfs_snaps[j].name;
+
+		links.held = name;
+		wosfs_snap_visit(wosfs_snap_fd, later.c_str(), "", wosfs_snap_find_links, &links);
+		for (size_t k = 0; k < links.rels.size(); k++) {
+			const std::string& rel = links.rels[k];
+			std::string link = later + "/" + rel, held = wosfs_snap_holder(name, rel);
+			std::string parent = link.substr(0, link.rfind('/'));
+			struct stat pst;
+			bool ok, times = fstatat(wosfs_snap_fd, parent.c_str(), &pst, 0) == 0;
+
+			if ( held != name )
+				ok = unlinkat(wosfs_snap_fd, link.c_str(), 0) == 0 &&
+				     symlinkat(wosfs_snap_ref(held, rel).c_str(), wosfs_snap_fd, link.c_str()) == 0;
+			else {
+				std::string from = std::string(name) + "/" + rel;
+				ok = unlinkat(wosfs_snap_fd, link.c_str(), 0) == 0 &&
+				     renameat(wosfs_snap_fd, from.c_str(), wosfs_snap_fd, link.c_str()) == 0 &&
+				     symlinkat(wosfs_snap_ref(later, rel).c_str(), wosfs_snap_fd, from.c_str()) == 0;
+				if ( ok )
+					moved.push_back(std::make_pair(later, rel));
+			}
+			if ( times ) {
+				struct timespec ts[2] = { pst.st_atim, pst.st_mtim };
+				utimensat(wosfs_snap_fd, parent.c_str(), ts, 0);
+			}
+			if ( !ok ) {
+				int res = -errno;
+				WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: snapshot %s: failed to hand %s over to %s, errno=%d", name, rel.c_str(), later.c_str(), -res);
+				pthread_mutex_unlock(&wosfs_snap_mtx);
+				return res;
+			}
+		}
+	}
+
+	// the OIDs of what moved, and of stubs later snapshots or the live tree share, stay held
+	if ( i + 1 < wosfs_snaps.size() ) {
+		struct wosfs_snap_keep keep;
+		for (size_t k = 0; k < moved.size(); k++) {
+			keep.fp = fopen(wosfs_snap_meta_path(moved[k].first + ".oids").c_str(), "a");
+			keep.all = true;
+			if ( keep.fp ) {
+				wosfs_snap_visit(wosfs_snap_fd, (moved[k].first + "/" + moved[k].second).c_str(), moved[k].second, wosfs_snap_keep_oids, &keep);
+				fclose(keep.fp);
+			}
+		}
+		keep.fp = fopen(wosfs_snap_meta_path(wosfs_snaps[i + 1].name + ".oids").c_str(), "a");
+		keep.all = false;
+		if ( keep.fp ) {
+			wosfs_snap_visit(wosfs_snap_fd, name, "", wosfs_snap_keep_oids, &keep);
+			fclose(keep.fp);
+		}
+	}
+
+	int res = wosfs_snap_remove(wosfs_snap_fd, name) == 0 ? 0 : -errno;
+	if ( res ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: snapshot %s: failed to remove, errno=%d", name, -res);
+		pthread_mutex_unlock(&wosfs_snap_mtx);
+		return res;
+	}
+
+	// what was walked for it is walked again by the snapshot after it
+	wosfs_snap_read_dirs(wosfs_snap_meta_path(std::string(name) + ".dirs"), dirs, trees, &full, NULL, NULL);
+	if ( i + 1 < wosfs_snaps.size() ) {
+		std::string next = wosfs_snap_meta_path(wosfs_snaps[i + 1].name + ".dirs");
+		wosfs_snap_read_dirs(next, dirs, trees, &full, NULL, NULL);
+		wosfs_snap_write_dirs(next, dirs, trees, full);
+	}
+	else {
+		pthread_mutex_lock(&wosfs_snap_journal_mtx);
+		wosfs_snap_dirs.insert(dirs.begin(), dirs.end());
+		wosfs_snap_trees.insert(trees.begin(), trees.end());
+		wosfs_snap_full = wosfs_snap_full || full;
+		wosfs_snap_journal_reset(i > 0 ? wosfs_snaps[i - 1].name : "");
+		wosfs_snap_on = i > 0;
+		pthread_mutex_unlock(&wosfs_snap_journal_mtx);
+	}
+	unlink(wosfs_snap_meta_path(std::string(name) + ".oids").c_str());
+	unlink(wosfs_snap_meta_path(std::string(name) + ".dirs").c_str());
+	wosfs_snaps.erase(wosfs_snaps.begin() + i);
+	if ( !wosfs_snap_write_list() )
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: snapshot: failed to write the list, errno=%d", errno);
+
+	wosfs_snap_load_oids();
+	wosfs_snap_release_deferred();
+	wosfs_snap_stats.deleted++;
+	pthread_mutex_unlock(&wosfs_snap_mtx);
+
+	// moved directories: cached handles below the snapshots may name other paths
+	wosfs_dirfd_invalidate(WOSFS_SNAP_NAME);
+	wosfs_attr_invalidate_tree(WOSFS_SNAP_NAME);
+	syslog(LOG_INFO, "fusewos snapshot %s deleted, %zu directories handed over", name, moved.size());
+	return 0;
+}
+
+/* from wosfs_setup(): the snapshot directory, the list and the journal */
+void wosfs_snap_init(void)
+{
+	std::set<std::string> dirs, trees;
+	std::string base;
+	bool full = false, clean = false;
+
+	wosfs_snap_path = (char *)malloc(wosfs_path_len + sizeof(WOSFS_SNAP_NAME));
+	if ( NULL == wosfs_snap_path )
+		return;
+	strcpy(wosfs_snap_path, wosfs_conf.wosfs_path);
+	strcpy(wosfs_snap_path + wosfs_path_len, WOSFS_SNAP_NAME);
+	mkdir(wosfs_snap_path, 0755);
+	mkdir((std::string(wosfs_snap_path) + "/" WOSFS_SNAP_META).c_str(), 0700);
+	wosfs_snap_fd = open(wosfs_snap_path, O_RDONLY | O_DIRECTORY);
+	if ( wosfs_snap_fd < 0 ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to open %s, no snapshots, errno=%d", wosfs_snap_path, errno);
+		return;
+	}
+
+	FILE *fp = fopen(wosfs_snap_meta_path(WOSFS_SNAP_LIST).c_str(), "r");
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t n;
+	while ( fp && (n = getline(&line, &len, fp)) != -1 ) {
+		struct wosfs_snap snap;
+		long long sec;
+		int off = 0;
+
+		if ( n > 0 && line[n - 1] == '\n' )
+			line[n - 1] = '\0';
+		if ( sscanf(line, "%lld %ld %n", &sec, &snap.taken.tv_nsec, &off) < 2 || off == 0 )
+			continue;
+		snap.taken.tv_sec = sec;
+		snap.name = line + off;
+		wosfs_snaps.push_back(snap);
+	}
+	free(line);
+	if ( fp )
+		fclose(fp);
+
+	pthread_mutex_lock(&wosfs_snap_journal_mtx);
+	if ( !wosfs_snaps.empty() ) {
+		wosfs_snap_on = true;
+		wosfs_snap_load_oids();
+		if ( !wosfs_snap_read_dirs(wosfs_snap_meta_path(WOSFS_SNAP_JOURNAL), dirs, trees, &full, &base, &clean) ||
+		     !clean || base != wosfs_snaps.back().name ) {
+			syslog(LOG_INFO, "fusewos snapshot: journal since %s incomplete, the next snapshot walks the whole tree", wosfs_snaps.back().name.c_str());
+			full = true;
+		}
+		wosfs_snap_dirs.swap(dirs);
+		wosfs_snap_trees.swap(trees);
+		wosfs_snap_full = full;
+	}
+	wosfs_snap_journal_reset(wosfs_snaps.empty() ? "" : wosfs_snaps.back().name);
+	pthread_mutex_unlock(&wosfs_snap_journal_mtx);
+}
+
+/* from wosfs_destroy(): the journal is complete */
+void wosfs_snap_stop(void)
+{
+	pthread_mutex_lock(&wosfs_snap_journal_mtx);
+	if ( wosfs_snap_journal ) {
+		fputs("clean\n", wosfs_snap_journal);
+		fclose(wosfs_snap_journal);
+		wosfs_snap_journal = NULL;
+	}
+	pthread_mutex_unlock(&wosfs_snap_journal_mtx);
+}
+#endif
+
+/* 
+ *  wosfs_xxx functions
+ */
+
+/*
+ *  /.WOSFS_stats
+ *
+ *  A read-only file at the mount root that does not exist in the backing
+ *  tree.  open renders the statistics once into a buffer kept in fi->fh,
+ *  so a reader sees one consistent snapshot; the file reports size 0 and
+ *  is opened with direct_io so that it is read to the end regardless.
+ *
+ *  Format, one record per line, fields separated by spaces:
+ *    uptime_ns <n>
+ *    op <name> count <n> errors <n> sum_ns <n> max_ns <n> p50_ns <n> p90_ns <n> p99_ns <n> p999_ns <n>
+ *    hist <name> <lower bound ns>:<count> ...
+ *    counter <name> <n>
+ *  Percentiles are the lower bound of the histogram bucket they fall in.
+ */
+
+#define WOSFS_STATS_NAME	"/.WOSFS_stats"
+
+static inline bool wosfs_is_stats_file(const char *path)
+{
+	return path[1] == '.' && strcmp(path, WOSFS_STATS_NAME) == 0;
+}
+
+void wosfs_stats_append(std::string *out, const char *fmt, ...)
+{
+	char line[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	int len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	out->append(line, std::min(len, (int)sizeof(line) - 1));
+}
+
+uint64_t wosfs_hist_pctl(const struct wosfs_op_stats *st, uint64_t per_mille)
+{
+	uint64_t rank = (st->count * per_mille + 999) / 1000;
+	uint64_t seen = 0;
+
+	for (int b = 0; b < WOSFS_HIST_BUCKETS; b++) {
+		seen += st->hist[b];
+		if ( seen >= rank && seen > 0 )
+			return wosfs_hist_lower(b);
+	}
+	return 0;
+}
+
+std::string *wosfs_stats_render(void)
+{
+	struct wosfs_op_stats *sum = (struct wosfs_op_stats *)calloc(WOSFS_ST_MAX, sizeof(struct wosfs_op_stats));
+	uint64_t phase[WOSFS_ST_WOS_GETSPAN][WOSFS_PH_MAX];
+	uint64_t slow_ops = 0;
+	std::string *out = new std::string;
+
+	if ( NULL == sum )
+		return out;
+
+	memset(phase, 0, sizeof(phase));
+	pthread_mutex_lock(&lock_stats);
+	for (struct wosfs_thread_stats *ts = wosfs_stats_head; ts; ts = ts->next) {
+		for (int id = 0; id < WOSFS_ST_WOS_GETSPAN; id++)
+			for (int ph = 0; ph < WOSFS_PH_MAX; ph++)
+				phase[id][ph] += ts->phase_sum_ns[id][ph];
+		slow_ops += ts->slow_ops;
+		for (int id = 0; id < WOSFS_ST_MAX; id++) {
+			const struct wosfs_op_stats *st = &ts->ops[id];
+
+			sum[id].count += st->count;
+			sum[id].errors += st->errors;
+			sum[id].sum_ns += st->sum_ns;
+			sum[id].max_ns = std::max(sum[id].max_ns, st->max_ns);
+			for (int b = 0; b < WOSFS_HIST_BUCKETS; b++)
+				sum[id].hist[b] += st->hist[b];
+		}
+	}
+	pthread_mutex_unlock(&lock_stats);
+
+	wosfs_stats_append(out, "uptime_ns %lu\n", wosfs_now_ns() - wosfs_stats_start_ns);
+	for (int id = 0; id < WOSFS_ST_MAX; id++) {
+		const struct wosfs_op_stats *st = &sum[id];
+
+		if ( 0 == st->count )
+			continue;
+		wosfs_stats_append(out, "op %s count %lu errors %lu sum_ns %lu max_ns %lu p50_ns %lu p90_ns %lu p99_ns %lu p999_ns %lu\n",
+			wosfs_stat_names[id], st->count, st->errors, st->sum_ns, st->max_ns,
+			wosfs_hist_pctl(st, 500), wosfs_hist_pctl(st, 900), wosfs_hist_pctl(st, 990), wosfs_hist_pctl(st, 999));
+		out->append("hist ");
+		out->append(wosfs_stat_names[id]);
+		for (int b = 0; b < WOSFS_HIST_BUCKETS; b++)
+			if ( st->hist[b] )
+				wosfs_stats_append(out, " %lu:%lu", wosfs_hist_lower(b), st->hist[b]);
+		out->append("\n");
+	}
+
+	// where the callbacks spent their time, and by tier
+	uint64_t tier_meta = 0, tier_wos = 0, tier_local = 0, tier_other = 0;
+	for (int id = 0; id < WOSFS_ST_WOS_GETSPAN; id++) {
+		uint64_t charged = 0;
+
+		if ( 0 == sum[id].count )
+			continue;
+		out->append("phase ");
+		out->append(wosfs_stat_names[id]);
+		for (int ph = 0; ph < WOSFS_PH_MAX; ph++) {
+			wosfs_stats_append(out, " %s_ns %lu", wosfs_phase_names[ph], phase[id][ph]);
+			charged += phase[id][ph];
+		}
+		uint64_t other = sum[id].sum_ns > charged ? sum[id].sum_ns - charged : 0;
+		wosfs_stats_append(out, " other_ns %lu\n", other);
+
+		tier_meta += phase[id][WOSFS_PH_LOOKUP] + phase[id][WOSFS_PH_STUB];
+		tier_wos += phase[id][WOSFS_PH_WOS_OPEN] + phase[id][WOSFS_PH_WOS_IO] + phase[id][WOSFS_PH_WAIT];
+		tier_local += phase[id][WOSFS_PH_COPY] + phase[id][WOSFS_PH_CACHE];
+		tier_other += other;
+	}
+	wosfs_stats_append(out, "tier metadata_ns %lu object_ns %lu local_ns %lu other_ns %lu\n",
+		tier_meta, tier_wos, tier_local, tier_other);
+	free(sum);
+
+	wosfs_stats_append(out, "counter reads %lu\n", wosfs_coalesce.reads);
+	wosfs_stats_append(out, "counter getspan_issued %lu\n", wosfs_coalesce.fetches);
+	wosfs_stats_append(out, "counter reads_coalesced %lu\n", wosfs_coalesce.coalesced);
+	wosfs_stats_append(out, "counter hedges %lu\n", wosfs_hedge.hedges);
+	wosfs_stats_append(out, "counter hedge_wins %lu\n", wosfs_hedge.hedge_wins);
+	wosfs_stats_append(out, "counter sbufs_allocated %lu\n", wosfs_sbufs.allocated);
+	wosfs_stats_append(out, "counter sbufs_throttled %lu\n", wosfs_sbufs.waits);
+	wosfs_stats_append(out, "counter sbufs_unbuffered %lu\n", wosfs_sbufs.fallbacks);
+	wosfs_stats_append(out, "counter attr_hits %lu\n", wosfs_attr_hits);
+	wosfs_stats_append(out, "counter attr_misses %lu\n", wosfs_attr_misses);
+	wosfs_stats_append(out, "counter attr_entries %ld\n", wosfs_attr_count);
+	wosfs_stats_append(out, "counter open_streams %d\n", wosclient_pool_count);
+	wosfs_stats_append(out, "counter trace_on %d\n", (int)wosfs_trace_on);
+	wosfs_stats_append(out, "counter trace_drops %lu\n", wosfs_trace_drops);
+	wosfs_stats_append(out, "counter slow_ops %lu\n", slow_ops);
+#ifdef WOSFS_FEATURE_TRASHCAN
+	pthread_mutex_lock(&wosfs_purge.mtx);
+	wosfs_stats_append(out, "counter purge_files %lu\n", wosfs_purge.files);
+	wosfs_stats_append(out, "counter purge_objects %lu\n", wosfs_purge.objects);
+	wosfs_stats_append(out, "counter purge_bytes %lu\n", wosfs_purge.bytes);
+	wosfs_stats_append(out, "counter purge_errors %lu\n", wosfs_purge.errors);
+	wosfs_stats_append(out, "counter purge_inflight %d\n", wosfs_purge.inflight);
+	wosfs_stats_append(out, "counter purge_objects_per_sec %lu\n", wosfs_purge.rate);
+	wosfs_stats_append(out, "counter purge_backlog_files %lu\n", wosfs_purge.backlog_files);
+	wosfs_stats_append(out, "counter purge_backlog_bytes %lu\n", wosfs_purge.backlog_bytes);
+	wosfs_stats_append(out, "counter purge_backlog_buckets %lu\n", wosfs_purge.backlog_buckets);
+	pthread_mutex_unlock(&wosfs_purge.mtx);
+	pthread_mutex_lock(&wosfs_compact_mtx);
+	wosfs_stats_append(out, "counter compact_queue %zu\n", wosfs_compact_queue.size());
+	pthread_mutex_unlock(&wosfs_compact_mtx);
+	wosfs_stats_append(out, "counter compact_stubs %lu\n", wosfs_compact_stubs);
+	wosfs_stats_append(out, "counter compact_versions %lu\n", wosfs_compact_versions);
+	wosfs_stats_append(out, "counter compact_skipped %lu\n", wosfs_compact_skipped);
+#endif
+#ifdef WOSFS_FEATURE_SNAPSHOTS
+	// not under wosfs_snap_mtx, held for as long as a snapshot takes
+	wosfs_stats_append(out, "counter snapshots %zu\n", wosfs_snaps.size());
+	wosfs_stats_append(out, "counter snapshots_taken %lu\n", wosfs_snap_stats.taken);
+	wosfs_stats_append(out, "counter snapshots_deleted %lu\n", wosfs_snap_stats.deleted);
+	wosfs_stats_append(out, "counter snapshot_last_ms %lu\n", wosfs_snap_stats.last_ms);
+	wosfs_stats_append(out, "counter snapshot_last_dirs %lu\n", wosfs_snap_stats.dirs);
+	wosfs_stats_append(out, "counter snapshot_last_links %lu\n", wosfs_snap_stats.links);
+	wosfs_stats_append(out, "counter snapshot_last_captured %lu\n", wosfs_snap_stats.captured);
+	wosfs_stats_append(out, "counter snapshot_last_kept %lu\n", wosfs_snap_stats.kept);
+	pthread_mutex_lock(&wosfs_snap_oids_mtx);
+	wosfs_stats_append(out, "counter snapshot_held_oids %zu\n", wosfs_snap_oids.size());
+	wosfs_stats_append(out, "counter snapshot_deferred %lu\n", wosfs_snap_deferred);
+	pthread_mutex_unlock(&wosfs_snap_oids_mtx);
+	wosfs_stats_append(out, "counter snapshot_unshared %lu\n", wosfs_snap_unshared);
+#endif
+
+	return out;
+}
+
+void wosfs_stats_getattr(struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_mode = S_IFREG | 0444;
+	stbuf->st_nlink = 1;
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+}
+
+int wosfs_stats_open(struct fuse_file_info *fi)
+{
+	if ( (fi->flags & O_ACCMODE) != O_RDONLY )
+		return -EACCES;
+
+	fi->fh = (uintptr_t) wosfs_stats_render();
+	fi->direct_io = 1;
+	return 0;
+}
+
+int wosfs_stats_read(struct fuse_file_info *fi, char *buf, size_t size, off_t offset)
+{
+	std::string *snap = (std::string *)(uintptr_t) fi->fh;
+
+	if ( (uint64_t)offset >= snap->size() )
+		return 0;
+	size = std::min(size, snap->size() - offset);
+	memcpy(buf, snap->data() + offset, size);
+	return size;
+}
+
+void wosfs_stats_release(struct fuse_file_info *fi)
+{
+	delete (std::string *)(uintptr_t) fi->fh;
+}
+
+static int wosfs_getattr(const char *path, struct stat *stbuf)
+{
+	WOSFS_OP_SCOPE(WOSFS_ST_GETATTR, path);
+	int res = -ENOENT;
+	struct wosfs_req *req = wosfs_req_begin();
+	char *path2 = req->path;
+
+	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s, size=%d", path, stbuf->st_size)
+
+	if ( wosfs_is_stats_file(path) ) {
+		wosfs_stats_getattr(stbuf);
+		return 0;
+	}
+
+	res = wosfs_fix_path(path, path2);
+	if (res)
+		return res;
+
+	if ( wosfs_attr_lookup(path, stbuf) )
+		return 0;
+
+	const char *name;
+	struct wosfs_dirfd *dir = wosfs_dirfd_get(path, &name);
+	if ( NULL == dir )
+		return -errno;
+
+        res = fstatat(dir->fd, name, stbuf, AT_SYMLINK_NOFOLLOW);
+        if (res == -1) {
+		res = -errno;
+		wosfs_dirfd_put(dir);
+		return res;
+	}
+	wosfs_snap_stat_fix(dir->fd, name, path, stbuf);
+
+        if (S_ISREG(stbuf->st_mode)) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: path2=%s, size=%d, res=%d", path2, stbuf->st_size, res);
+
+                struct wosobj_info wosobj_info;
+                memset(&wosobj_info, 0, sizeof(struct wosobj_info));
+                if ( wosobj_info_last_at(dir->fd, name, &wosobj_info) == true )
+	                stbuf->st_size = wosobj_info.obj_len;
+        }
+	wosfs_dirfd_put(dir);
+	wosfs_attr_store(path, stbuf);
+
+	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: OUT : path2=%s, size=%d, res=%d", path2, stbuf->st_size, res);
+
+	return res;
+}
+
+static int wosfs_access(const char *path, int mask)
+{
+	WOSFS_OP_SCOPE_RANGE(WOSFS_ST_ACCESS, path, 0, mask);
+	int res = -ENOENT;
+	struct wosfs_req *req = wosfs_req_begin();
+	char *path2 = req->path;
+
+        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
+
+     	res = wosfs_fix_path(path, path2);
+	if (res)
+		return res;
+
+	const char *name;
+	struct wosfs_dirfd *dir = wosfs_dirfd_get(path, &name);
+	if ( NULL == dir )
+		return -errno;
+
+	if ( (mask & W_OK) && wosfs_in_snapshots(path) )
+		res = -1, errno = EROFS;
+	else
+		res = faccessat(dir->fd, name, mask, 0);
+	if (res == -1)
+		res = -errno;
+	wosfs_dirfd_put(dir);
+	if (res)
+		return res;
+
+        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: OUT : path2=%s, res=%d", path2, res);
+
+	return res;
+}
+
+static int wosfs_readlink(const char *path, char *buf, size_t size)
+{
+	WOSFS_OP_SCOPE(WOSFS_ST_READLINK, path);
+	int res = -ENOENT;
+	struct wosfs_req *req = wosfs_req_begin();
+	char *path2 = req->path;
+
+	memset(buf, 0, size-1);
+
+        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s, size=%d", path, size);
+        res = wosfs_fix_path(path, path2);
+	if (res)
+		return res;
+
+	const char *name;
+	struct wosfs_dirfd *dir = wosfs_dirfd_get(path, &name);
+	if ( NULL == dir )
+		return -errno;
+
+        res = readlinkat(dir->fd, name, buf, size - 1);
+        if (res == -1)
+                res = -errno;
+	wosfs_dirfd_put(dir);
+        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: path2=%s, buf=%s, size-1=%d, res=%d", path2, buf, size-1, res);
+        if (res < 0)
+                return res;
+
+        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: OUT : path2=%s, res=%d", path2, res);
+
+        return 0;
+}
+
+/*
+ * An open directory keeps its DIR* and the current batch of entries in
+ * fi->fh, so that each readdir call picks up where the previous one
+ * stopped instead of listing the directory from the start.  Offsets
+ * handed to the filler are telldir() cookies; a seek by the kernel
+ * (rewinddir, NFS export) is a seekdir() and drops the batch.
+ */
+struct wosfs_dirp {
+	DIR				*dp;
+	off_t				offset;		// cookie of ents[next]
+	struct wosfs_dirent_attr	*ents;
+	int				count;
+	int				next;
+};
+
+static inline struct wosfs_dirp *wosfs_get_dirp(struct fuse_file_info *fi)
+{
+	return (struct wosfs_dirp *) (uintptr_t) fi->fh;
+}
+
+static int wosfs_opendir(const char *path, struct fuse_file_info *fi)
+{
+	WOSFS_OP_SCOPE(WOSFS_ST_OPENDIR, path);
+	int res = -ENOENT;
+	struct wosfs_req *req = wosfs_req_begin();
+	char *path2 = req->path;
+
+        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
+        res = wosfs_fix_path(path, path2);
+	if (res)
+		return res;
+
+	struct wosfs_dirp *d = (struct wosfs_dirp *)malloc(sizeof(struct wosfs_dirp));
+	if ( NULL == d )
+		return -ENOMEM;
+	memset(d, 0, sizeof(struct wosfs_dirp));
+
+	const char *name;
+	struct wosfs_dirfd *dir = wosfs_dirfd_get(path, &name);
+	if ( NULL == dir ) {
+		res = -errno;
+		free(d);
+		return res;
+	}
+
+	int fd = openat(dir->fd, name, O_RDONLY | O_DIRECTORY);
+	res = -errno;
+	wosfs_dirfd_put(dir);
+	if (fd < 0) {
+		free(d);
+		return res;
+	}
+
+        d->dp = fdopendir(fd);
+        if (d->dp == NULL) {
+		res = -errno;
+		close(fd);
+		free(d);
+                return res;
+	}
+
+	fi->fh = (unsigned long) d;
+	return 0;
+}
+
+static int wosfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		       off_t offset, struct fuse_file_info *fi)
+{
+	WOSFS_OP_SCOPE(WOSFS_ST_READDIR, path);
+	struct wosfs_dirp *d = wosfs_get_dirp(fi);
+        struct dirent *de;
+
+        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s, offset=%ld", path, (long)offset);
+
+	if (offset != d->offset) {
+		seekdir(d->dp, offset);
+		d->count = d->next = 0;
+		d->offset = offset;
+	}
+
+	if ( NULL == d->ents ) {
+		d->ents = (struct wosfs_dirent_attr *)malloc(WOSFS_READDIR_BATCH * sizeof(struct wosfs_dirent_attr));
+		if ( NULL == d->ents )
+			return -ENOMEM;
+	}
+
+	for (;;) {
+		if ( d->next == d->count ) {
+			d->count = d->next = 0;
+        		while ( d->count < WOSFS_READDIR_BATCH && (de = readdir(d->dp)) != NULL ) {
+				struct wosfs_dirent_attr *ent = &d->ents[d->count++];
+				strcpy(ent->name, de->d_name);
+				memset(&ent->st, 0, sizeof(ent->st));
+				ent->st.st_ino = de->d_ino;
+				ent->st.st_mode = de->d_type << 12;
+				ent->off = telldir(d->dp);
+				ent->valid = false;
+			}
+			if ( d->count == 0 )
+				break;
+
+			// full attributes, so that the getattr calls after an `ls -l` hit the attribute cache
+			wosfs_readdir_batch(dirfd(d->dp), path, d->ents, d->count);
+		}
+
+		struct wosfs_dirent_attr *ent = &d->ents[d->next];
+		if (filler(buf, ent->name, &ent->st, ent->off))
+			break;		// reply buffer full, resume from ent next time
+
+		d->offset = ent->off;
+		d->next++;
+        }
+
+        return 0;
+}
+
+static int wosfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	WOSFS_OP_SCOPE(WOSFS_ST_RELEASEDIR, path);
+	struct wosfs_dirp *d = wosfs_get_dirp(fi);
+
+	(void) path;
+	closedir(d->dp);
+	free(d->ents);
+	free(d);
+
+	return 0;
+}
+
+static int wosfs_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	WOSFS_OP_SCOPE_RANGE(WOSFS_ST_MKNOD, path, 0, mode);
+	int res = -ENOENT;
+	struct wosfs_req *req = wosfs_req_begin();
+	char *path2 = req->path;
+
+        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
+        res = wosfs_fix_path(path, path2);
+	if (res)
+		return res;
+	if ( wosfs_in_snapshots(path) )
+		return -EROFS;
+
+	const char *name;
+	struct wosfs_dirfd *dir = wosfs_dirfd_get(path, &name);
+	if ( NULL == dir )
+		return -errno;
+
+        /* On Linux this could just be 'mknod(path, mode, rdev)' but this
+           is more portable */
+        if (S_ISREG(mode)) {
+                res = openat(dir->fd, name, O_CREAT | O_EXCL | O_WRONLY, mode);
+                if (res >= 0)
+                        res = close(res);
+        } else if (S_ISFIFO(mode))
+                res = mkfifoat(dir->fd, name, mode);
+        else   
+                res = mknodat(dir->fd, name, mode, rdev);
+        if (res == -1)
+                res = -errno;
+	wosfs_dirfd_put(dir);
+        if (res)
+                return res;
+	wosfs_attr_invalidate_parent(path);
+	wosfs_snap_dirty(path);
+
+        return 0;
+}
+
+static int wosfs_mkdir(const char *path, mode_t mode)
+{
+	WOSFS_OP_SCOPE_RANGE(WOSFS_ST_MKDIR, path, 0, mode);
+	int res = -ENOENT;
+	struct wosfs_req *req = wosfs_req_begin();
+	char *path2 = req->path;
+
+        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
+        res = wosfs_fix_path(path, path2);
+	if (res)
+		return res;
+#ifdef WOSFS_FEATURE_SNAPSHOTS
+	if ( wosfs_snap_top(path) ) {
+		res = wosfs_snap_create(wosfs_snap_top(path));
+		if ( 0 == res )
+			wosfs_attr_invalidate_parent(path);
+		return res;
+	}
+#endif
+	if ( wosfs_in_snapshots(path) )
+		return -EROFS;
+
+	const char *name;
+	struct wosfs_dirfd *dir = wosfs_dirfd_get(path, &name);
+	if ( NULL == dir )
+		return -errno;
+
+        res = mkdirat(dir->fd, name, mode);
+        if (res == -1)
+                res = -errno;
+	wosfs_dirfd_put(dir);
+        if (res)
+                return res;
+	wosfs_attr_invalidate_parent(path);
+	wosfs_snap_dirty(path);
+
+        if ( wosfs_conf.wosfs_bak_path ) {
+                int res2;
+                char *tgt_path = req->path_bak;
+
+                res2 = wosfs_fix_bak_path(path, tgt_path);
+                WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: OUT : make new directory in backup path: path=%s, tgt_path=%s", path, tgt_path);
+
+                if (res2 == 0)
+                	res2 = mkdir(tgt_path, mode);
+                if (res2 != 0) {
+                        WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: OUT : failed to make directory path=%s", tgt_path);
+                }
+        }
+
+        return 0;
+}
+
+static int wosfs_unlink(const char *path)
+{
+	WOSFS_OP_SCOPE(WOSFS_ST_UNLINK, path);
+	int res = -ENOENT;
+	struct wosfs_req *req = wosfs_req_begin();
+	char *path2 = req->path;
+
+        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
+        res = wosfs_fix_path(path, path2);
+	if (res)
+		return res;
+	if ( wosfs_in_snapshots(path) )
+		return -EROFS;
+
+        struct stat stbuf;
+	const char *name;
+	struct wosfs_dirfd *dir = wosfs_dirfd_get(path, &name);
+	if ( NULL == dir )
+		return -errno;
+
+        res = fstatat(dir->fd, name, &stbuf, AT_SYMLINK_NOFOLLOW);
+	// a stub a snapshot shares is trashed as a copy of its own
+	if ( res == 0 && S_ISREG(stbuf.st_mode) && stbuf.st_nlink > 1 ) {
+		wosfs_stub_unshare_at(dir->fd, name);
+		res = fstatat(dir->fd, name, &stbuf, AT_SYMLINK_NOFOLLOW);
+	}
+        if (res == -1) {
+                res = -errno;
+		wosfs_dirfd_put(dir);
+                return res;
+	}
+
+        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s, path2=%s", path, path2);
+
+        if (S_ISREG(stbuf.st_mode) && stbuf.st_nlink == 1) {
+#ifdef WOSFS_FEATURE_TRASHCAN
+		if ( strncmp( path2, wosfs_trashcan_path, strlen(wosfs_trashcan_path)) == 0 ) {
+ 			// find all OIDs in the stub file and delete them from WOS core, then delete the local stub file and return.	
+			struct wosobj_oid_list_entry *wosobj_oids = wosobj_oid_entry_new(req);
+			if ( NULL == wosobj_oids ) {
+				wosfs_dirfd_put(dir);
+				return -ENOMEM;
+			}
+
+			if ( true == wosobj_get_oid_list(path2, wosobj_oids, req) ) {
+				struct wosobj_oid_list_entry *woid = wosobj_oids;
+				do {
+#ifdef WOSFS_FEATURE_SNAPSHOTS
+					if ( woid->oid[0] != '\0' && wosfs_snap_holds(woid->oid) )
+						wosfs_snap_defer(woid->oid);
+					else
+#endif
+					if ( woid->oid[0] != '\0'  ) {
+						WosStatus status;
+        			                WosOID oid(woid->oid);
+                        			WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: path=%s, oid=%s", path2, oid.c_str());
+						uint64_t start_ns = wosfs_wos_begin(WOSFS_ST_WOS_DELETE, 0, 0);
+	                        		wos_b.wos->Delete(status, oid);
+						wosfs_stat_record(WOSFS_ST_WOS_DELETE, start_ns, status);
+                        			if (status != ok) {
+                                			WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to delete oid: %s,  delete status=%s", woid->oid, status.ErrMsg().c_str());
+                        			}
+					}
+					woid = woid->next;		
+				} while ( woid != NULL );	
+			}
+			wosobj_oid_list_free(wosobj_oids);
+		}
+		else {
+        		char *trash_path = req->path_to;
+
+			int fd = wosfs_stub_open_locked(dir->fd, name, O_WRONLY | O_APPEND);
+		        FILE * fp = fd < 0 ? NULL : fdopen(fd, "a");
+        		if ( NULL == fp ) {
+                		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: OUT : failed to open file.  path=%s", path);
+				res = -errno;
+				if ( fd >= 0 )
+					close(fd);
+				wosfs_dirfd_put(dir);
+                		return res;
+        		}
+
+        		fprintf(fp, WOSFS_TRASH_ORIG "%s\n", path2);
+        		fclose(fp);
+
+			res = wosfs_trash_move(dir->fd, name, name, trash_path);
+			wosfs_dirfd_put(dir);
+			if ( res )
+				return res;
+			WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: path2=%s, trash_path=%s", path2, trash_path);	
+			wosfs_notify_inval_entry(path);
+			wosfs_snap_dirty(path);
+
+			return 0;
+		}
+#else
+                struct wosobj_info wosobj_info;
+                memset(&wosobj_info, 0, sizeof(struct wosobj_info));
+                if ( wosobj_info_last(path2, &wosobj_info) == false) {
+                        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: failed to read from file: %s", path2);
+                }
+                else {
+                        WosStatus status;
+                        WosOID oid(wosobj_info.oid);
+			uint64_t start_ns = wosfs_wos_begin(WOSFS_ST_WOS_DELETE, 0, 0);
+                        wos_b.wos->Delete(status, oid);
+			wosfs_stat_record(WOSFS_ST_WOS_DELETE, start_ns, status);
+                        if (status != ok) {
+                                WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to delete oid: %s,  delete status=%s", wosobj_info.oid, status.ErrMsg().c_str());
+                        }
+                        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: path=%s, oid=%s", path2, wosobj_info.oid);
+                }
+#endif
+        }
+        res = unlinkat(dir->fd, name, 0);
+        if (res == -1)
+                res = -errno;
+	wosfs_dirfd_put(dir);
+	wosfs_notify_inval_entry(path);
+	if ( 0 == res )
+		wosfs_snap_dirty(path);
+
+        return res;
+}
+
+static int wosfs_rmdir(const char *path)
+{
+	WOSFS_OP_SCOPE(WOSFS_ST_RMDIR, path);
+	int res = -ENOENT;
+	struct wosfs_req *req = wosfs_req_begin();
+	char *path2 = req->path;
+
+        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
+        res = wosfs_fix_path(path, path2);
+	if (res)
+		return res;
+#ifdef WOSFS_FEATURE_SNAPSHOTS
+	if ( wosfs_snap_top(path) ) {
+		res = wosfs_snap_delete(wosfs_snap_top(path));
+		if ( 0 == res ) {
+			wosfs_attr_invalidate_parent(path);
+			wosfs_notify_inval_entry(path);
+		}
+		return res;
+	}
+#endif
+	if ( wosfs_in_snapshots(path) )
+		return -EROFS;
+
+	const char *name;
+	struct wosfs_dirfd *dir = wosfs_dirfd_get(path, &name);
+	if ( NULL == dir )
+		return -errno;
+
+        res = unlinkat(dir->fd, name, AT_REMOVEDIR);
+        if (res == -1)
+                res = -errno;
+	wosfs_dirfd_put(dir);
+        if (res)
+                return res;
+
+	wosfs_dirfd_invalidate(path);
+	wosfs_attr_invalidate(path);
+	wosfs_attr_invalidate_parent(path);
+	wosfs_snap_dirty(path);
+
+        return 0;
+}
+
+static int wosfs_symlink(const char *from, const char *to)
+{
+	WOSFS_OP_SCOPE2(WOSFS_ST_SYMLINK, to, from);
+	int res = -ENOENT;
+	struct wosfs_req *req = wosfs_req_begin();
+	char *to2 = req->path_to;
+
+	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: from=%s, to=%s", from, to);
+
+        res = wosfs_fix_path(to, to2);
+	if (res)
+		return res;
+	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: from=%s, to2=%s", from, to2);
+	if ( wosfs_in_snapshots(to) )
+		return -EROFS;
+
+	const char *name;
+	struct wosfs_dirfd *dir = wosfs_dirfd_get(to, &name);
+	if ( NULL == dir )
+		return -errno;
+
+        res = symlinkat(from, dir->fd, name);
+        if (res == -1)
+                res = -errno;
+	wosfs_dirfd_put(dir);
+        if (res) {
+                WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to make link from from=%s to to=%s", from, to);
+                return res;
+        }
+	wosfs_attr_invalidate_parent(to);
+	wosfs_snap_dirty(to);
+        
+        return res;
+}
+
+static int wosfs_rename(const char *from, const char *to)
+{
+	WOSFS_OP_SCOPE2(WOSFS_ST_RENAME, from, to);
+	int res = -ENOENT;
+	struct wosfs_req *req = wosfs_req_begin();
+	char *from2 = req->path;
+	char *to2 = req->path_to;
+
+	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : from=%s, to=%s", from, to);
+
+        res = wosfs_fix_path(from, from2);
+	if (res == 0)
+        	res = wosfs_fix_path(to, to2);
+	if (res)
+		return res;
+	if ( wosfs_in_snapshots(from) || wosfs_in_snapshots(to) )
+		return -EROFS;
+
+	const char *from_name, *to_name;
+	struct wosfs_dirfd *from_dir = wosfs_dirfd_get(from, &from_name);
+	if ( NULL == from_dir )
+		return -errno;
+	struct wosfs_dirfd *to_dir = wosfs_dirfd_get(to, &to_name);
+	if ( NULL == to_dir ) {
+		res = -errno;
+		wosfs_dirfd_put(from_dir);
+		return res;
+	}
+
+        res = renameat(from_dir->fd, from_name, to_dir->fd, to_name);
+        if (res == -1)
+                res = -errno;
+
+	struct stat stbuf;
+	bool is_dir = ( res == 0 && fstatat(to_dir->fd, to_name, &stbuf, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(stbuf.st_mode) );
+	wosfs_dirfd_put(to_dir);
+	wosfs_dirfd_put(from_dir);
+        if (res)
+                return res;
+
+	// a directory moved or replaced: its cached handles now name other paths
+	wosfs_dirfd_invalidate(from);
+	wosfs_dirfd_invalidate(to);
+	wosfs_attr_invalidate_tree(from);
+	wosfs_attr_invalidate_tree(to);
+	wosfs_attr_invalidate_parent(from);
+	wosfs_attr_invalidate_parent(to);
+	if ( is_dir )
+		wosfs_oidmap_clear();
+	else {
+		wosfs_oidmap_drop(from);
+		wosfs_oidmap_drop(to);
+	}
+	wosfs_snap_dirty(from);
+	wosfs_snap_dirty(to);
+	if ( is_dir )
+		wosfs_snap_dirty_dir(to, true);
+
+        return 0;
+}
+
+static int wosfs_link(const char *from, const char *to)
+{
+	WOSFS_OP_SCOPE2(WOSFS_ST_LINK, from, to);
+	int res = -ENOENT;
+	struct wosfs_req *req = wosfs_req_begin();
+	char *from2 = req->path;
+	char *to2 = req->path_to;
+
+	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : from=%s, to=%s", from, to);
+
+        res = wosfs_fix_path(from, from2);
+	if (res == 0)
+        	res = wosfs_fix_path(to, to2);
+	if (res)
+		return res;
+	if ( wosfs_in_snapshots(to) )
+		return -EROFS;
+	if ( wosfs_in_snapshots(from) )
+		return -EXDEV;
+
+	const char *from_name, *to_name;
+	struct wosfs_dirfd *from_dir = wosfs_dirfd_get(from, &from_name);
+	if ( NULL == from_dir )
+		return -errno;
+	struct wosfs_dirfd *to_dir = wosfs_dirfd_get(to, &to_name);
+	if ( NULL == to_dir ) {
+		res = -errno;
+		wosfs_dirfd_put(from_dir);
+		return res;
+	}
+
+	// hard linked by the user from now on, snapshots copy it; locked so that none links it meanwhile
+	int fd = wosfs_stub_unmark_at(from_dir->fd, from_name);
+        res = linkat(from_dir->fd, from_name, to_dir->fd, to_name, 0);
+        if (res == -1)
+                res = -errno;
+	if ( fd >= 0 )
+		close(fd);
+	wosfs_dirfd_put(to_dir);
+	wosfs_dirfd_put(from_dir);
+        if (res)
+                return res;
+	wosfs_attr_invalidate(from);		// st_nlink
+	wosfs_attr_invalidate_parent(to);
+	wosfs_snap_dirty(to);
+
+        return 0;
+}
+
+static int wosfs_chmod(const char *path, mode_t mode)
+{
+	WOSFS_OP_SCOPE_RANGE(WOSFS_ST_CHMOD, path, 0, mode);
+	int res = -ENOENT;
+	struct wosfs_req *req = wosfs_req_begin();
+	char *path2 = req->path;
+
+        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
+        res = wosfs_fix_path(path, path2);
+	if (res)
+		return res;
+	if ( wosfs_in_snapshots(path) )
+		return -EROFS;
+
+	const char *name;
+	struct wosfs_dirfd *dir = wosfs_dirfd_get(path, &name);
+	if ( NULL == dir )
+		return -errno;
+
+	int fd = wosfs_stub_open_unshared(dir->fd, name);
+	if ( fd >= 0 )
+		res = fchmod(fd, mode);
+	else
+	        res = fchmodat(dir->fd, name, mode, 0);
+        if (res == -1)
+                res = -errno;
+	if ( fd >= 0 )
+		close(fd);
+	wosfs_dirfd_put(dir);
+        if (res)
+                return res;
+	wosfs_attr_invalidate(path);
+	wosfs_snap_dirty(path);
+	wosfs_snap_dirty_dir(path, false);
+
+        return 0;
+}
+
+static int wosfs_chown(const char *path, uid_t uid, gid_t gid)
+{
+	WOSFS_OP_SCOPE(WOSFS_ST_CHOWN, path);
+	int res = -ENOENT;
+	struct wosfs_req *req = wosfs_req_begin();
+	char *path2 = req->path;
+
+        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
+        res = wosfs_fix_path(path, path2);
+	if (res)
+		return res;
+	if ( wosfs_in_snapshots(path) )
+		return -EROFS;
+
+	const char *name;
+	struct wosfs_dirfd *dir = wosfs_dirfd_get(path, &name);
+	if ( NULL == dir )
+		return -errno;
+
+	int fd = wosfs_stub_open_unshared(dir->fd, name);
+	if ( fd >= 0 )
+		res = fchown(fd, uid, gid);
+	else
+	        res = fchownat(dir->fd, name, uid, gid, AT_SYMLINK_NOFOLLOW);
+        if (res == -1)  
+                res = -errno;
+	if ( fd >= 0 )
+		close(fd);
+	wosfs_dirfd_put(dir);
+        if (res)
+                return res;
+	wosfs_attr_invalidate(path);
+	wosfs_snap_dirty(path);
+	wosfs_snap_dirty_dir(path, false);
+
+        return 0;
+}
+
+static int wosfs_truncate(const char *path, off_t size)
+{
+	WOSFS_OP_SCOPE_RANGE(WOSFS_ST_TRUNCATE, path, size, 0);
+	int res = -ENOENT;
+	struct wosfs_req *req = wosfs_req_begin();
+	char *path2 = req->path;
+
+        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
+        res = wosfs_fix_path(path, path2);
+	if (res)
+		return res;
+	if ( wosfs_in_snapshots(path) )
+		return -EROFS;
+
+        struct stat stbuf;
+	const char *name;
+	struct wosfs_dirfd *dir = wosfs_dirfd_get(path, &name);
+	if ( NULL == dir )
+		return -errno;
+
+        res = fstatat(dir->fd, name, &stbuf, AT_SYMLINK_NOFOLLOW);
+        if (res == -1)
+                res = -errno;
+	wosfs_dirfd_put(dir);
+        if (res)
+                return res;
+
+      	if (strncmp (path2, wosfs_conf.wosfs_path, wosfs_path_len) == 0) {
+		/* let us to trucate the file if needed */
+                return 0;
+        }
+
+	res = truncate(path2, size);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+static int wosfs_utimens(const char *path, const struct timespec ts[2])
+{
+	WOSFS_OP_SCOPE(WOSFS_ST_UTIMENS, path);
+	int res = -ENOENT;
+	struct wosfs_req *req = wosfs_req_begin();
+	char *path2 = req->path;
+
+        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
+        res = wosfs_fix_path(path, path2);
+	if (res)
+		return res;
+	if ( wosfs_in_snapshots(path) )
+		return -EROFS;
+
+	const char *name;
+	struct wosfs_dirfd *dir = wosfs_dirfd_get(path, &name);
+	if ( NULL == dir )
+		return -errno;
+
+	int fd = wosfs_stub_open_unshared(dir->fd, name);
+	if ( fd >= 0 )
+		res = futimens(fd, ts);
+	else
+	        /* don't use utime/utimes since they follow symlinks */
+	        res = utimensat(dir->fd, name, ts, AT_SYMLINK_NOFOLLOW);
+        if (res == -1)
+                res = -errno;
+	if ( fd >= 0 )
+		close(fd);
+	wosfs_dirfd_put(dir);
+        if (res)
+                return res;
+	wosfs_attr_invalidate(path);
+	wosfs_snap_dirty(path);
+	wosfs_snap_dirty_dir(path, false);
+
+        return 0;
+}
+
+static int wosfs_open(const char *path, struct fuse_file_info *fi)
+{
+	WOSFS_OP_SCOPE_RANGE(WOSFS_ST_OPEN, path, 0, fi->flags);
+	int res = -ENOENT;
+	struct wosfs_req *req = wosfs_req_begin();
+	char *path2 = req->path;
+
+        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
+	if ( wosfs_is_stats_file(path) )
+		return wosfs_stats_open(fi);
+
+        res = wosfs_fix_path(path, path2);
+	if (res)
+		return res;
+	if ( wosfs_in_snapshots(path) && ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC)) )
+		return -EROFS;
+
+        struct wosclient_pool_entry *wosclient = NULL;
+        wosclient = wosclient_pool_lookup(path2);
+        if ( NULL != wosclient )        {
+        	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS: path=%s, path2=%s, active wosclient", path, path2);
+		if ( wosclient->type == WOS_READ && (fi->flags & O_ACCMODE) == O_RDONLY )
+			fi->keep_cache = wosfs_oidmap_check(path, wosclient->oid);
+		wosclient_pool_put(wosclient);
+	}
+	else {
+		const char *name;
+		struct wosfs_dirfd *dir = wosfs_dirfd_get(path, &name);
+		if ( NULL == dir )
+			return -errno;
+
+        	res = openat(dir->fd, name, fi->flags);
+        	if (res == -1)
+                	res = -errno;
+		else
+        		res = close(res);
+
+		if ( res == 0 && (fi->flags & O_ACCMODE) == O_RDONLY ) {
+			struct wosobj_info wosobj_info;
+			memset(&wosobj_info, 0, sizeof(struct wosobj_info));
+			if ( wosobj_info_last_at(dir->fd, name, &wosobj_info) == true )
+				fi->keep_cache = wosfs_oidmap_check(path, wosobj_info.oid);
+		}
+		wosfs_dirfd_put(dir);
+		if (res)
+			return res;
+	}
+	wosclient_pool_open(path2);	// until its release
+
+        return 0;
+}
+
+/* find or open the WOS_READ stream of stub file path, put by the caller; *wosclientp stays NULL for non-regular files */
+static int wosfs_read_client(const char *path, struct wosclient_pool_entry **wosclientp)
+{
+	WOSFS_PHASE(WOSFS_PH_LOOKUP);
+	int res;
+        struct stat stbuf;
+
+	*wosclientp = NULL;
+
+        struct wosclient_pool_entry *wosclient = NULL;
+
+        wosclient = wosclient_pool_lookup(path);
+        if ( NULL == wosclient )        {
+		// path is the backing path built by wosfs_fix_path()
+		const char *name;
+		struct wosfs_dirfd *dir = wosfs_dirfd_get(path + wosfs_path_len, &name);
+		if ( NULL == dir )
+			return -errno;
+
+        	res = fstatat(dir->fd, name, &stbuf, AT_SYMLINK_NOFOLLOW);
+        	if (res == -1 || !S_ISREG(stbuf.st_mode)) {
+			res = res == -1 ? -errno : 0;
+			wosfs_dirfd_put(dir);
+                	return res;
+		}
+
+                WosPtr_t WosPtr;
+                WosPtr.get_bytes=0;
+
+                struct wosobj_info wosobj_info;
+                memset(&wosobj_info, 0, sizeof(struct wosobj_info));
+                bool found = wosobj_info_last_at(dir->fd, name, &wosobj_info);
+		wosfs_dirfd_put(dir);
+                if ( found == false ) {
+			WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: OUT : can not read stub file: path=%s", path);
+			return -EAGAIN;
+		}
+
+                WosPtr.get_bytes = wosobj_info.obj_len;
+		WosPtr.put_bytes = 0;
+
+                WosOID oid(wosobj_info.oid);
+
+		uint64_t start_ns = wosfs_wos_begin(WOSFS_ST_WOS_CREATEGETSTREAM, 0, 0);
+                try {  
+                        WosPtr.gs = wos_b.wos->CreateGetStream(oid);
+			wosfs_stat_record(WOSFS_ST_WOS_CREATEGETSTREAM, start_ns, ok);
+                }
+                catch (WosE_ObjectNotFound& e) {
+			wosfs_stat_record(WOSFS_ST_WOS_CREATEGETSTREAM, start_ns, wosapi::error);
+                        WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: OUT : path=%s, Invalid OID: %s", path, oid.c_str());
+                        return -ENOENT;
+                }
+		bool added;
+                wosclient = wosclient_pool_add_to_list(path, WosPtr, true, WOS_READ, WosPtr.get_bytes, wosobj_info.oid, &added);
+		if ( NULL == wosclient )
+			return -ENOMEM;
+		if ( !added ) {
+			// opened by another thread meanwhile: use its stream as it is
+			WosPtr.gs.reset();
+			wosfs_phase_oid(wosclient->oid);
+		}
+        }
+	else
+		wosfs_phase_oid(wosclient->oid);
+
+	*wosclientp = wosclient;
+	return 0;
+}
+
+/* clip a read against the object length; false when there is nothing to read */
+static bool wosfs_read_clip(struct wosclient_pool_entry *wosclient, off_t offset, size_t *size)
+{
+	if ( 0 == wosclient->len )
+		return false;
+
+	if ( (uint64_t)offset > wosclient->len-1 ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: OUT : Invalid offset: offset=%d, length=%d", offset, wosclient->len);
+	 	return false;  // can not return -errno as it will break some app like md5sum which will read beyond end of file.
+	}
+
+	if ( *size > wosclient->len ) 
+		*size = wosclient->len;
+
+	if ( (offset + *size) > wosclient->len ) 
+		*size = wosclient->len - offset;
+
+	return true;
+}
+
+static int wosfs_read(const char *path1, char *buf, size_t size, off_t offset,
+		    struct fuse_file_info *fi)
+{
+	WOSFS_OP_SCOPE_RANGE(WOSFS_ST_READ, path1, offset, size);
+	int res = -ENOENT;
+	char *path = (char *)path1;
+
+	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS: IN : path=%s, offset = %u, size = %u", path, offset, size); 
+
+	if ( wosfs_is_stats_file(path) )
+		return wosfs_stats_read(fi, buf, size, offset);
+
+	struct wosfs_req *req = wosfs_req_begin();
+	char *path2 = req->path;
+
+        res = wosfs_fix_path(path, path2);
+	if (res)
+		return res;
+
+	path=path2;	
+
+        struct wosclient_pool_entry *wosclient = NULL;
+
+	res = wosfs_read_client(path, &wosclient);
+	if ( res < 0 || NULL == wosclient )
+		return res;
+
+	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: path=%s, offset=%d, size=%d, WosPtr.get_bytes=%d, length=%d", path, offset, size, wosclient->WosPtr.get_bytes, wosclient->len);
+	if ( !wosfs_read_clip(wosclient, offset, &size) ) {
+		wosclient_pool_put(wosclient);
+		return 0;
+	}
+
+	int fd = wosfs_cache_fd(wosclient);
+	if ( fd >= 0 ) {
+		WOSFS_PHASE(WOSFS_PH_CACHE);
+
+		res = pread(fd, buf, size, offset);
+		if ( res == -1 )
+			res = -errno;
+	}
+	else
+		res = wosfs_read_span(wosclient, buf, offset, size);
+	if ( res > 0 )
+		__sync_fetch_and_sub(&wosclient->WosPtr.get_bytes, res);
+	wosclient_pool_put(wosclient);
+
+	return res;
+}
+
+/*
+ * Same as wosfs_read, but lets libfuse move the data to /dev/fuse itself.
+ * Cached objects are handed over as an fd so that the reply is spliced
+ * from the page cache; other reads land in a buffer owned by libfuse,
+ * which is the only copy made.
+ */
+static int wosfs_read_buf(const char *path1, struct fuse_bufvec **bufp, size_t size,
+			off_t offset, struct fuse_file_info *fi)
+{
+	WOSFS_OP_SCOPE_RANGE(WOSFS_ST_READ, path1, offset, size);
+	int res = -ENOENT;
+	char *path = (char *)path1;
+
+	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS: IN : path=%s, offset = %u, size = %u", path, offset, size); 
+
+	(void)fi;
+
+	// libfuse frees both the bufvec and buf[0].mem after replying
+	struct fuse_bufvec *src = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec));
+	if ( NULL == src )
+		return -ENOMEM;
+	memset(src, 0, sizeof(struct fuse_bufvec));
+	src->count = 1;
+	src->buf[0].fd = -1;
+	*bufp = src;
+
+	if ( wosfs_is_stats_file(path) ) {
+		src->buf[0].mem = malloc(size);
+		if ( NULL == src->buf[0].mem )
+			return -ENOMEM;
+		src->buf[0].size = wosfs_stats_read(fi, (char *)src->buf[0].mem, size, offset);
+		return 0;
+	}
+
+	struct wosfs_req *req = wosfs_req_begin();
+	char *path2 = req->path;
+
+        res = wosfs_fix_path(path, path2);
+	if (res)
+		return res;
+
+	path=path2;	
+
+        struct wosclient_pool_entry *wosclient = NULL;
+
+	res = wosfs_read_client(path, &wosclient);
+	if ( res < 0 || NULL == wosclient )
+		return res;
+
+	if ( !wosfs_read_clip(wosclient, offset, &size) ) {
+		wosclient_pool_put(wosclient);
+		return 0;
+	}
+
+	int fd = wosfs_cache_fd(wosclient);
+	if ( fd >= 0 ) {
+		// the entry and its cache_fd may go before libfuse is done with the fd
+		fd = dup(fd);
+		wosclient_pool_put(wosclient);
+		if ( fd == -1 )
+			return -errno;
+		req->reply_fd = fd;
+		src->buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+		src->buf[0].fd = fd;
+		src->buf[0].pos = offset;
+		src->buf[0].size = size;
+		return 0;
+	}
+
+	src->buf[0].mem = malloc(size);
+	if ( NULL == src->buf[0].mem ) {
+		wosclient_pool_put(wosclient);
+		return -ENOMEM;
+	}
+
+	res = wosfs_read_span(wosclient, (char *)src->buf[0].mem, offset, size);
+	if ( res >= 0 ) {
+		src->buf[0].size = res;
+		__sync_fetch_and_sub(&wosclient->WosPtr.get_bytes, res);
+	}
+	wosclient_pool_put(wosclient);
+
+	return res < 0 ? res : 0;
+}
+
+/* find or create the WOS_WRITE stream of stub file path, put by the caller; *wosclientp stays NULL for non-regular files */
+static int wosfs_write_client(const char *path, off_t offset, size_t size, struct wosclient_pool_entry **wosclientp)
+{
+	WOSFS_PHASE(WOSFS_PH_LOOKUP);
+	int res;
+        struct stat stbuf;
+
+	*wosclientp = NULL;
+
+        struct wosclient_pool_entry *wosclient = NULL; 
+
+        wosclient = wosclient_pool_lookup(path);
+        if ( NULL == wosclient )        {
+		// path is the backing path built by wosfs_fix_path()
+		const char *name;
+		struct wosfs_dirfd *dir = wosfs_dirfd_get(path + wosfs_path_len, &name);
+		if ( NULL == dir )
+			return -errno;
+
+        	res = fstatat(dir->fd, name, &stbuf, AT_SYMLINK_NOFOLLOW);
+		if (res == -1)
+			res = -errno;
+		wosfs_dirfd_put(dir);
+        	if (res)
+                	return res;
+
+		if (!S_ISREG(stbuf.st_mode))
+			return 0;
+
+		if ( offset != 0 ) {
+			WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS::  not writing from BOF: path=%s, offset=%u, size=%u", path, offset, size);
+			return -EINVAL;
+		}
+
+               	WosPtr_t WosPtr;
+               	WosPtr.put_bytes = 0;
+		WosPtr.get_bytes = 0;
+		WosPolicy policy = wos_b.wos->GetPolicy(wosfs_conf.wos_policy);
+
+		if ( 0 == (wosfs_conf.wosfs_debug & WOSFS_WR_DROP ) ) {
+			uint64_t start_ns = wosfs_wos_begin(WOSFS_ST_WOS_CREATEPUTSTREAM, 0, 0);
+               		try {  
+               			WosPtr.ps = wos_b.wos->CreatePutStream(policy);
+				wosfs_stat_record(WOSFS_ST_WOS_CREATEPUTSTREAM, start_ns, ok);
+               		}
+               		catch (WosE_InvalidPolicy& e) {
+				wosfs_stat_record(WOSFS_ST_WOS_CREATEPUTSTREAM, start_ns, wosapi::error);
+                       		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: path=%s, Invalid Policy: %s", path, wosfs_conf.wos_policy);
+                       		return -EIO;
+               		}
+		}
+		bool added;
+               	wosclient = wosclient_pool_add_to_list(path, WosPtr, true, WOS_WRITE, 0, NULL, &added);
+		if ( NULL == wosclient )
+			return -ENOMEM;
+		if ( !added )
+			WosPtr.ps.reset();	// opened by another thread meanwhile
+        }
+
+	*wosclientp = wosclient;
+	return 0;
+}
+
+/*
+ * Move size bytes from src to the object at offset.  With --wos_buffer the
+ * data is copied once, by fuse_buf_copy, into the staging buffer; this
+ * reads straight from the splice pipe when libfuse received the request
+ * with splice.  Without it, a single in-memory buffer is passed to
+ * PutSpan as is.
+ */
+static int wosfs_write_data(struct wosclient_pool_entry *wosclient, struct fuse_bufvec *src, off_t offset, size_t size)
+{
+	WosStatus rstatus;
+
+	if (wosfs_conf.wosfs_debug & WOSFS_WR_DROP )
+		return 0;
+
+#ifdef WOSFS_PERF_FIX_01
+	if ( 0 != wosfs_conf.wosfs_buffer && NULL == wosclient->sbuf && !wosclient->sbuf_skip ) {
+		wosclient->sbuf = wosfs_sbuf_get();
+		if ( wosclient->sbuf ) 
+			wosclient->buffer = wosclient->b_ptr = wosclient->sbuf->mem;
+		else
+			wosclient->sbuf_skip = true;
+	}
+
+	if ( wosclient->sbuf ) {
+		size_t copied = 0;
+
+		while ( copied < size ) {
+			size_t used = wosclient->b_ptr - wosclient->buffer;
+			struct fuse_bufvec dst;
+			ssize_t res;
+
+			if ( 0 == used )
+				wosclient->offset = offset + copied;
+
+			memset(&dst, 0, sizeof(dst));
+			dst.count = 1;
+			dst.buf[0].mem = wosclient->b_ptr;
+			dst.buf[0].size = std::min(size - copied, wosfs_conf.wosfs_buffer - used);
+			dst.buf[0].fd = -1;
+
+			{
+				WOSFS_PHASE(WOSFS_PH_COPY);
+				res = fuse_buf_copy(&dst, src, (enum fuse_buf_copy_flags)0);
+			}
+			if ( res <= 0 )
+				return res < 0 ? res : -EIO;
+			wosclient->b_ptr += res;
+			copied += res;
+
+			if ( wosclient->b_ptr - wosclient->buffer == wosfs_conf.wosfs_buffer ) {
+				uint64_t start_ns = wosfs_wos_begin(WOSFS_ST_WOS_PUTSPAN, wosclient->offset, wosfs_conf.wosfs_buffer);
+				wosclient->WosPtr.ps->PutSpan(rstatus, (char *)wosclient->buffer, wosclient->offset, wosfs_conf.wosfs_buffer);
+				wosfs_stat_record(WOSFS_ST_WOS_PUTSPAN, start_ns, rstatus, wosclient->offset, wosfs_conf.wosfs_buffer);
+				if (rstatus != ok)
+					return -EIO;
+				wosclient->offset += wosfs_conf.wosfs_buffer;
+				wosclient->b_ptr = wosclient->buffer;
+			}
+		}
+		return 0;
+	}
+#endif
+
+	if ( 1 == src->count && !(src->buf[0].flags & FUSE_BUF_IS_FD) ) {
+		uint64_t start_ns = wosfs_wos_begin(WOSFS_ST_WOS_PUTSPAN, offset, size);
+		wosclient->WosPtr.ps->PutSpan(rstatus, src->buf[0].mem, offset, size);
+		wosfs_stat_record(WOSFS_ST_WOS_PUTSPAN, start_ns, rstatus, offset, size);
+		return rstatus == ok ? 0 : -EIO;
+	}
+
+	// fd backed or fragmented request, PutSpan needs one contiguous buffer
+	struct fuse_bufvec dst;
+	ssize_t res;
+
+	memset(&dst, 0, sizeof(dst));
+	dst.count = 1;
+	dst.buf[0].mem = malloc(size);
+	dst.buf[0].size = size;
+	dst.buf[0].fd = -1;
+	if ( NULL == dst.buf[0].mem )
+		return -ENOMEM;
+
+	{
+		WOSFS_PHASE(WOSFS_PH_COPY);
+		res = fuse_buf_copy(&dst, src, (enum fuse_buf_copy_flags)0);
+	}
+	if ( res == (ssize_t)size ) {
+		uint64_t start_ns = wosfs_wos_begin(WOSFS_ST_WOS_PUTSPAN, offset, size);
+		wosclient->WosPtr.ps->PutSpan(rstatus, dst.buf[0].mem, offset, size);
+		wosfs_stat_record(WOSFS_ST_WOS_PUTSPAN, start_ns, rstatus, offset, size);
+	}
+	free(dst.buf[0].mem);
+
+	if ( res != (ssize_t)size )
+		return res < 0 ? res : -EIO;
+	return rstatus == ok ? 0 : -EIO;
+}
+
+static int wosfs_write_buf(const char *path1, struct fuse_bufvec *buf,
+		     off_t offset, struct fuse_file_info *fi)
+{
+	WOSFS_OP_SCOPE_RANGE(WOSFS_ST_WRITE, path1, offset, fuse_buf_size(buf));
+	int res = -ENOENT;
+	char *path= (char *)path1;
+	size_t size = fuse_buf_size(buf);
+
+	(void) fi;
+
+	struct wosfs_req *req = wosfs_req_begin();
+	char *path2 = req->path;
+
+        res = wosfs_fix_path(path, path2);
+	if (res)
+		return res;
+
+	path = path2;
+
+	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS: IN : path=%s, offset = %u, size = %u", path, offset, size); 
+
+       	struct wosclient_pool_entry *wosclient = NULL; 
+
+	res = wosfs_write_client(path, offset, size, &wosclient);
+	if ( res < 0 || NULL == wosclient )
+		return res;
+
+	res = wosfs_write_data(wosclient, buf, offset, size);
+	if ( res < 0 ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS: path=%s, Error in PutSpan at offset = %u with size = %u", path, offset, size); 
+		wosclient_pool_put(wosclient);
+		return res;
+	}
+	wosclient->WosPtr.put_bytes += size;
+	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS: OUT: path=%s, offset = %u, size = %u, put_bytes= %u", path, offset, size, wosclient->WosPtr.put_bytes); 
+	wosclient_pool_put(wosclient);
+
+	return size;
+}
+
+static int wosfs_write(const char *path1, const char *buf, size_t size,
+		     off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec src;
+
+	memset(&src, 0, sizeof(src));
+	src.count = 1;
+	src.buf[0].mem = (void *)buf;
+	src.buf[0].size = size;
+	src.buf[0].fd = -1;
+
+	return wosfs_write_buf(path1, &src, offset, fi);
+}
+
+static int wosfs_statfs(const char *path, struct statvfs *stbuf)
+{
+	WOSFS_OP_SCOPE(WOSFS_ST_STATFS, path);
+	int res = -ENOENT;
+
+	struct wosfs_req *req = wosfs_req_begin();
+	char *path2 = req->path;
+
+        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
+        res = wosfs_fix_path(path, path2);
+	if (res)
+		return res;
+
+        res = statvfs(path2, stbuf);
+        if (res == -1)
+    	 	return -errno;
+
+	return 0;
+}
+
+/*
+ * Release a file opened at the mount relative path opened, whose stub is now
+ * at path1, or gone if path1 is NULL.  The stream is always taken out of the
+ * pool; its version is only appended when there is a stub to append it to.
+ */
+static int wosfs_release_at(const char *opened, const char *path1, struct fuse_file_info *fi)
+{
+	WOSFS_OP_SCOPE(WOSFS_ST_RELEASE, opened);
+
+	int res = -ENOENT;
+        struct stat stbuf;
+	char *path= (char *)opened;
+
+	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s, cur number=%d", path, wosclient_pool_count);
+
+	if ( wosfs_is_stats_file(path) ) {
+		wosfs_stats_release(fi);
+		return 0;
+	}
+
+	struct wosfs_req *req = wosfs_req_begin();
+	char *path2 = req->path;
+
+        res = wosfs_fix_path(path, path2);
+	if (res)
+		return res;
+	
+	path = path2;
+
+	const char *name;
+	struct wosfs_dirfd *dir = NULL;
+	if ( NULL == path1 )
+		res = -ENOENT;		// unlinked while open
+	else if ( NULL == (dir = wosfs_dirfd_get(path1, &name)) )
+		res = -errno;		// still drop the open below
+	else {
+	        res = fstatat(dir->fd, name, &stbuf, AT_SYMLINK_NOFOLLOW);
+	        if (res == -1)
+	                res = -errno;
+		wosfs_dirfd_put(dir);
+	}
+
+	//pthread_mutex_lock(&lock_release);
+
+        struct wosclient_pool_entry *wosclient = NULL;
+
+	// other opens keep the stream, the last one takes it out of the pool
+        wosclient = wosclient_pool_close(path);
+        if ( NULL == wosclient )        {
+		//pthread_mutex_unlock(&lock_release);
+                WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: OUT : no active wosclient to drop, path=%s", path);
+                return res;
+        }
+
+	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: active wosclient exists : path=%s, type=%d", path, wosclient->type);
+
+	if ( res ) {
+		// the stub went away while open: nothing to add a version to
+		wosclient_pool_put(wosclient);
+                WOSFS_DEBUGLOG(WOSFS_LOG_WARN, ":WOS:: OUT : stub gone, dropped stream, path=%s, res=%d", path, res);
+		return res;
+	}
+
+	if ( wosclient->type == WOS_READ ) {
+		wosclient_pool_put(wosclient);
+		//pthread_mutex_unlock(&lock_release);
+                WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: OUT : dropped WOS_READ stream, path=%s", path);
+		return res;
+	}
+
+	if ( (wosclient->type == WOS_WRITE) && (wosclient->WosPtr.put_bytes == 0)) {
+                WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: OUT : called with active WOS_WRITE stream, but put_bytes=%d, path=%s", wosclient->WosPtr.put_bytes, path);
+		wosclient_pool_put(wosclient);
+		//pthread_mutex_unlock(&lock_release);
+		return res;
+	}
+
+	WosStatus rstatus;
+	WosOID roid; 
+	uint64_t put_bytes = wosclient->WosPtr.put_bytes;
+	WosPutStreamPtr ps = wosclient->WosPtr.ps;
+
+#ifdef WOSFS_PERF_FIX_01
+    	if ( wosclient->sbuf ) {
+	   if ( wosclient->b_ptr != wosclient->buffer ) {
+		uint64_t start_ns = wosfs_wos_begin(WOSFS_ST_WOS_PUTSPAN, wosclient->offset, wosclient->b_ptr - wosclient->buffer);
+		ps->PutSpan(rstatus, (char *)wosclient->buffer, wosclient->offset, wosclient->b_ptr - wosclient->buffer);	
+		wosfs_stat_record(WOSFS_ST_WOS_PUTSPAN, start_ns, rstatus, wosclient->offset, wosclient->b_ptr - wosclient->buffer);
+		if (rstatus != ok) {
+			WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: OUT : Error in writing last bytes via PutSteam");
+		}
+	   }
+	}
+#endif
+	wosclient_pool_put(wosclient);
+
+        if ( wosfs_conf.wosfs_debug & WOSFS_WR_DROP ) { 
+		rstatus = ok;
+	}
+	else {
+		uint64_t start_ns = wosfs_wos_begin(WOSFS_ST_WOS_CLOSE, 0, 0);
+		ps->Close(rstatus, roid);
+		wosfs_stat_record(WOSFS_ST_WOS_CLOSE, start_ns, rstatus);
+	}
+
+        if (rstatus != ok) {
+                WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: OUT : Error in closing PutSteam");
+		//pthread_mutex_unlock(&lock_release);
+		return -errno;
+        }
+
+        const char *oid_str= roid.c_str();
+	wosfs_phase_oid(oid_str);
+	WOSFS_PHASE(WOSFS_PH_STUB);	// appending the new version
+
+        FILE * fp;
+	time_t sec;
+	sec = time (NULL);
+
+	dir = wosfs_dirfd_get(path1, &name);
+	if ( NULL == dir )
+		return -errno;
+	int fd = wosfs_stub_open_locked(dir->fd, name, O_RDWR | O_APPEND);
+	res = -errno;
+	wosfs_dirfd_put(dir);
+
+	fp = fd < 0 ? NULL : fdopen(fd, "a+");
+	if ( NULL == fp ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: OUT : failed to open file.  path=%s", path);
+		if ( fd >= 0 ) {
+			res = -errno;
+			close(fd);
+		}
+		return res;
+	}
+	res = 0;
+	
+	fprintf(fp, "%s %s %lu %ld %s %s\n", wosfs_conf.wosfs_magic, oid_str, put_bytes, sec, wosfs_conf.wos_ip, wosfs_conf.wos_policy);
+#ifdef WOSFS_FEATURE_TRASHCAN
+	wosfs_compact_note(path, path1, fp);
+#endif
+   	fclose(fp);
+	wosfs_notify_inval(path1, false);	// new object size
+	wosfs_snap_dirty(path1);
+	wosfs_oidmap_check(path1, oid_str);	// the page cache holds what was just written
+
+	if ( wosfs_conf.wosfs_bak_path ) {
+		char *tgt_path = req->path_bak;
+
+		fp = NULL;
+		if ( wosfs_fix_bak_path(path1, tgt_path) == 0 ) {
+			WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: OUT : write to backup path: orig path=%s, tgt_path=%s", path, tgt_path);
+			fp = fopen (tgt_path, "a+");
+		}
+		if ( NULL == fp ) {
+	                WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: OUT : failed to open file.  path=%s", path);
+		}
+		else {		
+			fprintf(fp, "%s %s %lu %ld %s %s\n", wosfs_conf.wosfs_magic, oid_str, put_bytes, sec, wosfs_conf.wos_ip, wosfs_conf.wos_policy);
+        		fclose(fp);
+		}
+	}	
+	
+	//pthread_mutex_unlock(&lock_release);
+	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: OUT : path=%s, cur number=%d", path, wosclient_pool_count);
+	return res;
+}
+
+static int wosfs_release(const char *path, struct fuse_file_info *fi)
+{
+	return wosfs_release_at(path, path, fi);
+}
+
+static int wosfs_fsync(const char *path, int isdatasync,
+		     struct fuse_file_info *fi)
+{
+	WOSFS_OP_SCOPE(WOSFS_ST_FSYNC, path);
+	int res = -ENOENT;
+
+        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
+
+#if 0
+        char path2[256];
+        memset((void *)&path2, 0, 256);
+
+        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
+        wosfs_fix_path(path, path2); 
+
+        struct wosclient_pool_entry *wosclient = NULL;
+        wosclient = wosclient_pool_search_in_list_by_path(path2, NULL);
+        if ( NULL != wosclient )        {
+                wosclient->open_count++;
+        	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: path=%s, open_count=%d", path, wosclient->open_count);
+        }
+#endif
+
+	/* Just a stub.	 This method is optional and can safely be left
+	   unimplemented */
+
+	(void) path;
+	(void) isdatasync;
+	(void) fi;
+	return 0;
+}
+
+#ifdef HAVE_POSIX_FALLOCATE
+static int wosfs_fallocate(const char *path, int mode,
+			off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	WOSFS_OP_SCOPE_RANGE(WOSFS_ST_FALLOCATE, path, offset, length);
+	int fd;
+	int res;
+
+	(void) fi;
+
+	if (mode)
+		return -EOPNOTSUPP;
+
+	fd = open(path, O_WRONLY);
+	if (fd == -1)
+		return -errno;
+
+	res = -posix_fallocate(fd, offset, length);
+
+	close(fd);
+	return res;
+}
+#endif
+
+#ifdef HAVE_SETXATTR
+/* xattr operations are optional and can safely be left unimplemented */
+static int wosfs_setxattr(const char *path, const char *name, const char *value,
+			size_t size, int flags)
+{
+	int res = lsetxattr(path, name, value, size, flags);
+	if (res == -1)
+		return -errno;
+	return 0;
+}
+
+static int wosfs_getxattr(const char *path, const char *name, char *value,
+			size_t size)
+{
+	int res = lgetxattr(path, name, value, size);
+	if (res == -1)
+		return -errno;
+	return res;
+}
+
+static int wosfs_listxattr(const char *path, char *list, size_t size)
+{
+	int res = llistxattr(path, list, size);
+	if (res == -1)
+		return -errno;
+	return res;
+}
+
+static int wosfs_removexattr(const char *path, const char *name)
+{
+	int res = lremovexattr(path, name);
+	if (res == -1)
+		return -errno;
+	return 0;
+}
+#endif /* HAVE_SETXATTR */
+
+static void *wosfs_init(struct fuse_conn_info *conn)
+{
+	// threads do not survive the daemonizing fork in fuse_main, start them here;
+	// that includes those of the WOS client completing callback calls
+	wos_b.Connect(wosfs_conf.wos_ip);
+	wosfs_workq_start(wosfs_conf.wosfs_threads);
+	if ( wosfs_conf.wosfs_cache )
+		wosfs_cache_start();
+	if ( wosfs_conf.wosfs_trace )
+		wosfs_trace_start();
+#ifdef WOSFS_FEATURE_TRASHCAN
+	// the purger also deletes the versions the compactor drops
+	if ( wosfs_conf.wosfs_purge_age > 0 || wosfs_conf.wosfs_purge_quota > 0 || wosfs_conf.wosfs_purge_files > 0 || wosfs_compact_on )
+		wosfs_purge_start();
+	if ( wosfs_compact_on )
+		wosfs_compact_start();
+#endif
+#ifdef WOSFS_FEATURE_SNAPSHOTS
+	// the trash can must not delete what a snapshot holds
+	if ( wosfs_snap_on )
+		wosfs_purge_start();
+#endif
+	if ( wosfs_conf.wosfs_slow_ms > 0 ) {
+		wosfs_slow_ns = (uint64_t)wosfs_conf.wosfs_slow_ms * 1000000;
+		if ( wosfs_conf.wosfs_slow_log ) {
+			wosfs_slow_fp = wosfs_fopen_private(wosfs_conf.wosfs_slow_log, O_APPEND, "a");
+			if ( NULL == wosfs_slow_fp )
+				WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to open slow call log %s, errno=%d, using syslog", wosfs_conf.wosfs_slow_log, errno);
+		}
+	}
+
+	// let wosfs_write_buf copy request data from the splice pipe into the staging buffer
+	if ( wosfs_conf.wosfs_buffer && (conn->capable & FUSE_CAP_SPLICE_READ) )
+		conn->want |= FUSE_CAP_SPLICE_READ;
+
+	// let libfuse splice cached object data straight into /dev/fuse
+	if ( wosfs_conf.wosfs_cache ) {
+		if ( conn->capable & FUSE_CAP_SPLICE_WRITE )
+			conn->want |= FUSE_CAP_SPLICE_WRITE;
+		if ( conn->capable & FUSE_CAP_SPLICE_MOVE )
+			conn->want |= FUSE_CAP_SPLICE_MOVE;
+	}
+
+	return NULL;
+}
+
+void wosfs_stats_report(void)
+{
+	syslog(LOG_INFO, "fusewos stats: reads=%lu, getspan=%lu, coalesced=%lu (%.1f%%), hedges=%lu, hedge_wins=%lu",
+		wosfs_coalesce.reads, wosfs_coalesce.fetches, wosfs_coalesce.coalesced,
+		wosfs_coalesce.reads ? 100.0 * wosfs_coalesce.coalesced / wosfs_coalesce.reads : 0.0,
+		wosfs_hedge.hedges, wosfs_hedge.hedge_wins);
+	syslog(LOG_INFO, "fusewos stats: staging buffers allocated=%lu, throttled=%lu, unbuffered=%lu",
+		wosfs_sbufs.allocated, wosfs_sbufs.waits, wosfs_sbufs.fallbacks);
+	syslog(LOG_INFO, "fusewos stats: attribute cache hits=%lu, misses=%lu, entries=%ld",
+		wosfs_attr_hits, wosfs_attr_misses, wosfs_attr_count);
+}
+
+static void wosfs_destroy(void *private_data)
+{
+	(void) private_data;
+
+	wosfs_stats_report();
+	if ( wosfs_trace_fp ) {
+		wosfs_trace_on = 0;
+		wosfs_trace_drain();
+	}
+#ifdef WOSFS_FEATURE_SNAPSHOTS
+	wosfs_snap_stop();
+#endif
+}
+
+static struct fuse_operations wosfs_oper = {
+	wosfs_getattr,
+	wosfs_readlink,
+       	NULL, 	// getdir
+	wosfs_mknod,
+	wosfs_mkdir,
+	wosfs_unlink,
+	wosfs_rmdir,
+	wosfs_symlink,
+	wosfs_rename,
+	wosfs_link,
+	wosfs_chmod,
+	wosfs_chown,
+	wosfs_truncate,
+	NULL,	// fgetattr
+	wosfs_open,
+	wosfs_read,
+	wosfs_write,
+	wosfs_statfs,
+ 	NULL,	// flush
+	wosfs_release,
+	wosfs_fsync,
+	NULL,	// setxattr
+	NULL,	// getxattr
+	NULL,	// listxattr
+	NULL,	// removexattr
+	wosfs_opendir, 	// opendir
+	wosfs_readdir,
+	wosfs_releasedir, 	// releasedir
+	NULL, 	// fsyncdir
+	wosfs_init, 	// init
+	wosfs_destroy, 	// destroy
+	wosfs_access,
+	NULL, 	// create
+	NULL,	// ftruncate
+	NULL, 	// fgetattr
+	NULL, 	// lock
+	wosfs_utimens, 	// utimens
+	NULL, 	// bmap
+	0,	// flag_nullpath_ok
+	0,	// flag_nopath
+	0,	// flag_utime_omit_ok
+	0,	// flag_reserved
+	NULL, 	// ioctl
+	NULL, 	// poll
+	wosfs_write_buf, 	// write_buf
+	wosfs_read_buf, 	// read_buf
+	NULL, 	// flock
+	NULL,	// fallocate
+};
+
+
+/*
+ *  FUSE session loop (--wos_fuse_threads)
+ *
+ *  fuse_session_loop_mt() starts workers on demand and stops them again
+ *  once more than ten are idle, so bursts pay for thread creation, and all
+ *  workers read the one /dev/fuse fd.  This loop starts a fixed number of
+ *  workers up front, optionally pins each to one of the allowed CPUs
+ *  (--wos_fuse_pin), and gives each its own clone of the session fd where
+ *  the kernel has FUSE_DEV_IOC_CLONE (Linux 4.2).  A request is answered on
+ *  the fd it was read from, so the kernel's processing list and its lock
+ *  are per worker.  Without clone support the workers share the session
+ *  channel, as with libfuse.  All workers receive through libfuse, so each
+ *  splices from its own fd when splice is on.
+ */
+
+#ifndef FUSE_DEV_IOC_CLONE
+#define FUSE_DEV_IOC_CLONE	_IOR(229, 0, uint32_t)
+#endif
+
+struct wosfs_fuse_worker {
+	pthread_t			thread;
+	struct fuse_session		*se;
+	struct fuse_chan		*ch;		// clone of the session channel, or the channel itself
+	bool				cloned;
+	int				cpu;		// CPU to pin to, -1 for none
+	char				*buf;
+	size_t				bufsize;
+	sem_t				*finish;
+};
+
+static int wosfs_clone_receive(struct fuse_chan **chp, char *buf, size_t size)
+{
+	ssize_t res = read(fuse_chan_fd(*chp), buf, size);
+
+	return res == -1 ? -errno : res;
+}
+
+static int wosfs_clone_send(struct fuse_chan *ch, const struct iovec iov[], size_t count)
+{
+	if ( iov && writev(fuse_chan_fd(ch), iov, count) == -1 ) {
+		// ENOENT: the request was interrupted
+		if ( errno != ENOENT )
+			WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to write cloned fuse fd %d, errno=%d", fuse_chan_fd(ch), errno);
+		return -errno;
+	}
+	return 0;
+}
+
+static void wosfs_clone_destroy(struct fuse_chan *ch)
+{
+	close(fuse_chan_fd(ch));
+}
+
+bool wosfs_clone_unsupported;	// the kernel has no FUSE_DEV_IOC_CLONE, don't try again
+
+/* a channel on a new /dev/fuse fd attached to the connection of ch, NULL if it can't be had now */
+struct fuse_chan *wosfs_clone_chan(struct fuse_chan *ch)
+{
+	struct fuse_chan_ops op;
+	uint32_t masterfd = fuse_chan_fd(ch);
+	int fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+
+	if ( fd == -1 ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to open /dev/fuse to clone, errno=%d", errno);
+		return NULL;
+	}
+	if ( ioctl(fd, FUSE_DEV_IOC_CLONE, &masterfd) == -1 ) {
+		if ( errno == ENOTTY || errno == EINVAL ) {
+			WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: FUSE_DEV_IOC_CLONE not supported, errno=%d", errno);
+			wosfs_clone_unsupported = true;
+		}
+		else
+			WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: FUSE_DEV_IOC_CLONE failed, errno=%d", errno);
+		close(fd);
+		return NULL;
+	}
+
+	memset(&op, 0, sizeof(op));
+	op.receive = wosfs_clone_receive;
+	op.send = wosfs_clone_send;
+	op.destroy = wosfs_clone_destroy;
+	struct fuse_chan *clone = fuse_chan_new(&op, fd, fuse_chan_bufsize(ch), NULL);
+	if ( NULL == clone )
+		close(fd);
+
+	return clone;
+}
+
+static void *wosfs_fuse_work(void *arg)
+{
+	struct wosfs_fuse_worker *w = (struct wosfs_fuse_worker *)arg;
+	struct fuse_session *se = w->se;
+
+	if ( w->cpu >= 0 ) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		if ( pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0 )
+			WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to pin fuse worker to cpu %d", w->cpu);
+	}
+
+	while ( !fuse_session_exited(se) ) {
+		struct fuse_chan *ch = w->ch;
+		struct fuse_buf fbuf;
+		int res;
+
+		memset(&fbuf, 0, sizeof(fbuf));
+		fbuf.mem = w->buf;
+		fbuf.size = w->bufsize;
+
+		// reads ch, a clone too: spliced into this thread's pipe when libfuse splices
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		res = fuse_session_receive_buf(se, &fbuf, &ch);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if ( fuse_session_exited(se) )
+			break;
+		if ( res == -EINTR || res == -EAGAIN || res == -ENOENT )
+			continue;
+		if ( res == -ENODEV || res == 0 ) {
+			fuse_session_exit(se);		// unmounted
+			break;
+		}
+		if ( res < 0 ) {
+			WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to read fuse device, errno=%d", -res);
+			fuse_session_exit(se);
+			break;
+		}
+
+		fuse_session_process_buf(se, &fbuf, ch);
+	}
+
+	sem_post(w->finish);
+	return NULL;
+}
+
+/* CPUs this process may run on, in order; returns how many */
+int wosfs_allowed_cpus(int *cpus, int max)
+{
+	cpu_set_t set;
+	int n = 0;
+
+	if ( sched_getaffinity(0, sizeof(set), &set) != 0 )
+		return 0;
+	for (int cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++)
+		if ( CPU_ISSET(cpu, &set) )
+			cpus[n++] = cpu;
+	return n;
+}
+
+/* fuse_session_loop_mt() with wosfs_conf.wosfs_fuse_threads fixed workers */
+int wosfs_session_loop(struct fuse_session *se)
+{
+	struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
+	int nthreads = wosfs_conf.wosfs_fuse_threads;
+	struct wosfs_fuse_worker *workers;
+	int cpus[CPU_SETSIZE];
+	int ncpus = 0;
+	int nclones = 0;
+	int started = 0;
+	sigset_t newset, oldset;
+	sem_t finish;
+
+	workers = (struct wosfs_fuse_worker *)calloc(nthreads, sizeof(struct wosfs_fuse_worker));
+	if ( NULL == workers )
+		return -1;
+	if ( wosfs_conf.wosfs_fuse_pin )
+		ncpus = wosfs_allowed_cpus(cpus, CPU_SETSIZE);
+	sem_init(&finish, 0, 0);
+
+	// signals go to the main thread, which is waiting for the workers below
+	sigemptyset(&newset);
+	sigaddset(&newset, SIGTERM);
+	sigaddset(&newset, SIGINT);
+	sigaddset(&newset, SIGHUP);
+	sigaddset(&newset, SIGQUIT);
+	pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+
+	for (int i = 0; i < nthreads; i++) {
+		struct wosfs_fuse_worker *w = &workers[i];
+
+		w->se = se;
+		w->finish = &finish;
+		w->cpu = ncpus > 0 ? cpus[i % ncpus] : -1;
+		w->ch = ( i > 0 && !wosfs_clone_unsupported ) ? wosfs_clone_chan(ch) : NULL;	// worker 0 keeps the session fd
+		w->cloned = ( NULL != w->ch );
+		if ( w->cloned )
+			nclones++;
+		else
+			w->ch = ch;
+		w->bufsize = fuse_chan_bufsize(w->ch);
+		w->buf = (char *)malloc(w->bufsize);
+		if ( NULL == w->buf || pthread_create(&w->thread, NULL, wosfs_fuse_work, w) != 0 ) {
+			WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: failed to start fuse worker %d", i);
+			free(w->buf);
+			if ( w->cloned )
+				fuse_chan_destroy(w->ch);
+			break;
+		}
+		started++;
+	}
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: %d fuse workers, %d cloned fds, %d cpus to pin to", started, nclones, ncpus);
+
+	if ( started > 0 ) {
+		/* sem_wait() is interruptible */
+		while ( !fuse_session_exited(se) )
+			sem_wait(&finish);
+	}
+
+	for (int i = 0; i < started; i++)
+		pthread_cancel(workers[i].thread);
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+		free(workers[i].buf);
+		if ( workers[i].cloned )
+			fuse_chan_destroy(workers[i].ch);
+	}
+	free(workers);
+	sem_destroy(&finish);
+	fuse_session_reset(se);
+
+	return started > 0 ? 0 : -1;
+}
+
+/* fuse_main() for the path frontend, with wosfs_session_loop() in place of fuse_loop_mt() */
+int wosfs_fuse_main(struct fuse_args *args)
+{
+	struct fuse *fuse;
+	char *mountpoint;
+	int multithreaded;
+	int res;
+
+	fuse = fuse_setup(args->argc, args->argv, &wosfs_oper, sizeof(wosfs_oper), &mountpoint, &multithreaded, NULL);
+	if ( NULL == fuse )
+		return 1;
+
+	if ( !multithreaded )
+		res = fuse_loop(fuse);
+	else if ( (res = fuse_start_cleanup_thread(fuse)) == 0 ) {
+		res = wosfs_session_loop(fuse_get_session(fuse));
+		fuse_stop_cleanup_thread(fuse);
+	}
+
+	fuse_teardown(fuse, mountpoint);
+	return res == -1 ? 1 : 0;
+}
+
+#ifndef WOSFS_NO_MAIN
+/*
+ *  Low-level frontend (--wos_lowlevel)
+ *
+ *  Talks to the kernel with fuse_lowlevel.h instead of fuse.c: no path
+ *  resolution through the fuse.c node tree and its lock, and read and
+ *  write requests that need WOS are answered from the WOS completion
+ *  callbacks (as in wos_nb_demo.cpp), so a few session threads can keep
+ *  many requests outstanding.  Metadata requests translate the inode to
+ *  its mount relative path and reuse the wosfs_* path functions above.
+ *
+ *  Node ids are handed out from wosfs_ll_next_ino and stay with a path
+ *  until the kernel forgets them; rename moves the paths of an inode and
+ *  of everything below it.  Like main(), it is left out of the
+ *  WOSFS_NO_MAIN build that wosfs_bench and wosfs_replay link.
+ */
+
+#define WOSFS_LL_HASH		65536
+
+struct wosfs_inode {
+	fuse_ino_t			ino;
+	uint64_t			nlookup;
+	char				*path;		// mount relative, NULL once unlinked
+	struct wosfs_inode		*ino_next;
+	struct wosfs_inode		*path_next;
+};
 
-      	if (strncmp (path2, wosfs_conf.wosfs_path, strlen(wosfs_conf.wosfs_path)) == 0) {
-		/* let us to trucate the file if needed */
-                return 0;
-        }
+struct wosfs_inode *wosfs_ll_inos[WOSFS_LL_HASH];
+struct wosfs_inode *wosfs_ll_paths[WOSFS_LL_HASH];
+fuse_ino_t wosfs_ll_next_ino = FUSE_ROOT_ID + 1;
+pthread_mutex_t lock_inodes;
+struct fuse_chan *wosfs_ll_chan = NULL;
+static struct fuse_lowlevel_ops wosfs_ll_oper;
 
-	res = truncate(path2, size);
-	if (res == -1)
-		return -errno;
+/* async PutSpans of the low-level write path that have not completed */
+pthread_mutex_t lock_inflight;
+pthread_cond_t cond_inflight;
 
-	return 0;
+unsigned int wosfs_ll_path_hash(const char *path)
+{
+	return (unsigned int)(wosfs_oidmap_key(path) % WOSFS_LL_HASH);
 }
 
-static int wosfs_utimens(const char *path, const struct timespec ts[2])
+/* caller holds lock_inodes */
+struct wosfs_inode *wosfs_ll_find_ino(fuse_ino_t ino)
 {
-	int res = -ENOENT;
+	struct wosfs_inode *node;
 
-        char path2[256];
-        memset((void *)&path2, 0, 256);
+	for (node = wosfs_ll_inos[ino % WOSFS_LL_HASH]; node; node = node->ino_next)
+		if ( node->ino == ino )
+			break;
+	return node;
+}
 
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
-        wosfs_fix_path(path, path2);
+/* caller holds lock_inodes */
+struct wosfs_inode *wosfs_ll_find_path(const char *path)
+{
+	struct wosfs_inode *node;
 
-        /* don't use utime/utimes since they follow symlinks */
-        res = utimensat(0, path2, ts, AT_SYMLINK_NOFOLLOW);
-        if (res == -1)
-                return -errno;
+	for (node = wosfs_ll_paths[wosfs_ll_path_hash(path)]; node; node = node->path_next)
+		if ( strcmp(node->path, path) == 0 )
+			break;
+	return node;
+}
 
-        return 0;
+/* caller holds lock_inodes */
+void wosfs_ll_unhash_path(struct wosfs_inode *node)
+{
+	struct wosfs_inode **pp = &wosfs_ll_paths[wosfs_ll_path_hash(node->path)];
+
+	while ( *pp != node )
+		pp = &(*pp)->path_next;
+	*pp = node->path_next;
+	node->path_next = NULL;
 }
 
-static int wosfs_open(const char *path, struct fuse_file_info *fi)
+/* caller holds lock_inodes */
+void wosfs_ll_hash_path(struct wosfs_inode *node)
 {
-	int res = -ENOENT;
+	unsigned int key = wosfs_ll_path_hash(node->path);
 
-        char path2[256];
-        memset((void *)&path2, 0, 256);
+	node->path_next = wosfs_ll_paths[key];
+	wosfs_ll_paths[key] = node;
+}
 
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
-        wosfs_fix_path(path, path2);
+bool wosfs_ll_init_inodes(void)
+{
+	struct wosfs_inode *root = (struct wosfs_inode *)malloc(sizeof(struct wosfs_inode));
 
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS: path=%s, path2=%s", path, path2);
+	if ( NULL == root || NULL == (root->path = strdup("/")) )
+		return false;
+	root->ino = FUSE_ROOT_ID;
+	root->nlookup = 1;
+	root->ino_next = NULL;
+	wosfs_ll_inos[FUSE_ROOT_ID % WOSFS_LL_HASH] = root;
+	wosfs_ll_hash_path(root);
 
-        struct wosclient_pool_entry *wosclient = NULL;
-        wosclient = wosclient_pool_search_in_list_by_path(path2, NULL);
-        if ( NULL != wosclient )        {
-		wosclient->open_count++;
-        	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS: path=%s, path2=%s, open_count=%d", path, path2, wosclient->open_count);
-	}
-	else {
-        	res = open(path2, fi->flags);
-        	if (res == -1)
-                	return -errno;
+	return true;
+}
 
-        	close(res);
+/* node id for path with one more lookup reference, 0 if out of memory */
+fuse_ino_t wosfs_ll_node_get(const char *path)
+{
+	struct wosfs_inode *node;
+
+	pthread_mutex_lock(&lock_inodes);
+	node = wosfs_ll_find_path(path);
+	if ( NULL == node ) {
+		node = (struct wosfs_inode *)malloc(sizeof(struct wosfs_inode));
+		if ( node && NULL == (node->path = strdup(path)) ) {
+			free(node);
+			node = NULL;
+		}
+		if ( NULL == node ) {
+			pthread_mutex_unlock(&lock_inodes);
+			return 0;
+		}
+		node->ino = wosfs_ll_next_ino++;
+		node->nlookup = 0;
+		node->ino_next = wosfs_ll_inos[node->ino % WOSFS_LL_HASH];
+		wosfs_ll_inos[node->ino % WOSFS_LL_HASH] = node;
+		wosfs_ll_hash_path(node);
 	}
+	node->nlookup++;
+	fuse_ino_t ino = node->ino;
+	pthread_mutex_unlock(&lock_inodes);
 
-        return 0;
+	return ino;
 }
 
-static int wosfs_read(const char *path1, char *buf, size_t size, off_t offset,
-		    struct fuse_file_info *fi)
+/* node id of path, 0 if the kernel does not know it */
+fuse_ino_t wosfs_ll_ino_of(const char *path)
 {
-	int res = -ENOENT;
-	char *path = (char *)path1;
-
-	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS: IN : path=%s, offset = %u, size = %u", path, offset, size); 
+	pthread_mutex_lock(&lock_inodes);
+	struct wosfs_inode *node = wosfs_ll_find_path(path);
+	fuse_ino_t ino = node ? node->ino : 0;
+	pthread_mutex_unlock(&lock_inodes);
 
-	(void)fi;
+	return ino;
+}
 
-        struct stat stbuf;
+/* copy the path of ino to path (PATH_MAX bytes) */
+int wosfs_ll_path(fuse_ino_t ino, char *path)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&lock_inodes);
+	struct wosfs_inode *node = wosfs_ll_find_ino(ino);
+	if ( NULL == node )
+		res = -ESTALE;
+	else if ( NULL == node->path )
+		res = -ENOENT;
+	else
+		strcpy(path, node->path);
+	pthread_mutex_unlock(&lock_inodes);
 
-        char path2[256];
-        memset((void *)&path2, 0, 256);
+	return res;
+}
 
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
-        wosfs_fix_path(path, path2);
+/* copy the path of name in directory parent to path (PATH_MAX bytes) */
+int wosfs_ll_child(fuse_ino_t parent, const char *name, char *path)
+{
+	int res = wosfs_ll_path(parent, path);
+	if ( res )
+		return res;
 
-	path=path2;	
+	size_t len = strlen(path);
+	if ( len == 1 )
+		len = 0;
+	if ( snprintf(path + len, PATH_MAX - len, "/%s", name) >= (int)(PATH_MAX - len) )
+		return -ENAMETOOLONG;
 
-        res = lstat(path, &stbuf);
-        if (res == -1)
-                return -errno;
+	return 0;
+}
 
-	if (S_ISREG(stbuf.st_mode)) {
+void wosfs_ll_forget_one(fuse_ino_t ino, uint64_t nlookup)
+{
+	if ( ino == FUSE_ROOT_ID )
+		return;
+
+	pthread_mutex_lock(&lock_inodes);
+	struct wosfs_inode *node = wosfs_ll_find_ino(ino);
+	if ( node && (node->nlookup -= std::min(nlookup, node->nlookup)) == 0 ) {
+		struct wosfs_inode **pp = &wosfs_ll_inos[ino % WOSFS_LL_HASH];
+		while ( *pp != node )
+			pp = &(*pp)->ino_next;
+		*pp = node->ino_next;
+		if ( node->path )
+			wosfs_ll_unhash_path(node);
+	}
+	else
+		node = NULL;
+	pthread_mutex_unlock(&lock_inodes);
 
-	//pthread_mutex_lock(&lock_read);
-        struct wosclient_pool_entry *wosclient = NULL;
+	if ( node ) {
+		free(node->path);
+		free(node);
+	}
+}
 
-        wosclient = wosclient_pool_search_in_list_by_path(path, NULL);
-        if ( NULL == wosclient )        {
-                WosPtr_t WosPtr;
-                WosPtr.get_bytes=0;
+/* the entry at path was removed; its inode lives on until forgotten */
+void wosfs_ll_detach(const char *path)
+{
+	pthread_mutex_lock(&lock_inodes);
+	struct wosfs_inode *node = wosfs_ll_find_path(path);
+	if ( node ) {
+		wosfs_ll_unhash_path(node);
+		free(node->path);
+		node->path = NULL;
+	}
+	pthread_mutex_unlock(&lock_inodes);
+}
 
-                char oid_str[41];
-                struct wosobj_info wosobj_info;
-                memset(&wosobj_info, 0, sizeof(struct wosobj_info));
-                if ( wosobj_info_last(path, &wosobj_info) == false ) {
-			WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: OUT : can not read stub file: path=%s", path);
-			//pthread_mutex_unlock(&lock_read);
-			//return -errno;
-			return EAGAIN;
+/* from was renamed to to: move the inode at from and everything below it */
+void wosfs_ll_move(const char *from, const char *to)
+{
+	size_t flen = strlen(from);
+	size_t tlen = strlen(to);
+	struct wosfs_inode *moved = NULL;
+
+	wosfs_ll_detach(to);
+
+	pthread_mutex_lock(&lock_inodes);
+	for (int key = 0; key < WOSFS_LL_HASH; key++) {
+		struct wosfs_inode **pp = &wosfs_ll_paths[key];
+		while ( *pp ) {
+			struct wosfs_inode *node = *pp;
+			if ( strncmp(node->path, from, flen) == 0 && (node->path[flen] == '\0' || node->path[flen] == '/') ) {
+				*pp = node->path_next;
+				node->path_next = moved;
+				moved = node;
+				continue;
+			}
+			pp = &node->path_next;
 		}
+	}
+	while ( moved ) {
+		struct wosfs_inode *node = moved;
+		moved = node->path_next;
+
+		size_t rest = strlen(node->path + flen);
+		char *path = (char *)malloc(tlen + rest + 1);
+		if ( NULL == path ) {
+			// can not rename in memory, the kernel will get ENOENT for it
+			free(node->path);
+			node->path = NULL;
+			continue;
+		}
+		memcpy(path, to, tlen);
+		memcpy(path + tlen, node->path + flen, rest + 1);
+		free(node->path);
+		node->path = path;
+		wosfs_ll_hash_path(node);
+	}
+	pthread_mutex_unlock(&lock_inodes);
+}
 
-                WosPtr.get_bytes = wosobj_info.obj_len;
-		WosPtr.put_bytes = 0;
-
-                WosOID oid(wosobj_info.oid);
+/*
+ * Kernel notifications are sent from a worker thread: the kernel may hold
+ * locks for the request that caused them until that request is answered.
+ */
+struct wosfs_ll_notify {
+	struct wosfs_job		job;
+	bool				entry;		// inval_entry of name in parent, else inval_inode of path
+	bool				data;
+	char				path[PATH_MAX];
+	char				name[NAME_MAX + 1];
+};
 
-                try {  
-                        WosPtr.gs = wos_b.wos->CreateGetStream(oid);
-                }
-                catch (WosE_ObjectNotFound& e) {
-                        WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: OUT : path=%s, Invalid OID: %s", path, oid.c_str());
-			//pthread_mutex_unlock(&lock_read);
-                        return -errno;
-                }
-                wosclient = wosclient_pool_add_to_list(path,WosPtr,true);
-		wosclient->type = WOS_READ;
-		wosclient->len = WosPtr.get_bytes;
-		
-        }
-	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: path=%s, offset=%d, size=%d, WosPtr.get_bytes=%d, length=%d", path, offset, size, wosclient->WosPtr.get_bytes, wosclient->len);
-	if ( wosclient->len > 0 ) {
-        	WosStatus rstatus;
-		WosObjPtr robj;
+void wosfs_ll_notify_run(void *arg)
+{
+	struct wosfs_ll_notify *n = (struct wosfs_ll_notify *)arg;
+	fuse_ino_t ino = wosfs_ll_ino_of(n->path);
+
+	if ( ino && n->entry )
+		fuse_lowlevel_notify_inval_entry(wosfs_ll_chan, ino, n->name, strlen(n->name));
+	else if ( ino )
+		fuse_lowlevel_notify_inval_inode(wosfs_ll_chan, ino, n->data ? 0 : -1, 0);
+	free(n);
+}
 
-		if ( offset > wosclient->len-1 ) {
-			WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: OUT : Invalid offset: offset=%d, length=%d", offset, wosclient->len);
-			//pthread_mutex_unlock(&lock_read);
-		 	return 0;  // can not return -errno as it will break some app like md5sum which will read beyond end of file.
-		}
+void wosfs_ll_notify_submit(const char *path, const char *name, bool data)
+{
+	struct wosfs_ll_notify *n = (struct wosfs_ll_notify *)malloc(sizeof(struct wosfs_ll_notify));
+
+	if ( NULL == n )
+		return;
+	n->job.fn = wosfs_ll_notify_run;
+	n->job.arg = n;
+	n->entry = ( NULL != name );
+	n->data = data;
+	strncpy(n->path, path, PATH_MAX - 1);
+	n->path[PATH_MAX - 1] = '\0';
+	if ( name ) {
+		strncpy(n->name, name, NAME_MAX);
+		n->name[NAME_MAX] = '\0';
+	}
+	if ( !wosfs_workq_submit(&n->job) )
+		free(n);
+}
 
-		if ( size > wosclient->len ) 
-			size = wosclient->len;
+void wosfs_ll_inval_inode(const char *path, bool data)
+{
+	wosfs_ll_notify_submit(path, NULL, data);
+}
 
-		if ( (offset + size) > wosclient->len ) 
-			size = wosclient->len - offset;
+void wosfs_ll_inval_entry(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	char parent[PATH_MAX];
 
-       		 wosclient->WosPtr.gs->GetSpan(rstatus, robj, offset, size);
-		if (rstatus == ok) {
-			const void* p;
-			uint64_t objlen; 
-			robj->GetData(p, objlen);
-			memcpy(buf, p, objlen); 
-			wosclient->WosPtr.get_bytes -= objlen;
-			res = objlen;
-		}
-		else
-			res = -errno;
-	}
+	if ( NULL == slash || slash[1] == '\0' || (size_t)(slash - path) >= PATH_MAX )
+		return;
+	if ( slash == path )
+		strcpy(parent, "/");
+	else {
+		memcpy(parent, path, slash - path);
+		parent[slash - path] = '\0';
 	}
+	wosfs_ll_notify_submit(parent, slash + 1, false);
+}
 
-	//pthread_mutex_unlock(&lock_read);
-	return res;
+/*
+ * A file was opened at path: keep the path in fi->fh.  Its stream is pooled
+ * under that path, which a rename or unlink may take from the inode before
+ * release.
+ */
+static int wosfs_ll_opened(const char *path, struct fuse_file_info *fi)
+{
+	if ( wosfs_is_stats_file(path) )
+		return 0;		// fi->fh holds the rendered statistics
+	char *opened = strdup(path);
+	if ( NULL == opened ) {
+		wosfs_release(path, fi);
+		return -ENOMEM;
+	}
+	fi->fh = (uintptr_t) opened;
+	return 0;
+}
 
+/* the kernel will not release what was opened at path */
+static void wosfs_ll_unopen(const char *path, struct fuse_file_info *fi)
+{
+	wosfs_release(path, fi);
+	if ( !wosfs_is_stats_file(path) )
+		free((char *)(uintptr_t) fi->fh);
 }
 
-static int wosfs_write(const char *path1, const char *buf, size_t size,
-		     off_t offset, struct fuse_file_info *fi)
+/* look path up again after it was created and answer the request with it */
+static void wosfs_ll_reply_entry(fuse_req_t req, const char *path, struct fuse_file_info *fi)
 {
+	struct fuse_entry_param e;
+	int res;
 
-	int res = -ENOENT;
-	char *path= (char *)path1;
+	memset(&e, 0, sizeof(e));
+	res = wosfs_getattr(path, &e.attr);
+	if ( res ) {
+		if ( fi )
+			wosfs_ll_unopen(path, fi);
+		fuse_reply_err(req, -res);
+		return;
+	}
+	e.ino = wosfs_ll_node_get(path);
+	if ( 0 == e.ino ) {
+		if ( fi )
+			wosfs_ll_unopen(path, fi);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	e.generation = 1;
+	e.attr_timeout = wosfs_conf.wosfs_kernel_ttl;
+	e.entry_timeout = wosfs_conf.wosfs_kernel_ttl;
+
+	if ( fi ) {
+		if ( fuse_reply_create(req, &e, fi) == -ENOENT ) {
+			wosfs_ll_forget_one(e.ino, 1);	// interrupted, the kernel will not release it
+			wosfs_ll_unopen(path, fi);
+		}
+	}
+	else if ( fuse_reply_entry(req, &e) == -ENOENT )
+		wosfs_ll_forget_one(e.ino, 1);
+}
 
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s, offset = %u, size = %u", path, offset, size);
+static void wosfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	char path[PATH_MAX];
+	int res = wosfs_ll_child(parent, name, path);
 
-        struct stat stbuf;
+	if ( res )
+		fuse_reply_err(req, -res);
+	else
+		wosfs_ll_reply_entry(req, path, NULL);
+}
 
-        char path2[256];
-        memset((void *)&path2, 0, 256);
+static void wosfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	wosfs_ll_forget_one(ino, nlookup);
+	fuse_reply_none(req);
+}
 
-        wosfs_fix_path(path, path2);
+static void wosfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	char path[PATH_MAX];
+	struct stat stbuf;
+	int res;
 
-	path = path2;
+	(void) fi;
+	res = wosfs_ll_path(ino, path);
+	if ( res == 0 )
+		res = wosfs_getattr(path, &stbuf);
+	if ( res )
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_attr(req, &stbuf, wosfs_conf.wosfs_kernel_ttl);
+}
 
-	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS: IN : path=%s, offset = %u, size = %u", path, offset, size); 
+static void wosfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+			     int to_set, struct fuse_file_info *fi)
+{
+	char path[PATH_MAX];
+	int res;
 
-        res = lstat(path, &stbuf);
-        if (res == -1)
-                return -errno;
-
-	//pthread_mutex_lock(&lock_write);
-	if (S_ISREG(stbuf.st_mode)) {
-        	struct wosclient_pool_entry *wosclient = NULL; 
-
-        	wosclient = wosclient_pool_search_in_list_by_path(path, NULL);
-		WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: Check 100");
-        	if ( NULL == wosclient )        {
-			WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: Check 101");
-			if ( offset != 0 ) {
-				WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS::  not writing from BOF: path=%s, offset=%u, size=%u", path, offset, size);
-				//pthread_mutex_unlock(&lock_write);
-				return -errno;
-			}
+	(void) fi;
+	res = wosfs_ll_path(ino, path);
+	if ( res == 0 && (to_set & FUSE_SET_ATTR_MODE) )
+		res = wosfs_chmod(path, attr->st_mode);
+	if ( res == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) )
+		res = wosfs_chown(path, (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t)-1,
+				  (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t)-1);
+	if ( res == 0 && (to_set & FUSE_SET_ATTR_SIZE) )
+		res = wosfs_truncate(path, attr->st_size);
+	if ( res == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) ) {
+		struct timespec ts[2];
+
+		ts[0].tv_sec = attr->st_atime;
+		ts[0].tv_nsec = 0;
+		ts[1].tv_sec = attr->st_mtime;
+		ts[1].tv_nsec = 0;
+		if ( !(to_set & FUSE_SET_ATTR_ATIME) )
+			ts[0].tv_nsec = UTIME_OMIT;
+		else if ( to_set & FUSE_SET_ATTR_ATIME_NOW )
+			ts[0].tv_nsec = UTIME_NOW;
+		if ( !(to_set & FUSE_SET_ATTR_MTIME) )
+			ts[1].tv_nsec = UTIME_OMIT;
+		else if ( to_set & FUSE_SET_ATTR_MTIME_NOW )
+			ts[1].tv_nsec = UTIME_NOW;
+		res = wosfs_utimens(path, ts);
+	}
+	if ( res ) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	wosfs_ll_getattr(req, ino, NULL);
+}
 
-                	WosPtr_t WosPtr;
-                	WosPtr.put_bytes = 0;
-			WosPtr.get_bytes = 0;
-			WosPolicy policy = wos_b.wos->GetPolicy(wosfs_conf.wos_policy);
-
-			if ( 0 == (wosfs_conf.wosfs_debug & WOSFS_WR_DROP ) ) {
-                		try {  
-                			WosPtr.ps = wos_b.wos->CreatePutStream(policy);
-                		}
-                		catch (WosE_InvalidPolicy& e) {
-                        		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: path=%s, Invalid Policy: %s", path, wosfs_conf.wos_policy);
-					//pthread_mutex_unlock(&lock_write);
-                        		return -errno;
-                		}
-			}
-			WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: Check 102");
-                	wosclient = wosclient_pool_add_to_list(path,WosPtr,true);
-			WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: Check 103");
-			wosclient->type = WOS_WRITE;
-        	}
+static void wosfs_ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	char path[PATH_MAX];
+	char buf[PATH_MAX];
+	int res;
 
-		WosStatus rstatus;
-		if (wosfs_conf.wosfs_debug & WOSFS_WR_DROP ) {
-			rstatus = ok;
-		}
-		else {
-#ifdef WOSFS_PERF_FIX_01
-    		   if ( 0 != wosfs_conf.wosfs_buffer) {
-			int tmp_offset = wosclient->b_ptr - wosclient->buffer;	
-			int s = wosfs_conf.wosfs_buffer - tmp_offset;
-
-			WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS: path=%s, wosclient->offset = %d, tmp_offset=%d, s=%d, wosclient->b_ptr=%p,wosclient->buffer=%p", path, wosclient->offset, tmp_offset, s, wosclient->b_ptr, wosclient->buffer);
-			if ( 0 == tmp_offset )
-				wosclient->offset = offset; 
-			if ( size > s ) { // assume size is always less than wosfs_conf.wosfs_buffer
-				memcpy(wosclient->b_ptr, buf, s);
-				wosclient->WosPtr.ps->PutSpan(rstatus, (char *)wosclient->buffer, wosclient->offset, wosfs_conf.wosfs_buffer);
-				wosclient->offset += wosfs_conf.wosfs_buffer;
-				wosclient->b_ptr = wosclient->buffer;
-				memcpy(wosclient->b_ptr, buf+ s, size - s);
-				wosclient->b_ptr += (size - s);
-			}
-			else {
-				WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS: path=%s, wosclient->offset = %d, wosclient->b_ptr = %p", path, wosclient->offset, wosclient->b_ptr);
-				memcpy(wosclient->b_ptr, buf, size);
-				wosclient->b_ptr += size;
-				rstatus = ok;
-			}
-		   }
-		   else
-			wosclient->WosPtr.ps->PutSpan(rstatus, (char *)buf, offset, size);
-#endif
-		}
-		if (rstatus != ok) {
-			WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS: path=%s, Error in PutSpan at offset = %u with size = %u", path, offset, size); 
-			//pthread_mutex_unlock(&lock_write);
-			return -errno;
-		}
-		wosclient->WosPtr.put_bytes += size;
-		WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS: OUT: path=%s, offset = %u, size = %u, put_bytes= %u", path, offset, size, wosclient->WosPtr.put_bytes); 
-		res=size;
-	}
+	buf[sizeof(buf) - 1] = '\0';
+	res = wosfs_ll_path(ino, path);
+	if ( res == 0 )
+		res = wosfs_readlink(path, buf, sizeof(buf));
+	if ( res )
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_readlink(req, buf);
+}
 
-	//pthread_mutex_unlock(&lock_write);
-	return res;
+static void wosfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+			   mode_t mode, dev_t rdev)
+{
+	char path[PATH_MAX];
+	int res = wosfs_ll_child(parent, name, path);
+
+	if ( res == 0 )
+		res = wosfs_mknod(path, mode, rdev);
+	if ( res )
+		fuse_reply_err(req, -res);
+	else
+		wosfs_ll_reply_entry(req, path, NULL);
 }
 
-static int wosfs_statfs(const char *path, struct statvfs *stbuf)
+static void wosfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
 {
-	int res = -ENOENT;
+	char path[PATH_MAX];
+	int res = wosfs_ll_child(parent, name, path);
 
-        char path2[256];
-        memset((void *)&path2, 0, 256);
+	if ( res == 0 )
+		res = wosfs_mkdir(path, mode);
+	if ( res )
+		fuse_reply_err(req, -res);
+	else
+		wosfs_ll_reply_entry(req, path, NULL);
+}
 
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
-        wosfs_fix_path(path, path2);
+static void wosfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	char path[PATH_MAX];
+	int res = wosfs_ll_child(parent, name, path);
+
+	if ( res == 0 )
+		res = wosfs_unlink(path);
+	if ( res == 0 )
+		wosfs_ll_detach(path);
+	fuse_reply_err(req, -res);
+}
 
-        res = statvfs(path2, stbuf);
-        if (res == -1)
-    	 	return -errno;
+static void wosfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	char path[PATH_MAX];
+	int res = wosfs_ll_child(parent, name, path);
+
+	if ( res == 0 )
+		res = wosfs_rmdir(path);
+	if ( res == 0 )
+		wosfs_ll_detach(path);
+	fuse_reply_err(req, -res);
 }
 
-static int wosfs_release(const char *path1, struct fuse_file_info *fi)
+static void wosfs_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
 {
+	char path[PATH_MAX];
+	int res = wosfs_ll_child(parent, name, path);
 
-	int res = -ENOENT;
-        struct stat stbuf;
-	char *path= (char *)path1;
+	if ( res == 0 )
+		res = wosfs_symlink(link, path);
+	if ( res )
+		fuse_reply_err(req, -res);
+	else
+		wosfs_ll_reply_entry(req, path, NULL);
+}
 
-	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s, cur number=%d", path, wosclient_pool_count);
+static void wosfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+			    fuse_ino_t newparent, const char *newname)
+{
+	char from[PATH_MAX];
+	char to[PATH_MAX];
+	int res = wosfs_ll_child(parent, name, from);
+
+	if ( res == 0 )
+		res = wosfs_ll_child(newparent, newname, to);
+	if ( res == 0 )
+		res = wosfs_rename(from, to);
+	if ( res == 0 )
+		wosfs_ll_move(from, to);
+	fuse_reply_err(req, -res);
+}
 
-        char path2[256];
-        memset((void *)&path2, 0, 256);
+static void wosfs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
+{
+	char from[PATH_MAX];
+	char to[PATH_MAX];
+	int res = wosfs_ll_path(ino, from);
+
+	if ( res == 0 )
+		res = wosfs_ll_child(newparent, newname, to);
+	if ( res == 0 )
+		res = wosfs_link(from, to);
+	if ( res )
+		fuse_reply_err(req, -res);
+	else
+		wosfs_ll_reply_entry(req, to, NULL);
+}
 
-        wosfs_fix_path(path, path2);
-	
-	path = path2;
+static void wosfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	char path[PATH_MAX];
+	int res = wosfs_ll_path(ino, path);
+
+	if ( res == 0 )
+		res = wosfs_open(path, fi);
+	if ( res == 0 )
+		res = wosfs_ll_opened(path, fi);
+	if ( res )
+		fuse_reply_err(req, -res);
+	else if ( fuse_reply_open(req, fi) == -ENOENT )
+		wosfs_ll_unopen(path, fi);	// interrupted, there will be no release
+}
 
-        res = lstat(path, &stbuf);
-        if (res == -1)
-                return -errno;
+/* take back the empty stub of a create that failed after making it */
+static void wosfs_ll_uncreate(const char *path)
+{
+	char path2[PATH_MAX];
 
-	//pthread_mutex_lock(&lock_release);
+	if ( wosfs_fix_path(path, path2) == 0 && unlink(path2) == 0 ) {
+		wosfs_attr_invalidate_parent(path);
+		wosfs_snap_dirty(path);
+	}
+}
 
-        struct wosclient_pool_entry *wosclient = NULL;
+/*
+ * create: mknod makes the stub, exclusively, and the stub is then opened
+ * as it is.  Without O_EXCL a stub made by someone else meanwhile is
+ * opened instead.
+ */
+static void wosfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+			    mode_t mode, struct fuse_file_info *fi)
+{
+	char path[PATH_MAX];
+	bool created = false;
+	int res = wosfs_ll_child(parent, name, path);
+
+	if ( res == 0 ) {
+		res = wosfs_mknod(path, (mode & ~S_IFMT) | S_IFREG, 0);
+		created = res == 0;
+		if ( res == -EEXIST && !(fi->flags & O_EXCL) )
+			res = 0;
+	}
+	if ( res == 0 ) {
+		fi->flags &= ~(O_CREAT | O_EXCL | O_TRUNC);
+		res = wosfs_open(path, fi);
+	}
+	if ( res == 0 )
+		res = wosfs_ll_opened(path, fi);
+	if ( res ) {
+		if ( created )
+			wosfs_ll_uncreate(path);
+		fuse_reply_err(req, -res);
+	}
+	else
+		wosfs_ll_reply_entry(req, path, fi);
+}
 
-        wosclient = wosclient_pool_search_in_list_by_path(path, NULL);
-        if ( NULL == wosclient )        {
-		//pthread_mutex_unlock(&lock_release);
-                WOSFS_DEBUGLOG(WOSFS_LOG_WARN, ":WOS:: OUT : no active wosclient found, path=%s", path);
-                return res;
-        }
+/*
+ * read: answered from the local object cache right away, otherwise by the
+ * GetSpan completion callback, which puts the pool entry.  The hedging and
+ * coalescing of the path frontend are blocking and are not used here.
+ */
+struct wosfs_ll_read_ctx {
+	fuse_req_t			req;
+	struct wosclient_pool_entry	*wosclient;
+	uint64_t			start_ns;
+	uint64_t			offset;
+	size_t				size;
+	uint64_t			hash;		// of the path while tracing
+};
 
-	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: active wosclient exists : path=%s, open_count=%d, type=%d", path, wosclient->open_count, wosclient->type);
+void wosfs_ll_read_done(WosStatus status, WosObjPtr obj, WosCluster::Context ctx)
+{
+	struct wosfs_ll_read_ctx *rc = (struct wosfs_ll_read_ctx *)ctx;
 
-	if ( wosclient->open_count != 0 ) {
-		wosclient->open_count--;
-		return res;
+	wosfs_stat_record(WOSFS_ST_WOS_GETSPAN, rc->start_ns, status, rc->offset, rc->size, rc->hash);
+	if ( status != ok ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: GetSpan failed: %s", status.ErrMsg().c_str());
+		fuse_reply_err(rc->req, EIO);
 	}
+	else {
+		const void *p = NULL;
+		uint64_t len = 0;
 
-	if ( wosclient->type == WOS_READ ) {
-		wosclient_pool_delete_from_list(path);
-		//pthread_mutex_unlock(&lock_release);
-                WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: OUT : called with active WOS_READ stream?! path=%s", path);
-		return res;
+		obj->GetData(p, len);
+		__sync_fetch_and_sub(&rc->wosclient->WosPtr.get_bytes, len);
+		fuse_reply_buf(rc->req, (const char *)p, len);
 	}
+	wosclient_pool_put(rc->wosclient);
+	delete rc;
+}
 
-	if ( (wosclient->type == WOS_WRITE) && (wosclient->WosPtr.put_bytes == 0)) {
-		wosclient_pool_delete_from_list(path);
-		//pthread_mutex_unlock(&lock_release);
-                WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: OUT : called with active WOS_WRITE stream, but put_bytes=%d, path=%s", wosclient->WosPtr.put_bytes, path);
-		return res;
-	}
+static void wosfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+			  struct fuse_file_info *fi)
+{
+	char path[PATH_MAX];
+	char path2[PATH_MAX];
+	struct wosclient_pool_entry *wosclient = NULL;
+	int res;
 
-	WosStatus rstatus;
-	WosOID roid; 
-	uint64_t put_bytes = wosclient->WosPtr.put_bytes;
-	WosPutStreamPtr ps = wosclient->WosPtr.ps;
+	res = wosfs_ll_path(ino, path);
+	if ( res == 0 && wosfs_is_stats_file(path) ) {
+		char *buf = (char *)malloc(size);
+
+		if ( NULL == buf )
+			fuse_reply_err(req, ENOMEM);
+		else
+			fuse_reply_buf(req, buf, wosfs_stats_read(fi, buf, size, off));
+		free(buf);
+		return;
+	}
+	if ( res == 0 )
+		res = wosfs_fix_path(path, path2);
+	if ( res == 0 )
+		res = wosfs_read_client(path2, &wosclient);
+	if ( res ) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	if ( NULL == wosclient || !wosfs_read_clip(wosclient, off, &size) ) {
+		if ( wosclient )
+			wosclient_pool_put(wosclient);
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
 
-#ifdef WOSFS_PERF_FIX_01
-    	if ( 0 != wosfs_conf.wosfs_buffer) {
-	   if ( wosclient->b_ptr != wosclient->buffer ) {
-		ps->PutSpan(rstatus, (char *)wosclient->buffer, wosclient->offset, wosclient->b_ptr - wosclient->buffer);	
-		if (rstatus != ok) {
-			WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: OUT : Error in writing last bytes via PutSteam");
-		}
-	   }
+	int fd = wosfs_cache_fd(wosclient);
+	if ( fd >= 0 ) {
+		struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+
+		// the reference keeps cache_fd open until the reply is sent
+		buf.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+		buf.buf[0].fd = fd;
+		buf.buf[0].pos = off;
+		fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+		wosclient_pool_put(wosclient);
+		return;
 	}
-#endif
-	wosclient_pool_delete_from_list(path);
 
-        if ( wosfs_conf.wosfs_debug & WOSFS_WR_DROP ) { 
-		rstatus = ok;
+	struct wosfs_ll_read_ctx *rc = new wosfs_ll_read_ctx;
+	rc->req = req;
+	rc->wosclient = wosclient;
+	rc->start_ns = wosfs_wos_begin(WOSFS_ST_WOS_GETSPAN, off, size);
+	rc->offset = off;
+	rc->size = size;
+	rc->hash = wosfs_trace_on ? wosfs_path_hash(path) : 0;
+	wosclient->WosPtr.gs->GetSpan(off, size, rc, wosfs_ll_read_done);
+}
+
+/*
+ * write: staged writes are a copy into the staging buffer and are answered
+ * inline; unstaged writes are copied once (the request buffer is gone when
+ * this returns) and answered by the PutSpan completion callback, which puts
+ * the pool entry.  A write waits for the PutSpan before it on the same
+ * stream to complete.
+ */
+struct wosfs_ll_write_ctx {
+	fuse_req_t			req;
+	struct wosclient_pool_entry	*wosclient;
+	void				*data;
+	size_t				size;
+	uint64_t			start_ns;
+	uint64_t			offset;
+	uint64_t			hash;		// of the path while tracing
+};
+
+void wosfs_ll_write_done(WosStatus status, WosObjPtr obj, WosCluster::Context ctx)
+{
+	struct wosfs_ll_write_ctx *wc = (struct wosfs_ll_write_ctx *)ctx;
+
+	(void) obj;
+	wosfs_stat_record(WOSFS_ST_WOS_PUTSPAN, wc->start_ns, status, wc->offset, wc->size, wc->hash);
+	if ( status != ok ) {
+		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: PutSpan failed: %s", status.ErrMsg().c_str());
+		fuse_reply_err(wc->req, EIO);
 	}
 	else
-		ps->Close(rstatus, roid);
+		fuse_reply_write(wc->req, wc->size);
 
-        if (rstatus != ok) {
-                WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: OUT : Error in closing PutSteam");
-		//pthread_mutex_unlock(&lock_release);
-		return -errno;
-        }
+	pthread_mutex_lock(&lock_inflight);
+	if ( --wc->wosclient->inflight == 0 )
+		pthread_cond_broadcast(&cond_inflight);
+	pthread_mutex_unlock(&lock_inflight);
+	wosclient_pool_put(wc->wosclient);
 
-        const char *oid_str= roid.c_str();
+	free(wc->data);
+	delete wc;
+}
 
-        FILE * fp;
-	time_t sec;
-	sec = time (NULL);
+static void wosfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+			   size_t size, off_t off, struct fuse_file_info *fi)
+{
+	char path[PATH_MAX];
+	char path2[PATH_MAX];
+	struct wosclient_pool_entry *wosclient = NULL;
+	int res;
 
-	fp = fopen (path, "a+");
-	if ( NULL == fp ) {
-		WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: OUT : failed to open file.  path=%s", path);
-		return -errno;
+	(void) fi;
+	res = wosfs_ll_path(ino, path);
+	if ( res == 0 )
+		res = wosfs_fix_path(path, path2);
+	if ( res == 0 )
+		res = wosfs_write_client(path2, off, size, &wosclient);
+	if ( res || NULL == wosclient ) {
+		fuse_reply_err(req, res ? -res : EIO);
+		return;
 	}
-	
-	fprintf(fp, "%s %s %lu %ld %s %s\n", wosfs_conf.wosfs_magic, oid_str, put_bytes, sec, wosfs_conf.wos_ip, wosfs_conf.wos_policy);
-   	fclose(fp);
 
-	if ( wosfs_conf.wosfs_bak_path ) {
-		char tgt_path[256];
-		memset(tgt_path, 0, 256);
-		int i;
+	if ( 0 != wosfs_conf.wosfs_buffer || (wosfs_conf.wosfs_debug & WOSFS_WR_DROP) ) {
+		struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
 
-		i=strlen(wosfs_conf.wosfs_bak_path);
-		strncpy(tgt_path, wosfs_conf.wosfs_bak_path, i); 
-		strncpy(tgt_path+i, path+strlen(wosfs_conf.wosfs_path), strlen(path)-strlen(wosfs_conf.wosfs_path));
-		WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: OUT : write to backup path: orig path=%s, tgt_path=%s", path, tgt_path);
+		src.buf[0].mem = (void *)buf;
+		res = wosfs_write_data(wosclient, &src, off, size);
+		if ( res == 0 )
+			wosclient->WosPtr.put_bytes += size;
+		wosclient_pool_put(wosclient);
+		if ( res )
+			fuse_reply_err(req, -res);
+		else
+			fuse_reply_write(req, size);
+		return;
+	}
 
-		fp = fopen (tgt_path, "a+");
-		if ( NULL == fp ) {
-	                WOSFS_DEBUGLOG(WOSFS_LOG_ERRORS, ":WOS:: OUT : failed to open file.  path=%s", path);
-		}
-		else {		
-			fprintf(fp, "%s %s %lu %ld %s %s\n", wosfs_conf.wosfs_magic, oid_str, put_bytes, sec, wosfs_conf.wos_ip, wosfs_conf.wos_policy);
-        		fclose(fp);
-		}
-	}	
-	
-	//pthread_mutex_unlock(&lock_release);
-	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: OUT : path=%s, cur number=%d", path, wosclient_pool_count);
-	return res;
+	struct wosfs_ll_write_ctx *wc = new wosfs_ll_write_ctx;
+	wc->req = req;
+	wc->wosclient = wosclient;
+	wc->size = size;
+	wc->data = malloc(size);
+	if ( NULL == wc->data ) {
+		delete wc;
+		wosclient_pool_put(wosclient);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	memcpy(wc->data, buf, size);
+
+	// one PutSpan outstanding per stream, so that they reach WOS in the order written
+	pthread_mutex_lock(&lock_inflight);
+	while ( wosclient->inflight > 0 )
+		pthread_cond_wait(&cond_inflight, &lock_inflight);
+	wosclient->inflight++;
+	pthread_mutex_unlock(&lock_inflight);
+	__sync_fetch_and_add(&wosclient->WosPtr.put_bytes, size);
+
+	wc->start_ns = wosfs_wos_begin(WOSFS_ST_WOS_PUTSPAN, off, size);
+	wc->offset = off;
+	wc->hash = wosfs_trace_on ? wosfs_path_hash(path) : 0;
+	wosclient->WosPtr.ps->PutSpan(wc->data, off, size, wc, wosfs_ll_write_done);
 }
 
-static int wosfs_fsync(const char *path, int isdatasync,
-		     struct fuse_file_info *fi)
+/*
+ * release closes the put stream and appends the stub, which waits on WOS;
+ * it runs on the worker pool and answers from there.  The stream is found
+ * by the path the file was opened at, kept in fi->fh.
+ */
+struct wosfs_ll_release_ctx {
+	struct wosfs_job		job;
+	fuse_req_t			req;
+	struct fuse_file_info		fi;
+	char				opened[PATH_MAX];
+	char				path[PATH_MAX];	// where the stub is now, empty once unlinked
+};
+
+void wosfs_ll_release_run(void *arg)
 {
-	int res = -ENOENT;
+	struct wosfs_ll_release_ctx *rc = (struct wosfs_ll_release_ctx *)arg;
+	char path2[PATH_MAX];
+
+	if ( wosfs_fix_path(rc->opened, path2) == 0 ) {
+		struct wosclient_pool_entry *wosclient = wosclient_pool_lookup(path2);
+
+		// Close may only follow the last PutSpan
+		pthread_mutex_lock(&lock_inflight);
+		while ( wosclient && wosclient->inflight > 0 )
+			pthread_cond_wait(&cond_inflight, &lock_inflight);
+		pthread_mutex_unlock(&lock_inflight);
+		if ( wosclient )
+			wosclient_pool_put(wosclient);
+	}
+	wosfs_release_at(rc->opened, rc->path[0] ? rc->path : NULL, &rc->fi);
+	fuse_reply_err(rc->req, 0);
+	free(rc);
+}
 
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
+static void wosfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct wosfs_ll_release_ctx *rc = (struct wosfs_ll_release_ctx *)malloc(sizeof(struct wosfs_ll_release_ctx));
 
-#if 0
-        char path2[256];
-        memset((void *)&path2, 0, 256);
+	if ( NULL == rc ) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	rc->job.fn = wosfs_ll_release_run;
+	rc->job.arg = rc;
+	rc->req = req;
+	rc->fi = *fi;
+	if ( wosfs_ll_path(ino, rc->path) != 0 )
+		rc->path[0] = '\0';
+	if ( rc->path[0] && wosfs_is_stats_file(rc->path) )
+		strcpy(rc->opened, rc->path);
+	else {
+		char *opened = (char *)(uintptr_t) fi->fh;
 
-        WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: IN : path=%s", path);
-        wosfs_fix_path(path, path2); 
+		strcpy(rc->opened, opened);
+		free(opened);
+	}
+	if ( !wosfs_workq_submit(&rc->job) )
+		wosfs_ll_release_run(rc);
+}
 
-        struct wosclient_pool_entry *wosclient = NULL;
-        wosclient = wosclient_pool_search_in_list_by_path(path2, NULL);
-        if ( NULL != wosclient )        {
-                wosclient->open_count++;
-        	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: path=%s, open_count=%d", path, wosclient->open_count);
-        }
-#endif
+static void wosfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	char path[PATH_MAX];
+	int res = wosfs_ll_path(ino, path);
+
+	if ( res == 0 )
+		res = wosfs_opendir(path, fi);
+	if ( res )
+		fuse_reply_err(req, -res);
+	else if ( fuse_reply_open(req, fi) == -ENOENT )
+		wosfs_releasedir(path, fi);
+}
 
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+/* fuse_fill_dir_t on top of fuse_add_direntry() */
+struct wosfs_ll_dirbuf {
+	fuse_req_t			req;
+	char				*buf;
+	size_t				size;
+	size_t				used;
+};
 
-	(void) path;
-	(void) isdatasync;
-	(void) fi;
+static int wosfs_ll_filler(void *arg, const char *name, const struct stat *st, off_t off)
+{
+	struct wosfs_ll_dirbuf *b = (struct wosfs_ll_dirbuf *)arg;
+	size_t len = fuse_add_direntry(b->req, NULL, 0, name, NULL, 0);
+
+	if ( b->used + len > b->size )
+		return 1;
+	fuse_add_direntry(b->req, b->buf + b->used, b->size - b->used, name, st, off);
+	b->used += len;
 	return 0;
 }
 
-#ifdef HAVE_POSIX_FALLOCATE
-static int wosfs_fallocate(const char *path, int mode,
-			off_t offset, off_t length, struct fuse_file_info *fi)
+static void wosfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+			     struct fuse_file_info *fi)
 {
-	int fd;
-	int res;
-
-	(void) fi;
+	char path[PATH_MAX];
+	struct wosfs_ll_dirbuf b;
+	int res = wosfs_ll_path(ino, path);
 
-	if (mode)
-		return -EOPNOTSUPP;
+	if ( res ) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	b.req = req;
+	b.size = size;
+	b.used = 0;
+	b.buf = (char *)malloc(size);
+	if ( NULL == b.buf ) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	res = wosfs_readdir(path, &b, wosfs_ll_filler, off, fi);
+	if ( res )
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_buf(req, b.buf, b.used);
+	free(b.buf);
+}
 
-	fd = open(path, O_WRONLY);
-	if (fd == -1)
-		return -errno;
+static void wosfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void) ino;
+	wosfs_releasedir(NULL, fi);
+	fuse_reply_err(req, 0);
+}
 
-	res = -posix_fallocate(fd, offset, length);
+static void wosfs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs stbuf;
+	int res;
 
-	close(fd);
-	return res;
+	(void) ino;
+	res = wosfs_statfs("/", &stbuf);
+	if ( res )
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_statfs(req, &stbuf);
 }
-#endif
 
-#ifdef HAVE_SETXATTR
-/* xattr operations are optional and can safely be left unimplemented */
-static int wosfs_setxattr(const char *path, const char *name, const char *value,
-			size_t size, int flags)
+static void wosfs_ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
 {
-	int res = lsetxattr(path, name, value, size, flags);
-	if (res == -1)
-		return -errno;
-	return 0;
+	char path[PATH_MAX];
+	int res = wosfs_ll_path(ino, path);
+
+	if ( res == 0 )
+		res = wosfs_access(path, mask);
+	fuse_reply_err(req, -res);
 }
 
-static int wosfs_getxattr(const char *path, const char *name, char *value,
-			size_t size)
+static void wosfs_ll_init(void *userdata, struct fuse_conn_info *conn)
 {
-	int res = lgetxattr(path, name, value, size);
-	if (res == -1)
-		return -errno;
-	return res;
+	(void) userdata;
+	wosfs_init(conn);
+
+	// fusewos knows the inodes now: let wosfs_notify_inval*() reach the kernel
+	wosfs_kernel_inval_inode = wosfs_ll_inval_inode;
+	wosfs_kernel_inval_entry = wosfs_ll_inval_entry;
 }
 
-static int wosfs_listxattr(const char *path, char *list, size_t size)
+static void wosfs_ll_destroy(void *userdata)
 {
-	int res = llistxattr(path, list, size);
-	if (res == -1)
-		return -errno;
-	return res;
+	wosfs_kernel_inval_inode = NULL;
+	wosfs_kernel_inval_entry = NULL;
+	wosfs_destroy(userdata);
 }
 
-static int wosfs_removexattr(const char *path, const char *name)
+static int wosfs_ll_main(struct fuse_args *args)
 {
-	int res = lremovexattr(path, name);
-	if (res == -1)
-		return -errno;
-	return 0;
-}
-#endif /* HAVE_SETXATTR */
+	struct fuse_session *se;
+	char *mountpoint;
+	int multithreaded;
+	int foreground;
+	int err = -1;
+
+	memset(&wosfs_ll_oper, 0, sizeof(wosfs_ll_oper));
+	wosfs_ll_oper.init = wosfs_ll_init;
+	wosfs_ll_oper.destroy = wosfs_ll_destroy;
+	wosfs_ll_oper.lookup = wosfs_ll_lookup;
+	wosfs_ll_oper.forget = wosfs_ll_forget;
+	wosfs_ll_oper.getattr = wosfs_ll_getattr;
+	wosfs_ll_oper.setattr = wosfs_ll_setattr;
+	wosfs_ll_oper.readlink = wosfs_ll_readlink;
+	wosfs_ll_oper.mknod = wosfs_ll_mknod;
+	wosfs_ll_oper.mkdir = wosfs_ll_mkdir;
+	wosfs_ll_oper.unlink = wosfs_ll_unlink;
+	wosfs_ll_oper.rmdir = wosfs_ll_rmdir;
+	wosfs_ll_oper.symlink = wosfs_ll_symlink;
+	wosfs_ll_oper.rename = wosfs_ll_rename;
+	wosfs_ll_oper.link = wosfs_ll_link;
+	wosfs_ll_oper.open = wosfs_ll_open;
+	wosfs_ll_oper.read = wosfs_ll_read;
+	wosfs_ll_oper.write = wosfs_ll_write;
+	wosfs_ll_oper.release = wosfs_ll_release;
+	wosfs_ll_oper.opendir = wosfs_ll_opendir;
+	wosfs_ll_oper.readdir = wosfs_ll_readdir;
+	wosfs_ll_oper.releasedir = wosfs_ll_releasedir;
+	wosfs_ll_oper.statfs = wosfs_ll_statfs;
+	wosfs_ll_oper.access = wosfs_ll_access;
+	wosfs_ll_oper.create = wosfs_ll_create;
+
+	if ( fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1 )
+		return 1;
+
+	wosfs_ll_chan = fuse_mount(mountpoint, args);
+	if ( NULL == wosfs_ll_chan )
+		return 1;
+
+	se = fuse_lowlevel_new(args, &wosfs_ll_oper, sizeof(wosfs_ll_oper), NULL);
+	if ( se != NULL ) {
+		if ( fuse_set_signal_handlers(se) != -1 ) {
+			fuse_session_add_chan(se, wosfs_ll_chan);
+			if ( fuse_daemonize(foreground) == -1 )
+				err = -1;
+			else if ( !multithreaded )
+				err = fuse_session_loop(se);
+			else if ( wosfs_conf.wosfs_fuse_threads > 0 )
+				err = wosfs_session_loop(se);
+			else
+				err = fuse_session_loop_mt(se);
+			fuse_remove_signal_handlers(se);
+			fuse_session_remove_chan(wosfs_ll_chan);
+		}
+		fuse_session_destroy(se);
+	}
+	fuse_unmount(mountpoint, wosfs_ll_chan);
+	free(mountpoint);
+	fuse_opt_free_args(args);
 
-static struct fuse_operations wosfs_oper = {
-	wosfs_getattr,
-	wosfs_readlink,
-       	NULL, 	// getdir
-	wosfs_mknod,
-	wosfs_mkdir,
-	wosfs_unlink,
-	wosfs_rmdir,
-	wosfs_symlink,
-	wosfs_rename,
-	wosfs_link,
-	wosfs_chmod,
-	wosfs_chown,
-	wosfs_truncate,
-	NULL,	// fgetattr
-	wosfs_open,
-	wosfs_read,
-	wosfs_write,
-	wosfs_statfs,
- 	NULL,	// flush
-	wosfs_release,
-	wosfs_fsync,
-	NULL,	// setxattr
-	NULL,	// getxattr
-	NULL,	// listxattr
-	NULL,	// removexattr
-	NULL,  	// opendir
-	wosfs_readdir,
-	NULL, 	// releasedir
-	NULL, 	// fsyncdir
-	NULL, 	// init
-   	NULL, 	// destroy
-	wosfs_access,
-	NULL, 	// create
-	NULL,	// ftruncate
-	NULL, 	// fgetattr
-	NULL, 	// lock
-	wosfs_utimens, 	// utimens
-	NULL, 	// bmap
-	0,	// flag_nopath and flag_reserve
-	NULL, 	// ioctl
-	NULL, 	// poll
-	NULL, 	// write_buf
-	NULL, 	// read_buf
-	NULL, 	// flock
-	NULL,	// fallocate
-};
+	return err ? 1 : 0;
+}
 
+#endif /* WOSFS_NO_MAIN */
 
 static int wosfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
 {
@@ -1551,6 +8410,34 @@ static int wosfs_opt_proc(void *data, const char *arg, int key, struct fuse_args
                      "    -b path 	   \t   WosFS backup path in local file system tree\n"
                      "    -w <ip address>  \t   WOS cluster IP address to use\n"
                      "    -p policy 	   \t   WOS policy to use\n"
+                     "    --wos_buffer=N   \t   stage writes in N byte buffers before PutSpan (default: 0, off)\n"
+                     "    --wos_buffer_budget=N\t   MB of staging buffers shared by all open files (default: 0, unlimited)\n"
+                     "    --wos_hugepages  \t   back staging buffers with huge pages\n"
+                     "    --wos_hedge=N    \t   hedge slow reads, at most N%% duplicate GetSpan calls (default: 0, off)\n"
+                     "    --wos_hedge_pctl=N\t   latency percentile after which a read is hedged, 1-99 (default: 95)\n"
+                     "    --wos_cache=path \t   local object cache directory, served with splice (default: none)\n"
+                     "    --wos_cache_max=N\t   largest object in MB to keep in the cache (default: 64)\n"
+                     "    --wos_cache_size=N\t   cache size limit in MB (default: 0, unlimited)\n"
+                     "    --wos_dirfd_cache=N\t   directory fds kept open for *at() calls (default: 256, 0 off)\n"
+                     "    --wos_attr_ttl=N \t   ms to cache file attributes and object sizes (default: 1000, 0 off)\n"
+                     "    --wos_threads=N  \t   worker threads for parsing stubs of large directories (default: 4)\n"
+                     "    --wos_kernel_ttl=N\t   entry_timeout and attr_timeout unless given with -o (default: 30 with --wos_lowlevel, else libfuse's)\n"
+                     "    --wos_lowlevel   \t   low-level FUSE API, reads and writes complete asynchronously\n"
+                     "    --wos_fuse_threads=N\t   N fixed fuse workers with cloned /dev/fuse fds (default: 0, libfuse loop)\n"
+                     "    --wos_fuse_pin   \t   pin the fuse workers to the allowed CPUs round robin\n"
+                     "    --wos_trace=path \t   binary trace file, replaced at mount, SIGUSR2 toggles tracing (--wos_debug=16: on at mount)\n"
+                     "    --wos_slow_ms=N  \t   log calls taking N ms or more with their phase breakdown (default: 0, off)\n"
+                     "    --wos_slow_log=path\t   slow call log file (default: syslog)\n"
+                     "    --wos_purge_age=N  \t   purge trashed files after N seconds (default: 0, keep)\n"
+                     "    --wos_purge_quota=N\t   purge the oldest trashed files beyond N MB (default: 0, unlimited)\n"
+                     "    --wos_purge_files=N\t   purge the oldest trashed files beyond N files (default: 0, unlimited)\n"
+                     "    --wos_purge_interval=N\t   seconds between trash can scans (default: 60)\n"
+                     "    --wos_purge_depth=N\t   WOS deletes in flight while purging (default: 16)\n"
+                     "    --wos_purge_rate=N \t   WOS deletes per second while purging (default: 0, unlimited)\n"
+                     "    --wos_trash_shards=N\t   trash can shards per hour bucket, 0 for one flat directory (default: 16)\n"
+                     "    --wos_keep_versions=N\t   compact stubs to their last N versions (default: 0, keep all)\n"
+                     "    --wos_keep_age=N   \t   compact away versions older than N seconds (default: 0, keep all)\n"
+                     "    --wos_snapshot_threads=N\t   threads walking the tree for a snapshot (default: 8)\n"
                      , outargs->argv[0]);
              fuse_opt_add_arg(outargs, "-ho");
              fuse_main(outargs->argc, outargs->argv, &wosfs_oper, NULL);
@@ -1573,11 +8460,12 @@ int fuse_main_real(int argc, char *argv[], const struct fuse_operations *op,
 }
 
 struct fuse_args args;
-int main(int argc, char *argv[])
-{
-	int opt = 0;
 
+/* everything main() does before handing the mount to libfuse, wosfs_bench runs it too */
+int wosfs_setup(int argc, char *argv[])
+{
 	openlog("fusewos", 0, LOG_USER);
+	wosfs_stats_start_ns = wosfs_now_ns();
 
      	args = FUSE_ARGS_INIT(argc, argv);
 
@@ -1588,15 +8476,51 @@ int main(int argc, char *argv[])
 	wosfs_conf.wos_policy= wos_default_policy;
 	wosfs_conf.wosfs_debug = WOSFS_LOG_ERRORS;
 	wosfs_conf.wosfs_buffer = 0;
+	wosfs_conf.wosfs_hedge = 0;
+	wosfs_conf.wosfs_hedge_pctl = 95;
+	wosfs_conf.wosfs_cache_max = 64;
+	wosfs_conf.wosfs_dirfd_cache = 256;
+	wosfs_conf.wosfs_attr_ttl = 1000;
+	wosfs_conf.wosfs_threads = 4;
+	wosfs_conf.wosfs_kernel_ttl = -1;
+	wosfs_conf.wosfs_purge_interval = 60;
+	wosfs_conf.wosfs_purge_depth = 16;
+	wosfs_conf.wosfs_trash_shards = 16;
+	wosfs_conf.wosfs_snapshot_threads = 8;
 
      	fuse_opt_parse(&args, &wosfs_conf, wosfs_opts, wosfs_opt_proc);
+#ifdef WOSFS_FEATURE_TRASHCAN
+	wosfs_compact_on = wosfs_conf.wosfs_keep_versions > 0 || wosfs_conf.wosfs_keep_age > 0;
+#endif
 
 	if ( 0 != wosfs_conf.wosfs_buffer ) 
 		if ( wosfs_conf.wosfs_buffer < WOSFS_1MB )
 			wosfs_conf.wosfs_buffer = WOSFS_1MB;
+	wosfs_conf.wosfs_hedge_pctl = std::max(1, std::min(wosfs_conf.wosfs_hedge_pctl, 99));
+
+	// fusewos is the only writer of the stubs it serves: let the kernel keep entries and attributes
+	// (the low-level frontend passes wosfs_kernel_ttl with every reply instead).  Only the low-level
+	// frontend tells the kernel when fusewos changes a stub, so the high-level one keeps libfuse's
+	// timeouts unless asked for more.
+	if ( wosfs_conf.wosfs_kernel_ttl < 0 )
+		wosfs_conf.wosfs_kernel_ttl = wosfs_conf.wosfs_lowlevel ? 30 : 0;
+	if ( wosfs_conf.wosfs_kernel_ttl > 0 && !wosfs_conf.wosfs_lowlevel ) {
+		bool given = false;
+		for (int i = 1; i < args.argc; i++) {
+			if ( strstr(args.argv[i], "entry_timeout=") || strstr(args.argv[i], "attr_timeout=") )
+				given = true;
+		}
+		if ( !given ) {
+			char ttl_opt[64];
+			snprintf(ttl_opt, sizeof(ttl_opt), "-oentry_timeout=%d,attr_timeout=%d", wosfs_conf.wosfs_kernel_ttl, wosfs_conf.wosfs_kernel_ttl);
+			fuse_opt_add_arg(&args, ttl_opt);
+		}
+	}
 
 	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: wosfs_magic=%s, wosfs_path=%s, wos_ip=%s, wos_policy=%s, wosfs_bak_path=%s, wosfs_debug=%d, wosfs_buffer=%d", wosfs_conf.wosfs_magic, wosfs_conf.wosfs_path, wosfs_conf.wos_ip, wosfs_conf.wos_policy, wosfs_conf.wosfs_bak_path, wosfs_conf.wosfs_debug, wosfs_conf.wosfs_buffer);
 
+	wosfs_path_len = strlen(wosfs_conf.wosfs_path);
+
 #ifdef WOSFS_FEATURE_TRASHCAN
 	wosfs_trashcan_path = (char *)malloc(strlen(wosfs_conf.wosfs_path) + sizeof(WOSFS_TRASHCAN_NAME));	
 	if ( NULL == wosfs_trashcan_path ) {
@@ -1611,6 +8535,9 @@ int main(int argc, char *argv[])
 	}
 	WOSFS_DEBUGLOG(WOSFS_LOG_FILEOP, ":WOS:: wosfs_trashcan_path=%s", wosfs_trashcan_path);
 
+#endif
+#ifdef WOSFS_FEATURE_SNAPSHOTS
+	wosfs_snap_init();
 #endif
 
 
@@ -1650,12 +8577,87 @@ int main(int argc, char *argv[])
         	return 1;
     	}
 
+	if (pthread_mutex_init(&lock_hedge, NULL) != 0)
+    	{
+        	printf("\n mutex init failed\n");
+        	return 1;
+    	}
+
+	if (pthread_mutex_init(&lock_flight, NULL) != 0)
+    	{
+        	printf("\n mutex init failed\n");
+        	return 1;
+    	}
+
+	if (pthread_mutex_init(&wosfs_sbufs.mtx, NULL) != 0 || pthread_cond_init(&wosfs_sbufs.cond, NULL) != 0)
+    	{
+        	printf("\n mutex init failed\n");
+        	return 1;
+    	}
+
+	if (pthread_mutex_init(&lock_cache, NULL) != 0)
+    	{
+        	printf("\n mutex init failed\n");
+        	return 1;
+    	}
+
+	if (pthread_mutex_init(&lock_dirfd, NULL) != 0)
+    	{
+        	printf("\n mutex init failed\n");
+        	return 1;
+    	}
+
+	if ( wosfs_dirfd_init() == false )
+		return 2;
+
+	if (wosfs_attr_init() == false || pthread_mutex_init(&lock_oidmap, NULL) != 0 || pthread_mutex_init(&wosfs_workq.mtx, NULL) != 0 || pthread_cond_init(&wosfs_workq.cond, NULL) != 0)
+    	{
+        	printf("\n mutex init failed\n");
+        	return 1;
+    	}
+
+#ifndef WOSFS_NO_MAIN
+	if (pthread_mutex_init(&lock_inodes, NULL) != 0 || pthread_mutex_init(&lock_inflight, NULL) != 0 || pthread_cond_init(&cond_inflight, NULL) != 0 || wosfs_ll_init_inodes() == false)
+    	{
+        	printf("\n mutex init failed\n");
+        	return 1;
+    	}
+#endif
+
+	if (pthread_key_create(&wosfs_req_key, wosfs_req_free) != 0 || pthread_key_create(&wosfs_stats_key, wosfs_stats_thread_exit) != 0)
+    	{
+        	printf("\n pthread key create failed\n");
+        	return 1;
+    	}
+
+	if ( wosfs_conf.wosfs_cache && wosfs_cache_init() == false )
+		return 2;
+
 	if (wosfs_parse_ns_paths(wosfs_conf.wosfs_path) == false )
 		return 2;
 
 	umask(0);
 
-	wos_b.Connect(wosfs_conf.wos_ip);
+	return 0;
+}
+
+#ifndef WOSFS_NO_MAIN
+int main(int argc, char *argv[])
+{
+	int res = wosfs_setup(argc, argv);
+
+	if ( res )
+		return res;
+
+	if ( wosfs_conf.wosfs_lowlevel )
+		return wosfs_ll_main(&args);
+
+	if ( wosfs_conf.wosfs_fuse_threads > 0 )
+		return wosfs_fuse_main(&args);
 
 	return fuse_main(args.argc, args.argv, &wosfs_oper, NULL);
 }
+#else
+/* wosfs_bench calls the high level callbacks directly */
+const struct fuse_operations *wosfs_bench_oper = &wosfs_oper;
+#endif
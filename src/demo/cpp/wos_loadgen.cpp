@@ -0,0 +1,747 @@
+/**
+ * wos_loadgen.cpp
+ *
+ * A load generator for capacity planning against a WOS cluster, built on
+ * the blocking C++ API like wos_b_demo.
+ *
+ * Each thread draws operations from a put/get/delete mix and object sizes
+ * from a distribution, either as fast as the cluster answers (closed loop)
+ * or at a fixed total target rate (open loop, where latency is counted
+ * from the moment the operation was due, so a cluster that falls behind
+ * shows it in the percentiles).  Objects move either whole (Put/Get) or
+ * as streams in fixed size spans.  Latencies go into log-linear
+ * histograms with about 1% resolution, reported per op as text, CSV or
+ * JSON.
+ *
+ * Size distributions (-s), sizes take K, M and G suffixes:
+ *   fixed:SIZE
+ *   uniform:MIN:MAX
+ *   lognormal:MEDIAN:SIGMA      e.g. lognormal:256K:1.5
+ *   hist:FILE                   lines of "size weight", e.g. from du output
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "wos_obj.hpp"
+#include "wos_cluster.hpp"
+#include "wos_exception.hpp"
+
+/**
+ * The maximum sized object which we can do a whole object Put for.
+ */
+#define WSIZE_MAX (64*1024*1024-512)
+
+using namespace wosapi;
+
+enum OpType { OP_PUT, OP_GET, OP_DELETE, OP_MAX };
+static const char* op_names[OP_MAX] = { "put", "get", "delete" };
+
+static uint64_t now_ns()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Parse "4096", "64K", "1.5M" or "2G"
+ */
+static uint64_t parse_size(const char* s)
+{
+   char* end;
+   double v = strtod(s, &end);
+
+   switch (*end) {
+   case 'k': case 'K': v *= 1024; break;
+   case 'm': case 'M': v *= 1024 * 1024; break;
+   case 'g': case 'G': v *= 1024.0 * 1024 * 1024; break;
+   }
+   return (uint64_t)v;
+}
+
+/**
+ * Class Histogram
+ * Log-linear latency histogram in the spirit of HdrHistogram: values
+ * below 128 get their own bucket, above that every power of two is split
+ * in 64 buckets, so any recorded value is known to within 1.6%.
+ */
+class Histogram
+{
+   static const int SUB = 64;
+   static const int NBUCKETS = 2 * SUB + 58 * SUB;
+
+   uint64_t counts[NBUCKETS];
+   uint64_t n, sum, max;
+
+   static int index(uint64_t v);
+   static uint64_t value(int idx);
+public:
+   Histogram() { Reset(); }
+
+   void Reset();
+   void Record(uint64_t v);
+   void Add(const Histogram& other);
+
+   uint64_t Count() const { return n; }
+   uint64_t Max() const { return max; }
+   double Mean() const { return n ? (double)sum / n : 0; }
+   uint64_t Percentile(double p) const;
+};
+
+void
+Histogram::Reset()
+{
+   memset(counts, 0, sizeof(counts));
+   n = sum = max = 0;
+}
+
+int
+Histogram::index(uint64_t v)
+{
+   if (v < 2 * SUB)
+      return v;
+   int shift = 63 - __builtin_clzll(v) - 6;   // v >> shift is in [64, 128)
+   return 2 * SUB + (shift - 1) * SUB + (int)((v >> shift) - SUB);
+}
+
+/**
+ * The highest value that lands in bucket idx
+ */
+uint64_t
+Histogram::value(int idx)
+{
+   if (idx < 2 * SUB)
+      return idx;
+   int shift = (idx - 2 * SUB) / SUB + 1;
+   uint64_t sub = (idx - 2 * SUB) % SUB + SUB;
+   return ((sub + 1) << shift) - 1;
+}
+
+void
+Histogram::Record(uint64_t v)
+{
+   int idx = index(v);
+   if (idx >= NBUCKETS)
+      idx = NBUCKETS - 1;
+   counts[idx]++;
+   n++;
+   sum += v;
+   if (v > max)
+      max = v;
+}
+
+void
+Histogram::Add(const Histogram& other)
+{
+   for (int i = 0; i < NBUCKETS; ++i)
+      counts[i] += other.counts[i];
+   n += other.n;
+   sum += other.sum;
+   if (other.max > max)
+      max = other.max;
+}
+
+uint64_t
+Histogram::Percentile(double p) const
+{
+   uint64_t want = (uint64_t)ceil(p / 100 * n);
+   uint64_t seen = 0;
+
+   if (want == 0)
+      want = 1;
+   for (int i = 0; i < NBUCKETS; ++i) {
+      seen += counts[i];
+      if (seen >= want)
+         return std::min(value(i), max);
+   }
+   return max;
+}
+
+/**
+ * Class SizeDist
+ * Object sizes drawn from one of the distributions above
+ */
+class SizeDist
+{
+   enum { FIXED, UNIFORM, LOGNORMAL, HIST } kind;
+   uint64_t a, b;
+   double mu, sigma;
+   std::vector<uint64_t> sizes;
+   std::vector<double> cumulative;
+public:
+   std::string desc;
+   uint64_t maxsize;
+
+   bool Parse(const std::string& spec, uint64_t limit);
+   uint64_t Next(unsigned* seed) const;
+};
+
+bool
+SizeDist::Parse(const std::string& spec, uint64_t limit)
+{
+   std::string kind_s = spec.substr(0, spec.find(':'));
+   std::string rest = spec.find(':') == std::string::npos ? "" : spec.substr(spec.find(':') + 1);
+   std::string second = rest.find(':') == std::string::npos ? "" : rest.substr(rest.find(':') + 1);
+
+   desc = spec;
+   if (kind_s == "fixed" && !rest.empty()) {
+      kind = FIXED;
+      a = b = parse_size(rest.c_str());
+   }
+   else if (kind_s == "uniform" && !second.empty()) {
+      kind = UNIFORM;
+      a = parse_size(rest.c_str());
+      b = parse_size(second.c_str());
+      if (b < a)
+         return false;
+   }
+   else if (kind_s == "lognormal" && !second.empty()) {
+      kind = LOGNORMAL;
+      mu = log((double)std::max<uint64_t>(parse_size(rest.c_str()), 1));
+      sigma = atof(second.c_str());
+      a = 0;
+      b = limit;
+   }
+   else if (kind_s == "hist" && !rest.empty()) {
+      kind = HIST;
+      FILE* fp = fopen(rest.c_str(), "r");
+      if (!fp) {
+         perror(rest.c_str());
+         return false;
+      }
+      char line[256], size_s[64];
+      double weight, total = 0;
+      a = limit;
+      b = 0;
+      while (fgets(line, sizeof(line), fp)) {
+         if (line[0] == '#' || sscanf(line, "%63s %lf", size_s, &weight) != 2 || weight <= 0)
+            continue;
+         uint64_t sz = parse_size(size_s);
+         sizes.push_back(sz);
+         cumulative.push_back(total += weight);
+         a = std::min(a, sz);
+         b = std::max(b, sz);
+      }
+      fclose(fp);
+      if (sizes.empty())
+         return false;
+   }
+   else
+      return false;
+
+   maxsize = std::min(b, limit);
+   return true;
+}
+
+uint64_t
+SizeDist::Next(unsigned* seed) const
+{
+   double u = (rand_r(seed) + 0.5) / (RAND_MAX + 1.0);
+   uint64_t v = a;
+
+   switch (kind) {
+   case FIXED:
+      break;
+   case UNIFORM:
+      v = a + (uint64_t)(u * (b - a + 1));
+      break;
+   case LOGNORMAL: {
+      // Box-Muller
+      double u2 = (rand_r(seed) + 0.5) / (RAND_MAX + 1.0);
+      double z = sqrt(-2 * log(u)) * cos(2 * M_PI * u2);
+      v = (uint64_t)exp(mu + sigma * z);
+      break;
+   }
+   case HIST:
+      v = sizes[std::lower_bound(cumulative.begin(), cumulative.end(), u * cumulative.back()) - cumulative.begin()];
+      break;
+   }
+   return std::min(v, maxsize);
+}
+
+/**
+ * Objects written so far, for gets and deletes to pick from
+ */
+class OidPool
+{
+   pthread_mutex_t lock;
+   std::vector<WosOID> oids;
+public:
+   OidPool() { pthread_mutex_init(&lock, 0); }
+
+   void Add(const WosOID& oid);
+   bool Pick(unsigned* seed, WosOID& oid, bool remove);
+   size_t Size() { return oids.size(); }
+};
+
+void
+OidPool::Add(const WosOID& oid)
+{
+   pthread_mutex_lock(&lock);
+   oids.push_back(oid);
+   pthread_mutex_unlock(&lock);
+}
+
+bool
+OidPool::Pick(unsigned* seed, WosOID& oid, bool remove)
+{
+   pthread_mutex_lock(&lock);
+   bool found = !oids.empty();
+   if (found) {
+      size_t i = rand_r(seed) % oids.size();
+      oid = oids[i];
+      if (remove) {
+         oids[i] = oids.back();
+         oids.pop_back();
+      }
+   }
+   pthread_mutex_unlock(&lock);
+   return found;
+}
+
+struct Options {
+   std::string cloud;
+   std::string policy;
+   std::string sizes;
+   std::string format;
+   int nthreads;
+   int mix[OP_MAX];
+   double rate;         // total ops/s, 0 for closed loop
+   double duration;
+   long nops;
+   uint64_t span;       // stream span size, 0 for whole objects
+   int preload;
+
+   Options() : cloud("localhost"), policy("default"), sizes("fixed:4K"), format("text"),
+      nthreads(4), rate(), duration(10), nops(), span(), preload(100)
+   {
+      mix[OP_PUT] = 50;
+      mix[OP_GET] = 50;
+      mix[OP_DELETE] = 0;
+   }
+};
+
+/**
+ * Class LoadGen
+ * Shared state of one run; every worker thread runs Work()
+ */
+class LoadGen
+{
+   WosClusterPtr wos;
+   WosPolicy pol;
+   const Options& opts;
+   SizeDist dist;
+   OidPool pool;
+   char* data;
+   uint64_t datalen;
+   uint64_t start_ns;
+   uint64_t end_ns;
+   pthread_mutex_t lock;
+public:
+   Histogram hist[OP_MAX];
+   uint64_t count[OP_MAX], errors[OP_MAX], bytes[OP_MAX];
+   double elapsed;
+
+   LoadGen(const Options& o) : opts(o), data(), datalen(), start_ns(), end_ns(), elapsed() {}
+   ~LoadGen() { delete [] data; }
+
+   bool Setup();
+   void Run();
+   void Work(int id);
+
+   void Report(FILE* fp);
+private:
+   bool Put(unsigned* seed, uint64_t& len);
+   bool Get(unsigned* seed, uint64_t& len);
+   bool Delete(unsigned* seed);
+};
+
+bool
+LoadGen::Setup()
+{
+   if (!dist.Parse(opts.sizes, opts.span ? WosPutStream::ms_max_obj_size : WSIZE_MAX)) {
+      fprintf(stderr, "bad size distribution %s\n", opts.sizes.c_str());
+      return false;
+   }
+
+   // whole objects are cut from one random buffer, streams reuse one span of it
+   datalen = opts.span ? opts.span : std::max<uint64_t>(dist.maxsize, 1);
+   data = new char[datalen + 4096];
+   for (uint64_t i = 0; i < datalen + 4096; ++i)
+      data[i] = random();
+
+   memset(count, 0, sizeof(count));
+   memset(errors, 0, sizeof(errors));
+   memset(bytes, 0, sizeof(bytes));
+   pthread_mutex_init(&lock, 0);
+
+   try {
+      wos = WosCluster::Connect(opts.cloud);
+      pol = wos->GetPolicy(opts.policy);
+   }
+   catch (WosException& e) {
+      fprintf(stderr, "cannot connect to cluster %s: %s\n", opts.cloud.c_str(), e.what());
+      return false;
+   }
+
+   // something for the first gets and deletes to find
+   unsigned seed = 1;
+   for (int i = 0; i < opts.preload; ++i) {
+      uint64_t len;
+      Put(&seed, len);
+   }
+   return true;
+}
+
+bool
+LoadGen::Put(unsigned* seed, uint64_t& len)
+{
+   WosStatus s;
+   WosOID oid;
+
+   len = dist.Next(seed);
+   if (opts.span == 0) {
+      WosObjPtr w = WosObj::Create();
+      w->SetMeta("loadgen", "1");
+      w->SetData(data + rand_r(seed) % 4096, len);
+      wos->Put(s, oid, pol, w);
+   }
+   else {
+      try {
+         WosPutStreamPtr ps = wos->CreatePutStream(pol);
+         ps->SetMeta("loadgen", "1");
+         for (uint64_t off = 0; off < len && s == wosapi::ok; off += opts.span)
+            ps->PutSpan(s, data, off, std::min(opts.span, len - off));
+         if (s == wosapi::ok)
+            ps->Close(s, oid);
+      }
+      catch (WosException& e) {
+         return false;
+      }
+   }
+
+   if (s != wosapi::ok)
+      return false;
+   pool.Add(oid);
+   return true;
+}
+
+bool
+LoadGen::Get(unsigned* seed, uint64_t& len)
+{
+   WosStatus s;
+   WosOID oid;
+
+   len = 0;
+   if (!pool.Pick(seed, oid, false))
+      return false;
+
+   if (opts.span == 0) {
+      WosObjPtr o;
+      const void* p;
+      wos->Get(s, oid, o);
+      if (s == wosapi::ok && o)
+         o->GetData(p, len);
+   }
+   else {
+      try {
+         WosGetStreamPtr gs = wos->CreateGetStream(oid);
+         uint64_t total = gs->GetLength();
+         for (uint64_t off = 0; off < total && s == wosapi::ok; off += opts.span) {
+            WosObjPtr o;
+            const void* p;
+            uint64_t n = 0;
+            gs->GetSpan(s, o, off, std::min(opts.span, total - off));
+            if (s == wosapi::ok && o)
+               o->GetData(p, n);
+            len += n;
+         }
+      }
+      catch (WosException& e) {
+         return false;
+      }
+   }
+   return s == wosapi::ok;
+}
+
+bool
+LoadGen::Delete(unsigned* seed)
+{
+   WosStatus s;
+   WosOID oid;
+
+   if (!pool.Pick(seed, oid, true))
+      return false;
+   wos->Delete(s, oid);
+   return s == wosapi::ok;
+}
+
+void
+LoadGen::Work(int id)
+{
+   unsigned seed = 1000 + id;
+   Histogram h[OP_MAX];
+   uint64_t c[OP_MAX] = { 0 }, e[OP_MAX] = { 0 }, b[OP_MAX] = { 0 };
+   int total = opts.mix[OP_PUT] + opts.mix[OP_GET] + opts.mix[OP_DELETE];
+   uint64_t period = opts.rate > 0 ? (uint64_t)(1e9 * opts.nthreads / opts.rate) : 0;
+   // spread the threads over one period so open loop arrivals do not come in bursts
+   uint64_t due = start_ns + period * id / opts.nthreads;
+   long limit = opts.nops ? (opts.nops + opts.nthreads - 1 - id) / opts.nthreads : -1;
+
+   for (long i = 0; limit < 0 || i < limit; ++i) {
+      uint64_t t0 = now_ns();
+
+      if (period) {
+         if (due > t0) {
+            struct timespec ts = { (time_t)((due - t0) / 1000000000), (long)((due - t0) % 1000000000) };
+            nanosleep(&ts, 0);
+         }
+         t0 = due;      // open loop: latency includes any time spent behind schedule
+         due += period;
+      }
+      if (limit < 0 && t0 >= end_ns)
+         break;
+
+      int r = rand_r(&seed) % total;
+      OpType op = r < opts.mix[OP_PUT] ? OP_PUT : r < opts.mix[OP_PUT] + opts.mix[OP_GET] ? OP_GET : OP_DELETE;
+      uint64_t len = 0;
+      bool ok;
+
+      switch (op) {
+      case OP_PUT:
+         ok = Put(&seed, len);
+         break;
+      case OP_GET:
+         ok = Get(&seed, len);
+         break;
+      default:
+         ok = Delete(&seed);
+         break;
+      }
+
+      h[op].Record((now_ns() - t0) / 1000);
+      c[op]++;
+      b[op] += len;
+      if (!ok)
+         e[op]++;
+   }
+
+   pthread_mutex_lock(&lock);
+   for (int op = 0; op < OP_MAX; ++op) {
+      hist[op].Add(h[op]);
+      count[op] += c[op];
+      errors[op] += e[op];
+      bytes[op] += b[op];
+   }
+   pthread_mutex_unlock(&lock);
+}
+
+struct WorkArg {
+   LoadGen* lg;
+   int id;
+};
+
+void*
+work(void* x)
+{
+   WorkArg* arg = (WorkArg*) x;
+   arg->lg->Work(arg->id);
+   return 0;
+}
+
+void
+LoadGen::Run()
+{
+   std::vector<pthread_t> threads(opts.nthreads);
+   std::vector<WorkArg> args(opts.nthreads);
+
+   start_ns = now_ns();
+   end_ns = start_ns + (uint64_t)(opts.duration * 1e9);
+   for (int i = 0; i < opts.nthreads; ++i) {
+      args[i].lg = this;
+      args[i].id = i;
+      if (pthread_create(&threads[i], 0, work, &args[i]) != 0)
+         printf("error: thread create\n");
+   }
+   for (int i = 0; i < opts.nthreads; ++i)
+      pthread_join(threads[i], 0);
+   elapsed = (now_ns() - start_ns) / 1e9;
+}
+
+void
+LoadGen::Report(FILE* fp)
+{
+   static const double pctls[] = { 50, 90, 99, 99.9, 99.99 };
+   static const char* pnames[] = { "p50", "p90", "p99", "p99.9", "p99.99" };
+   const int npctls = sizeof(pctls) / sizeof(pctls[0]);
+
+   if (opts.format == "json") {
+      fprintf(fp, "{\"cluster\":\"%s\",\"policy\":\"%s\",\"threads\":%d,\"sizes\":\"%s\",\"mode\":\"%s\","
+         "\"target_rate\":%.1f,\"seconds\":%.3f,\"ops\":[", opts.cloud.c_str(), opts.policy.c_str(),
+         opts.nthreads, opts.sizes.c_str(), opts.span ? "stream" : "whole", opts.rate, elapsed);
+      bool first = true;
+      for (int op = 0; op < OP_MAX; ++op) {
+         if (!count[op])
+            continue;
+         fprintf(fp, "%s\n {\"op\":\"%s\",\"count\":%lu,\"errors\":%lu,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,"
+            "\"mean_us\":%.1f", first ? "" : ",", op_names[op], count[op], errors[op], count[op] / elapsed,
+            bytes[op] / elapsed / (1024 * 1024), hist[op].Mean());
+         for (int i = 0; i < npctls; ++i)
+            fprintf(fp, ",\"%s_us\":%lu", pnames[i], hist[op].Percentile(pctls[i]));
+         fprintf(fp, ",\"max_us\":%lu}", hist[op].Max());
+         first = false;
+      }
+      fprintf(fp, "\n]}\n");
+   }
+   else if (opts.format == "csv") {
+      fprintf(fp, "op,count,errors,ops_per_sec,mb_per_sec,mean_us");
+      for (int i = 0; i < npctls; ++i)
+         fprintf(fp, ",%s_us", pnames[i]);
+      fprintf(fp, ",max_us\n");
+      for (int op = 0; op < OP_MAX; ++op) {
+         if (!count[op])
+            continue;
+         fprintf(fp, "%s,%lu,%lu,%.1f,%.2f,%.1f", op_names[op], count[op], errors[op], count[op] / elapsed,
+            bytes[op] / elapsed / (1024 * 1024), hist[op].Mean());
+         for (int i = 0; i < npctls; ++i)
+            fprintf(fp, ",%lu", hist[op].Percentile(pctls[i]));
+         fprintf(fp, ",%lu\n", hist[op].Max());
+      }
+   }
+   else {
+      fprintf(fp, "%d threads, %s, %s objects, %.1f s, %s\n", opts.nthreads, opts.sizes.c_str(),
+         opts.span ? "streamed" : "whole", elapsed,
+         opts.rate > 0 ? "open loop" : "closed loop");
+      fprintf(fp, "%-7s %10s %7s %10s %9s %9s", "op", "count", "errors", "ops/s", "MB/s", "mean_us");
+      for (int i = 0; i < npctls; ++i)
+         fprintf(fp, " %9s", pnames[i]);
+      fprintf(fp, " %9s\n", "max");
+      for (int op = 0; op < OP_MAX; ++op) {
+         if (!count[op])
+            continue;
+         fprintf(fp, "%-7s %10lu %7lu %10.1f %9.2f %9.1f", op_names[op], count[op], errors[op],
+            count[op] / elapsed, bytes[op] / elapsed / (1024 * 1024), hist[op].Mean());
+         for (int i = 0; i < npctls; ++i)
+            fprintf(fp, " %9lu", hist[op].Percentile(pctls[i]));
+         fprintf(fp, " %9lu\n", hist[op].Max());
+      }
+   }
+}
+
+void usage(char* cmd) {
+   printf("usage: %s [-h] [-c cloud-name] [-p policy] [-t thcount] [-s sizes] [-m mix] [-r rate]\n"
+          "          [-d seconds | -n ops] [-S span] [-P preload] [-o text|csv|json]\n", cmd);
+   printf("  -h:          help: this message\n");
+   printf("  -c:          cloud name\n");
+   printf("  -p:          policy\n");
+   printf("  -t:          thread-count (default 4)\n");
+   printf("  -s:          object sizes: fixed:SIZE, uniform:MIN:MAX, lognormal:MEDIAN:SIGMA\n");
+   printf("               or hist:FILE (default fixed:4K)\n");
+   printf("  -m:          op mix, e.g. put:70,get:25,delete:5 (default put:50,get:50)\n");
+   printf("  -r:          open loop at this total rate in ops/s (default: closed loop)\n");
+   printf("  -d:          run time in seconds (default 10)\n");
+   printf("  -n:          run this many ops in total instead\n");
+   printf("  -S:          stream objects in spans of this size (default: whole objects)\n");
+   printf("  -P:          objects to put before measuring (default 100)\n");
+   printf("  -o:          output format (default text)\n");
+}
+
+bool parse_mix(const char* s, int* mix) {
+   std::string str(s);
+   size_t pos = 0;
+
+   mix[OP_PUT] = mix[OP_GET] = mix[OP_DELETE] = 0;
+   while (pos < str.size()) {
+      size_t end = str.find(',', pos);
+      std::string item = str.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+      size_t colon = item.find(':');
+      int op;
+
+      for (op = 0; op < OP_MAX; ++op)
+         if (colon != std::string::npos && item.substr(0, colon) == op_names[op])
+            break;
+      if (op == OP_MAX)
+         return false;
+      mix[op] = atoi(item.c_str() + colon + 1);
+      if (end == std::string::npos)
+         break;
+      pos = end + 1;
+   }
+   return mix[OP_PUT] + mix[OP_GET] + mix[OP_DELETE] > 0;
+}
+
+int
+main(int argc, char** argv)
+{
+   Options opts;
+   int opt;
+
+   while ((opt = getopt(argc, argv, "hc:p:t:s:m:r:d:n:S:P:o:")) > 0) {
+      switch (opt) {
+      case 'c':
+         opts.cloud = std::string(optarg);
+         break;
+      case 'p':
+         opts.policy = std::string(optarg);
+         break;
+      case 't':
+         opts.nthreads = std::max(atoi(optarg), 1);
+         break;
+      case 's':
+         opts.sizes = std::string(optarg);
+         break;
+      case 'm':
+         if (!parse_mix(optarg, opts.mix)) {
+            printf("bad op mix %s\n", optarg);
+            exit(1);
+         }
+         break;
+      case 'r':
+         opts.rate = atof(optarg);
+         break;
+      case 'd':
+         opts.duration = atof(optarg);
+         break;
+      case 'n':
+         opts.nops = atol(optarg);
+         break;
+      case 'S':
+         opts.span = parse_size(optarg);
+         break;
+      case 'P':
+         opts.preload = atoi(optarg);
+         break;
+      case 'o':
+         opts.format = std::string(optarg);
+         if (opts.format != "text" && opts.format != "csv" && opts.format != "json") {
+            usage(argv[0]);
+            exit(1);
+         }
+         break;
+      default:
+         usage(argv[0]);
+         exit(1);
+      }
+   }
+   if (optind != argc) {
+      usage(argv[0]);
+      exit(1);
+   }
+
+   LoadGen lg(opts);
+   if (!lg.Setup())
+      return 1;
+   lg.Run();
+   lg.Report(stdout);
+
+   return 0;
+}
@@ -0,0 +1,687 @@
+/*
+ * wosfs_bench.cpp
+ *
+ * Drives the fusewos high level callbacks in-process, without a kernel
+ * mount, from many threads and prints one JSON object with ops/s and
+ * latency percentiles per workload.  Meant to be linked against
+ * libwoslocal (make WOS=local wosfs_bench) so runs are repeatable.
+ *
+ * usage: wosfs_bench [-t threads] [-n ops] [-s size] [-r repeats] [-m ms] [-w list]
+ *                    [-o out.json] [-b baseline.json] [-T pct] [-- fusewos options]
+ *   -t threads   client threads (default 8)
+ *   -n ops       operations per thread and workload (default 500)
+ *   -s size      bytes of each seqwrite/seqread file per thread (default 8MB)
+ *   -r repeats   runs of each workload at least (default 5)
+ *   -m ms        run a workload again until its runs took ms in total, up to
+ *                BENCH_MAX_REPEATS runs (default 200); ops/s and latency
+ *                percentiles are the medians over the runs
+ *   -w list      comma separated workloads (default all):
+ *                create getattr seqwrite seqread randread rewrite trash
+ *   -o file      also write the JSON to file, e.g. to keep as a baseline
+ *   -b file      compare with a baseline written by -o: exit 1 if any
+ *                workload lost more than pct of its median ops/s or its p99
+ *                grew by more than pct
+ *   -T pct       regression tolerance in percent (default 10)
+ *
+ * Without -l among the fusewos options the stubs go to a fresh directory
+ * under /tmp, removed on exit; the WOS side is whatever libwoslocal is set
+ * up for through WOSLOCAL or -w (see woslocal.cpp).  Every run of create
+ * and seqwrite leaves its objects there.
+ */
+#define FUSE_USE_VERSION 		26
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include <fuse.h>
+
+#include <vector>
+#include <string>
+#include <algorithm>
+
+extern int wosfs_setup(int argc, char *argv[]);
+extern const struct fuse_operations *wosfs_bench_oper;
+
+#define BENCH_IO_SIZE		(128 * 1024)
+#define BENCH_SMALL_SIZE	4096
+#define BENCH_WIDE_FILES	2000
+#define BENCH_MAX_REPEATS	25
+
+static const struct fuse_operations *ops;
+static int nthreads = 8;
+static int nops = 500;
+static size_t file_size = 8 * 1024 * 1024;
+static int repeats = 5;
+static int min_ms = 200;
+static int rep;			// run of the current workload, create and trash use files of their own per run
+static int created_reps;	// runs of create, whose files trash deletes
+static char root[64];
+static char stubdir[] = "/tmp/wosfs_bench.XXXXXX";
+
+struct bench_result {
+	std::string			name;
+	int				repeats;
+	uint64_t			ops;		// totals over all runs
+	uint64_t			errors;
+	uint64_t			bytes;
+	double				seconds;
+	double				ops_per_sec, mb_per_sec;	// medians over the runs
+	double				p50_us, p90_us, p99_us, p999_us, max_us;
+};
+
+struct bench_thread {
+	pthread_t			tid;
+	int				id;
+	unsigned int			seed;
+	void				(*fn)(struct bench_thread *);
+	std::vector<uint64_t>		lat_ns;
+	uint64_t			errors;
+	uint64_t			bytes;
+};
+
+static pthread_barrier_t bench_start;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void done(struct bench_thread *t, uint64_t start, int res)
+{
+	t->lat_ns.push_back(now_ns() - start);
+	if ( res < 0 )
+		t->errors++;
+}
+
+/* what the kernel and libfuse do for creat(), write() and close() of a new file */
+static int create_file(const char *path, size_t size, const char *data)
+{
+	struct fuse_file_info fi;
+	int res;
+
+	res = ops->mknod(path, S_IFREG | 0644, 0);
+	if ( res < 0 )
+		return res;
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_WRONLY;
+	res = ops->open(path, &fi);
+	if ( res < 0 )
+		return res;
+	for (size_t off = 0; off < size && res >= 0; off += BENCH_IO_SIZE)
+		res = ops->write(path, data, std::min(size - off, (size_t)BENCH_IO_SIZE), off, &fi);
+	ops->release(path, &fi);
+	return res < 0 ? res : 0;
+}
+
+/* read through read_buf as libfuse does, copying out what it hands back */
+static int read_range(const char *path, char *dst, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec *src = NULL;
+	struct fuse_bufvec out = FUSE_BUFVEC_INIT(size);
+	int res;
+
+	res = ops->read_buf(path, &src, size, off, fi);
+	if ( res < 0 )
+		return res;
+	out.buf[0].mem = dst;
+	res = fuse_buf_copy(&out, src, (enum fuse_buf_copy_flags)0);
+	for (size_t i = 0; i < src->count; i++)
+		if ( !(src->buf[i].flags & FUSE_BUF_IS_FD) )
+			free(src->buf[i].mem);
+	free(src);
+	return res;
+}
+
+static char *pattern(size_t size)
+{
+	char *buf = (char *)malloc(size);
+
+	for (size_t i = 0; i < size; i++)
+		buf[i] = (char)(i * 31 + 7);
+	return buf;
+}
+
+static void path_of(char *path, const char *dir, int t, int i)
+{
+	snprintf(path, PATH_MAX, "%s/%s/t%d.%d", root, dir, t, i);
+}
+
+/* small file create storm: mknod, open, one 4KB write, release */
+static void wl_create(struct bench_thread *t)
+{
+	char path[PATH_MAX];
+	char *data = pattern(BENCH_SMALL_SIZE);
+
+	for (int i = 0; i < nops; i++) {
+		path_of(path, "small", t->id, rep * nops + i);
+		uint64_t start = now_ns();
+		done(t, start, create_file(path, BENCH_SMALL_SIZE, data));
+		t->bytes += BENCH_SMALL_SIZE;
+	}
+	free(data);
+}
+
+/* getattr storm on random entries of one wide directory */
+static void wl_getattr(struct bench_thread *t)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	for (int i = 0; i < nops; i++) {
+		snprintf(path, sizeof(path), "%s/wide/f%d", root, rand_r(&t->seed) % BENCH_WIDE_FILES);
+		uint64_t start = now_ns();
+		done(t, start, ops->getattr(path, &st));
+	}
+}
+
+/* one file_size file per thread written in 128KB chunks, a new version of it on later runs */
+static void wl_seqwrite(struct bench_thread *t)
+{
+	char path[PATH_MAX];
+	char *data = pattern(BENCH_IO_SIZE);
+	struct fuse_file_info fi;
+	int res;
+
+	path_of(path, "large", t->id, 0);
+	res = ops->mknod(path, S_IFREG | 0644, 0);
+	if ( res == -EEXIST && rep > 0 )
+		res = 0;
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_WRONLY;
+	if ( res < 0 || (res = ops->open(path, &fi)) < 0 ) {
+		t->errors++;
+		free(data);
+		return;
+	}
+	for (size_t off = 0; off < file_size; off += BENCH_IO_SIZE) {
+		uint64_t start = now_ns();
+		res = ops->write(path, data, BENCH_IO_SIZE, off, &fi);
+		done(t, start, res);
+		if ( res > 0 )
+			t->bytes += res;
+	}
+	// the WOS close happens in release, count it as one more op
+	uint64_t start = now_ns();
+	done(t, start, ops->release(path, &fi));
+	free(data);
+}
+
+static void wl_seqread(struct bench_thread *t)
+{
+	char path[PATH_MAX];
+	char *buf = (char *)malloc(BENCH_IO_SIZE);
+	struct fuse_file_info fi;
+	int res;
+
+	path_of(path, "large", t->id, 0);
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDONLY;
+	if ( ops->open(path, &fi) < 0 ) {
+		t->errors++;
+		free(buf);
+		return;
+	}
+	for (size_t off = 0; off < file_size; off += BENCH_IO_SIZE) {
+		uint64_t start = now_ns();
+		res = read_range(path, buf, BENCH_IO_SIZE, off, &fi);
+		done(t, start, res);
+		if ( res > 0 )
+			t->bytes += res;
+	}
+	ops->release(path, &fi);
+	free(buf);
+}
+
+/* 4KB reads at random offsets of the seqwrite files of all threads */
+static void wl_randread(struct bench_thread *t)
+{
+	char path[PATH_MAX];
+	char buf[BENCH_SMALL_SIZE];
+	struct fuse_file_info fi;
+	int res;
+
+	for (int i = 0; i < nops; i++) {
+		path_of(path, "large", rand_r(&t->seed) % nthreads, 0);
+		off_t off = (off_t)(rand_r(&t->seed) % (file_size / BENCH_SMALL_SIZE)) * BENCH_SMALL_SIZE;
+		memset(&fi, 0, sizeof(fi));
+		fi.flags = O_RDONLY;
+		uint64_t start = now_ns();
+		res = ops->open(path, &fi);
+		if ( res == 0 ) {
+			res = read_range(path, buf, sizeof(buf), off, &fi);
+			ops->release(path, &fi);
+		}
+		done(t, start, res);
+		if ( res > 0 )
+			t->bytes += res;
+	}
+}
+
+/* rewrite one small file over and over, each release adds a version to its stub */
+static void wl_rewrite(struct bench_thread *t)
+{
+	char path[PATH_MAX];
+	char *data = pattern(BENCH_SMALL_SIZE);
+	struct fuse_file_info fi;
+	int res;
+
+	path_of(path, "small", t->id, 0);
+	for (int i = 0; i < nops; i++) {
+		memset(&fi, 0, sizeof(fi));
+		fi.flags = O_WRONLY;
+		uint64_t start = now_ns();
+		res = ops->open(path, &fi);
+		if ( res == 0 ) {
+			res = ops->write(path, data, BENCH_SMALL_SIZE, 0, &fi);
+			int r2 = ops->release(path, &fi);
+			if ( res >= 0 )
+				res = r2;
+		}
+		done(t, start, res);
+		t->bytes += BENCH_SMALL_SIZE;
+	}
+	free(data);
+}
+
+/* delete the create storm files, which moves them to the trash can */
+static void wl_trash(struct bench_thread *t)
+{
+	char path[PATH_MAX];
+
+	for (int i = 0; i < nops; i++) {
+		path_of(path, "small", t->id, rep * nops + i);
+		uint64_t start = now_ns();
+		done(t, start, ops->unlink(path));
+	}
+}
+
+static void *bench_thread_main(void *arg)
+{
+	struct bench_thread *t = (struct bench_thread *)arg;
+
+	pthread_barrier_wait(&bench_start);
+	t->fn(t);
+	return NULL;
+}
+
+static double pctl(const std::vector<uint64_t>& v, double p)
+{
+	if ( v.empty() )
+		return 0;
+	size_t i = (size_t)(p * v.size());
+	return v[std::min(i, v.size() - 1)] / 1000.0;
+}
+
+static double median(std::vector<double> v)
+{
+	std::sort(v.begin(), v.end());
+	return v.size() % 2 ? v[v.size() / 2] : (v[v.size() / 2 - 1] + v[v.size() / 2]) / 2;
+}
+
+/* one run of fn on all threads */
+static struct bench_result run_once(const char *name, void (*fn)(struct bench_thread *))
+{
+	std::vector<bench_thread> threads(nthreads);
+	std::vector<uint64_t> all;
+	struct bench_result r;
+	uint64_t start;
+
+	pthread_barrier_init(&bench_start, NULL, nthreads + 1);
+	for (int i = 0; i < nthreads; i++) {
+		threads[i].id = i;
+		threads[i].seed = 1 + i;
+		threads[i].fn = fn;
+		threads[i].errors = 0;
+		threads[i].bytes = 0;
+		pthread_create(&threads[i].tid, NULL, bench_thread_main, &threads[i]);
+	}
+	start = now_ns();
+	pthread_barrier_wait(&bench_start);
+
+	r.name = name;
+	r.errors = r.bytes = 0;
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].tid, NULL);
+		all.insert(all.end(), threads[i].lat_ns.begin(), threads[i].lat_ns.end());
+		r.errors += threads[i].errors;
+		r.bytes += threads[i].bytes;
+	}
+	r.seconds = (now_ns() - start) / 1e9;
+	pthread_barrier_destroy(&bench_start);
+
+	std::sort(all.begin(), all.end());
+	r.ops = all.size();
+	r.p50_us = pctl(all, 0.50);
+	r.p90_us = pctl(all, 0.90);
+	r.p99_us = pctl(all, 0.99);
+	r.p999_us = pctl(all, 0.999);
+	r.max_us = all.empty() ? 0 : all.back() / 1000.0;
+	r.ops_per_sec = r.ops / r.seconds;
+	r.mb_per_sec = r.bytes / r.seconds / (1024 * 1024);
+	r.repeats = 1;
+	return r;
+}
+
+/*
+ * Run fn repeats times, and again while the runs took less than min_ms in
+ * total.  A single short run is mostly noise, so ops/s and the percentiles
+ * reported and gated on are the medians over the runs.  before, if set,
+ * prepares each run untimed.
+ */
+static struct bench_result run(const char *name, void (*fn)(struct bench_thread *), void (*before)(void) = NULL)
+{
+	std::vector<double> ops_per_sec, mb_per_sec, p50, p90, p99, p999;
+	struct bench_result r;
+	double total = 0;
+
+	r.name = name;
+	r.ops = r.errors = r.bytes = 0;
+	r.max_us = 0;
+	for (rep = 0; rep < BENCH_MAX_REPEATS && (rep < repeats || total * 1000 < min_ms); rep++) {
+		if ( before )
+			before();
+		struct bench_result one = run_once(name, fn);
+
+		total += one.seconds;
+		r.ops += one.ops;
+		r.errors += one.errors;
+		r.bytes += one.bytes;
+		r.max_us = std::max(r.max_us, one.max_us);
+		ops_per_sec.push_back(one.ops_per_sec);
+		mb_per_sec.push_back(one.mb_per_sec);
+		p50.push_back(one.p50_us);
+		p90.push_back(one.p90_us);
+		p99.push_back(one.p99_us);
+		p999.push_back(one.p999_us);
+	}
+	r.repeats = rep;
+	r.seconds = total;
+	r.ops_per_sec = median(ops_per_sec);
+	r.mb_per_sec = median(mb_per_sec);
+	r.p50_us = median(p50);
+	r.p90_us = median(p90);
+	r.p99_us = median(p99);
+	r.p999_us = median(p999);
+	fprintf(stderr, "%-10s %8lu ops %3d runs %8.2f s %10.1f ops/s p99 %8.1f us errors %lu\n",
+		name, r.ops, r.repeats, r.seconds, r.ops_per_sec, r.p99_us, r.errors);
+	return r;
+}
+
+static void mkdirs(void)
+{
+	char path[PATH_MAX];
+
+	ops->mkdir(root, 0755);
+	snprintf(path, sizeof(path), "%s/small", root);
+	ops->mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/large", root);
+	ops->mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/wide", root);
+	ops->mkdir(path, 0755);
+}
+
+/* untimed setup for workloads run without the one that makes their files: files first..first+count-1, of each thread but in wide */
+static void prepare(const char *dir, int first, int count, size_t size)
+{
+	char path[PATH_MAX];
+	char *data = pattern(std::max(size, (size_t)BENCH_IO_SIZE));
+	bool wide = strcmp(dir, "wide") == 0;
+
+	for (int t = 0; t < (wide ? 1 : nthreads); t++) {
+		for (int i = first; i < first + count; i++) {
+			if ( wide )
+				snprintf(path, sizeof(path), "%s/wide/f%d", root, i);
+			else
+				path_of(path, dir, t, i);
+			create_file(path, size, data);
+		}
+	}
+	free(data);
+}
+
+/* trash deletes the files of one create run, make them for runs create did not have */
+static void before_trash(void)
+{
+	if ( rep >= created_reps )
+		prepare("small", rep * nops, nops, BENCH_SMALL_SIZE);
+}
+
+static int remove_one(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	(void) st;
+	(void) flag;
+	(void) ftw;
+	remove(path);
+	return 0;
+}
+
+/* atexit: the scratch stub directory goes with the run */
+static void remove_stubdir(void)
+{
+	nftw(stubdir, remove_one, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+static std::string to_json(const std::vector<bench_result>& res)
+{
+	std::string s = "{\"threads\":";
+	char buf[512];
+
+	snprintf(buf, sizeof(buf), "%d,\"ops_per_thread\":%d,\"file_size\":%zu,\"workloads\":[", nthreads, nops, file_size);
+	s += buf;
+	for (size_t i = 0; i < res.size(); i++) {
+		const bench_result& r = res[i];
+		snprintf(buf, sizeof(buf), "%s\n {\"name\":\"%s\",\"repeats\":%d,\"ops\":%lu,\"errors\":%lu,\"seconds\":%.3f,"
+			"\"ops_per_sec\":%.1f,\"mb_per_sec\":%.1f,\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,"
+			"\"p999_us\":%.1f,\"max_us\":%.1f}", i ? "," : "", r.name.c_str(), r.repeats, r.ops, r.errors, r.seconds,
+			r.ops_per_sec, r.mb_per_sec, r.p50_us, r.p90_us, r.p99_us, r.p999_us, r.max_us);
+		s += buf;
+	}
+	s += "\n]}\n";
+	return s;
+}
+
+/* the value of key in the workload object named name of a to_json() file */
+static bool baseline_value(const std::string& json, const char *name, const char *key, double *val)
+{
+	std::string tag = std::string("\"name\":\"") + name + "\"";
+	size_t pos = json.find(tag);
+	if ( pos == std::string::npos )
+		return false;
+	size_t end = json.find('}', pos);
+	size_t k = json.find(std::string("\"") + key + "\":", pos);
+	if ( k == std::string::npos || k > end )
+		return false;
+	*val = strtod(json.c_str() + k + strlen(key) + 3, NULL);
+	return true;
+}
+
+static int compare(const char *file, const std::vector<bench_result>& res, double tol)
+{
+	std::string json;
+	char buf[4096];
+	size_t n;
+	int regressions = 0;
+
+	FILE *fp = fopen(file, "r");
+	if ( fp == NULL ) {
+		perror(file);
+		return 2;
+	}
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		json.append(buf, n);
+	fclose(fp);
+
+	for (size_t i = 0; i < res.size(); i++) {
+		const char *name = res[i].name.c_str();
+		double base_ops, base_p99;
+
+		if ( !baseline_value(json, name, "ops_per_sec", &base_ops) || !baseline_value(json, name, "p99_us", &base_p99) ) {
+			fprintf(stderr, "%-10s not in baseline\n", name);
+			continue;
+		}
+		double ops_s = res[i].ops_per_sec;
+		if ( ops_s < base_ops * (1 - tol / 100) ) {
+			printf("REGRESSION %s ops_per_sec %.1f < baseline %.1f (-%.1f%%)\n", name, ops_s, base_ops,
+				100 * (base_ops - ops_s) / base_ops);
+			regressions++;
+		}
+		if ( res[i].p99_us > base_p99 * (1 + tol / 100) ) {
+			printf("REGRESSION %s p99_us %.1f > baseline %.1f (+%.1f%%)\n", name, res[i].p99_us, base_p99,
+				100 * (res[i].p99_us - base_p99) / base_p99);
+			regressions++;
+		}
+		if ( res[i].errors ) {
+			printf("REGRESSION %s %lu errors\n", name, res[i].errors);
+			regressions++;
+		}
+	}
+	return regressions ? 1 : 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-t threads] [-n ops] [-s size] [-r repeats] [-m ms] [-w list] [-o out.json] [-b baseline.json] [-T pct] [-- fusewos options]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *workloads = "create,getattr,seqwrite,seqread,randread,rewrite,trash";
+	const char *out = NULL, *baseline = NULL;
+	double tol = 10;
+	int c;
+
+	while ((c = getopt(argc, argv, "t:n:s:r:m:w:o:b:T:")) != -1) {
+		switch (c) {
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'n':
+			nops = atoi(optarg);
+			break;
+		case 's':
+			file_size = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			repeats = atoi(optarg);
+			break;
+		case 'm':
+			min_ms = atoi(optarg);
+			break;
+		case 'w':
+			workloads = optarg;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'b':
+			baseline = optarg;
+			break;
+		case 'T':
+			tol = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if ( nthreads < 1 || nops < 1 || file_size < BENCH_IO_SIZE || repeats < 1 || repeats > BENCH_MAX_REPEATS || min_ms < 0 )
+		usage(argv[0]);
+	file_size -= file_size % BENCH_IO_SIZE;
+
+	// the rest goes to fusewos, with a scratch stub directory unless -l was given
+	std::vector<char *> fargv;
+	bool have_l = false;
+
+	fargv.push_back(argv[0]);
+	for (int i = optind; i < argc; i++) {
+		if ( strncmp(argv[i], "-l", 2) == 0 )
+			have_l = true;
+		fargv.push_back(argv[i]);
+	}
+	if ( !have_l ) {
+		if ( mkdtemp(stubdir) == NULL ) {
+			perror("mkdtemp");
+			return 2;
+		}
+		atexit(remove_stubdir);
+		fargv.push_back((char *)"-l");
+		fargv.push_back(stubdir);
+	}
+	fargv.push_back(NULL);
+	if ( wosfs_setup(fargv.size() - 1, &fargv[0]) != 0 )
+		return 2;
+
+	ops = wosfs_bench_oper;
+	struct fuse_conn_info conn;
+	memset(&conn, 0, sizeof(conn));
+	ops->init(&conn);
+
+	snprintf(root, sizeof(root), "/bench.%d", (int)getpid());
+	mkdirs();
+
+	std::string list = std::string(",") + workloads + ",";
+	bool written = false;
+	std::vector<bench_result> res;
+
+#define WANT(name)	(list.find("," name ",") != std::string::npos)
+	if ( WANT("create") ) {
+		res.push_back(run("create", wl_create));
+		created_reps = res.back().repeats;
+	}
+	if ( WANT("getattr") ) {
+		prepare("wide", 0, BENCH_WIDE_FILES, 0);
+		res.push_back(run("getattr", wl_getattr));
+	}
+	if ( WANT("seqwrite") ) {
+		res.push_back(run("seqwrite", wl_seqwrite));
+		written = true;
+	}
+	if ( (WANT("seqread") || WANT("randread")) && !written ) {
+		char path[PATH_MAX];
+		char *data = pattern(BENCH_IO_SIZE);
+
+		for (int i = 0; i < nthreads; i++) {
+			path_of(path, "large", i, 0);
+			create_file(path, file_size, data);
+		}
+		free(data);
+	}
+	if ( WANT("seqread") )
+		res.push_back(run("seqread", wl_seqread));
+	if ( WANT("randread") )
+		res.push_back(run("randread", wl_randread));
+	if ( WANT("rewrite") && created_reps == 0 )
+		prepare("small", 0, 1, BENCH_SMALL_SIZE);
+	if ( WANT("rewrite") )
+		res.push_back(run("rewrite", wl_rewrite));
+	if ( WANT("trash") )
+		res.push_back(run("trash", wl_trash, before_trash));
+#undef WANT
+
+	ops->destroy(NULL);
+
+	std::string json = to_json(res);
+	fputs(json.c_str(), stdout);
+	if ( out ) {
+		FILE *fp = fopen(out, "w");
+		if ( fp == NULL || fputs(json.c_str(), fp) < 0 || fclose(fp) != 0 ) {
+			perror(out);
+			return 2;
+		}
+	}
+	if ( baseline )
+		return compare(baseline, res, tol);
+	return 0;
+}
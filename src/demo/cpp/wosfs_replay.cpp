@@ -0,0 +1,655 @@
+/*
+ * wosfs_replay.cpp
+ *
+ * Re-issues the callbacks of a fusewos --wos_trace file, either as system
+ * calls under a mount (-m) or straight into the fusewos callbacks linked
+ * in, as wosfs_bench does, and compares the latencies with the traced ones.
+ *
+ * usage: wosfs_replay [-m mountpoint] [-s speed] [-p] [-D] tracefile [-- fusewos options]
+ *   -m dir    replay with system calls under dir instead of in-process
+ *   -s speed  1 replays at the traced pace (default), 2 twice as fast,
+ *             0 as fast as the dependencies below allow
+ *   -p        first create the files and directories the trace uses but
+ *             does not create itself; the default in-process without -l
+ *   -D        ignore dependencies between threads
+ *
+ * Every traced thread gets a replay thread that issues its calls in
+ * order.  A call also waits for the last call of another thread on the
+ * same path, its second path or its parent directory, if that call had
+ * finished before this one started in the trace, so e.g. a read is never
+ * replayed ahead of the create in another thread it depended on.  WOS
+ * calls are not replayed, they follow from the callbacks.
+ *
+ * Needs the <trace>.paths file fusewos writes next to the trace.  The
+ * trace carries no data, writes replay a fixed pattern of the traced size.
+ */
+#define FUSE_USE_VERSION 		26
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include <fuse.h>
+
+#include <vector>
+#include <string>
+#include <map>
+#include <deque>
+#include <algorithm>
+
+#include "wosfs_trace.h"
+
+extern int wosfs_setup(int argc, char *argv[]);
+extern const struct fuse_operations *wosfs_bench_oper;
+
+#define REPLAY_FILL_SIZE	(1024 * 1024)
+
+struct replay_rec {
+	struct wosfs_trace_rec		r;
+	const char			*path;
+	const char			*path2;		// rename, link and symlink
+	std::vector<size_t>		deps;		// records to wait for
+	uint64_t			lat_ns;		// replayed latency
+	int				res;
+	volatile int			done;
+};
+
+/* open files and directories by path hash, a release may come from any thread */
+struct replay_handle {
+	struct fuse_file_info		fi;
+	int				fd;
+	DIR				*dir;
+};
+
+static const struct fuse_operations *ops;	// NULL when replaying under a mount
+static const char *mountpoint;
+static std::vector<replay_rec> recs;
+static std::map<uint64_t, std::string> names;
+static std::map<uint64_t, std::deque<replay_handle> > handles;
+static pthread_mutex_t lock_handles = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t lock_done = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_done = PTHREAD_COND_INITIALIZER;
+static double speed = 1;
+static uint64_t trace_start_ns, replay_start_ns;
+static char *fill;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool by_time(const replay_rec& a, const replay_rec& b)
+{
+	return a.r.ts_ns < b.r.ts_ns;
+}
+
+static const char *name_of(uint64_t hash)
+{
+	std::map<uint64_t, std::string>::iterator it = names.find(hash);
+
+	return it == names.end() ? NULL : it->second.c_str();
+}
+
+static std::string parent_of(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+
+	if ( slash == NULL || slash == path )
+		return "/";
+	return std::string(path, slash - path);
+}
+
+static bool second_path(int op)
+{
+	return op == WOSFS_ST_RENAME || op == WOSFS_ST_LINK || op == WOSFS_ST_SYMLINK;
+}
+
+static bool load(const char *file)
+{
+	FILE *fp = fopen(file, "r");
+	struct wosfs_trace_hdr hdr;
+	struct wosfs_trace_rec r;
+	size_t unnamed = 0;
+
+	if ( fp == NULL ) {
+		perror(file);
+		return false;
+	}
+	if ( fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, WOSFS_TRACE_MAGIC, sizeof(WOSFS_TRACE_MAGIC)) != 0 ||
+	     hdr.version != WOSFS_TRACE_VERSION || hdr.rec_size != sizeof(struct wosfs_trace_rec) ) {
+		fprintf(stderr, "%s: not a version %u fusewos trace\n", file, WOSFS_TRACE_VERSION);
+		fclose(fp);
+		return false;
+	}
+
+	std::string pfile = std::string(file) + WOSFS_TRACE_PATHS_SUFFIX;
+	FILE *pf = fopen(pfile.c_str(), "r");
+	char line[PATH_MAX + 32];
+	if ( pf == NULL ) {
+		perror(pfile.c_str());
+		fclose(fp);
+		return false;
+	}
+	while ( fgets(line, sizeof(line), pf) ) {
+		char *end;
+		uint64_t hash = strtoull(line, &end, 16);
+		if ( *end != ' ' )
+			continue;
+		end[strcspn(end, "\n")] = '\0';
+		names[hash] = end + 1;
+	}
+	fclose(pf);
+
+	while ( fread(&r, sizeof(r), 1, fp) == 1 ) {
+		if ( r.op >= WOSFS_ST_WOS_GETSPAN || r.path_hash == 0 )
+			continue;
+		replay_rec rr;
+		rr.r = r;
+		rr.path = name_of(r.path_hash);
+		rr.path2 = second_path(r.op) ? name_of(r.offset) : NULL;
+		rr.lat_ns = 0;
+		rr.res = 0;
+		rr.done = 0;
+		if ( rr.path == NULL || (second_path(r.op) && rr.path2 == NULL) ) {
+			unnamed++;
+			continue;
+		}
+		recs.push_back(rr);
+	}
+	fclose(fp);
+	if ( unnamed )
+		fprintf(stderr, "%zu records without a path in %s, skipped\n", unnamed, pfile.c_str());
+
+	std::stable_sort(recs.begin(), recs.end(), by_time);
+	return !recs.empty();
+}
+
+/* what each record has to wait for, see the top of the file */
+static void link_deps(void)
+{
+	std::map<uint64_t, size_t> last;	// path hash -> last record on it
+
+	for (size_t i = 0; i < recs.size(); i++) {
+		replay_rec& rr = recs[i];
+		uint64_t on[3] = { rr.r.path_hash, rr.path2 ? rr.r.offset : 0, wosfs_path_hash(parent_of(rr.path).c_str()) };
+
+		for (int k = 0; k < 3; k++) {
+			std::map<uint64_t, size_t>::iterator it = last.find(on[k]);
+			if ( on[k] == 0 || it == last.end() )
+				continue;
+			const replay_rec& prev = recs[it->second];
+			if ( prev.r.tid != rr.r.tid && prev.r.ts_ns + prev.r.lat_ns <= rr.r.ts_ns &&
+			     std::find(rr.deps.begin(), rr.deps.end(), it->second) == rr.deps.end() )
+				rr.deps.push_back(it->second);
+		}
+		last[rr.r.path_hash] = i;
+		if ( rr.path2 )
+			last[rr.r.offset] = i;
+	}
+}
+
+static std::string full(const char *path)
+{
+	return std::string(mountpoint) + path;
+}
+
+static int filler(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	(void) buf; (void) name; (void) st; (void) off;
+	return 0;
+}
+
+static void push_handle(uint64_t hash, const replay_handle& h)
+{
+	pthread_mutex_lock(&lock_handles);
+	handles[hash].push_back(h);
+	pthread_mutex_unlock(&lock_handles);
+}
+
+static bool pop_handle(uint64_t hash, replay_handle *h, bool remove)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&lock_handles);
+	std::map<uint64_t, std::deque<replay_handle> >::iterator it = handles.find(hash);
+	if ( it != handles.end() && !it->second.empty() ) {
+		*h = it->second.front();
+		if ( remove )
+			it->second.pop_front();
+		found = true;
+	}
+	pthread_mutex_unlock(&lock_handles);
+	return found;
+}
+
+static int sys_res(int res)
+{
+	return res < 0 ? -errno : res;
+}
+
+/* one file or directory handle for path: the one opened in the trace, else a temporary one */
+static bool get_handle(const replay_rec& rr, replay_handle *h, bool dir)
+{
+	if ( pop_handle(rr.r.path_hash, h, false) )
+		return false;
+
+	memset(h, 0, sizeof(*h));
+	h->fd = -1;
+	h->fi.flags = rr.r.op == WOSFS_ST_WRITE ? O_WRONLY : O_RDONLY;
+	if ( ops ) {
+		if ( dir )
+			ops->opendir(rr.path, &h->fi);
+		else
+			ops->open(rr.path, &h->fi);
+	}
+	else if ( dir )
+		h->dir = opendir(full(rr.path).c_str());
+	else
+		h->fd = open(full(rr.path).c_str(), h->fi.flags);
+	return true;
+}
+
+static void put_handle(const replay_rec& rr, replay_handle *h, bool dir)
+{
+	if ( ops ) {
+		if ( dir )
+			ops->releasedir(rr.path, &h->fi);
+		else
+			ops->release(rr.path, &h->fi);
+	}
+	else if ( dir ) {
+		if ( h->dir )
+			closedir(h->dir);
+	}
+	else if ( h->fd >= 0 )
+		close(h->fd);
+}
+
+/* replay one record, returns what the callback or system call returned */
+static int replay_one(const replay_rec& rr)
+{
+	const char *path = rr.path;
+	std::string fp = ops ? "" : full(path);
+	std::string fp2 = ops || rr.path2 == NULL ? "" : (rr.r.op == WOSFS_ST_SYMLINK ? rr.path2 : full(rr.path2));
+	mode_t mode = rr.r.size;
+	replay_handle h;
+	struct stat st;
+	struct statvfs sv;
+	char buf[PATH_MAX];
+	int res = 0;
+	bool tmp;
+
+	switch (rr.r.op) {
+	case WOSFS_ST_GETATTR:
+		return ops ? ops->getattr(path, &st) : sys_res(lstat(fp.c_str(), &st));
+	case WOSFS_ST_ACCESS:
+		return ops ? ops->access(path, rr.r.size) : sys_res(access(fp.c_str(), rr.r.size));
+	case WOSFS_ST_READLINK:
+		return ops ? ops->readlink(path, buf, sizeof(buf)) : sys_res(readlink(fp.c_str(), buf, sizeof(buf)));
+	case WOSFS_ST_OPENDIR:
+		memset(&h, 0, sizeof(h));
+		h.fd = -1;
+		if ( ops )
+			res = ops->opendir(path, &h.fi);
+		else if ( (h.dir = opendir(fp.c_str())) == NULL )
+			res = -errno;
+		if ( res == 0 )
+			push_handle(rr.r.path_hash, h);
+		return res;
+	case WOSFS_ST_READDIR:
+		tmp = get_handle(rr, &h, true);
+		if ( ops )
+			res = ops->readdir(path, NULL, filler, 0, &h.fi);
+		else if ( h.dir ) {
+			rewinddir(h.dir);
+			while ( readdir(h.dir) )
+				;
+		}
+		else
+			res = -ENOENT;
+		if ( tmp )
+			put_handle(rr, &h, true);
+		return res;
+	case WOSFS_ST_RELEASEDIR:
+		if ( !pop_handle(rr.r.path_hash, &h, true) )
+			return -EBADF;
+		put_handle(rr, &h, true);
+		return 0;
+	case WOSFS_ST_MKNOD:
+		if ( !S_ISREG(mode) )
+			mode = S_IFREG | (mode ? mode : 0644);
+		return ops ? ops->mknod(path, mode, 0) : sys_res(mknod(fp.c_str(), mode, 0));
+	case WOSFS_ST_MKDIR:
+		return ops ? ops->mkdir(path, mode) : sys_res(mkdir(fp.c_str(), mode));
+	case WOSFS_ST_UNLINK:
+		return ops ? ops->unlink(path) : sys_res(unlink(fp.c_str()));
+	case WOSFS_ST_RMDIR:
+		return ops ? ops->rmdir(path) : sys_res(rmdir(fp.c_str()));
+	case WOSFS_ST_SYMLINK:
+		return ops ? ops->symlink(rr.path2, path) : sys_res(symlink(fp2.c_str(), fp.c_str()));
+	case WOSFS_ST_RENAME:
+		return ops ? ops->rename(path, rr.path2) : sys_res(rename(fp.c_str(), fp2.c_str()));
+	case WOSFS_ST_LINK:
+		return ops ? ops->link(path, rr.path2) : sys_res(link(fp.c_str(), fp2.c_str()));
+	case WOSFS_ST_CHMOD:
+		return ops ? ops->chmod(path, mode) : sys_res(chmod(fp.c_str(), mode));
+	case WOSFS_ST_CHOWN:
+		return ops ? ops->chown(path, (uid_t)-1, (gid_t)-1) : sys_res(chown(fp.c_str(), (uid_t)-1, (gid_t)-1));
+	case WOSFS_ST_TRUNCATE:
+		return ops ? ops->truncate(path, rr.r.offset) : sys_res(truncate(fp.c_str(), rr.r.offset));
+	case WOSFS_ST_UTIMENS: {
+		struct timespec ts[2] = { { 0, UTIME_NOW }, { 0, UTIME_NOW } };
+		return ops ? ops->utimens(path, ts) : sys_res(utimensat(AT_FDCWD, fp.c_str(), ts, AT_SYMLINK_NOFOLLOW));
+	}
+	case WOSFS_ST_OPEN:
+		memset(&h, 0, sizeof(h));
+		h.fi.flags = rr.r.size;
+		h.fd = -1;
+		if ( ops )
+			res = ops->open(path, &h.fi);
+		else if ( (h.fd = open(fp.c_str(), rr.r.size & ~O_CREAT)) < 0 )
+			res = -errno;
+		if ( res == 0 )
+			push_handle(rr.r.path_hash, h);
+		return res;
+	case WOSFS_ST_READ:
+	case WOSFS_ST_WRITE: {
+		size_t size = std::min((size_t)rr.r.size, (size_t)REPLAY_FILL_SIZE);
+		char *data = rr.r.op == WOSFS_ST_WRITE ? fill : (char *)malloc(size);
+
+		tmp = get_handle(rr, &h, false);
+		if ( rr.r.op == WOSFS_ST_WRITE )
+			res = ops ? ops->write(path, data, size, rr.r.offset, &h.fi) : sys_res(pwrite(h.fd, data, size, rr.r.offset));
+		else if ( ops && ops->read_buf ) {
+			struct fuse_bufvec *src = NULL;
+			struct fuse_bufvec out = FUSE_BUFVEC_INIT(size);
+
+			res = ops->read_buf(path, &src, size, rr.r.offset, &h.fi);
+			if ( res >= 0 ) {
+				out.buf[0].mem = data;
+				res = fuse_buf_copy(&out, src, (enum fuse_buf_copy_flags)0);
+				for (size_t i = 0; i < src->count; i++)
+					if ( !(src->buf[i].flags & FUSE_BUF_IS_FD) )
+						free(src->buf[i].mem);
+				free(src);
+			}
+		}
+		else
+			res = ops ? ops->read(path, data, size, rr.r.offset, &h.fi) : sys_res(pread(h.fd, data, size, rr.r.offset));
+		if ( tmp )
+			put_handle(rr, &h, false);
+		if ( data != fill )
+			free(data);
+		return res;
+	}
+	case WOSFS_ST_STATFS:
+		return ops ? ops->statfs(path, &sv) : sys_res(statvfs(fp.c_str(), &sv));
+	case WOSFS_ST_RELEASE:
+		if ( !pop_handle(rr.r.path_hash, &h, true) )
+			return -EBADF;
+		put_handle(rr, &h, false);
+		return 0;
+	case WOSFS_ST_FSYNC:
+		tmp = get_handle(rr, &h, false);
+		res = ops ? ops->fsync(path, 0, &h.fi) : sys_res(fsync(h.fd));
+		if ( tmp )
+			put_handle(rr, &h, false);
+		return res;
+	default:
+		return -ENOSYS;
+	}
+}
+
+/*
+ * the files and directories the trace works on without creating them:
+ * directories for anything listed or with children, files of the largest
+ * size read from them
+ */
+static void prepopulate(void)
+{
+	std::map<std::string, uint64_t> files;
+	std::map<std::string, bool> dirs, created;
+
+	for (size_t i = 0; i < recs.size(); i++) {
+		const replay_rec& rr = recs[i];
+		std::string p = rr.path;
+		int op = rr.r.op;
+
+		for (std::string d = parent_of(p.c_str()); d != "/"; d = parent_of(d.c_str()))
+			if ( !created.count(d) )
+				dirs[d] = true;
+		if ( created.count(p) )
+			continue;
+		if ( op == WOSFS_ST_MKNOD || op == WOSFS_ST_MKDIR || op == WOSFS_ST_SYMLINK ) {
+			created[p] = true;
+			continue;
+		}
+		if ( op == WOSFS_ST_RENAME || op == WOSFS_ST_LINK )
+			created[rr.path2] = true;
+		if ( op == WOSFS_ST_OPENDIR || op == WOSFS_ST_READDIR || op == WOSFS_ST_RMDIR )
+			dirs[p] = true;
+		else if ( op != WOSFS_ST_GETATTR && op != WOSFS_ST_ACCESS ) {
+			uint64_t end = op == WOSFS_ST_READ ? rr.r.offset + rr.r.size : 0;
+			files[p] = std::max(files[p], end);
+		}
+	}
+
+	// std::map order puts every directory before its children
+	for (std::map<std::string, bool>::iterator it = dirs.begin(); it != dirs.end(); ++it) {
+		files.erase(it->first);
+		if ( ops )
+			ops->mkdir(it->first.c_str(), 0755);
+		else
+			mkdir(full(it->first.c_str()).c_str(), 0755);
+	}
+	for (std::map<std::string, uint64_t>::iterator it = files.begin(); it != files.end(); ++it) {
+		const char *path = it->first.c_str();
+
+		if ( ops ) {
+			struct fuse_file_info fi;
+			memset(&fi, 0, sizeof(fi));
+			fi.flags = O_WRONLY;
+			if ( ops->mknod(path, S_IFREG | 0644, 0) < 0 || ops->open(path, &fi) < 0 )
+				continue;
+			for (uint64_t off = 0; off < it->second; off += REPLAY_FILL_SIZE)
+				ops->write(path, fill, std::min(it->second - off, (uint64_t)REPLAY_FILL_SIZE), off, &fi);
+			ops->release(path, &fi);
+		}
+		else {
+			int fd = open(full(path).c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+			if ( fd < 0 )
+				continue;
+			for (uint64_t off = 0; off < it->second; off += REPLAY_FILL_SIZE)
+				pwrite(fd, fill, std::min(it->second - off, (uint64_t)REPLAY_FILL_SIZE), off);
+			close(fd);
+		}
+	}
+	fprintf(stderr, "prepopulated %zu directories, %zu files\n", dirs.size(), files.size());
+}
+
+struct replay_thread {
+	pthread_t			tid;
+	std::vector<size_t>		todo;
+};
+
+static void *replay_thread_main(void *arg)
+{
+	struct replay_thread *t = (struct replay_thread *)arg;
+
+	for (size_t k = 0; k < t->todo.size(); k++) {
+		replay_rec& rr = recs[t->todo[k]];
+
+		if ( speed > 0 ) {
+			uint64_t due = replay_start_ns + (uint64_t)((rr.r.ts_ns - trace_start_ns) / speed);
+			uint64_t now = now_ns();
+			if ( due > now ) {
+				struct timespec ts = { (time_t)((due - now) / 1000000000), (long)((due - now) % 1000000000) };
+				nanosleep(&ts, NULL);
+			}
+		}
+		if ( !rr.deps.empty() ) {
+			pthread_mutex_lock(&lock_done);
+			for (size_t d = 0; d < rr.deps.size(); d++)
+				while ( !recs[rr.deps[d]].done )
+					pthread_cond_wait(&cond_done, &lock_done);
+			pthread_mutex_unlock(&lock_done);
+		}
+
+		uint64_t start = now_ns();
+		rr.res = replay_one(rr);
+		rr.lat_ns = now_ns() - start;
+
+		pthread_mutex_lock(&lock_done);
+		rr.done = 1;
+		pthread_cond_broadcast(&cond_done);
+		pthread_mutex_unlock(&lock_done);
+	}
+	return NULL;
+}
+
+static double pctl(std::vector<uint64_t>& v, double p)
+{
+	if ( v.empty() )
+		return 0;
+	return v[std::min((size_t)(p * v.size()), v.size() - 1)] / 1000.0;
+}
+
+static void report(double seconds)
+{
+	std::vector<uint64_t> traced[WOSFS_ST_WOS_GETSPAN], replayed[WOSFS_ST_WOS_GETSPAN];
+	uint64_t errors[WOSFS_ST_WOS_GETSPAN] = { 0 };
+	uint64_t tsum[WOSFS_ST_WOS_GETSPAN] = { 0 }, rsum[WOSFS_ST_WOS_GETSPAN] = { 0 };
+
+	for (size_t i = 0; i < recs.size(); i++) {
+		int op = recs[i].r.op;
+		traced[op].push_back(recs[i].r.lat_ns);
+		replayed[op].push_back(recs[i].lat_ns);
+		tsum[op] += recs[i].r.lat_ns;
+		rsum[op] += recs[i].lat_ns;
+		if ( recs[i].res < 0 )
+			errors[op]++;
+	}
+
+	const replay_rec& last = recs.back();
+	printf("traced %.3f s, replayed %.3f s at speed %g, %zu calls\n",
+		(last.r.ts_ns + last.r.lat_ns - trace_start_ns) / 1e9, seconds, speed, recs.size());
+	printf("%-12s %8s %7s %12s %12s %12s %12s\n", "op", "count", "errors", "trace_mean", "trace_p99", "replay_mean", "replay_p99");
+	for (int op = 0; op < WOSFS_ST_WOS_GETSPAN; op++) {
+		size_t n = traced[op].size();
+		if ( n == 0 )
+			continue;
+		std::sort(traced[op].begin(), traced[op].end());
+		std::sort(replayed[op].begin(), replayed[op].end());
+		printf("%-12s %8zu %7lu %12.1f %12.1f %12.1f %12.1f\n", wosfs_stat_names[op], n, errors[op],
+			tsum[op] / 1000.0 / n, pctl(traced[op], 0.99), rsum[op] / 1000.0 / n, pctl(replayed[op], 0.99));
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-m mountpoint] [-s speed] [-p] [-D] tracefile [-- fusewos options]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	bool populate = false, nodeps = false;
+	int c;
+
+	while ((c = getopt(argc, argv, "m:s:pD")) != -1) {
+		switch (c) {
+		case 'm':
+			mountpoint = optarg;
+			break;
+		case 's':
+			speed = atof(optarg);
+			break;
+		case 'p':
+			populate = true;
+			break;
+		case 'D':
+			nodeps = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if ( optind >= argc || speed < 0 )
+		usage(argv[0]);
+	if ( !load(argv[optind]) ) {
+		fprintf(stderr, "%s: nothing to replay\n", argv[optind]);
+		return 1;
+	}
+	if ( !nodeps )
+		link_deps();
+
+	fill = (char *)malloc(REPLAY_FILL_SIZE);
+	for (int i = 0; i < REPLAY_FILL_SIZE; i++)
+		fill[i] = (char)(i * 31 + 7);
+
+	if ( mountpoint == NULL ) {
+		// in-process, the rest of the arguments go to fusewos
+		std::vector<char *> fargv;
+		char stubdir[] = "/tmp/wosfs_replay.XXXXXX";
+		bool have_l = false;
+
+		fargv.push_back(argv[0]);
+		for (int i = optind + 1; i < argc; i++) {
+			if ( strncmp(argv[i], "-l", 2) == 0 )
+				have_l = true;
+			fargv.push_back(argv[i]);
+		}
+		if ( !have_l ) {
+			if ( mkdtemp(stubdir) == NULL ) {
+				perror("mkdtemp");
+				return 2;
+			}
+			fargv.push_back((char *)"-l");
+			fargv.push_back(stubdir);
+			populate = true;
+		}
+		fargv.push_back(NULL);
+		if ( wosfs_setup(fargv.size() - 1, &fargv[0]) != 0 )
+			return 2;
+
+		struct fuse_conn_info conn;
+		memset(&conn, 0, sizeof(conn));
+		ops = wosfs_bench_oper;
+		ops->init(&conn);
+	}
+	else if ( optind + 1 != argc )
+		usage(argv[0]);
+
+	if ( populate )
+		prepopulate();
+
+	// one replay thread per traced thread
+	std::map<uint32_t, replay_thread> threads;
+	for (size_t i = 0; i < recs.size(); i++)
+		threads[recs[i].r.tid].todo.push_back(i);
+
+	trace_start_ns = recs[0].r.ts_ns;
+	replay_start_ns = now_ns();
+	for (std::map<uint32_t, replay_thread>::iterator it = threads.begin(); it != threads.end(); ++it)
+		pthread_create(&it->second.tid, NULL, replay_thread_main, &it->second);
+	for (std::map<uint32_t, replay_thread>::iterator it = threads.begin(); it != threads.end(); ++it)
+		pthread_join(it->second.tid, NULL);
+	double seconds = (now_ns() - replay_start_ns) / 1e9;
+
+	if ( ops )
+		ops->destroy(NULL);
+	report(seconds);
+	return 0;
+}
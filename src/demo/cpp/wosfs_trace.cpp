@@ -0,0 +1,140 @@
+/*
+ * wosfs_trace.cpp
+ *
+ * Decodes the binary trace written by fusewos --wos_trace into one text
+ * line per record:
+ *
+ *   <wall clock time> <tid> <op> <path hash> <offset> <size> <latency us> <status>
+ *
+ * usage: wosfs_trace [-s] [-o op] [-p path] [-l us] [-S] tracefile
+ *   -s       sort all records by start time (default: file order)
+ *   -o op    only records of op, e.g. read or wos_getspan
+ *   -p path  only records of the mount relative path, e.g. /dir/file
+ *   -l us    only records that took at least us microseconds
+ *   -S       print count, mean and max latency per op instead of records
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "wosfs_trace.h"
+
+static bool by_time(const wosfs_trace_rec& a, const wosfs_trace_rec& b)
+{
+	return a.ts_ns < b.ts_ns;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-s] [-o op] [-p path] [-l us] [-S] tracefile\n", prog);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	bool sort = false;
+	bool summary = false;
+	int op = -1;
+	uint64_t hash = 0;
+	uint64_t min_ns = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "so:p:l:S")) != -1) {
+		switch (c) {
+		case 's':
+			sort = true;
+			break;
+		case 'o':
+			for (op = 0; op < WOSFS_ST_MAX; op++)
+				if (strcmp(optarg, wosfs_stat_names[op]) == 0)
+					break;
+			if (op == WOSFS_ST_MAX) {
+				fprintf(stderr, "unknown op %s\n", optarg);
+				return 2;
+			}
+			break;
+		case 'p':
+			hash = wosfs_path_hash(optarg);
+			break;
+		case 'l':
+			min_ns = strtoull(optarg, NULL, 10) * 1000;
+			break;
+		case 'S':
+			summary = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	FILE *fp = fopen(argv[optind], "r");
+	if (fp == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	struct wosfs_trace_hdr hdr;
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, WOSFS_TRACE_MAGIC, sizeof(WOSFS_TRACE_MAGIC)) != 0) {
+		fprintf(stderr, "%s: not a fusewos trace\n", argv[optind]);
+		return 1;
+	}
+	if (hdr.version != WOSFS_TRACE_VERSION || hdr.rec_size != sizeof(struct wosfs_trace_rec)) {
+		fprintf(stderr, "%s: trace version %u with %u byte records, expected %u with %zu\n", argv[optind],
+			hdr.version, hdr.rec_size, WOSFS_TRACE_VERSION, sizeof(struct wosfs_trace_rec));
+		return 1;
+	}
+
+	std::vector<wosfs_trace_rec> recs;
+	struct wosfs_trace_rec rec;
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		if (rec.op >= WOSFS_ST_MAX)
+			continue;
+		if ((op >= 0 && rec.op != op) || (hash && rec.path_hash != hash) || rec.lat_ns < min_ns)
+			continue;
+		recs.push_back(rec);
+	}
+	fclose(fp);
+
+	if (summary) {
+		uint64_t count[WOSFS_ST_MAX] = { 0 }, sum[WOSFS_ST_MAX] = { 0 }, max[WOSFS_ST_MAX] = { 0 }, errors[WOSFS_ST_MAX] = { 0 };
+
+		for (size_t i = 0; i < recs.size(); i++) {
+			count[recs[i].op]++;
+			sum[recs[i].op] += recs[i].lat_ns;
+			max[recs[i].op] = std::max(max[recs[i].op], recs[i].lat_ns);
+			if (recs[i].status)
+				errors[recs[i].op]++;
+		}
+		printf("%-20s %10s %8s %12s %12s\n", "op", "count", "errors", "mean_us", "max_us");
+		for (int i = 0; i < WOSFS_ST_MAX; i++)
+			if (count[i])
+				printf("%-20s %10lu %8lu %12.1f %12.1f\n", wosfs_stat_names[i], count[i], errors[i],
+					sum[i] / 1000.0 / count[i], max[i] / 1000.0);
+		return 0;
+	}
+
+	if (sort)
+		std::stable_sort(recs.begin(), recs.end(), by_time);
+
+	for (size_t i = 0; i < recs.size(); i++) {
+		const struct wosfs_trace_rec *r = &recs[i];
+		uint64_t real_ns = hdr.real_ns + (r->ts_ns - hdr.mono_ns);
+		time_t sec = real_ns / 1000000000;
+		struct tm tm;
+		char when[32];
+
+		localtime_r(&sec, &tm);
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+		printf("%s.%06lu %u %s %016lx %lu %u %.1f %d\n", when, (unsigned long)(real_ns % 1000000000 / 1000),
+			r->tid, wosfs_stat_names[r->op], r->path_hash, r->offset, r->size, r->lat_ns / 1000.0, r->status);
+	}
+
+	return 0;
+}
@@ -0,0 +1,101 @@
+/*
+ * wosfs_trace.h
+ *
+ * Operation ids and the binary trace file format shared by fusewos and
+ * the wosfs_trace decoder.
+ *
+ * A trace file is one struct wosfs_trace_hdr followed by any number of
+ * struct wosfs_trace_rec in host byte order.  Records of one thread are
+ * in time order; records of different threads are not, sort on ts_ns.
+ *
+ * Next to it, <trace>WOSFS_TRACE_PATHS_SUFFIX maps path hashes back to
+ * paths, one "<hash in hex> <path>" line per path the first time it is
+ * traced (possibly more than once), which is what wosfs_replay needs.
+ */
+#ifndef WOSFS_TRACE_H
+#define WOSFS_TRACE_H
+
+#include <stdint.h>
+
+enum wosfs_stat_id {
+	WOSFS_ST_GETATTR,
+	WOSFS_ST_ACCESS,
+	WOSFS_ST_READLINK,
+	WOSFS_ST_OPENDIR,
+	WOSFS_ST_READDIR,
+	WOSFS_ST_RELEASEDIR,
+	WOSFS_ST_MKNOD,
+	WOSFS_ST_MKDIR,
+	WOSFS_ST_UNLINK,
+	WOSFS_ST_RMDIR,
+	WOSFS_ST_SYMLINK,
+	WOSFS_ST_RENAME,
+	WOSFS_ST_LINK,
+	WOSFS_ST_CHMOD,
+	WOSFS_ST_CHOWN,
+	WOSFS_ST_TRUNCATE,
+	WOSFS_ST_UTIMENS,
+	WOSFS_ST_OPEN,
+	WOSFS_ST_READ,
+	WOSFS_ST_WRITE,
+	WOSFS_ST_STATFS,
+	WOSFS_ST_RELEASE,
+	WOSFS_ST_FSYNC,
+	WOSFS_ST_FALLOCATE,
+	WOSFS_ST_WOS_GETSPAN,		// first WOS call
+	WOSFS_ST_WOS_PUTSPAN,
+	WOSFS_ST_WOS_CLOSE,
+	WOSFS_ST_WOS_DELETE,
+	WOSFS_ST_WOS_PUT,
+	WOSFS_ST_WOS_CREATEGETSTREAM,
+	WOSFS_ST_WOS_CREATEPUTSTREAM,
+	WOSFS_ST_MAX
+};
+
+static const char *wosfs_stat_names[WOSFS_ST_MAX] = {
+	"getattr", "access", "readlink", "opendir", "readdir", "releasedir",
+	"mknod", "mkdir", "unlink", "rmdir", "symlink", "rename", "link",
+	"chmod", "chown", "truncate", "utimens", "open", "read", "write",
+	"statfs", "release", "fsync", "fallocate",
+	"wos_getspan", "wos_putspan", "wos_close", "wos_delete", "wos_put",
+	"wos_creategetstream", "wos_createputstream",
+};
+
+/* 64-bit FNV-1a of a mount relative path, as in path_hash */
+static inline uint64_t wosfs_path_hash(const char *path)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	for ( ; *path; path++)
+		h = (h ^ (unsigned char)*path) * 1099511628211ULL;
+	return h;
+}
+
+#define WOSFS_TRACE_MAGIC		"WOSTRC1"
+#define WOSFS_TRACE_VERSION		2	// 1 had offset and size of reads, writes, truncate and fallocate only
+
+struct wosfs_trace_hdr {
+	char				magic[8];	// WOSFS_TRACE_MAGIC
+	uint32_t			version;
+	uint32_t			rec_size;	// sizeof(struct wosfs_trace_rec)
+	uint64_t			mono_ns;	// CLOCK_MONOTONIC at ...
+	uint64_t			real_ns;	// ... CLOCK_REALTIME, to map ts_ns to wall clock
+};
+
+#define WOSFS_TRACE_PATHS_SUFFIX	".paths"
+
+struct wosfs_trace_rec {
+	uint64_t			ts_ns;		// CLOCK_MONOTONIC at the start of the call
+	uint64_t			lat_ns;
+	uint64_t			path_hash;	// FNV-1a of the mount relative path, 0 if none
+	uint64_t			offset;		// new size for truncate, path hash of the second
+							// path for rename, link and symlink
+	uint32_t			size;		// open flags for open, mode for mknod, mkdir, chmod,
+							// mask for access
+	uint32_t			tid;
+	uint16_t			op;		// enum wosfs_stat_id
+	uint16_t			pad;
+	int32_t				status;		// WosStatus of WOS calls, 0 for callbacks
+};
+
+#endif
@@ -0,0 +1,360 @@
+/*
+ * wosfs_trash.cpp
+ *
+ * Lists and restores the stubs in a fusewos trash can, bucket by bucket
+ * (see wosfs_trash.h), without a mount and without listing buckets that
+ * are not asked for.  Run it on the trash can in the stub path, e.g.
+ * /wosfs_stubs/.WOSFS_TrashCan: the original paths kept in the stubs are
+ * stub paths, not mount paths.
+ *
+ * usage: wosfs_trash [-b from[:to]] [-p prefix] [-r old=new] [-m magic] [-s shards] [-n] [-f]
+ *                    trashcan buckets|list|restore|migrate [stub...]
+ *   buckets    one line per bucket: bucket, stubs, stubs being purged, bytes
+ *   list       one line per stub: trashed time, bytes, versions, original path, stub
+ *   restore    move stubs back to their original path, the latest first;
+ *              versions dropped by compaction are not restored
+ *   migrate    move the stubs at the top of the trash can into buckets
+ *
+ *   -b from[:to]  only buckets from..to, a prefix matches all it starts,
+ *                 e.g. -b 20261019 for a day or -b 20261019-08:20261019-11
+ *   -p prefix     only stubs whose original path starts with prefix
+ *   -r old=new    restore to the original path with prefix old changed to new
+ *   -m magic      stub magic (default DDNWOS)
+ *   -s shards     shards per bucket for migrate (default 16)
+ *   -n            show what restore or migrate would do
+ *   -f            restore over existing files
+ *
+ * Stubs named on the command line, relative to the trash can as list
+ * prints them, are taken instead of the buckets.  Stubs at the top of the
+ * trash can are taken when there is no -b.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "wosfs_trash.h"
+
+struct stub {
+	std::string			name;		// relative to the trash can
+	std::string			orig;		// "" if none recorded
+	time_t				trashed;
+	uint64_t			bytes;
+	int				versions;
+};
+
+static const char *magic = "DDNWOS";
+static std::string bucket_from, bucket_to, prefix, rewrite_old, rewrite_new;
+static int shards = 16;
+static bool dry_run = false, force = false;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-b from[:to]] [-p prefix] [-r old=new] [-m magic] [-s shards] [-n] [-f]\n"
+			"       trashcan buckets|list|restore|migrate [stub...]\n", prog);
+	exit(2);
+}
+
+static bool in_range(const std::string& bucket)
+{
+	if (!bucket_from.empty() && bucket.compare(0, bucket_from.size(), bucket_from) < 0)
+		return false;
+	if (!bucket_to.empty() && bucket.compare(0, bucket_to.size(), bucket_to) > 0)
+		return false;
+	return true;
+}
+
+static bool read_stub(int dirfd, const std::string& name, struct stub *s)
+{
+	int fd = openat(dirfd, name.c_str(), O_RDONLY);
+	FILE *fp = fd < 0 ? NULL : fdopen(fd, "r");
+	size_t magic_len = strlen(magic), orig_len = strlen(WOSFS_TRASH_ORIG);
+	const char *base = strrchr(name.c_str(), '/');
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t n;
+	struct stat st;
+
+	if (fp == NULL) {
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+	s->name = name;
+	s->orig.clear();
+	s->bytes = 0;
+	s->versions = 0;
+	while ((n = getline(&line, &len, fp)) != -1) {
+		char m[64], oid[41];
+		unsigned long size;
+
+		if (n > 0 && line[n - 1] == '\n')
+			line[n - 1] = '\0';
+		if (strncmp(line, magic, magic_len) == 0 && sscanf(line, "%63s %40s %lu", m, oid, &size) == 3) {
+			s->bytes += size;
+			s->versions++;
+		}
+		else if (strncmp(line, WOSFS_TRASH_ORIG, orig_len) == 0) {
+			// the last one is where it was deleted from, as -l path + mount path
+			s->orig.clear();
+			for (const char *p = line + orig_len; *p; p++)
+				if (!(*p == '/' && p[1] == '/'))
+					s->orig += *p;
+		}
+	}
+	free(line);
+	s->trashed = wosfs_trash_stub_time(base ? base + 1 : name.c_str());
+	if (s->trashed == 0 && fstat(fileno(fp), &st) == 0)
+		s->trashed = st.st_mtime;
+	fclose(fp);
+	return true;
+}
+
+/* the names in dir, sorted; dirs selects directories or other files */
+static void list_dir(int dirfd, const std::string& dir, bool dirs, std::vector<std::string>& out)
+{
+	int fd = openat(dirfd, dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY);
+	DIR *dp = fd < 0 ? NULL : fdopendir(fd);
+	struct dirent *de;
+
+	if (dp == NULL) {
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	while ((de = readdir(dp)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		std::string name = dir.empty() ? std::string(de->d_name) : dir + "/" + de->d_name;
+		bool is_dir = de->d_type == DT_DIR;
+		struct stat st;
+		if (de->d_type == DT_UNKNOWN && fstatat(dirfd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0)
+			is_dir = S_ISDIR(st.st_mode);
+		if (is_dir == dirs)
+			out.push_back(name);
+	}
+	closedir(dp);
+	std::sort(out.begin(), out.end());
+}
+
+/* the <nsec> of a stub name, for stubs trashed in the same second */
+static long stub_nsec(const std::string& name)
+{
+	std::string s = name;
+	size_t slen = strlen(WOSFS_PURGE_SUFFIX);
+
+	if (s.size() > slen && s.compare(s.size() - slen, std::string::npos, WOSFS_PURGE_SUFFIX) == 0)
+		s.erase(s.size() - slen);
+	size_t dot = s.rfind('.');
+	return dot == std::string::npos ? 0 : atol(s.c_str() + dot + 1);
+}
+
+static bool later(const struct stub& a, const struct stub& b)
+{
+	if (a.trashed != b.trashed)
+		return a.trashed > b.trashed;
+	return stub_nsec(a.name) > stub_nsec(b.name);
+}
+
+static bool restore(int dirfd, const struct stub& s)
+{
+	std::string to = s.orig;
+
+	if (to.empty()) {
+		fprintf(stderr, "%s: no original path recorded\n", s.name.c_str());
+		return false;
+	}
+	if (!rewrite_old.empty() && to.compare(0, rewrite_old.size(), rewrite_old) == 0)
+		to = rewrite_new + to.substr(rewrite_old.size());
+	if (!force && access(to.c_str(), F_OK) == 0) {
+		fprintf(stderr, "%s: %s exists, -f to restore over it\n", s.name.c_str(), to.c_str());
+		return false;
+	}
+	printf("%s -> %s\n", s.name.c_str(), to.c_str());
+	if (dry_run)
+		return true;
+	if (renameat(dirfd, s.name.c_str(), AT_FDCWD, to.c_str()) != 0) {
+		fprintf(stderr, "%s: %s: %s\n", s.name.c_str(), to.c_str(), strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/* move a stub at the top into the bucket and shard fusewos would have put it in */
+static bool migrate(int dirfd, const struct stub& s)
+{
+	char bucket[WOSFS_TRASH_BUCKET_LEN + 1], shard[4];
+	std::string base = s.name;
+	size_t dot = base.rfind('.');
+
+	// the name before it was trashed, without .<sec>.<nsec>
+	if (wosfs_trash_stub_time(s.name.c_str()) > 0 && dot != std::string::npos && dot > 0)
+		base.erase(base.rfind('.', dot - 1));
+	wosfs_trash_bucket(s.trashed, bucket);
+	snprintf(shard, sizeof(shard), "%02x", wosfs_trash_shard(base.c_str(), shards) & 0xff);	// below WOSFS_TRASH_MAX_SHARDS
+	std::string dir = std::string(bucket) + "/" + shard;
+	std::string to = dir + "/" + s.name;
+
+	printf("%s -> %s\n", s.name.c_str(), to.c_str());
+	if (dry_run)
+		return true;
+	mkdirat(dirfd, bucket, 0700);
+	mkdirat(dirfd, dir.c_str(), 0700);
+	if (renameat(dirfd, s.name.c_str(), dirfd, to.c_str()) != 0) {
+		fprintf(stderr, "%s: %s\n", s.name.c_str(), strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "b:p:r:m:s:nf")) != -1) {
+		switch (c) {
+		case 'b': {
+			const char *colon = strchr(optarg, ':');
+			bucket_from = colon ? std::string(optarg, colon - optarg) : optarg;
+			bucket_to = colon ? colon + 1 : optarg;
+			break;
+		}
+		case 'p':
+			prefix = optarg;
+			break;
+		case 'r': {
+			const char *eq = strchr(optarg, '=');
+			if (eq == NULL)
+				usage(argv[0]);
+			rewrite_old = std::string(optarg, eq - optarg);
+			rewrite_new = eq + 1;
+			break;
+		}
+		case 'm':
+			magic = optarg;
+			break;
+		case 's':
+			shards = atoi(optarg);
+			if (shards < 1 || shards > WOSFS_TRASH_MAX_SHARDS)
+				usage(argv[0]);
+			break;
+		case 'n':
+			dry_run = true;
+			break;
+		case 'f':
+			force = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind < 2)
+		usage(argv[0]);
+
+	const char *trash = argv[optind];
+	std::string cmd = argv[optind + 1];
+	if (cmd != "buckets" && cmd != "list" && cmd != "restore" && cmd != "migrate")
+		usage(argv[0]);
+	int dirfd = open(trash, O_RDONLY | O_DIRECTORY);
+	if (dirfd < 0) {
+		perror(trash);
+		return 1;
+	}
+
+	// the groups of stubs to go through, one bucket at a time; "" is the top
+	std::vector<std::string> groups;
+	std::vector<std::string> named(argv + optind + 2, argv + argc);
+	if (named.empty()) {
+		std::vector<std::string> dirs;
+		if (bucket_from.empty() || cmd == "migrate")
+			groups.push_back(std::string());
+		if (cmd != "migrate") {
+			list_dir(dirfd, "", true, dirs);
+			for (size_t i = 0; i < dirs.size(); i++)
+				if (wosfs_trash_bucket_time(dirs[i].c_str()) >= 0 && in_range(dirs[i]))
+					groups.push_back(dirs[i]);
+		}
+	}
+	else
+		groups.push_back("\n");	// the named stubs
+	// the latest stub of a path is restored, the older ones then find it there
+	if (cmd == "restore")
+		std::reverse(groups.begin(), groups.end());
+
+	int errors = 0;
+	for (size_t g = 0; g < groups.size(); g++) {
+		std::vector<std::string> names;
+		if (groups[g] == "\n")
+			names = named;
+		else if (groups[g].empty())
+			list_dir(dirfd, "", false, names);
+		else {
+			std::vector<std::string> dirs;
+			list_dir(dirfd, groups[g], true, dirs);
+			for (size_t i = 0; i < dirs.size(); i++)
+				list_dir(dirfd, dirs[i], false, names);
+		}
+
+		std::vector<struct stub> stubs;
+		for (size_t i = 0; i < names.size(); i++) {
+			struct stub s;
+			if (!read_stub(dirfd, names[i], &s)) {
+				fprintf(stderr, "%s: %s\n", names[i].c_str(), strerror(errno));
+				errors++;
+				continue;
+			}
+			if (!prefix.empty() && s.orig.compare(0, prefix.size(), prefix) != 0)
+				continue;
+			stubs.push_back(s);
+		}
+		std::sort(stubs.begin(), stubs.end(), later);
+
+		if (cmd == "buckets") {
+			uint64_t bytes = 0;
+			int purging = 0;
+			for (size_t i = 0; i < stubs.size(); i++) {
+				bytes += stubs[i].bytes;
+				if (stubs[i].name.size() > strlen(WOSFS_PURGE_SUFFIX) &&
+				    stubs[i].name.compare(stubs[i].name.size() - strlen(WOSFS_PURGE_SUFFIX), std::string::npos, WOSFS_PURGE_SUFFIX) == 0)
+					purging++;
+			}
+			if (!stubs.empty() || !groups[g].empty())
+				printf("%-12s %10zu %8d %14lu\n", groups[g].empty() ? "-" : groups[g].c_str(), stubs.size(), purging, bytes);
+			continue;
+		}
+
+		for (size_t i = 0; i < stubs.size(); i++) {
+			const struct stub& s = stubs[i];
+			if (cmd == "list") {
+				struct tm tm;
+				char when[32];
+				localtime_r(&s.trashed, &tm);
+				strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+				printf("%s %12lu %4d %s %s\n", when, s.bytes, s.versions, s.orig.empty() ? "-" : s.orig.c_str(), s.name.c_str());
+			}
+			else if (s.name.size() > strlen(WOSFS_PURGE_SUFFIX) &&
+				 s.name.compare(s.name.size() - strlen(WOSFS_PURGE_SUFFIX), std::string::npos, WOSFS_PURGE_SUFFIX) == 0) {
+				fprintf(stderr, "%s: being purged\n", s.name.c_str());
+				errors++;
+			}
+			else if (cmd == "restore" && wosfs_trash_is_versions(s.name.c_str()))
+				continue;	// old versions of a file still there, not a deleted one
+			else if (cmd == "restore")
+				errors += !restore(dirfd, s);
+			else if (cmd == "migrate")
+				errors += !migrate(dirfd, s);
+		}
+	}
+	close(dirfd);
+
+	return errors ? 1 : 0;
+}
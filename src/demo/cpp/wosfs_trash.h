@@ -0,0 +1,115 @@
+/*
+ * wosfs_trash.h
+ *
+ * Layout of the fusewos trash can, shared by fusewos and the wosfs_trash
+ * tool.
+ *
+ * A stub deleted at time t is renamed, with a "WOSFS original path:" line
+ * appended, to
+ *
+ *   .WOSFS_TrashCan/<bucket>/<shard>/<name>.<sec>.<nsec>
+ *
+ * where <bucket> is the UTC hour of t as YYYYMMDD-HH, so buckets sort in
+ * time order, and <shard> is the hash of <name> modulo the number of
+ * shards (--wos_trash_shards) in two hex digits.  Stubs directly in the
+ * trash can, from before the buckets or from --wos_trash_shards=0, have the
+ * same names and count as older than any bucket.
+ *
+ * The version compactor moves the versions it drops from a stub to a stub
+ * named <name>WOSFS_TRASH_VERSIONS.<sec>.<nsec>, which the purger deletes
+ * on its next scan whatever the retention.
+ */
+#ifndef WOSFS_TRASH_H
+#define WOSFS_TRASH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define WOSFS_TRASH_BUCKET_LEN		11		// YYYYMMDD-HH
+#define WOSFS_TRASH_BUCKET_SECS		3600
+#define WOSFS_TRASH_MAX_SHARDS		256
+#define WOSFS_TRASH_ORIG		"WOSFS original path: "
+#define WOSFS_PURGE_SUFFIX		".purging"	// a stub being purged
+#define WOSFS_TRASH_VERSIONS		".WOSFS_versions"	// versions dropped by compaction
+
+/* the bucket of time t, buf holds at least WOSFS_TRASH_BUCKET_LEN + 1 */
+static inline void wosfs_trash_bucket(time_t t, char *buf)
+{
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	strftime(buf, WOSFS_TRASH_BUCKET_LEN + 1, "%Y%m%d-%H", &tm);
+}
+
+/* the start of a bucket, or -1 when name is not one */
+static inline time_t wosfs_trash_bucket_time(const char *name)
+{
+	struct tm tm;
+
+	if ( strlen(name) != WOSFS_TRASH_BUCKET_LEN || name[8] != '-' )
+		return -1;
+	for (int i = 0; i < WOSFS_TRASH_BUCKET_LEN; i++)
+		if ( i != 8 && (name[i] < '0' || name[i] > '9') )
+			return -1;
+	memset(&tm, 0, sizeof(tm));
+	if ( sscanf(name, "%4d%2d%2d-%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour) != 4 )
+		return -1;
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	return timegm(&tm);
+}
+
+/* the shard of a stub by its name before trashing, FNV-1a */
+static inline unsigned wosfs_trash_shard(const char *name, int shards)
+{
+	unsigned h = 2166136261U;
+
+	for ( ; *name; name++)
+		h = (h ^ (unsigned char)*name) * 16777619U;
+	return h % shards;
+}
+
+/* the time a stub was trashed from the .<sec>.<nsec> of its name, 0 if none */
+static inline time_t wosfs_trash_stub_time(const char *name)
+{
+	size_t len = strlen(name), slen = sizeof(WOSFS_PURGE_SUFFIX) - 1;
+	const char *end, *nsec = NULL, *sec = NULL;
+
+	if ( len > slen && strcmp(name + len - slen, WOSFS_PURGE_SUFFIX) == 0 )
+		len -= slen;
+	for (end = name + len; end > name; end--) {
+		if ( end[-1] != '.' )
+			continue;
+		if ( NULL == nsec )
+			nsec = end - 1;
+		else {
+			sec = end;
+			break;
+		}
+	}
+	if ( NULL == sec )
+		return 0;
+
+	char *stop;
+	long long t = strtoll(sec, &stop, 10);
+	return stop == nsec && t > 0 ? (time_t)t : 0;
+}
+
+/* whether a trashed stub holds versions dropped by compaction */
+static inline bool wosfs_trash_is_versions(const char *name)
+{
+	size_t len = strlen(name), slen = sizeof(WOSFS_PURGE_SUFFIX) - 1, vlen = sizeof(WOSFS_TRASH_VERSIONS) - 1;
+	int dots = 0;
+
+	if ( len > slen && strcmp(name + len - slen, WOSFS_PURGE_SUFFIX) == 0 )
+		len -= slen;
+	// drop .<sec>.<nsec>
+	while ( len > 0 && dots < 2 )
+		if ( name[--len] == '.' )
+			dots++;
+	return dots == 2 && len >= vlen && strncmp(name + len - vlen, WOSFS_TRASH_VERSIONS, vlen) == 0;
+}
+
+#endif /* WOSFS_TRASH_H */
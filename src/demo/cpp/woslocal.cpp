@@ -0,0 +1,1200 @@
+/*
+ * woslocal.cpp
+ *
+ * A stand-in for libwos_cpp that keeps objects in memory or in a local
+ * directory, so that fusewos and the demos run without a WOS cluster.
+ * It implements the part of the wosapi interface they use: Connect,
+ * GetPolicy, Put/Get, Reserve/PutOID, Delete, Exists, the callback forms
+ * of these, Wait, and the put and get streams.
+ *
+ * Build it with "make libwoslocal.so" and link against it with
+ * "make WOS=local".  It is configured by a comma separated list of
+ * key=value settings, taken from the WOSLOCAL environment variable and
+ * then from the cluster name given to Connect when that contains a '='
+ * (fusewos -w):
+ *
+ *   dir=path        keep objects as files in path (default: in memory)
+ *   latency_us=N    added to every call
+ *   jitter_us=N     plus a uniformly distributed 0..N
+ *   bw_mbs=N        data moves over one link of N MB/s shared by all calls
+ *   fail_pct=N      fail N percent of the calls named in fail_ops
+ *   fail_ops=a:b    put, get, reserve, putoid, delete, exists, putspan,
+ *                   getspan, close (default: all of them)
+ *   fail_status=N   WosStatus of failed calls (default: 211, IOErr)
+ *   policies=a:b    the only valid policy names (default: any name)
+ *   threads=N       threads completing callback calls (default: 16)
+ *   seed=N          seed for the jitter and failure draws
+ *
+ * Objects in memory live as long as the process, shared by all
+ * connections.  Reservations are never written to the directory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <map>
+#include <set>
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+#include "wos_obj.hpp"
+#include "wos_policy.hpp"
+#include "wos_cluster.hpp"
+#include "wos_exception.hpp"
+
+using namespace wosapi;
+
+/*
+ *  Configuration
+ */
+
+enum woslocal_call {
+	WL_PUT, WL_GET, WL_RESERVE, WL_PUTOID, WL_DELETE, WL_EXISTS,
+	WL_PUTSPAN, WL_GETSPAN, WL_CLOSE, WL_MAX
+};
+
+static const char *woslocal_call_names[WL_MAX] = {
+	"put", "get", "reserve", "putoid", "delete", "exists", "putspan", "getspan", "close",
+};
+
+struct woslocal_config {
+	std::string			dir;
+	uint64_t			latency_ns;
+	uint64_t			jitter_ns;
+	uint64_t			bw_bps;		// bytes per second, 0 for unlimited
+	double				fail_pct;
+	bool				fail_ops[WL_MAX];
+	int				fail_status;
+	std::set<std::string>		policies;	// empty for any
+	int				threads;
+	uint64_t			seed;
+
+	woslocal_config() : latency_ns(0), jitter_ns(0), bw_bps(0), fail_pct(0), fail_status(IOErr),
+		threads(16), seed(0)
+	{
+		for (int i = 0; i < WL_MAX; i++)
+			fail_ops[i] = true;
+	}
+};
+
+static void woslocal_split(const std::string& s, char sep, std::vector<std::string>& out)
+{
+	size_t start = 0;
+
+	while (start <= s.size()) {
+		size_t end = s.find(sep, start);
+		if (end == std::string::npos)
+			end = s.size();
+		if (end > start)
+			out.push_back(s.substr(start, end - start));
+		start = end + 1;
+	}
+}
+
+static void woslocal_parse(woslocal_config& conf, const std::string& settings)
+{
+	std::vector<std::string> kvs;
+
+	woslocal_split(settings, ',', kvs);
+	for (size_t i = 0; i < kvs.size(); i++) {
+		size_t eq = kvs[i].find('=');
+		if (eq == std::string::npos) {
+			fprintf(stderr, "woslocal: ignoring setting '%s'\n", kvs[i].c_str());
+			continue;
+		}
+		std::string key = kvs[i].substr(0, eq);
+		std::string val = kvs[i].substr(eq + 1);
+		unsigned long long n = strtoull(val.c_str(), NULL, 10);
+
+		if (key == "dir")
+			conf.dir = val;
+		else if (key == "latency_us")
+			conf.latency_ns = n * 1000;
+		else if (key == "jitter_us")
+			conf.jitter_ns = n * 1000;
+		else if (key == "bw_mbs")
+			conf.bw_bps = n * 1000000;
+		else if (key == "fail_pct")
+			conf.fail_pct = strtod(val.c_str(), NULL);
+		else if (key == "fail_status")
+			conf.fail_status = n;
+		else if (key == "threads")
+			conf.threads = std::max(1, (int)n);
+		else if (key == "seed")
+			conf.seed = n;
+		else if (key == "policies") {
+			std::vector<std::string> names;
+			woslocal_split(val, ':', names);
+			conf.policies.clear();
+			conf.policies.insert(names.begin(), names.end());
+		}
+		else if (key == "fail_ops") {
+			std::vector<std::string> names;
+			woslocal_split(val, ':', names);
+			for (int c = 0; c < WL_MAX; c++)
+				conf.fail_ops[c] = std::find(names.begin(), names.end(), woslocal_call_names[c]) != names.end();
+		}
+		else
+			fprintf(stderr, "woslocal: unknown setting '%s'\n", key.c_str());
+	}
+}
+
+static uint64_t woslocal_now_ns(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+/*
+ *  Objects
+ */
+
+class WosLocalObj : public WosObj {
+public:
+	WosOID				oid;
+	std::string			data;
+	std::map<std::string, std::string>	meta;
+
+	const WosOID GetOID() const { return oid; }
+	void SetMeta(const std::string& key, const std::string value) { meta[key] = value; }
+	void SetData(const void* ptr, uint64_t len) { data.assign((const char *)ptr, len); }
+	void GetData(const void*& ptr, uint64_t& len) { ptr = data.data(); len = data.size(); }
+	void GetMeta(const std::string& key, std::string& value)
+	{
+		std::map<std::string, std::string>::const_iterator it = meta.find(key);
+		value = it == meta.end() ? std::string() : it->second;
+	}
+	void EachMeta(void* p, MetaVisitor v)
+	{
+		for (std::map<std::string, std::string>::const_iterator it = meta.begin(); it != meta.end(); ++it)
+			v(p, it->first, it->second);
+	}
+};
+
+typedef boost::shared_ptr<WosLocalObj> WosLocalObjPtr;
+
+WosObj::WosObj() {}
+WosObj::~WosObj() {}
+const WosOID WosObj::GetOID() const { return WosOID(); }
+
+WosObjPtr WosObj::Create()
+{
+	return WosObjPtr(new WosLocalObj);
+}
+
+static WosLocalObjPtr woslocal_obj(const WosOID& oid)
+{
+	WosLocalObjPtr obj(new WosLocalObj);
+
+	obj->oid = oid;
+	return obj;
+}
+
+WosPolicy::WosPolicy() : m_id(0) {}
+
+struct WosLocalPolicy : public WosPolicy {
+	WosLocalPolicy(unsigned int id) { m_id = id; }
+};
+
+WosStatus::WosStatus(int v) : m_value(v) {}
+
+int WosStatus::Value() const
+{
+	return m_value;
+}
+
+std::string WosStatus::ErrMsg() const
+{
+	static const char *msgs[] = {
+		"NoNodeForPolicy", "NoNodeForObject", "UnknownPolicyName", "InternalError", "ObjectFrozen",
+		"InvalidObjId", "NoSpace", "ObjNotFound", "ObjCorrupted", "FsCorrupted", "PolicyNotSupported",
+		"IOErr", "InvalidObjectSize", "MissingObject", "TemporarilyNotSupported", "OutOfMemory",
+		"ReservationNotFound", "EmptyObject", "InvalidMetadataKey", "UnusedReservation", "WireCorruption",
+		"CommandTimeout", "InvalidGetSpanMode", "PutStreamAbandoned", "IncompleteSearchMetadata",
+		"InvalidSearchMetadataTextLength", "InvalidIntegerSearchMetadata", "InvalidRealSearchMetadata",
+		"ObjectComplianceReject", "InvalidComplianceDate",
+	};
+
+	if (m_value == ok)
+		return "ok";
+	if (m_value >= NoNodeForPolicy && m_value < _max_err_code)
+		return msgs[m_value - NoNodeForPolicy];
+	return "error";
+}
+
+/*
+ *  Object store
+ *
+ *  Stored objects never change.  In memory an object is shared with the
+ *  get streams reading it; in a directory it is <dir>/<oid>, with its
+ *  metadata in <dir>/<oid>.meta as key=value lines, both written to a
+ *  temporary name first and renamed into place.
+ */
+
+struct woslocal_stored {
+	std::string			data;
+	std::map<std::string, std::string>	meta;
+};
+
+typedef boost::shared_ptr<woslocal_stored> woslocal_storedPtr;
+
+static pthread_mutex_t woslocal_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<WosOID, woslocal_storedPtr> woslocal_mem;	// under woslocal_lock
+static std::set<WosOID> woslocal_reserved;			// under woslocal_lock
+static uint64_t woslocal_oid_seq;
+
+static WosOID woslocal_new_oid(void)
+{
+	static uint64_t prefix;
+	char oid[41];
+
+	pthread_mutex_lock(&woslocal_lock);
+	if (prefix == 0) {
+		int fd = open("/dev/urandom", O_RDONLY);
+		if (fd < 0 || read(fd, &prefix, sizeof(prefix)) != sizeof(prefix))
+			prefix = woslocal_now_ns() ^ ((uint64_t)getpid() << 32);
+		if (fd >= 0)
+			close(fd);
+		prefix |= 1;
+	}
+	uint64_t seq = ++woslocal_oid_seq;
+	pthread_mutex_unlock(&woslocal_lock);
+
+	snprintf(oid, sizeof(oid), "WL%016llx%016llx", (unsigned long long)prefix, (unsigned long long)seq);
+	return oid;
+}
+
+/* take the reservation of oid for writing; a status if there is none */
+static int woslocal_take_reservation(const WosOID& oid)
+{
+	pthread_mutex_lock(&woslocal_lock);
+	int res = woslocal_reserved.erase(oid) ? (int)ok : (int)ReservationNotFound;
+	pthread_mutex_unlock(&woslocal_lock);
+	return res;
+}
+
+namespace wos {
+
+class WosClusterImpl {
+public:
+	woslocal_config			conf;
+
+	WosClusterImpl(const std::string& clustername);
+	~WosClusterImpl();
+
+	// the cost of a call moving bytes, and whether it fails
+	int Delay(int call, uint64_t bytes);
+
+	int Store(const WosOID& oid, const std::string& data, const std::map<std::string, std::string>& meta);
+	int StoreFile(const WosOID& oid, const std::string& tmp, const std::map<std::string, std::string>& meta);
+	int Lookup(const WosOID& oid, uint64_t *len);
+	int Load(const WosOID& oid, woslocal_storedPtr& obj);
+	int ReadSpan(const WosOID& oid, uint64_t off, uint64_t len, std::string& out);
+	int Remove(const WosOID& oid);
+	std::string Path(const WosOID& oid) const { return conf.dir + "/" + oid; }
+
+	// the calls, blocking
+	int Put(WosOID& oid, WosObjPtr wobj);
+	int Get(const WosOID& oid, WosObjPtr& wobj);
+	int Reserve(WosOID& oid);
+	int PutOID(const WosOID& oid, WosObjPtr wobj);
+	int Delete(const WosOID& oid);
+	int Exists(const WosOID& oid);
+
+	// callback calls
+	struct Job {
+		int			call;
+		WosOID			oid;
+		WosObjPtr		obj;
+		WosPolicy		pol;
+		WosPutStreamImplPtr	ps;
+		WosGetStreamImplPtr	gs;
+		const void		*data;
+		uint64_t		off;
+		uint64_t		len;
+		WosCluster::Callback	cb;
+		WosCluster::Context	ctx;
+	};
+	void Submit(const Job& job);
+	void Run(Job& job);
+	void Wait();
+	static void *Worker(void *arg);
+
+	pthread_mutex_t			lock;		// rng, link and job queue
+	pthread_cond_t			cond_jobs;
+	pthread_cond_t			cond_idle;
+	uint64_t			rng;
+	uint64_t			link_free_ns;	// when the shared link is next idle
+	std::deque<Job>			jobs;
+	int				pending;	// submitted and not yet called back
+	bool				stopping;
+	std::vector<pthread_t>		workers;
+};
+
+class WosPutStreamImpl {
+public:
+	WosClusterImpl			*cluster;
+	WosOID				oid;		// reserved OID, or empty
+	pthread_mutex_t			lock;
+	std::string			data;		// in memory
+	std::string			tmp;		// in a directory: the file being written
+	int				fd;
+	std::map<std::string, std::string>	meta;
+	bool				closed;
+	bool				empty;
+
+	WosPutStreamImpl(WosClusterImpl *c, const WosOID& reserved);
+	~WosPutStreamImpl();
+	int PutSpan(const void *p, uint64_t off, uint64_t len);
+	int Close(WosOID& result);
+};
+
+class WosGetStreamImpl {
+public:
+	WosClusterImpl			*cluster;
+	WosOID				oid;
+	uint64_t			length;
+	woslocal_storedPtr		obj;		// in memory
+	std::map<std::string, std::string>	meta;
+
+	int GetSpan(uint64_t off, uint64_t len, WosObjPtr& out);
+};
+
+} // namespace wos
+
+using namespace wos;
+
+WosClusterImpl::WosClusterImpl(const std::string& clustername) : rng(0), link_free_ns(0), pending(0), stopping(false)
+{
+	const char *env = getenv("WOSLOCAL");
+
+	if (env)
+		woslocal_parse(conf, env);
+	if (clustername.find('=') != std::string::npos)
+		woslocal_parse(conf, clustername);
+	if (!conf.dir.empty() && mkdir(conf.dir.c_str(), 0755) != 0 && errno != EEXIST)
+		throw WosE_CannotConnect();
+	rng = conf.seed ? conf.seed : woslocal_now_ns();
+
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond_jobs, NULL);
+	pthread_cond_init(&cond_idle, NULL);
+	for (int i = 0; i < conf.threads; i++) {
+		pthread_t t;
+		if (pthread_create(&t, NULL, Worker, this) == 0)
+			workers.push_back(t);
+	}
+	if (workers.empty())
+		throw WosE_CannotConnect();
+}
+
+WosClusterImpl::~WosClusterImpl()
+{
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&cond_jobs);
+	pthread_mutex_unlock(&lock);
+	for (size_t i = 0; i < workers.size(); i++)
+		pthread_join(workers[i], NULL);
+	pthread_cond_destroy(&cond_idle);
+	pthread_cond_destroy(&cond_jobs);
+	pthread_mutex_destroy(&lock);
+}
+
+/*
+ * Sleep for the latency of one call that moves bytes over the link, then
+ * draw whether it fails.  The link carries one transfer at a time, so
+ * concurrent calls share its bandwidth.
+ */
+int WosClusterImpl::Delay(int call, uint64_t bytes)
+{
+	uint64_t now = woslocal_now_ns();
+	uint64_t done = now + conf.latency_ns;
+	bool fail = false;
+
+	pthread_mutex_lock(&lock);
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	uint64_t r = rng * 2685821657736338717ULL;
+	if (conf.jitter_ns)
+		done += r % (conf.jitter_ns + 1);
+	if (conf.fail_pct > 0 && conf.fail_ops[call])
+		fail = (r >> 11) * (1.0 / 9007199254740992.0) * 100 < conf.fail_pct;
+	if (conf.bw_bps && bytes) {
+		uint64_t start = std::max(now, link_free_ns);
+		link_free_ns = start + bytes * 1000000000 / conf.bw_bps;
+		done += link_free_ns - now;
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (done > now) {
+		struct timespec ts;
+		ts.tv_sec = done / 1000000000;
+		ts.tv_nsec = done % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+	}
+	return fail ? conf.fail_status : (int)ok;
+}
+
+static int woslocal_write_all(int fd, const char *p, size_t len, off_t off)
+{
+	while (len > 0) {
+		ssize_t n = pwrite(fd, p, len, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static int woslocal_write_meta(const std::string& path, const std::map<std::string, std::string>& meta)
+{
+	std::string tmp = path + ".tmp";
+	FILE *fp = fopen(tmp.c_str(), "w");
+
+	if (fp == NULL)
+		return IOErr;
+	for (std::map<std::string, std::string>::const_iterator it = meta.begin(); it != meta.end(); ++it)
+		fprintf(fp, "%s=%s\n", it->first.c_str(), it->second.c_str());
+	if (fclose(fp) != 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+		unlink(tmp.c_str());
+		return IOErr;
+	}
+	return ok;
+}
+
+static void woslocal_read_meta(const std::string& path, std::map<std::string, std::string>& meta)
+{
+	FILE *fp = fopen(path.c_str(), "r");
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t n;
+
+	if (fp == NULL)
+		return;
+	while ((n = getline(&line, &cap, fp)) > 0) {
+		std::string kv(line, line[n - 1] == '\n' ? n - 1 : n);
+		size_t eq = kv.find('=');
+		if (eq != std::string::npos)
+			meta[kv.substr(0, eq)] = kv.substr(eq + 1);
+	}
+	free(line);
+	fclose(fp);
+}
+
+int WosClusterImpl::Store(const WosOID& oid, const std::string& data, const std::map<std::string, std::string>& meta)
+{
+	if (conf.dir.empty()) {
+		woslocal_storedPtr obj(new woslocal_stored);
+		obj->data = data;
+		obj->meta = meta;
+		pthread_mutex_lock(&woslocal_lock);
+		woslocal_mem[oid] = obj;
+		pthread_mutex_unlock(&woslocal_lock);
+		return ok;
+	}
+
+	std::string tmp = Path(oid) + ".part";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return IOErr;
+	int res = woslocal_write_all(fd, data.data(), data.size(), 0);
+	if (close(fd) != 0 || res != 0) {
+		unlink(tmp.c_str());
+		return IOErr;
+	}
+	return StoreFile(oid, tmp, meta);
+}
+
+/* move a fully written temporary file into place as oid */
+int WosClusterImpl::StoreFile(const WosOID& oid, const std::string& tmp, const std::map<std::string, std::string>& meta)
+{
+	if (!meta.empty() && woslocal_write_meta(Path(oid) + ".meta", meta) != ok) {
+		unlink(tmp.c_str());
+		return IOErr;
+	}
+	if (rename(tmp.c_str(), Path(oid).c_str()) != 0) {
+		unlink(tmp.c_str());
+		return IOErr;
+	}
+	return ok;
+}
+
+int WosClusterImpl::Lookup(const WosOID& oid, uint64_t *len)
+{
+	if (conf.dir.empty()) {
+		pthread_mutex_lock(&woslocal_lock);
+		std::map<WosOID, woslocal_storedPtr>::const_iterator it = woslocal_mem.find(oid);
+		int res = it == woslocal_mem.end() ? (int)ObjNotFound : (int)ok;
+		if (res == ok && len)
+			*len = it->second->data.size();
+		pthread_mutex_unlock(&woslocal_lock);
+		return res;
+	}
+
+	struct stat st;
+	if (oid.empty() || oid.find('/') != std::string::npos || stat(Path(oid).c_str(), &st) != 0)
+		return ObjNotFound;
+	if (len)
+		*len = st.st_size;
+	return ok;
+}
+
+int WosClusterImpl::Load(const WosOID& oid, woslocal_storedPtr& obj)
+{
+	if (conf.dir.empty()) {
+		pthread_mutex_lock(&woslocal_lock);
+		std::map<WosOID, woslocal_storedPtr>::const_iterator it = woslocal_mem.find(oid);
+		if (it != woslocal_mem.end())
+			obj = it->second;
+		pthread_mutex_unlock(&woslocal_lock);
+		return obj ? (int)ok : (int)ObjNotFound;
+	}
+
+	uint64_t len;
+	if (Lookup(oid, &len) != ok)
+		return ObjNotFound;
+	obj.reset(new woslocal_stored);
+	int res = ReadSpan(oid, 0, len, obj->data);
+	if (res == ok)
+		woslocal_read_meta(Path(oid) + ".meta", obj->meta);
+	return res;
+}
+
+int WosClusterImpl::ReadSpan(const WosOID& oid, uint64_t off, uint64_t len, std::string& out)
+{
+	int fd = open(Path(oid).c_str(), O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? ObjNotFound : IOErr;
+
+	out.resize(len);
+	uint64_t got = 0;
+	while (got < len) {
+		ssize_t n = pread(fd, &out[got], len - got, off + got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			close(fd);
+			return IOErr;
+		}
+		if (n == 0)
+			break;
+		got += n;
+	}
+	out.resize(got);
+	close(fd);
+	return ok;
+}
+
+int WosClusterImpl::Remove(const WosOID& oid)
+{
+	if (conf.dir.empty()) {
+		pthread_mutex_lock(&woslocal_lock);
+		int res = woslocal_mem.erase(oid) ? (int)ok : (int)ObjNotFound;
+		pthread_mutex_unlock(&woslocal_lock);
+		return res;
+	}
+
+	if (Lookup(oid, NULL) != ok || unlink(Path(oid).c_str()) != 0)
+		return ObjNotFound;
+	unlink((Path(oid) + ".meta").c_str());
+	return ok;
+}
+
+static const WosLocalObj *woslocal_cast(WosObjPtr wobj)
+{
+	if (!wobj)
+		throw WosE_MissingObject();
+	return static_cast<const WosLocalObj *>(wobj.get());
+}
+
+int WosClusterImpl::Put(WosOID& oid, WosObjPtr wobj)
+{
+	const WosLocalObj *o = woslocal_cast(wobj);
+	int s = Delay(WL_PUT, o->data.size());
+
+	if (s != ok)
+		return s;
+	oid = woslocal_new_oid();
+	return Store(oid, o->data, o->meta);
+}
+
+int WosClusterImpl::Get(const WosOID& oid, WosObjPtr& wobj)
+{
+	woslocal_storedPtr stored;
+	uint64_t len = 0;
+	WosLocalObjPtr obj = woslocal_obj(oid);
+
+	wobj = obj;
+	Lookup(oid, &len);
+	int s = Delay(WL_GET, len);
+	if (s != ok)
+		return s;
+	s = Load(oid, stored);
+	if (s == ok) {
+		obj->data = stored->data;
+		obj->meta = stored->meta;
+	}
+	return s;
+}
+
+int WosClusterImpl::Reserve(WosOID& oid)
+{
+	int s = Delay(WL_RESERVE, 0);
+
+	if (s != ok)
+		return s;
+	oid = woslocal_new_oid();
+	pthread_mutex_lock(&woslocal_lock);
+	woslocal_reserved.insert(oid);
+	pthread_mutex_unlock(&woslocal_lock);
+	return ok;
+}
+
+int WosClusterImpl::PutOID(const WosOID& oid, WosObjPtr wobj)
+{
+	const WosLocalObj *o = woslocal_cast(wobj);
+	int s = Delay(WL_PUTOID, o->data.size());
+
+	if (s != ok)
+		return s;
+	if (Lookup(oid, NULL) == ok)
+		return ObjectFrozen;
+	s = woslocal_take_reservation(oid);
+	if (s == ok)
+		s = Store(oid, o->data, o->meta);
+	return s;
+}
+
+int WosClusterImpl::Delete(const WosOID& oid)
+{
+	int s = Delay(WL_DELETE, 0);
+
+	return s != ok ? s : Remove(oid);
+}
+
+int WosClusterImpl::Exists(const WosOID& oid)
+{
+	int s = Delay(WL_EXISTS, 0);
+
+	return s != ok ? s : Lookup(oid, NULL);
+}
+
+/*
+ *  Callback calls
+ *
+ *  A fixed set of threads takes submitted calls in order, runs them with
+ *  the same latency and failures as blocking calls, and calls back.  Up
+ *  to threads calls are thus in flight at once.
+ */
+
+void WosClusterImpl::Submit(const Job& job)
+{
+	if (job.cb == NULL)
+		throw WosE_MissingCallback();
+	pthread_mutex_lock(&lock);
+	jobs.push_back(job);
+	pending++;
+	pthread_cond_signal(&cond_jobs);
+	pthread_mutex_unlock(&lock);
+}
+
+void *WosClusterImpl::Worker(void *arg)
+{
+	WosClusterImpl *c = (WosClusterImpl *)arg;
+
+	pthread_mutex_lock(&c->lock);
+	for (;;) {
+		while (c->jobs.empty() && !c->stopping)
+			pthread_cond_wait(&c->cond_jobs, &c->lock);
+		if (c->jobs.empty())
+			break;
+		Job job = c->jobs.front();
+		c->jobs.pop_front();
+		pthread_mutex_unlock(&c->lock);
+
+		c->Run(job);
+
+		pthread_mutex_lock(&c->lock);
+		if (--c->pending == 0)
+			pthread_cond_broadcast(&c->cond_idle);
+	}
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}
+
+void WosClusterImpl::Wait()
+{
+	pthread_mutex_lock(&lock);
+	while (pending > 0)
+		pthread_cond_wait(&cond_idle, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ *  WosCluster
+ */
+
+WosCluster::WosCluster(wos::WosClusterImplPtr i) : impl(i) {}
+
+WosCluster::~WosCluster()
+{
+	impl->Wait();
+}
+
+WosClusterPtr WosCluster::Connect(const std::string& clustername)
+{
+	return WosClusterPtr(new WosCluster(wos::WosClusterImplPtr(new wos::WosClusterImpl(clustername))));
+}
+
+WosPolicy WosCluster::GetPolicy(std::string policy)
+{
+	const std::set<std::string>& names = impl->conf.policies;
+
+	if (!names.empty() && names.find(policy) == names.end())
+		throw WosE_InvalidPolicy();
+
+	// a stable id for the name
+	unsigned int id = 5381;
+	for (size_t i = 0; i < policy.size(); i++)
+		id = id * 33 + (unsigned char)policy[i];
+	return WosLocalPolicy(id);
+}
+
+std::string WosCluster::GetPolicyName(unsigned int id)
+{
+	const std::set<std::string>& names = impl->conf.policies;
+
+	for (std::set<std::string>::const_iterator it = names.begin(); it != names.end(); ++it)
+		if (GetPolicy(*it).GetId() == id)
+			return *it;
+	return std::string();
+}
+
+void WosCluster::Put(WosStatus& s, WosOID& oid, WosPolicy pol, WosObjPtr wobj)
+{
+	(void) pol;
+	s = impl->Put(oid, wobj);
+}
+
+void WosCluster::Get(WosStatus& s, const WosOID& oid, WosObjPtr& wobj)
+{
+	s = impl->Get(oid, wobj);
+}
+
+void WosCluster::Reserve(WosStatus& s, WosOID& oid, WosPolicy pol)
+{
+	(void) pol;
+	s = impl->Reserve(oid);
+}
+
+void WosCluster::PutOID(WosStatus& s, const WosOID& oid, WosObjPtr wobj)
+{
+	s = impl->PutOID(oid, wobj);
+}
+
+void WosCluster::Delete(WosStatus& s, const WosOID& oid)
+{
+	s = impl->Delete(oid);
+}
+
+void WosCluster::Exists(WosStatus& s, const WosOID& oid)
+{
+	s = impl->Exists(oid);
+}
+
+bool WosCluster::IsMissing(const WosOID& oid)
+{
+	(void) oid;
+	return false;		// nothing is ever lost here
+}
+
+static wos::WosClusterImpl::Job woslocal_job(int call, WosCluster::Callback cb, WosCluster::Context ctx)
+{
+	wos::WosClusterImpl::Job job;
+
+	job.call = call;
+	job.data = NULL;
+	job.off = 0;
+	job.len = 0;
+	job.cb = cb;
+	job.ctx = ctx;
+	return job;
+}
+
+void WosCluster::Reserve(WosPolicy pol, Callback cb, Context ctx)
+{
+	wos::WosClusterImpl::Job job = woslocal_job(WL_RESERVE, cb, ctx);
+
+	job.pol = pol;
+	impl->Submit(job);
+}
+
+void WosCluster::Put(WosObjPtr wobj, WosPolicy pol, Callback cb, Context ctx)
+{
+	wos::WosClusterImpl::Job job = woslocal_job(WL_PUT, cb, ctx);
+
+	if (!wobj)
+		throw WosE_MissingObject();
+	job.obj = wobj;
+	job.pol = pol;
+	impl->Submit(job);
+}
+
+void WosCluster::PutOID(WosObjPtr wobj, const WosOID& oid, Callback cb, Context ctx)
+{
+	wos::WosClusterImpl::Job job = woslocal_job(WL_PUTOID, cb, ctx);
+
+	if (!wobj)
+		throw WosE_MissingObject();
+	job.obj = wobj;
+	job.oid = oid;
+	impl->Submit(job);
+}
+
+void WosCluster::Get(const WosOID& oid, Callback cb, Context ctx)
+{
+	wos::WosClusterImpl::Job job = woslocal_job(WL_GET, cb, ctx);
+
+	job.oid = oid;
+	impl->Submit(job);
+}
+
+void WosCluster::Delete(const WosOID& oid, Callback cb, Context ctx)
+{
+	wos::WosClusterImpl::Job job = woslocal_job(WL_DELETE, cb, ctx);
+
+	job.oid = oid;
+	impl->Submit(job);
+}
+
+void WosCluster::Exists(const WosOID& oid, Callback cb, Context ctx)
+{
+	wos::WosClusterImpl::Job job = woslocal_job(WL_EXISTS, cb, ctx);
+
+	job.oid = oid;
+	impl->Submit(job);
+}
+
+void WosCluster::Wait()
+{
+	impl->Wait();
+}
+
+/*
+ *  Streams
+ */
+
+struct WosLocalPutStream : public WosPutStream {
+	WosLocalPutStream(wos::WosPutStreamImplPtr i) : WosPutStream(i) {}
+};
+
+struct WosLocalGetStream : public WosGetStream {
+	WosLocalGetStream(wos::WosGetStreamImplPtr i) : WosGetStream(i) {}
+};
+
+WosPutStream::WosPutStream(wos::WosPutStreamImplPtr i) : impl(i) {}
+WosGetStream::WosGetStream(wos::WosGetStreamImplPtr i) : impl(i) {}
+
+WosPutStreamPtr WosCluster::CreatePutStream(WosPolicy policy)
+{
+	(void) policy;
+	return WosPutStreamPtr(new WosLocalPutStream(wos::WosPutStreamImplPtr(new wos::WosPutStreamImpl(impl.get(), WosOID()))));
+}
+
+WosPutStreamPtr WosCluster::CreatePutOIDStream(WosOID oid)
+{
+	if (woslocal_take_reservation(oid) != ok)
+		throw WosE_InvalidReservation();
+	return WosPutStreamPtr(new WosLocalPutStream(wos::WosPutStreamImplPtr(new wos::WosPutStreamImpl(impl.get(), oid))));
+}
+
+WosGetStreamPtr WosCluster::CreateGetStream(WosOID oid, bool prefetch_metadata)
+{
+	wos::WosGetStreamImplPtr gs(new wos::WosGetStreamImpl);
+
+	(void) prefetch_metadata;
+	gs->cluster = impl.get();
+	gs->oid = oid;
+	gs->length = 0;
+	if (impl->Lookup(oid, &gs->length) != ok) {
+		bool reserved;
+
+		pthread_mutex_lock(&woslocal_lock);
+		reserved = woslocal_reserved.count(oid) != 0;
+		pthread_mutex_unlock(&woslocal_lock);
+		if (reserved)
+			throw WosE_UnusedReservation();
+		throw WosE_ObjectNotFound();
+	}
+	if (impl->conf.dir.empty()) {
+		impl->Load(oid, gs->obj);
+		gs->meta = gs->obj->meta;
+	}
+	else
+		woslocal_read_meta(impl->Path(oid) + ".meta", gs->meta);
+	return WosGetStreamPtr(new WosLocalGetStream(gs));
+}
+
+WosPutStreamImpl::WosPutStreamImpl(WosClusterImpl *c, const WosOID& reserved)
+	: cluster(c), oid(reserved), fd(-1), closed(false), empty(true)
+{
+	pthread_mutex_init(&lock, NULL);
+	if (!cluster->conf.dir.empty()) {
+		tmp = cluster->Path(woslocal_new_oid()) + ".part";
+		fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			throw WosE_StreamInvalid();
+	}
+}
+
+WosPutStreamImpl::~WosPutStreamImpl()
+{
+	if (fd >= 0) {
+		close(fd);
+		unlink(tmp.c_str());	// never closed: abandoned
+	}
+	pthread_mutex_destroy(&lock);
+}
+
+/* spans may come in any order; a hole left at Close reads as zeroes */
+int WosPutStreamImpl::PutSpan(const void *p, uint64_t off, uint64_t len)
+{
+	int res = ok;
+
+	if (len == 0)
+		throw WosE_EmptyStream();
+	if (off + len > WosPutStream::ms_max_obj_size)
+		throw WosE_ObjectTooBig();
+	res = cluster->Delay(WL_PUTSPAN, len);
+	if (res != ok)
+		return res;
+
+	pthread_mutex_lock(&lock);
+	if (closed) {
+		pthread_mutex_unlock(&lock);
+		throw WosE_StreamFrozen();
+	}
+	if (fd >= 0)
+		res = woslocal_write_all(fd, (const char *)p, len, off) == 0 ? (int)ok : (int)IOErr;
+	else {
+		if (data.size() < off + len)
+			data.resize(off + len);
+		memcpy(&data[off], p, len);
+	}
+	empty = false;
+	pthread_mutex_unlock(&lock);
+	return res;
+}
+
+int WosPutStreamImpl::Close(WosOID& result)
+{
+	int res;
+
+	pthread_mutex_lock(&lock);
+	if (closed) {
+		pthread_mutex_unlock(&lock);
+		throw WosE_StreamFrozen();
+	}
+	if (empty && meta.empty()) {
+		pthread_mutex_unlock(&lock);
+		throw WosE_EmptyStream();
+	}
+	pthread_mutex_unlock(&lock);
+
+	res = cluster->Delay(WL_CLOSE, 0);
+	if (res != ok)
+		return res;
+
+	pthread_mutex_lock(&lock);
+	if (closed) {
+		pthread_mutex_unlock(&lock);
+		throw WosE_StreamFrozen();
+	}
+	closed = true;
+	if (oid.empty())
+		oid = woslocal_new_oid();
+	if (fd >= 0) {
+		res = close(fd) == 0 ? (int)ok : (int)IOErr;
+		fd = -1;
+		if (res == ok)
+			res = cluster->StoreFile(oid, tmp, meta);
+		else
+			unlink(tmp.c_str());
+	}
+	else {
+		res = cluster->Store(oid, data, meta);
+		std::string().swap(data);
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (res == ok)
+		result = oid;
+	return res;
+}
+
+int WosGetStreamImpl::GetSpan(uint64_t off, uint64_t len, WosObjPtr& out)
+{
+	WosLocalObjPtr obj = woslocal_obj(oid);
+	int res = ok;
+
+	out = obj;
+	len = off >= length ? 0 : std::min(len, length - off);
+	res = cluster->Delay(WL_GETSPAN, len);
+	if (res != ok || len == 0)
+		return res;
+	if (this->obj)
+		obj->data.assign(this->obj->data, off, len);
+	else
+		res = cluster->ReadSpan(oid, off, len, obj->data);
+	return res;
+}
+
+/* the blocking call behind a submitted job, then its callback */
+void WosClusterImpl::Run(Job& job)
+{
+	WosStatus s;
+	WosObjPtr obj;
+	WosOID oid;
+
+	try {
+		switch (job.call) {
+		case WL_PUT:
+			s = Put(oid, job.obj);
+			static_cast<WosLocalObj *>(job.obj.get())->oid = oid;
+			obj = job.obj;
+			break;
+		case WL_GET:
+			s = Get(job.oid, obj);
+			break;
+		case WL_RESERVE:
+			s = Reserve(oid);
+			obj = woslocal_obj(oid);
+			break;
+		case WL_PUTOID:
+			s = PutOID(job.oid, job.obj);
+			static_cast<WosLocalObj *>(job.obj.get())->oid = job.oid;
+			obj = job.obj;
+			break;
+		case WL_DELETE:
+			s = Delete(job.oid);
+			obj = woslocal_obj(job.oid);
+			break;
+		case WL_EXISTS:
+			s = Exists(job.oid);
+			obj = woslocal_obj(job.oid);
+			break;
+		case WL_PUTSPAN:
+			s = job.ps->PutSpan(job.data, job.off, job.len);
+			break;
+		case WL_CLOSE:
+			s = job.ps->Close(oid);
+			obj = woslocal_obj(oid);
+			break;
+		case WL_GETSPAN:
+			s = job.gs->GetSpan(job.off, job.len, obj);
+			break;
+		}
+	}
+	catch (WosException& e) {
+		s = InternalError;	// what the blocking call would have thrown
+	}
+	job.cb(s, obj, job.ctx);
+}
+
+/*
+ *  Stream calls
+ */
+
+void WosPutStream::SetMeta(const std::string& key, const std::string& value)
+{
+	pthread_mutex_lock(&impl->lock);
+	impl->meta[key] = value;
+	pthread_mutex_unlock(&impl->lock);
+}
+
+void WosPutStream::PutSpan(WosStatus& status, const void* data, uint64_t off, uint64_t len)
+{
+	status = impl->PutSpan(data, off, len);
+}
+
+void WosPutStream::Close(WosStatus& status, WosOID& oid)
+{
+	status = impl->Close(oid);
+}
+
+void WosPutStream::PutSpan(const void* data, uint64_t off, uint64_t len, Context context, Callback cb)
+{
+	wos::WosClusterImpl::Job job = woslocal_job(WL_PUTSPAN, cb, context);
+
+	job.ps = impl;
+	job.data = data;
+	job.off = off;
+	job.len = len;
+	impl->cluster->Submit(job);
+}
+
+void WosPutStream::Close(Context context, Callback cb)
+{
+	wos::WosClusterImpl::Job job = woslocal_job(WL_CLOSE, cb, context);
+
+	job.ps = impl;
+	impl->cluster->Submit(job);
+}
+
+void WosGetStream::GetMeta(const std::string& key, std::string& value)
+{
+	std::map<std::string, std::string>::const_iterator it = impl->meta.find(key);
+
+	value = it == impl->meta.end() ? std::string() : it->second;
+}
+
+void WosGetStream::EachMeta(Context ctx, MetaVisitor v)
+{
+	for (std::map<std::string, std::string>::const_iterator it = impl->meta.begin(); it != impl->meta.end(); ++it)
+		v(ctx, it->first, it->second);
+}
+
+void WosGetStream::GetSpan(WosStatus& status, WosObjPtr& obj, uint64_t off, uint64_t len,
+	BufferMode mode, IntegrityCheck integrity_check)
+{
+	if (mode == Buffered && integrity_check == IntegrityCheckDisabled)
+		throw WosE_InvalidGetSpanMode();
+	status = impl->GetSpan(off, len, obj);
+}
+
+void WosGetStream::GetSpan(uint64_t off, uint64_t len, Context context, Callback cb,
+	BufferMode mode, IntegrityCheck integrity_check)
+{
+	wos::WosClusterImpl::Job job = woslocal_job(WL_GETSPAN, cb, context);
+
+	if (mode == Buffered && integrity_check == IntegrityCheckDisabled)
+		throw WosE_InvalidGetSpanMode();
+	job.gs = impl;
+	job.off = off;
+	job.len = len;
+	impl->cluster->Submit(job);
+}
+
+uint64_t WosGetStream::GetLength() const
+{
+	return impl->length;
+}